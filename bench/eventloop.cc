@@ -0,0 +1,190 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Measures the processor time the event loop thread spends forwarding traffic replayed on the loopback interface, in
+ * each transmit mode, with the event loop backend the tree is configured with; configure once with and once without
+ * MCV4FWDD_EPOLL_EVENT_LOOP to compare Boost.Asio with the built-in epoll event loop.
+ */
+
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <functional>
+#include <thread>
+
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "eventloop.h"
+#include "router.h"
+#include "config/model/network.h"
+
+
+namespace
+{
+  using address_t = Router::address_t;
+  using endpoint_t = Router::endpoint_t;
+  using Network = config::model::Network;
+  using TransmitMode = Router::TransmitMode;
+
+
+  const address_t REPLAY_SOURCE(0x7f000002);
+  const endpoint_t ENDPOINT(address_t(0xefff4701), 47001);
+
+  enum
+  {
+    DATAGRAMS = 200000,
+    DATAGRAM_SIZE = 512,
+    /** Datagrams sent before waiting for their forwarded copies, so that receivers handle several per wake-up */
+    BURST = 16,
+    LOOPBACK_MTU = 65536
+  };
+
+
+  /** Opens a UDP socket bound to the given address and port, sending on the loopback interface */
+  int openSocket(address_t address, uint16_t port)
+  {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    int enable = 1;
+    sockaddr_in local = sockaddr_in();
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(static_cast<uint32_t>(address.to_ulong()));
+    local.sin_port = htons(port);
+    timeval timeout = { 1, 0 };
+    in_addr loopback = { htonl(INADDR_LOOPBACK) };
+    ip_mreq membership = { { htonl(static_cast<uint32_t>(ENDPOINT.address().to_v4().to_ulong())) },
+      { htonl(INADDR_LOOPBACK) } };
+    if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) != 0
+      || bind(fd, reinterpret_cast<sockaddr *>(&local), sizeof(local)) != 0
+      || setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0
+      || setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &loopback, sizeof(loopback)) != 0
+      || (port != 0 && setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0))
+    {
+      std::perror("opening socket failed");
+      std::exit(1);
+    }
+    return fd;
+  }
+
+  /** Sends the datagrams in bursts, waiting for the forwarded copies of each; returns the number of these received */
+  unsigned replay()
+  {
+    auto source = openSocket(REPLAY_SOURCE, 0);
+    auto listener = openSocket(address_t::any(), ENDPOINT.port());
+    static char data[DATAGRAM_SIZE];
+    static char received[LOOPBACK_MTU];
+    unsigned forwarded = 0;
+    for (unsigned i = 0; i < DATAGRAMS; i += BURST)
+    {
+      for (unsigned j = i; j < i + BURST; ++j)
+      {
+        sendto(source, data, sizeof(data), 0, ENDPOINT.data(), static_cast<socklen_t>(ENDPOINT.size()));
+      }
+      for (unsigned copies = 0; copies < BURST;)
+      {
+        sockaddr_in sender;
+        socklen_t senderLength = sizeof(sender);
+        if (recvfrom(listener, received, sizeof(received), 0, reinterpret_cast<sockaddr *>(&sender),
+          &senderLength) < 0)
+        {
+          break;
+        }
+        if (sender.sin_addr.s_addr == htonl(INADDR_LOOPBACK))
+        {
+          ++copies;
+          ++forwarded;
+        }
+      }
+    }
+    close(listener);
+    close(source);
+    return forwarded;
+  }
+
+  double getThreadTime() noexcept
+  {
+    timespec time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return static_cast<double>(time.tv_sec) + static_cast<double>(time.tv_nsec) / 1e9;
+  }
+
+  /** Forwards the replayed traffic with a router in the given transmit mode, and reports the processor time taken */
+  void run(TransmitMode transmitMode, const char *name)
+  {
+    EventLoop eventLoop;
+    Router router(eventLoop, transmitMode);
+    const address_t loopback = address_t::loopback();
+    const Network accepted(REPLAY_SOURCE, 32);
+    router.addRule(ENDPOINT, loopback, &accepted, 1, loopback, if_nametoindex("lo"), LOOPBACK_MTU, 0, 0, false, 0,
+      nullptr);
+    router.start();
+
+    std::atomic<unsigned> forwarded(0);
+    std::atomic<bool> done(false);
+    std::thread replayer([&forwarded, &done] {
+      forwarded = replay();
+      done = true;
+    });
+
+    // Polling for the end costs the same with either backend, and little compared to the traffic
+    Timer timer(eventLoop);
+    std::function<void(const boost::system::error_code &)> poll = [&](const boost::system::error_code &) {
+      if (done)
+      {
+        eventLoop.stop();
+        return;
+      }
+      timer.expires_from_now(boost::posix_time::milliseconds(50));
+      timer.async_wait(poll);
+    };
+    auto start = getThreadTime();
+    poll(boost::system::error_code());
+    eventLoop.run();
+    auto elapsed = getThreadTime() - start;
+    replayer.join();
+
+    router.stop();
+    eventLoop.reset();
+    eventLoop.poll();
+
+    std::printf("%-22s %6u of %u datagrams forwarded, %7.1f ms processor time, %6.0f ns per datagram\n", name,
+      forwarded.load(), unsigned(DATAGRAMS), elapsed * 1e3, forwarded != 0 ? elapsed * 1e9 / forwarded : 0.0);
+  }
+}
+
+
+int main()
+{
+#ifdef MCV4FWDD_EPOLL_EVENT_LOOP
+  std::printf("Event loop: epoll\n");
+#else
+  std::printf("Event loop: Boost.Asio\n");
+#endif
+  run(TransmitMode::PER_INTERFACE, "per-interface sockets");
+  run(TransmitMode::SHARED, "shared socket");
+  run(TransmitMode::CONNECTED, "connected sockets");
+  return 0;
+}
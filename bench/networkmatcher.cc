@@ -0,0 +1,129 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Measures the time to match a source address against rules of 16 up to 1024 networks, with each implementation of
+ * NetworkMatcher this CPU supports, and with Network::contains called for one network after the other as before
+ */
+
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "networkmatcher.h"
+#include "config/model/network.h"
+
+
+namespace
+{
+  using address_t = NetworkMatcher::address_t;
+  using Network = config::model::Network;
+
+
+  /** Keeps the results of the matching, so that it cannot be optimized away */
+  volatile uint64_t sink;
+
+  enum
+  {
+    ADDRESSES = 4096,
+    /** Matches timed per implementation and rule size */
+    MATCHES = 1 << 22
+  };
+
+
+  /** Times the given function, called once for each of the addresses in turn; returns nanoseconds per call */
+  template <class Function>
+  double measure(const std::vector<address_t> &addresses, Function &&function)
+  {
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < MATCHES; ++i)
+    {
+      function(addresses[i % ADDRESSES]);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / MATCHES;
+  }
+}
+
+
+int main()
+{
+  std::mt19937 random(42);
+  std::uniform_int_distribution<uint32_t> anyAddress;
+  std::uniform_int_distribution<unsigned> prefixLength(8, 32);
+
+  std::vector<address_t> addresses;
+  for (std::size_t i = 0; i < ADDRESSES; ++i)
+  {
+    addresses.emplace_back(anyAddress(random));
+  }
+
+  auto implementations = NetworkMatcher::getImplementations();
+  std::printf("%8s %12s", "networks", "contains");
+  for (auto name: implementations)
+  {
+    std::printf(" %12s", name);
+  }
+  std::printf("   (ns per match)\n");
+
+  for (std::size_t count = 16; count <= 1024; count *= 2)
+  {
+    std::vector<Network> networks;
+    NetworkMatcher matcher;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      networks.emplace_back(address_t(anyAddress(random)), static_cast<uint8_t>(prefixLength(random)));
+      matcher.add(networks.back());
+    }
+    // Most sources are unknown; one in eight belongs to one of the networks
+    for (std::size_t i = 0; i < ADDRESSES; i += 8)
+    {
+      auto &network = networks[i % count];
+      auto hostMask = static_cast<uint32_t>(uint64_t(0xffffffff) >> network.getPrefixLength());
+      addresses[i] = address_t(static_cast<uint32_t>(network.getMaskedAddress().to_ulong())
+        | (anyAddress(random) & hostMask));
+    }
+
+    uint64_t checksum = 0;
+    std::printf("%8zu", count);
+    std::printf(" %12.1f", measure(addresses, [&networks, &checksum](address_t address) {
+      for (std::size_t i = 0; i < networks.size(); ++i)
+      {
+        checksum += networks[i].contains(address) ? i : 0;
+      }
+    }));
+    std::vector<uint64_t> bitmap(matcher.getBitmapSize());
+    for (auto name: implementations)
+    {
+      matcher.setImplementation(name);
+      std::printf(" %12.1f", measure(addresses, [&matcher, &bitmap, &checksum](address_t address) {
+        matcher.match(address, bitmap.data());
+        checksum += bitmap[0];
+      }));
+    }
+    std::printf("\n");
+    sink = checksum;
+  }
+  return 0;
+}
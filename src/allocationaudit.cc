@@ -0,0 +1,169 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "allocationaudit.h"
+
+#ifdef MCV4FWDD_ALLOCATION_AUDIT
+
+#include <cinttypes>
+#include <cstdlib>
+#include <exception>
+#include <new>
+
+#include <syslog.h>
+
+
+namespace
+{
+  bool armed = false;
+
+  /** Nesting depth of AllocationAudit::Scope on the current thread */
+  thread_local unsigned scopeDepth = 0;
+
+  /** Number of allocations made while within an AllocationAudit::Scope on the current thread */
+  thread_local uint64_t scopedAllocations = 0;
+
+
+  void *allocate(std::size_t size)
+  {
+    if (scopeDepth != 0)
+    {
+      ++scopedAllocations;
+    }
+    if (void *pointer = std::malloc(size != 0 ? size : 1))
+    {
+      return pointer;
+    }
+    throw std::bad_alloc();
+  }
+
+  void *allocate(std::size_t size, std::align_val_t alignment)
+  {
+    if (scopeDepth != 0)
+    {
+      ++scopedAllocations;
+    }
+    auto align = static_cast<std::size_t>(alignment);
+    if (void *pointer = std::aligned_alloc(align, (size + align - 1) & ~(align - 1)))
+    {
+      return pointer;
+    }
+    throw std::bad_alloc();
+  }
+}
+
+
+void AllocationAudit::arm() noexcept
+{
+  armed = true;
+}
+
+AllocationAudit::Exemption::Exemption() noexcept:
+  m_scopeDepth(scopeDepth)
+{
+  scopeDepth = 0;
+}
+
+AllocationAudit::Exemption::~Exemption()
+{
+  scopeDepth = m_scopeDepth;
+}
+
+AllocationAudit::Scope::Scope() noexcept:
+  m_allocations(scopedAllocations)
+{
+  ++scopeDepth;
+}
+
+AllocationAudit::Scope::~Scope()
+{
+  --scopeDepth;
+  // Don't interfere with exceptions propagating out of the event loop; these are fatal anyway
+  if (armed && scopedAllocations != m_allocations && !std::uncaught_exceptions())
+  {
+    syslog(LOG_ALERT, "allocation audit failed: %" PRIu64 " heap allocation(s) while handling datagrams",
+      scopedAllocations - m_allocations);
+    std::abort();
+  }
+}
+
+
+void *operator new(std::size_t size)
+{
+  return allocate(size);
+}
+
+void *operator new[](std::size_t size)
+{
+  return allocate(size);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment)
+{
+  return allocate(size, alignment);
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment)
+{
+  return allocate(size, alignment);
+}
+
+void operator delete(void *pointer) noexcept
+{
+  std::free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept
+{
+  std::free(pointer);
+}
+
+void operator delete(void *pointer, std::size_t) noexcept
+{
+  std::free(pointer);
+}
+
+void operator delete[](void *pointer, std::size_t) noexcept
+{
+  std::free(pointer);
+}
+
+void operator delete(void *pointer, std::align_val_t) noexcept
+{
+  std::free(pointer);
+}
+
+void operator delete[](void *pointer, std::align_val_t) noexcept
+{
+  std::free(pointer);
+}
+
+void operator delete(void *pointer, std::size_t, std::align_val_t) noexcept
+{
+  std::free(pointer);
+}
+
+void operator delete[](void *pointer, std::size_t, std::align_val_t) noexcept
+{
+  std::free(pointer);
+}
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+
+
+/**
+ * Audit of heap allocations on the data path, for builds configured with MCV4FWDD_ALLOCATION_AUDIT: once armed, any
+ * call to operator new while handling datagrams aborts the daemon. Otherwise, all of this compiles to nothing.
+ */
+struct AllocationAudit
+{
+  struct Exemption;
+  struct Scope;
+
+
+  AllocationAudit() = delete;
+
+  /** Starts auditing; called once the router has started, i.e. when the data path must be in its steady state */
+  static void arm() noexcept;
+};
+
+
+/** Marks the handling of datagrams on the current thread, during which no heap allocations are allowed */
+struct AllocationAudit::Scope
+{
+  Scope() noexcept;
+
+  Scope(const Scope &) = delete;
+  Scope &operator =(const Scope &) = delete;
+
+  ~Scope();
+
+
+#ifdef MCV4FWDD_ALLOCATION_AUDIT
+private:
+
+  uint64_t m_allocations;
+#endif
+};
+
+
+/** Exempts debug output, which debug builds make while handling datagrams, from the audit on the current thread */
+struct AllocationAudit::Exemption
+{
+  Exemption() noexcept;
+
+  Exemption(const Exemption &) = delete;
+  Exemption &operator =(const Exemption &) = delete;
+
+  ~Exemption();
+
+
+#ifdef MCV4FWDD_ALLOCATION_AUDIT
+private:
+
+  unsigned m_scopeDepth;
+#endif
+};
+
+
+#ifndef MCV4FWDD_ALLOCATION_AUDIT
+
+inline
+void AllocationAudit::arm() noexcept
+{}
+
+inline
+AllocationAudit::Exemption::Exemption() noexcept
+{}
+
+inline
+AllocationAudit::Exemption::~Exemption()
+{}
+
+inline
+AllocationAudit::Scope::Scope() noexcept
+{}
+
+inline
+AllocationAudit::Scope::~Scope()
+{}
+
+#endif
@@ -21,6 +21,7 @@
 
 #include "application.h"
 
+#include <fstream>
 #include <iostream>
 
 #include <ifaddrs.h>
@@ -38,20 +39,29 @@ namespace
 
   const auto RESET_DELAY = boost::posix_time::seconds(5);
 
-  /** Returns true when the given set of interface names refers only to interfaces which are up */
-  bool areAllInterfacesUp(const std::set<std::string> &interfaces);
-
-  /** Builds a list of senders (as IP networks) whose datagrams will be forwarded according to the given rule */
-  std::list<Network> getAcceptedSourceNetworks(const config::model::ForwardingRule &forwardingRule,
-    InterfaceAddressMap::const_iterator sourceIter, const InterfaceAddressMap &interfaceAddresses);
+  /** Returns true when the given interface names refer only to interfaces which are up */
+  bool areAllInterfacesUp(const std::vector<std::string> &interfaces);
 
   /** Builds a map of interface names to their IPv4 networks */
   InterfaceAddressMap getInterfaceAddresses();
 
+  /**
+   * Builds a list of all networks on the interface of the given address, i.e. those from which senders are accepted
+   * by rules that do not restrict them (can contain duplicates)
+   */
+  std::vector<Network> getInterfaceNetworks(InterfaceAddressMap::const_iterator sourceIter,
+    const InterfaceAddressMap &interfaceAddresses);
+
   /** Finds the address for the given interfaces; throws if none found */
   InterfaceAddressMap::const_iterator getInterfaceAddress(const InterfaceAddressMap &interfaceAddresses,
     const std::string &interface, const char *purpose);
 
+  /** Gets the index of the given interface; throws if it does not exist */
+  unsigned getInterfaceIndex(const std::string &interface);
+
+  /** Gets the MTU of the given interface; throws if it does not exist */
+  std::size_t getInterfaceMtu(const std::string &interface);
+
   /** Checks whether the given interface is up using the given socket descriptor */
   bool isInterfaceUp(int socketFD, const std::string &interface);
 
@@ -59,7 +69,7 @@ namespace
     const std::string &interface, InterfaceAddressMap::const_iterator iter, const char *purpose);
 
 
-  bool areAllInterfacesUp(const std::set<std::string> &interfaces)
+  bool areAllInterfacesUp(const std::vector<std::string> &interfaces)
   {
     std::ostringstream allInterfacesOS;
     allInterfacesOS << "Checking whether interfaces are up:";
@@ -87,30 +97,6 @@ namespace
     return allInterfacesUp;
   }
 
-  std::list<Network> getAcceptedSourceNetworks(const config::model::ForwardingRule &forwardingRule,
-    InterfaceAddressMap::const_iterator sourceIter, const InterfaceAddressMap &interfaceAddresses)
-  {
-    std::list<Network> networks;
-    if (forwardingRule.getNetworks().empty())
-    {
-      // No configuration; accept from all networks on which this interface has addresses (can contain duplicates)
-      auto iter = sourceIter;
-      do
-      {
-        networks.emplace_back(sourceIter->second.getMaskedNetwork());
-        iter = std::next(iter);
-      }
-      while (iter != std::end(interfaceAddresses) && iter->first == sourceIter->first);
-    }
-    else
-    {
-      // Add only those networks specified in the configuration
-      std::copy(std::begin(forwardingRule.getNetworks()), std::end(forwardingRule.getNetworks()),
-        std::back_inserter(networks));
-    }
-    return networks;
-  }
-
   InterfaceAddressMap getInterfaceAddresses()
   {
     ifaddrs *interfaceAddressList = nullptr;
@@ -153,6 +139,55 @@ namespace
     return addressIter;
   }
 
+  std::vector<Network> getInterfaceNetworks(InterfaceAddressMap::const_iterator sourceIter,
+    const InterfaceAddressMap &interfaceAddresses)
+  {
+    std::vector<Network> networks;
+    auto iter = sourceIter;
+    do
+    {
+      networks.emplace_back(sourceIter->second.getMaskedNetwork());
+      iter = std::next(iter);
+    }
+    while (iter != std::end(interfaceAddresses) && iter->first == sourceIter->first);
+    return networks;
+  }
+
+  unsigned getInterfaceIndex(const std::string &interface)
+  {
+    auto index = if_nametoindex(interface.c_str());
+    if (index == 0)
+    {
+      auto error = errno;
+      std::ostringstream oss;
+      oss << "Failed to identify index of interface " << interface << ": " << utility::getErrorString(error);
+      throw std::runtime_error(oss.str());
+    }
+    return index;
+  }
+
+  std::size_t getInterfaceMtu(const std::string &interface)
+  {
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (sock == -1)
+    {
+      throw std::runtime_error(utility::getErrorString(errno));
+    }
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, interface.c_str(), sizeof(ifr.ifr_name) - 1);
+    auto result = ioctl(sock, SIOCGIFMTU, &ifr);
+    auto error = errno;
+    close(sock);
+    if (result < 0)
+    {
+      std::ostringstream oss;
+      oss << "Failed to identify MTU of interface " << interface << ": " << utility::getErrorString(error);
+      throw std::runtime_error(oss.str());
+    }
+    return static_cast<std::size_t>(ifr.ifr_mtu);
+  }
+
   bool isInterfaceUp(int socketFD, const std::string &interface)
   {
     struct ifreq ifr;
@@ -185,13 +220,34 @@ namespace
   }
 }
 
+struct Application::ResolvedInterface
+{
+  /** Address to join receivers on */
+  boost::asio::ip::address_v4 sourceAddress;
+  /** Networks accepted by rules that do not restrict their senders; empty until resolved as source */
+  std::vector<Network> sourceNetworks;
+  boost::asio::ip::address_v4 destinationAddress;
+  /** Index of the interface to send on; zero until resolved as destination */
+  unsigned destinationIndex = 0;
+  /** MTU of the interface to send on, only resolved for services that coalesce datagrams */
+  std::size_t destinationMtu = 0;
+};
+
+
 Application::Application(std::unique_ptr<Configuration> &&configuration):
   m_configuration(std::move(configuration)),
   m_ioService(),
   m_resetTimer(),
+  m_statisticsSignals(),
   m_router()
 {}
 
+void Application::beginWaitForStatisticsSignal()
+{
+  m_statisticsSignals->async_wait(boost::bind(&Application::reportStatistics, this,
+    boost::asio::placeholders::error));
+}
+
 void Application::doRestart(const boost::system::error_code &error)
 {
   // Only restart if timer was not canceled
@@ -201,17 +257,55 @@ void Application::doRestart(const boost::system::error_code &error)
   }
 }
 
+int Application::emitForwardingTable(std::unique_ptr<Configuration> &&configuration,
+  const std::string &configurationFileName, const std::string &tableFileName)
+{
+  try
+  {
+    Application application(std::move(configuration));
+    if (!areAllInterfacesUp(application.m_configuration->getInterfaces()))
+    {
+      throw std::runtime_error("all interfaces must be up to resolve their addresses");
+    }
+
+    // Senders open their sockets when created, so the router needs an event loop even though it never starts
+    application.m_ioService = std::make_shared<EventLoop>();
+    application.m_router = std::make_unique<Router>(*application.m_ioService,
+      application.m_configuration->getTransmitMode());
+    application.setupRouterConfiguration(getInterfaceAddresses());
+
+    std::ofstream table(tableFileName);
+    application.m_router->emitForwardingTable(table, configurationFileName);
+    table.close();
+    if (!table)
+    {
+      throw std::runtime_error("failed writing forwarding table to '" + tableFileName + "'");
+    }
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
 int Application::run()
 {
-  m_ioService = std::make_shared<io_service>();
-  m_resetTimer = std::make_unique<deadline_timer>(*m_ioService);
+  m_ioService = std::make_shared<EventLoop>();
+  m_resetTimer = std::make_unique<Timer>(*m_ioService);
 
   // Cleanly exit on SIGINT (CTRL-C) and SIGTERM
-  boost::asio::signal_set signals(*m_ioService, SIGINT, SIGTERM);
-  signals.async_wait(boost::bind(&io_service::stop, m_ioService));
+  SignalSet signals(*m_ioService, SIGINT, SIGTERM);
+  signals.async_wait(boost::bind(&EventLoop::stop, m_ioService));
+
+  // Log statistics on SIGUSR1
+  m_statisticsSignals = std::make_unique<SignalSet>(*m_ioService, SIGUSR1);
+  beginWaitForStatisticsSignal();
 
   m_ioService->post(boost::bind(&Application::setupRouter, this));
 
+  int result = 0;
   try
   {
     m_ioService->run();
@@ -219,9 +313,14 @@ int Application::run()
   catch (const std::runtime_error &e)
   {
     syslog(LOG_ALERT, "crashed: %s", e.what());
-    return 1;
+    result = 1;
   }
-  return 0;
+
+  // Operations still pending hold memory of the router; have their handlers run before it goes
+  retireRouter();
+  m_ioService->reset();
+  m_ioService->poll();
+  return result;
 }
 
 int Application::run(std::unique_ptr<Configuration> &&configuration)
@@ -229,6 +328,39 @@ int Application::run(std::unique_ptr<Configuration> &&configuration)
   return Application(std::move(configuration)).run();
 }
 
+void Application::reportStatistics(const boost::system::error_code &error)
+{
+  if (error)
+  {
+    return;
+  }
+  if (m_router != nullptr)
+  {
+    m_router->reportStatistics();
+  }
+  else
+  {
+    syslog(LOG_INFO, "No statistics: router not configured");
+  }
+  beginWaitForStatisticsSignal();
+}
+
+void Application::retireRouter()
+{
+  if (m_router == nullptr)
+  {
+    return;
+  }
+  if (m_ioService == nullptr)
+  {
+    // Just testing; nothing was started
+    m_router.reset();
+    return;
+  }
+  m_router->stop();
+  m_ioService->post([router = std::shared_ptr<Router>(std::move(m_router))] {});
+}
+
 void Application::scheduleRestart()
 {
   m_resetTimer->expires_from_now(RESET_DELAY);
@@ -237,9 +369,9 @@ void Application::scheduleRestart()
 
 void Application::setupRouter()
 {
-  m_router.reset();
+  retireRouter();
 
-  auto interfaces = m_configuration->getInterfaces();
+  auto &interfaces = m_configuration->getInterfaces();
 
   if (!areAllInterfacesUp(interfaces))
   {
@@ -254,12 +386,17 @@ void Application::setupRouter()
   auto interfaceAddresses = getInterfaceAddresses();
   if (m_ioService != nullptr)
   {
-    m_router = std::make_unique<Router>(*m_ioService);
+    m_router = std::make_unique<Router>(*m_ioService, m_configuration->getTransmitMode());
   }
 
   try
   {
     setupRouterConfiguration(interfaceAddresses);
+    // Starting creates the forwarders, which join the multicast groups
+    if (m_router != nullptr)
+    {
+      m_router->start();
+    }
   }
   catch (const std::runtime_error &e)
   {
@@ -272,40 +409,122 @@ void Application::setupRouter()
     scheduleRestart();
     return;
   }
-  if (m_router != nullptr)
-  {
-    m_router->start();
-  }
 }
 
 void Application::setupRouterConfiguration(const InterfaceAddressMap &interfaceAddresses)
 {
+  if (m_router != nullptr)
+  {
+    std::vector<boost::asio::ip::address_v4> localAddresses;
+    for (auto &interfaceAddress: interfaceAddresses)
+    {
+      localAddresses.push_back(interfaceAddress.second.getAddress());
+    }
+    m_router->setLocalAddresses(std::move(localAddresses));
+    if (m_configuration->getIgmpSnooping() != Configuration::IgmpSnooping::OFF)
+    {
+      m_router->enableIgmpSnooping(m_configuration->getIgmpSnooping() == Configuration::IgmpSnooping::QUERIER);
+    }
+  }
+  std::vector<ResolvedInterface> interfaces(m_configuration->getInterfaces().size());
   for (const auto &serviceConfiguration: m_configuration->getServiceConfigurations())
   {
-    setupRouterConfiguration(serviceConfiguration, interfaceAddresses);
+    setupRouterConfiguration(serviceConfiguration, interfaces, interfaceAddresses);
   }
 }
 
 void Application::setupRouterConfiguration(const ServiceConfiguration &serviceConfiguration,
-  const InterfaceAddressMap &interfaceAddresses)
+  std::vector<ResolvedInterface> &interfaces, const InterfaceAddressMap &interfaceAddresses)
 {
   boost::asio::ip::udp::endpoint multicastEndpoint(serviceConfiguration.getGroupAddress(),
     serviceConfiguration.getPort());
+
+  /* Proxied groups are forwarded according to the listeners that IGMP snooping finds, which neither coalescing nor the
+   * sockets connected up front for each endpoint could follow */
+  if (serviceConfiguration.isProxy())
+  {
+    std::ostringstream oss;
+    if (m_configuration->getIgmpSnooping() == Configuration::IgmpSnooping::OFF)
+    {
+      oss << "Proxy for " << serviceConfiguration.getGroups() << " requires igmp_snooping";
+      throw std::runtime_error(oss.str());
+    }
+    if (serviceConfiguration.getCoalescingWindow() != 0)
+    {
+      oss << "Proxy for " << serviceConfiguration.getGroups() << " cannot coalesce responses";
+      throw std::runtime_error(oss.str());
+    }
+    if (m_configuration->getTransmitMode() == Configuration::TransmitMode::CONNECTED)
+    {
+      oss << "Proxy for " << serviceConfiguration.getGroups() << " cannot use connected transmit mode";
+      throw std::runtime_error(oss.str());
+    }
+  }
+
+  // Create stages even when only testing the configuration, as that validates their arguments; proxies create their
+  // own for each group
+  Pipeline pipeline(serviceConfiguration.getStages());
+  if (m_router != nullptr && !pipeline.empty() && !serviceConfiguration.isProxy())
+  {
+    m_router->addPipeline(multicastEndpoint, std::move(pipeline));
+  }
+
   for (const auto &forwardingRule: serviceConfiguration.getForwardingRules())
   {
-    // Figure out source interface address (iterator)
-    auto sourceIter = getInterfaceAddress(interfaceAddresses, forwardingRule.getFromInterface(), "joining receiver");
+    // Figure out source interface address and networks
+    auto &source = interfaces[forwardingRule.getFromInterface()];
+    if (source.sourceNetworks.empty())
+    {
+      auto sourceIter = getInterfaceAddress(interfaceAddresses,
+        m_configuration->getInterface(forwardingRule.getFromInterface()), "joining receiver");
+      source.sourceAddress = sourceIter->second.getAddress();
+      source.sourceNetworks = getInterfaceNetworks(sourceIter, interfaceAddresses);
+    }
+
+    // Figure out destination interface address and index
+    auto &destination = interfaces[forwardingRule.getToInterface()];
+    if (destination.destinationIndex == 0)
+    {
+      auto &toInterface = m_configuration->getInterface(forwardingRule.getToInterface());
+      destination.destinationAddress = getInterfaceAddress(interfaceAddresses, toInterface, "configuring sender")
+        ->second.getAddress();
+      destination.destinationIndex = getInterfaceIndex(toInterface);
+    }
+    if (serviceConfiguration.getCoalescingWindow() != 0 && destination.destinationMtu == 0)
+    {
+      destination.destinationMtu = getInterfaceMtu(m_configuration->getInterface(forwardingRule.getToInterface()));
+    }
 
-    // Figure out destination interface address
-    auto destination = getInterfaceAddress(interfaceAddresses, forwardingRule.getToInterface(), "configuring sender")
-      ->second.getAddress();
+    // Figure out from which addresses we need to forward datagrams; without configuration, accept all on the interface
+    const Network *acceptedSourceNetworks = forwardingRule.getNetworks().begin();
+    std::size_t acceptedSourceNetworkCount = forwardingRule.getNetworks().size();
+    if (acceptedSourceNetworkCount == 0)
+    {
+      acceptedSourceNetworks = source.sourceNetworks.data();
+      acceptedSourceNetworkCount = source.sourceNetworks.size();
+    }
 
-    // Figure out from which addresses we need to forward datagrams
-    auto acceptedSourceNetworks = getAcceptedSourceNetworks(forwardingRule, sourceIter, interfaceAddresses);
+    // Figure out which stages datagrams pass before being forwarded along this rule
+    std::shared_ptr<Pipeline> rulePipeline;
+    if (!forwardingRule.getStages().empty())
+    {
+      rulePipeline = std::make_shared<Pipeline>(forwardingRule.getStages());
+    }
 
-    if (m_router != nullptr)
+    if (m_router != nullptr && serviceConfiguration.isProxy())
+    {
+      m_router->addProxyRule(serviceConfiguration.getGroups(), serviceConfiguration.getPort(), source.sourceAddress,
+        acceptedSourceNetworks, acceptedSourceNetworkCount, destination.destinationAddress,
+        destination.destinationIndex, serviceConfiguration.getReceiveBufferSize(),
+        serviceConfiguration.getSendBufferSize(), serviceConfiguration.getOffload(), serviceConfiguration.getStages(),
+        forwardingRule.getStages());
+    }
+    else if (m_router != nullptr)
     {
-      m_router->addRule(multicastEndpoint, sourceIter->second.getAddress(), acceptedSourceNetworks, destination);
+      m_router->addRule(multicastEndpoint, source.sourceAddress, acceptedSourceNetworks, acceptedSourceNetworkCount,
+        destination.destinationAddress, destination.destinationIndex, destination.destinationMtu,
+        serviceConfiguration.getReceiveBufferSize(), serviceConfiguration.getSendBufferSize(),
+        serviceConfiguration.getOffload(), serviceConfiguration.getCoalescingWindow(), rulePipeline);
     }
   }
 }
@@ -22,9 +22,11 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 
 #include <boost/asio.hpp>
 
+#include "eventloop.h"
 #include "router.h"
 #include "config/model/configuration.h"
 
@@ -41,6 +43,10 @@ struct Application final
   Application &operator =(const Application &) = delete;
   Application &operator =(Application &&) = delete;
 
+  /** Resolves the configuration on this host, and writes the resulting rules as a forwarding table to the given file */
+  static int emitForwardingTable(std::unique_ptr<Configuration> &&configuration,
+    const std::string &configurationFileName, const std::string &tableFileName);
+
   static int run(std::unique_ptr<Configuration> &&configuration);
 
   static int test(std::unique_ptr<Configuration> &&configuration);
@@ -48,15 +54,24 @@ struct Application final
 
 private:
 
-  using deadline_timer = boost::asio::deadline_timer;
-  using io_service = boost::asio::io_service;
   using ServiceConfiguration = config::model::ServiceConfiguration;
 
+  /** Addresses, networks and index of an interface; resolved once, as forwarding rules typically share few */
+  struct ResolvedInterface;
+
 
   Application(std::unique_ptr<Configuration> &&configuration);
 
+  void beginWaitForStatisticsSignal();
+
   void doRestart(const boost::system::error_code &error);
 
+  /** Logs router statistics upon SIGUSR1 */
+  void reportStatistics(const boost::system::error_code &error);
+
+  /** Stops the router, if any, and destroys it once the handlers it still has pending have run */
+  void retireRouter();
+
   int run();
 
   void scheduleRestart();
@@ -69,11 +84,12 @@ private:
 
   /** Translates the given ServiceConfiguration into a run-time configuration for the router */
   void setupRouterConfiguration(const ServiceConfiguration &ServiceConfiguration,
-    const InterfaceAddressMap &interfaceAddresses);
+    std::vector<ResolvedInterface> &interfaces, const InterfaceAddressMap &interfaceAddresses);
 
 
   std::unique_ptr<Configuration> m_configuration;
-  std::shared_ptr<io_service> m_ioService;
-  std::unique_ptr<deadline_timer> m_resetTimer;
+  std::shared_ptr<EventLoop> m_ioService;
+  std::unique_ptr<Timer> m_resetTimer;
+  std::unique_ptr<SignalSet> m_statisticsSignals;
   std::unique_ptr<Router> m_router;
 };
@@ -35,6 +35,7 @@ namespace
 
 CommandLine::CommandLine():
   m_configurationFilename(CONFIGURATION_FILE),
+  m_forwardingTableFilename(),
   m_pidFilename(PID_FILE),
   m_foreground(false),
   m_testConfigurationOnly(false)
@@ -43,13 +44,16 @@ CommandLine::CommandLine():
 int CommandLine::doParse(int argc, char *argv[], std::ostream *&helpStream)
 {
   int option;
-  while ((option = getopt(argc, argv, "c:fhnp:")) != -1)
+  while ((option = getopt(argc, argv, "c:e:fhnp:")) != -1)
   {
     switch (option)
     {
       case 'c':
         m_configurationFilename = optarg;
         break;
+      case 'e':
+        m_forwardingTableFilename = optarg;
+        break;
       case 'f':
         m_foreground = true;
         break;
@@ -101,9 +105,12 @@ void CommandLine::printHelp(const char *self, std::ostream &os)
      << "Copyright (C) 2018  Niels Penneman" << std::endl
      << std::endl
      << "Usage: " << self << " [-c CONFIGURATION_FILE] [-f] [-n] [-p PID_FILE]" << std::endl
+     << "       " << self << " [-c CONFIGURATION_FILE] -e TABLE_FILE" << std::endl
      << "       " << self << " -h" << std::endl
      << "  -c CONFIGURATION_FILE  Specify path to configuration filename (default: " << CONFIGURATION_FILE << ")"
      << std::endl
+     << "  -e TABLE_FILE          Write the forwarding table for this host, to build it into the daemon; then exit"
+     << std::endl
      << "  -f                     Run in foreground; do not fork" << std::endl
      << "  -h                     Print this help message" << std::endl
      << "  -n                     Exit after testing configuration" << std::endl
@@ -30,6 +30,8 @@ struct CommandLine
 
   const std::string &getConfigurationFileName() const noexcept;
   bool getForeground() const noexcept;
+  /** Gets the file to write the forwarding table to, or an empty string to run the daemon */
+  const std::string &getForwardingTableFileName() const noexcept;
   const std::string &getPidFileName() const noexcept;
   bool getTestConfigurationOnly() const noexcept;
   int parse(int argc, char *argv[]);
@@ -42,6 +44,7 @@ private:
 
 
   std::string m_configurationFilename;
+  std::string m_forwardingTableFilename;
   std::string m_pidFilename;
   bool m_foreground;
   bool m_testConfigurationOnly;
@@ -59,6 +62,12 @@ bool CommandLine::getForeground() const noexcept
   return m_foreground;
 }
 
+inline
+const std::string &CommandLine::getForwardingTableFileName() const noexcept
+{
+  return m_forwardingTableFilename;
+}
+
 inline
 const std::string &CommandLine::getPidFileName() const noexcept
 {
@@ -0,0 +1,214 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "compiledforwarder.h"
+
+#ifdef MCV4FWDD_FORWARDING_TABLE
+
+#include <array>
+#include <iostream>
+#include <utility>
+
+#include <syslog.h>
+
+#include "forwardingtable.gen.h"
+
+
+namespace
+{
+  /** Forwarder for entry ENDPOINT of the forwarding table, with the matching of every rule unrolled */
+  template <std::size_t ENDPOINT>
+  struct CompiledForwarder final: Forwarder
+  {
+    CompiledForwarder(EventLoop &ioService, ReceiveBuffer &receiveBuffer, const endpoint_t &multicastEndpoint,
+      std::vector<Rule> &&rules);
+
+
+  protected:
+
+    void handlePacket(const endpoint_t &senderEndpoint, address_t inInterfaceAddress, const char *data,
+      std::size_t length) override;
+
+    void printVariant(std::ostream &os) const override;
+
+
+  private:
+
+    static constexpr const ForwardingTable::Endpoint &ENTRY = FORWARDING_TABLE_ENDPOINTS[ENDPOINT];
+
+
+    template <std::size_t... RULES>
+    std::size_t forward(uint32_t sourceAddress, const char *data, std::size_t length, std::index_sequence<RULES...>);
+
+    template <std::size_t RULE>
+    static constexpr bool matches(uint32_t sourceAddress) noexcept;
+
+
+    std::array<Sender *, ENTRY.ruleCount> m_senders;
+    std::array<Sender::out_interface_t, ENTRY.ruleCount> m_outInterfaces;
+  };
+
+
+  using factory_t = std::unique_ptr<Forwarder> (*)(EventLoop &ioService, ReceiveBuffer &receiveBuffer,
+    const Forwarder::endpoint_t &multicastEndpoint, std::vector<Forwarder::Rule> &&rules);
+
+
+  template <std::size_t ENDPOINT>
+  std::unique_ptr<Forwarder> create(EventLoop &ioService, ReceiveBuffer &receiveBuffer,
+    const Forwarder::endpoint_t &multicastEndpoint, std::vector<Forwarder::Rule> &&rules)
+  {
+    return std::make_unique<CompiledForwarder<ENDPOINT>>(ioService, receiveBuffer, multicastEndpoint,
+      std::move(rules));
+  }
+
+  template <std::size_t... ENDPOINTS>
+  constexpr std::array<factory_t, sizeof...(ENDPOINTS)> getFactories(std::index_sequence<ENDPOINTS...>) noexcept
+  {
+    return {{ &create<ENDPOINTS>... }};
+  }
+
+  /** Tells whether the given table entry holds the given endpoint and rules, with their outgoing interfaces */
+  bool corresponds(const ForwardingTable::Endpoint &entry, const Forwarder::endpoint_t &multicastEndpoint,
+    const std::vector<Forwarder::Rule> &rules, const std::vector<Sender::out_interface_t> &outInterfaces) noexcept
+  {
+    if (entry.address != multicastEndpoint.address().to_v4().to_ulong() || entry.port != multicastEndpoint.port()
+      || entry.ruleCount != rules.size() || outInterfaces.size() != rules.size())
+    {
+      return false;
+    }
+    for (std::size_t i = 0; i < rules.size(); ++i)
+    {
+      auto &tableRule = FORWARDING_TABLE_RULES[entry.firstRule + i];
+      if (rules[i].sender->isShared() != FORWARDING_TABLE_SHARED
+        || tableRule.networkAddress != rules[i].network.getMaskedAddress().to_ulong()
+        || tableRule.prefixLength != rules[i].network.getPrefixLength()
+        || tableRule.outInterfaceAddress != ntohl(outInterfaces[i].ipi_spec_dst.s_addr)
+        || tableRule.outInterfaceIndex != static_cast<unsigned>(outInterfaces[i].ipi_ifindex))
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+
+  template <std::size_t ENDPOINT>
+  CompiledForwarder<ENDPOINT>::CompiledForwarder(EventLoop &ioService, ReceiveBuffer &receiveBuffer,
+    const endpoint_t &multicastEndpoint, std::vector<Rule> &&rules):
+    Forwarder(ioService, receiveBuffer, multicastEndpoint, std::move(rules)),
+    m_senders(),
+    m_outInterfaces()
+  {
+    for (std::size_t i = 0; i < ENTRY.ruleCount; ++i)
+    {
+      m_senders[i] = getRules()[i].sender.get();
+      m_outInterfaces[i] = getRules()[i].outInterface;
+    }
+  }
+
+  template <std::size_t ENDPOINT>
+  template <std::size_t... RULES>
+  std::size_t CompiledForwarder<ENDPOINT>::forward(uint32_t sourceAddress, const char *data, std::size_t length,
+    std::index_sequence<RULES...>)
+  {
+    std::size_t forwarded = 0;
+    if constexpr (FORWARDING_TABLE_SHARED)
+    {
+      // Collect the copies, so that they can be sent all at once
+      std::array<Sender::out_interface_t, ENTRY.ruleCount> outInterfaces;
+      ((matches<RULES>(sourceAddress) ? void(outInterfaces[forwarded++] = m_outInterfaces[RULES]) : void()), ...);
+      if (forwarded != 0)
+      {
+        m_senders[0]->send(data, length, getMulticastEndpoint(), outInterfaces.data(), forwarded);
+      }
+    }
+    else
+    {
+      ((matches<RULES>(sourceAddress)
+        ? void((m_senders[RULES]->send(data, length, getMulticastEndpoint()), ++forwarded)) : void()), ...);
+    }
+    return forwarded;
+  }
+
+  template <std::size_t ENDPOINT>
+  void CompiledForwarder<ENDPOINT>::handlePacket(const endpoint_t &senderEndpoint,
+    [[maybe_unused]] address_t inInterfaceAddress, const char *data, std::size_t length)
+  {
+#ifndef NDEBUG
+    Receiver::handlePacket(senderEndpoint, inInterfaceAddress, data, length);
+#endif
+
+    auto forwarded = forward(static_cast<uint32_t>(senderEndpoint.address().to_v4().to_ulong()), data, length,
+      std::make_index_sequence<ENTRY.ruleCount>());
+    if (forwarded != 0)
+    {
+      m_forwardedDatagrams += forwarded;
+    }
+    else
+    {
+      ++m_discardedDatagrams;
+    }
+#ifndef NDEBUG
+    if (forwarded != 0)
+    {
+      std::cout << "Datagram queued for forwarding " << forwarded << " times" << std::endl;
+    }
+    else
+    {
+      std::cout << "Datagram discarded" << std::endl;
+    }
+#endif
+  }
+
+  template <std::size_t ENDPOINT>
+  template <std::size_t RULE>
+  constexpr bool CompiledForwarder<ENDPOINT>::matches(uint32_t sourceAddress) noexcept
+  {
+    constexpr auto &rule = FORWARDING_TABLE_RULES[ENTRY.firstRule + RULE];
+    return (sourceAddress & ForwardingTable::getMask(rule.prefixLength)) == rule.networkAddress;
+  }
+
+  template <std::size_t ENDPOINT>
+  void CompiledForwarder<ENDPOINT>::printVariant(std::ostream &os) const
+  {
+    os << "compiled table entry #" << ENDPOINT;
+  }
+}
+
+
+std::unique_ptr<Forwarder> createCompiledForwarder(EventLoop &ioService, ReceiveBuffer &receiveBuffer,
+  const Forwarder::endpoint_t &multicastEndpoint, std::vector<Forwarder::Rule> &rules,
+  const std::vector<Sender::out_interface_t> &outInterfaces)
+{
+  static constexpr auto factories = getFactories(std::make_index_sequence<FORWARDING_TABLE_ENDPOINTS.size()>());
+  for (std::size_t i = 0; i < FORWARDING_TABLE_ENDPOINTS.size(); ++i)
+  {
+    if (corresponds(FORWARDING_TABLE_ENDPOINTS[i], multicastEndpoint, rules, outInterfaces))
+    {
+      return factories[i](ioService, receiveBuffer, multicastEndpoint, std::move(rules));
+    }
+  }
+  syslog(LOG_WARNING, "Forwarding table built in does not match the rules for %s:%u; matching them at run time",
+    multicastEndpoint.address().to_string().c_str(), multicastEndpoint.port());
+  return nullptr;
+}
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "forwarder.h"
+
+
+/**
+ * Creates a forwarder for the given endpoint that has its rules compiled in from the forwarding table built into the
+ * daemon (see MCV4FWDD_FORWARDING_TABLE), given the outgoing interface of each rule; returns nullptr when the table has
+ * no entry for the endpoint, or when its entry no longer corresponds to the given rules, e.g. because the addresses or
+ * indices of an interface changed
+ */
+std::unique_ptr<Forwarder> createCompiledForwarder(EventLoop &ioService, ReceiveBuffer &receiveBuffer,
+  const Forwarder::endpoint_t &multicastEndpoint, std::vector<Forwarder::Rule> &rules,
+  const std::vector<Sender::out_interface_t> &outInterfaces);
+
+
+#ifndef MCV4FWDD_FORWARDING_TABLE
+
+inline
+std::unique_ptr<Forwarder> createCompiledForwarder(EventLoop &, ReceiveBuffer &, const Forwarder::endpoint_t &,
+  std::vector<Forwarder::Rule> &, const std::vector<Sender::out_interface_t> &)
+{
+  return nullptr;
+}
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "config/model/arena.h"
+
+#include <cassert>
+#include <cstdint>
+
+
+using Arena = config::model::Arena;
+
+
+std::string_view Arena::copy(const std::string &string)
+{
+  if (string.empty())
+  {
+    return std::string_view();
+  }
+  auto data = static_cast<char *>(allocate(string.size(), 1));
+  string.copy(data, string.size());
+  return std::string_view(data, string.size());
+}
+
+void *Arena::allocate(std::size_t size, std::size_t alignment)
+{
+  assert(alignment <= alignof(std::max_align_t));
+  auto padding = (alignment - reinterpret_cast<uintptr_t>(m_next) % alignment) % alignment;
+  if (padding + size > m_available)
+  {
+    if (size > BLOCK_SIZE / 4)
+    {
+      // Keep the remainder of the current block for smaller objects to come
+      m_blocks.emplace_back(new char[size]);
+      return m_blocks.back().get();
+    }
+    m_blocks.emplace_back(new char[BLOCK_SIZE]);
+    m_next = m_blocks.back().get();
+    m_available = BLOCK_SIZE;
+    padding = 0;
+  }
+  auto result = m_next + padding;
+  m_next += padding + size;
+  m_available -= padding + size;
+  return result;
+}
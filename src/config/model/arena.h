@@ -0,0 +1,156 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+
+namespace config::model
+{
+  /**
+   * Bump allocator backing the parsed configuration: objects are copied into large blocks, and stay put until the
+   * arena is destroyed, so that large configurations take few allocations and can be traversed contiguously
+   */
+  struct Arena;
+
+  /** Contiguous, immutable sequence of objects copied into an Arena */
+  template <class T>
+  struct ArenaArray;
+}
+
+
+template <class T>
+struct config::model::ArenaArray
+{
+  ArenaArray() noexcept = default;
+  ArenaArray(const T *data, std::size_t size) noexcept;
+
+
+  const T &operator [](std::size_t index) const noexcept;
+
+  const T *begin() const noexcept;
+  bool empty() const noexcept;
+  const T *end() const noexcept;
+  std::size_t size() const noexcept;
+
+
+private:
+
+  const T *m_data = nullptr;
+  std::size_t m_size = 0;
+};
+
+
+struct config::model::Arena
+{
+  Arena() = default;
+
+  Arena(const Arena &) = delete;
+  Arena &operator =(const Arena &) = delete;
+
+  Arena(Arena &&) = default;
+  Arena &operator =(Arena &&) = default;
+
+
+  /** Copies the given objects into the arena */
+  template <class T>
+  ArenaArray<T> copy(const std::vector<T> &objects);
+
+  /** Copies the characters of the given string into the arena */
+  std::string_view copy(const std::string &string);
+
+
+private:
+
+  static constexpr std::size_t BLOCK_SIZE = 64 * 1024;
+
+
+  void *allocate(std::size_t size, std::size_t alignment);
+
+
+  std::vector<std::unique_ptr<char[]>> m_blocks;
+  char *m_next = nullptr;
+  std::size_t m_available = 0;
+};
+
+
+template <class T>
+inline
+config::model::ArenaArray<T>::ArenaArray(const T *data, std::size_t size) noexcept:
+  m_data(data),
+  m_size(size)
+{}
+
+template <class T>
+inline
+const T &config::model::ArenaArray<T>::operator [](std::size_t index) const noexcept
+{
+  return m_data[index];
+}
+
+template <class T>
+inline
+const T *config::model::ArenaArray<T>::begin() const noexcept
+{
+  return m_data;
+}
+
+template <class T>
+inline
+bool config::model::ArenaArray<T>::empty() const noexcept
+{
+  return m_size == 0;
+}
+
+template <class T>
+inline
+const T *config::model::ArenaArray<T>::end() const noexcept
+{
+  return m_data + m_size;
+}
+
+template <class T>
+inline
+std::size_t config::model::ArenaArray<T>::size() const noexcept
+{
+  return m_size;
+}
+
+template <class T>
+inline
+auto config::model::Arena::copy(const std::vector<T> &objects) -> ArenaArray<T>
+{
+  // The arena never runs destructors
+  static_assert(std::is_trivially_destructible_v<T>);
+  if (objects.empty())
+  {
+    return ArenaArray<T>();
+  }
+  auto data = static_cast<T *>(allocate(objects.size() * sizeof(T), alignof(T)));
+  std::uninitialized_copy(std::begin(objects), std::end(objects), data);
+  return ArenaArray<T>(data, objects.size());
+}
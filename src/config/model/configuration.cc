@@ -21,7 +21,6 @@
 
 #include "config/model/configuration.h"
 
-#include <algorithm>
 #include <sstream>
 
 
@@ -30,12 +29,67 @@ using Configuration = config::model::Configuration;
 
 std::ostream &operator <<(std::ostream &os, const Configuration &configuration)
 {
-  os << "Configuration" << std::endl;
-  std::for_each(std::begin(configuration.getServiceConfigurations()), std::end(configuration.getServiceConfigurations()),
-    [&](auto &serviceConfiguration) { os << serviceConfiguration; });
+  os << "Configuration" << std::endl << "\tTransmit mode: ";
+  switch (configuration.getTransmitMode())
+  {
+    case Configuration::TransmitMode::PER_INTERFACE:
+      os << "per interface";
+      break;
+    case Configuration::TransmitMode::SHARED:
+      os << "shared";
+      break;
+    case Configuration::TransmitMode::CONNECTED:
+      os << "connected";
+      break;
+  }
+  os << std::endl << "\tIGMP snooping: ";
+  switch (configuration.getIgmpSnooping())
+  {
+    case Configuration::IgmpSnooping::OFF:
+      os << "off";
+      break;
+    case Configuration::IgmpSnooping::PASSIVE:
+      os << "passive";
+      break;
+    case Configuration::IgmpSnooping::QUERIER:
+      os << "querier";
+      break;
+  }
+  os << std::endl;
+  for (auto &serviceConfiguration: configuration.getServiceConfigurations())
+  {
+    os << serviceConfiguration;
+    for (auto &forwardingRule: serviceConfiguration.getForwardingRules())
+    {
+      os << "\tForward from '" << configuration.getInterface(forwardingRule.getFromInterface()) << "' to '"
+        << configuration.getInterface(forwardingRule.getToInterface()) << "'";
+      if (!forwardingRule.getNetworks().empty())
+      {
+        os << " limited to: ";
+        for (auto &network: forwardingRule.getNetworks())
+        {
+          os << network << ' ';
+        }
+      }
+      for (auto &stage: forwardingRule.getStages())
+      {
+        os << std::endl << "\t\tStage: " << stage;
+      }
+      os << std::endl;
+    }
+  }
   return os;
 }
 
+auto Configuration::addInterface(const std::string &interface) -> interface_t
+{
+  auto index = m_interfaceIndices.emplace(interface, static_cast<interface_t>(m_interfaces.size()));
+  if (index.second)
+  {
+    m_interfaces.push_back(interface);
+  }
+  return index.first->second;
+}
 
 void Configuration::checkInterfaceName(const std::string &interface)
 {
@@ -47,18 +101,11 @@ void Configuration::checkInterfaceName(const std::string &interface)
   }
 }
 
-std::set<std::string> Configuration::getInterfaces() const
+auto Configuration::getInterfaces() const -> const interfaces_t &
 {
-  std::set<std::string> interfaces;
-  for (const auto &serviceConfiguration: getServiceConfigurations())
+  for (const auto &interface: m_interfaces)
   {
-    for (const auto &forwardingRule: serviceConfiguration.getForwardingRules())
-    {
-      checkInterfaceName(forwardingRule.getFromInterface());
-      interfaces.insert(forwardingRule.getFromInterface());
-      checkInterfaceName(forwardingRule.getToInterface());
-      interfaces.insert(forwardingRule.getToInterface());
-    }
+    checkInterfaceName(interface);
   }
-  return interfaces;
+  return m_interfaces;
 }
@@ -21,10 +21,11 @@
 
 #pragma once
 
-#include <list>
-#include <set>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
+#include "config/model/arena.h"
 #include "config/model/serviceconfiguration.h"
 
 
@@ -38,7 +39,31 @@ std::ostream &operator <<(std::ostream &os, const config::model::Configuration &
 
 struct config::model::Configuration
 {
-  using service_configurations_t = std::list<ServiceConfiguration>;
+  using interface_t = ForwardingRule::interface_t;
+  using interfaces_t = std::vector<std::string>;
+  using service_configurations_t = std::vector<ServiceConfiguration>;
+
+  /** Selects whether forwarding to an interface depends on the listeners there, as learned from IGMP */
+  enum class IgmpSnooping
+  {
+    /** Forward to all outgoing interfaces of the rules */
+    OFF,
+    /** Forward only to interfaces with listeners, relying on another querier on their networks */
+    PASSIVE,
+    /** Forward only to interfaces with listeners, and query for those where no other querier does */
+    QUERIER
+  };
+
+  /** Selects how forwarded datagrams leave the host */
+  enum class TransmitMode
+  {
+    /** One socket for each outgoing interface */
+    PER_INTERFACE,
+    /** One socket for all outgoing interfaces, selecting the interface for each datagram separately */
+    SHARED,
+    /** One socket for each outgoing interface, plus one connected socket for each multicast endpoint on it */
+    CONNECTED
+  };
 
 
   Configuration() = default;
@@ -47,15 +72,32 @@ struct config::model::Configuration
   Configuration &operator =(const Configuration &) = delete;
 
 
+  /** Interns the given interface name, so that forwarding rules can refer to it by index */
+  interface_t addInterface(const std::string &interface);
+
   void addServiceConfiguration(ServiceConfiguration &&serviceConfiguration);
 
-  /** Gets all interfaces used in the given configuration */
-  std::set<std::string> getInterfaces() const;
+  /** Gets the arena holding the forwarding rules and their networks */
+  Arena &getArena() noexcept;
+
+  /** Gets the name of the interface with the given index */
+  const std::string &getInterface(interface_t interface) const noexcept;
+
+  /** Gets all interfaces used in the given configuration, in order of their index */
+  const interfaces_t &getInterfaces() const;
 
   service_configurations_t &getServiceConfigurations() noexcept;
 
   const service_configurations_t &getServiceConfigurations() const noexcept;
 
+  IgmpSnooping getIgmpSnooping() const noexcept;
+
+  TransmitMode getTransmitMode() const noexcept;
+
+  void setIgmpSnooping(IgmpSnooping igmpSnooping) noexcept;
+
+  void setTransmitMode(TransmitMode transmitMode) noexcept;
+
 
 private:
 
@@ -63,7 +105,13 @@ private:
   static void checkInterfaceName(const std::string &interface);
 
 
+  /** Declared first as it must outlive the models referring into it */
+  Arena m_arena;
+  interfaces_t m_interfaces;
+  std::unordered_map<std::string, interface_t> m_interfaceIndices;
   service_configurations_t m_services;
+  TransmitMode m_transmitMode = TransmitMode::PER_INTERFACE;
+  IgmpSnooping m_igmpSnooping = IgmpSnooping::OFF;
 };
 
 
@@ -73,6 +121,18 @@ void config::model::Configuration::addServiceConfiguration(ServiceConfiguration
   m_services.emplace_back(std::move(serviceConfiguration));
 }
 
+inline
+auto config::model::Configuration::getArena() noexcept -> Arena &
+{
+  return m_arena;
+}
+
+inline
+const std::string &config::model::Configuration::getInterface(interface_t interface) const noexcept
+{
+  return m_interfaces[interface];
+}
+
 inline
 auto config::model::Configuration::getServiceConfigurations() noexcept -> service_configurations_t &
 {
@@ -84,3 +144,27 @@ auto config::model::Configuration::getServiceConfigurations() const noexcept ->
 {
   return m_services;
 }
+
+inline
+auto config::model::Configuration::getIgmpSnooping() const noexcept -> IgmpSnooping
+{
+  return m_igmpSnooping;
+}
+
+inline
+auto config::model::Configuration::getTransmitMode() const noexcept -> TransmitMode
+{
+  return m_transmitMode;
+}
+
+inline
+void config::model::Configuration::setIgmpSnooping(IgmpSnooping igmpSnooping) noexcept
+{
+  m_igmpSnooping = igmpSnooping;
+}
+
+inline
+void config::model::Configuration::setTransmitMode(TransmitMode transmitMode) noexcept
+{
+  m_transmitMode = transmitMode;
+}
@@ -21,11 +21,11 @@
 
 #pragma once
 
-#include <ostream>
-#include <list>
-#include <string>
+#include <cstdint>
 
+#include "config/model/arena.h"
 #include "config/model/network.h"
+#include "config/model/stageconfiguration.h"
 
 
 namespace config::model
@@ -33,68 +33,82 @@ namespace config::model
   struct ForwardingRule;
 }
 
-std::ostream &operator <<(std::ostream &os, const config::model::ForwardingRule &forwardingRule);
-
 
 struct config::model::ForwardingRule
 {
-  using networks_t = std::list<Network>;
+  /** Index of an interface name interned in the Configuration */
+  using interface_t = uint32_t;
+  using networks_t = ArenaArray<Network>;
+  using stages_t = ArenaArray<StageConfiguration>;
 
 
-  ForwardingRule(const std::string &fromInterface, const std::string &toInterface);
+  ForwardingRule(interface_t fromInterface, interface_t toInterface) noexcept;
 
-  ForwardingRule(const ForwardingRule &) = delete;
-  ForwardingRule &operator =(const ForwardingRule &) = delete;
 
-  ForwardingRule(ForwardingRule &&) = default;
-  ForwardingRule &operator =(ForwardingRule &&) = default;
+  interface_t getFromInterface() const noexcept;
 
+  /** Gets the source networks to forward from; empty when all networks on the incoming interface are accepted */
+  const networks_t &getNetworks() const noexcept;
 
-  const Network &addNetwork(Network &&network);
+  /** Gets the stages that datagrams from matching sources pass before being forwarded along this rule */
+  const stages_t &getStages() const noexcept;
 
-  const std::string &getFromInterface() const noexcept;
+  interface_t getToInterface() const noexcept;
 
-  const networks_t &getNetworks() const noexcept;
+  void setNetworks(networks_t networks) noexcept;
 
-  const std::string &getToInterface() const noexcept;
+  void setStages(stages_t stages) noexcept;
 
 
 private:
 
-  std::string m_fromInterface;
-  std::string m_toInterface;
+  interface_t m_fromInterface;
+  interface_t m_toInterface;
   networks_t m_fromNetworks;
+  stages_t m_stages;
 };
 
 
 inline
-config::model::ForwardingRule::ForwardingRule(const std::string &fromInterface, const std::string &toInterface):
+config::model::ForwardingRule::ForwardingRule(interface_t fromInterface, interface_t toInterface) noexcept:
   m_fromInterface(fromInterface),
   m_toInterface(toInterface),
-  m_fromNetworks()
+  m_fromNetworks(),
+  m_stages()
 {}
 
 inline
-auto config::model::ForwardingRule::addNetwork(Network &&network) -> const Network &
+auto config::model::ForwardingRule::getFromInterface() const noexcept -> interface_t
 {
-  m_fromNetworks.emplace_back(std::move(network));
-  return m_fromNetworks.back();
+  return m_fromInterface;
 }
 
 inline
-const std::string &config::model::ForwardingRule::getFromInterface() const noexcept
+auto config::model::ForwardingRule::getNetworks() const noexcept -> const networks_t &
 {
-  return m_fromInterface;
+  return m_fromNetworks;
 }
 
 inline
-auto config::model::ForwardingRule::getNetworks() const noexcept -> const networks_t &
+auto config::model::ForwardingRule::getStages() const noexcept -> const stages_t &
 {
-  return m_fromNetworks;
+  return m_stages;
 }
 
 inline
-const std::string &config::model::ForwardingRule::getToInterface() const noexcept
+auto config::model::ForwardingRule::getToInterface() const noexcept -> interface_t
 {
   return m_toInterface;
 }
+
+inline
+void config::model::ForwardingRule::setNetworks(networks_t networks) noexcept
+{
+  m_fromNetworks = networks;
+}
+
+inline
+void config::model::ForwardingRule::setStages(stages_t stages) noexcept
+{
+  m_stages = stages;
+}
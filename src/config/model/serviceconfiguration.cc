@@ -23,6 +23,7 @@
 
 #include <algorithm>
 #include <cassert>
+#include <climits>
 #include <cstring>
 #include <stdexcept>
 
@@ -44,7 +45,7 @@ namespace
     uint16_t port;
 
     bool operator <(const std::string &other) const noexcept;
-    bool operator <(const WellKnownService &other) const noexcept;
+    [[maybe_unused]] bool operator <(const WellKnownService &other) const noexcept;
     bool operator ==(const char *name) const noexcept;
   };
 
@@ -71,8 +72,15 @@ using ServiceConfiguration = config::model::ServiceConfiguration;
 
 ServiceConfiguration::ServiceConfiguration(boost::asio::ip::address_v4 groupAddress, uint16_t port):
   m_groupAddress(groupAddress),
+  m_groupPrefixLength(32),
   m_port(port),
-  m_forwardingRules()
+  m_proxy(false),
+  m_receiveBufferSize(),
+  m_sendBufferSize(),
+  m_offload(false),
+  m_coalescingWindow(),
+  m_forwardingRules(),
+  m_stages()
 {
   if (port == 0)
   {
@@ -80,10 +88,39 @@ ServiceConfiguration::ServiceConfiguration(boost::asio::ip::address_v4 groupAddr
   }
 }
 
+ServiceConfiguration::ServiceConfiguration(const Network &groups, uint16_t port):
+  m_groupAddress(groups.getMaskedAddress()),
+  m_groupPrefixLength(groups.getPrefixLength()),
+  m_port(port),
+  m_proxy(true),
+  m_receiveBufferSize(),
+  m_sendBufferSize(),
+  m_offload(false),
+  m_coalescingWindow(),
+  m_forwardingRules(),
+  m_stages()
+{
+  if (groups.getPrefixLength() < 4 || !Network(address_t(ip(224, 0, 0, 0)), 4).contains(groups.getAddress()))
+  {
+    throw std::invalid_argument("proxied groups must be multicast groups");
+  }
+  if (port == 0)
+  {
+    throw std::invalid_argument("port cannot be zero");
+  }
+}
+
 ServiceConfiguration::ServiceConfiguration(const std::string &name):
   m_groupAddress(),
+  m_groupPrefixLength(32),
   m_port(),
-  m_forwardingRules()
+  m_proxy(false),
+  m_receiveBufferSize(),
+  m_sendBufferSize(),
+  m_offload(false),
+  m_coalescingWindow(),
+  m_forwardingRules(),
+  m_stages()
 {
   assert(std::is_sorted(std::begin(WELL_KNOWN_SERVICES), std::end(WELL_KNOWN_SERVICES)));
   auto iter = std::lower_bound(std::begin(WELL_KNOWN_SERVICES), std::end(WELL_KNOWN_SERVICES), name);
@@ -95,10 +132,56 @@ ServiceConfiguration::ServiceConfiguration(const std::string &name):
   m_port = iter->port;
 }
 
+void ServiceConfiguration::checkSocketBufferSize(std::size_t size)
+{
+  // The kernel doubles the requested value to account for bookkeeping overhead, and stores the result as an int
+  if (size == 0 || size > INT_MAX / 2)
+  {
+    throw std::invalid_argument("invalid socket buffer size");
+  }
+}
+
+void ServiceConfiguration::setCoalescingWindow(unsigned long window)
+{
+  // Responders already delay their responses by up to 120 ms (RFC 6762 6); much more would outdate them
+  if (window == 0 || window > 1000)
+  {
+    throw std::invalid_argument("invalid coalescing window");
+  }
+  m_coalescingWindow = static_cast<unsigned>(window);
+}
+
 std::ostream &operator <<(std::ostream &os, const ServiceConfiguration &serviceConfiguration)
 {
-  os << "Service " << serviceConfiguration.getGroupAddress().to_string() << ':' << serviceConfiguration.getPort() << std::endl;
-  std::for_each(std::begin(serviceConfiguration.getForwardingRules()), std::end(serviceConfiguration.getForwardingRules()),
-    [&](auto &forwardingRule) { os << '\t' << forwardingRule; });
+  if (serviceConfiguration.isProxy())
+  {
+    os << "Proxy " << serviceConfiguration.getGroups() << ':' << serviceConfiguration.getPort() << std::endl;
+  }
+  else
+  {
+    os << "Service " << serviceConfiguration.getGroupAddress().to_string() << ':' << serviceConfiguration.getPort()
+      << std::endl;
+  }
+  if (serviceConfiguration.getReceiveBufferSize() != 0)
+  {
+    os << "\tReceive buffer size: " << serviceConfiguration.getReceiveBufferSize() << std::endl;
+  }
+  if (serviceConfiguration.getSendBufferSize() != 0)
+  {
+    os << "\tSend buffer size: " << serviceConfiguration.getSendBufferSize() << std::endl;
+  }
+  if (serviceConfiguration.getOffload())
+  {
+    os << "\tUDP segmentation and receive offload" << std::endl;
+  }
+  if (serviceConfiguration.getCoalescingWindow() != 0)
+  {
+    os << "\tCoalescing Multicast DNS responses for " << serviceConfiguration.getCoalescingWindow() << " ms"
+      << std::endl;
+  }
+  for (auto &stage: serviceConfiguration.getStages())
+  {
+    os << "\tStage: " << stage << std::endl;
+  }
   return os;
 }
@@ -21,9 +21,13 @@
 
 #pragma once
 
-#include <list>
+#include <ostream>
+#include <string>
 
+#include "config/model/arena.h"
 #include "config/model/forwardingrule.h"
+#include "config/model/network.h"
+#include "config/model/stageconfiguration.h"
 
 
 namespace config::model
@@ -37,12 +41,19 @@ std::ostream &operator <<(std::ostream &os, const config::model::ServiceConfigur
 struct config::model::ServiceConfiguration
 {
   using address_t = boost::asio::ip::address_v4;
-  using forwarding_rules_t = std::list<ForwardingRule>;
+  using forwarding_rules_t = ArenaArray<ForwardingRule>;
+  using stages_t = ArenaArray<StageConfiguration>;
 
   explicit ServiceConfiguration(const std::string &name);
 
   ServiceConfiguration(address_t groupAddress, uint16_t port);
 
+  /**
+   * Proxies the given range of groups: each is forwarded while it has listeners, as learned by IGMP snooping. Throws an
+   * std::invalid_argument unless the range lies within 224.0.0.0/4.
+   */
+  ServiceConfiguration(const Network &groups, uint16_t port);
+
   ServiceConfiguration(const ServiceConfiguration &) = delete;
   ServiceConfiguration &operator =(const ServiceConfiguration &) = delete;
 
@@ -50,47 +61,94 @@ struct config::model::ServiceConfiguration
   ServiceConfiguration &operator =(ServiceConfiguration &&) = default;
 
 
-  void addForwardingRule(ForwardingRule &&forwardingRule);
-
-  forwarding_rules_t &getForwardingRules() noexcept;
+  /** Gets the window in milliseconds for which Multicast DNS responses are held back to be merged; zero if not */
+  unsigned getCoalescingWindow() const noexcept;
 
   const forwarding_rules_t &getForwardingRules() const noexcept;
 
   address_t getGroupAddress() const noexcept;
 
+  /** Gets the range of groups of a proxy, or the single group of a service */
+  Network getGroups() const noexcept;
+
+  /** Returns true when UDP segmentation offload (GSO) and receive offload (GRO) should be used */
+  bool getOffload() const noexcept;
+
   uint16_t getPort() const noexcept;
 
+  /** Gets the requested receive socket buffer size in bytes; zero when the system default applies */
+  std::size_t getReceiveBufferSize() const noexcept;
+
+  /** Gets the requested send socket buffer size in bytes; zero when the system default applies */
+  std::size_t getSendBufferSize() const noexcept;
+
+  /** Gets the stages that all datagrams accepted by the rules of this service pass before being forwarded */
+  const stages_t &getStages() const noexcept;
+
+  bool isProxy() const noexcept;
+
+  /** Throws an std::invalid_argument when the given window in milliseconds is zero or longer than a second */
+  void setCoalescingWindow(unsigned long window);
+
+  void setForwardingRules(forwarding_rules_t forwardingRules) noexcept;
+
+  void setOffload(bool offload) noexcept;
+
+  /** Throws an std::invalid_argument when the given size cannot be used as a socket buffer size */
+  void setReceiveBufferSize(std::size_t size);
+
+  /** Throws an std::invalid_argument when the given size cannot be used as a socket buffer size */
+  void setSendBufferSize(std::size_t size);
+
+  void setStages(stages_t stages) noexcept;
+
 
 private:
 
+  static void checkSocketBufferSize(std::size_t size);
+
+
   address_t m_groupAddress;
+  uint8_t m_groupPrefixLength;
   uint16_t m_port;
+  bool m_proxy;
+  std::size_t m_receiveBufferSize;
+  std::size_t m_sendBufferSize;
+  bool m_offload;
+  unsigned m_coalescingWindow;
   forwarding_rules_t m_forwardingRules;
+  stages_t m_stages;
 };
 
 
 inline
-void config::model::ServiceConfiguration::addForwardingRule(ForwardingRule &&forwardingRule)
+unsigned config::model::ServiceConfiguration::getCoalescingWindow() const noexcept
 {
-  m_forwardingRules.emplace_back(std::move(forwardingRule));
+  return m_coalescingWindow;
 }
 
 inline
-auto config::model::ServiceConfiguration::getForwardingRules() noexcept -> forwarding_rules_t &
+auto config::model::ServiceConfiguration::getForwardingRules() const noexcept -> const forwarding_rules_t &
 {
   return m_forwardingRules;
 }
 
 inline
-auto config::model::ServiceConfiguration::getForwardingRules() const noexcept -> const forwarding_rules_t &
+auto config::model::ServiceConfiguration::getGroupAddress() const noexcept -> address_t
 {
-  return m_forwardingRules;
+  return m_groupAddress;
 }
 
 inline
-auto config::model::ServiceConfiguration::getGroupAddress() const noexcept -> address_t
+auto config::model::ServiceConfiguration::getGroups() const noexcept -> Network
 {
-  return m_groupAddress;
+  return Network(m_groupAddress, m_groupPrefixLength);
+}
+
+inline
+bool config::model::ServiceConfiguration::getOffload() const noexcept
+{
+  return m_offload;
 }
 
 inline
@@ -98,3 +156,59 @@ uint16_t config::model::ServiceConfiguration::getPort() const noexcept
 {
   return m_port;
 }
+
+inline
+std::size_t config::model::ServiceConfiguration::getReceiveBufferSize() const noexcept
+{
+  return m_receiveBufferSize;
+}
+
+inline
+std::size_t config::model::ServiceConfiguration::getSendBufferSize() const noexcept
+{
+  return m_sendBufferSize;
+}
+
+inline
+auto config::model::ServiceConfiguration::getStages() const noexcept -> const stages_t &
+{
+  return m_stages;
+}
+
+inline
+bool config::model::ServiceConfiguration::isProxy() const noexcept
+{
+  return m_proxy;
+}
+
+inline
+void config::model::ServiceConfiguration::setForwardingRules(forwarding_rules_t forwardingRules) noexcept
+{
+  m_forwardingRules = forwardingRules;
+}
+
+inline
+void config::model::ServiceConfiguration::setOffload(bool offload) noexcept
+{
+  m_offload = offload;
+}
+
+inline
+void config::model::ServiceConfiguration::setReceiveBufferSize(std::size_t size)
+{
+  checkSocketBufferSize(size);
+  m_receiveBufferSize = size;
+}
+
+inline
+void config::model::ServiceConfiguration::setSendBufferSize(std::size_t size)
+{
+  checkSocketBufferSize(size);
+  m_sendBufferSize = size;
+}
+
+inline
+void config::model::ServiceConfiguration::setStages(stages_t stages) noexcept
+{
+  m_stages = stages;
+}
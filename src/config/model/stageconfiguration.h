@@ -0,0 +1,87 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <ostream>
+#include <string_view>
+
+#include "config/model/arena.h"
+
+
+namespace config::model
+{
+  /** Processing stage listed in the configuration, by name and with its arguments as written */
+  struct StageConfiguration;
+}
+
+std::ostream &operator <<(std::ostream &os, const config::model::StageConfiguration &stageConfiguration);
+
+
+struct config::model::StageConfiguration
+{
+  using arguments_t = ArenaArray<std::string_view>;
+
+
+  StageConfiguration(std::string_view name, arguments_t arguments) noexcept;
+
+
+  const arguments_t &getArguments() const noexcept;
+
+  std::string_view getName() const noexcept;
+
+
+private:
+
+  std::string_view m_name;
+  arguments_t m_arguments;
+};
+
+
+inline
+config::model::StageConfiguration::StageConfiguration(std::string_view name, arguments_t arguments) noexcept:
+  m_name(name),
+  m_arguments(arguments)
+{}
+
+inline
+auto config::model::StageConfiguration::getArguments() const noexcept -> const arguments_t &
+{
+  return m_arguments;
+}
+
+inline
+std::string_view config::model::StageConfiguration::getName() const noexcept
+{
+  return m_name;
+}
+
+
+inline
+std::ostream &operator <<(std::ostream &os, const config::model::StageConfiguration &stageConfiguration)
+{
+  os << stageConfiguration.getName();
+  for (auto argument: stageConfiguration.getArguments())
+  {
+    os << " \"" << argument << '"';
+  }
+  return os;
+}
@@ -22,6 +22,9 @@
 #pragma once
 
 #include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include "config/model/configuration.h"
 
@@ -42,8 +45,7 @@ struct config::parser::Context
   ~Context();
 
 
-  template <class...Ts>
-  void addForwardingRule(Ts &&... args);
+  void addForwardingRule(const std::string &fromInterface, const std::string &toInterface);
 
   template <class...Ts>
   void addServiceConfiguration(Ts &&... args);
@@ -51,6 +53,19 @@ struct config::parser::Context
   template<class... Ts>
   const model::Network &addNetwork(Ts &&... args);
 
+  /** Begins a stage of the current forwarding rule, or of the current service outside of forwarding rules */
+  void addStage(const std::string &name);
+
+  void addStageArgument(const std::string &argument);
+
+  /** Moves the networks and stages of the current forwarding rule into the configuration */
+  void finishForwardingRule();
+
+  /** Moves the forwarding rules and stages of the current service into the configuration */
+  void finishServiceConfiguration();
+
+  void finishStage();
+
   FILE *getFile() noexcept;
 
   const std::string &getFileName() const noexcept;
@@ -61,6 +76,18 @@ struct config::parser::Context
 
   void setReadError(int error) noexcept;
 
+  void setCoalescingWindow(unsigned long window);
+
+  void setIgmpSnooping(model::Configuration::IgmpSnooping igmpSnooping) noexcept;
+
+  void setOffload(bool offload) noexcept;
+
+  void setReceiveBufferSize(std::size_t size);
+
+  void setSendBufferSize(std::size_t size);
+
+  void setTransmitMode(model::Configuration::TransmitMode transmitMode) noexcept;
+
   void updateStatus(bool success) noexcept;
 
 
@@ -78,8 +105,15 @@ private:
   bool m_success;
 
   model::Configuration &m_configuration;
-  model::ServiceConfiguration *m_currentServiceConfiguration;
-  model::ForwardingRule *m_currentForwardingRule;
+  /** Collects the forwarding rules of the current service, and the networks of the current rule until finished */
+  std::vector<model::ForwardingRule> m_forwardingRules;
+  std::vector<model::Network> m_networks;
+  /** Collects the stages of the current service and forwarding rule, and the arguments of the current stage */
+  std::vector<model::StageConfiguration> m_serviceStages;
+  std::vector<model::StageConfiguration> m_forwardingRuleStages;
+  std::string_view m_stageName;
+  std::vector<std::string_view> m_stageArguments;
+  bool m_inForwardingRule;
 };
 
 
@@ -90,7 +124,14 @@ config::parser::Context::Context(const std::string &fileName, FILE *stream, mode
   m_stream(stream),
   m_readError(0),
   m_success(true),
-  m_configuration(configuration)
+  m_configuration(configuration),
+  m_forwardingRules(),
+  m_networks(),
+  m_serviceStages(),
+  m_forwardingRuleStages(),
+  m_stageName(),
+  m_stageArguments(),
+  m_inForwardingRule(false)
 {
   initializeScanner();
 }
@@ -101,11 +142,13 @@ config::parser::Context::~Context()
   destroyScanner();
 }
 
-template <class...Ts>
 inline
-void config::parser::Context::addForwardingRule(Ts &&... args)
+void config::parser::Context::addForwardingRule(const std::string &fromInterface, const std::string &toInterface)
 {
-  m_configuration.getServiceConfigurations().back().addForwardingRule(model::ForwardingRule(std::forward<Ts>(args)...));
+  auto from = m_configuration.addInterface(fromInterface);
+  auto to = m_configuration.addInterface(toInterface);
+  m_forwardingRules.emplace_back(from, to);
+  m_inForwardingRule = true;
 }
 
 template <class...Ts>
@@ -119,8 +162,51 @@ template<class... Ts>
 inline
 const config::model::Network &config::parser::Context::addNetwork(Ts &&... args)
 {
-  return m_configuration.getServiceConfigurations().back().getForwardingRules().back()
-    .addNetwork(model::Network(std::forward<Ts>(args)...));
+  return m_networks.emplace_back(std::forward<Ts>(args)...);
+}
+
+inline
+void config::parser::Context::addStage(const std::string &name)
+{
+  m_stageName = m_configuration.getArena().copy(name);
+}
+
+inline
+void config::parser::Context::addStageArgument(const std::string &argument)
+{
+  m_stageArguments.push_back(m_configuration.getArena().copy(argument));
+}
+
+inline
+void config::parser::Context::finishForwardingRule()
+{
+  m_forwardingRules.back().setNetworks(m_configuration.getArena().copy(m_networks));
+  m_forwardingRules.back().setStages(m_configuration.getArena().copy(m_forwardingRuleStages));
+  m_networks.clear();
+  m_forwardingRuleStages.clear();
+  m_inForwardingRule = false;
+}
+
+inline
+void config::parser::Context::finishServiceConfiguration()
+{
+  // There may be none yet when adding the service failed
+  auto &serviceConfigurations = m_configuration.getServiceConfigurations();
+  if (!std::empty(serviceConfigurations))
+  {
+    serviceConfigurations.back().setForwardingRules(m_configuration.getArena().copy(m_forwardingRules));
+    serviceConfigurations.back().setStages(m_configuration.getArena().copy(m_serviceStages));
+  }
+  m_forwardingRules.clear();
+  m_serviceStages.clear();
+}
+
+inline
+void config::parser::Context::finishStage()
+{
+  (m_inForwardingRule ? m_forwardingRuleStages : m_serviceStages).emplace_back(m_stageName,
+    m_configuration.getArena().copy(m_stageArguments));
+  m_stageArguments.clear();
 }
 
 inline
@@ -153,6 +239,42 @@ void config::parser::Context::setReadError(int error) noexcept
   m_readError = error;
 }
 
+inline
+void config::parser::Context::setCoalescingWindow(unsigned long window)
+{
+  m_configuration.getServiceConfigurations().back().setCoalescingWindow(window);
+}
+
+inline
+void config::parser::Context::setIgmpSnooping(model::Configuration::IgmpSnooping igmpSnooping) noexcept
+{
+  m_configuration.setIgmpSnooping(igmpSnooping);
+}
+
+inline
+void config::parser::Context::setOffload(bool offload) noexcept
+{
+  m_configuration.getServiceConfigurations().back().setOffload(offload);
+}
+
+inline
+void config::parser::Context::setReceiveBufferSize(std::size_t size)
+{
+  m_configuration.getServiceConfigurations().back().setReceiveBufferSize(size);
+}
+
+inline
+void config::parser::Context::setSendBufferSize(std::size_t size)
+{
+  m_configuration.getServiceConfigurations().back().setSendBufferSize(size);
+}
+
+inline
+void config::parser::Context::setTransmitMode(model::Configuration::TransmitMode transmitMode) noexcept
+{
+  m_configuration.setTransmitMode(transmitMode);
+}
+
 inline
 void config::parser::Context::updateStatus(bool success) noexcept
 {
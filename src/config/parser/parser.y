@@ -64,13 +64,24 @@ namespace
 %token                T_BLOCK_BEGIN
 %token                T_BLOCK_END
 %token <stringValue>  T_IDENTIFIER
+%token <stringValue>  T_INTEGER
 %token <stringValue>  T_IP_ADDRESS_PORT
+%token                T_KEYWORD_COALESCE
 %token                T_KEYWORD_FORWARD
 %token                T_KEYWORD_FROM
+%token                T_KEYWORD_IGMP_SNOOPING
+%token                T_KEYWORD_OFFLOAD
+%token                T_KEYWORD_PROXY
+%token                T_KEYWORD_RCVBUF
 %token                T_KEYWORD_SERVICE
+%token                T_KEYWORD_SNDBUF
+%token                T_KEYWORD_STAGE
 %token                T_KEYWORD_TO
+%token                T_KEYWORD_TRANSMIT
 %token                T_SEMICOLON
 %token <stringValue>  T_NETWORK
+%token <stringValue>  T_NETWORK_PORT
+%token <stringValue>  T_STRING
 %token                T_UNKNOWN
 
 
@@ -79,18 +90,66 @@ namespace
 %type  <stringValue>  ServiceAddressAndPort
 %type  <stringValue>  ServiceName
 %type  <stringValue>  Network
+%type  <stringValue>  StageArgument
 
 
 %start Configuration
 %%
 
 Configuration:
-  ServiceConfigurations
+  Statements
   ;
 
-ServiceConfigurations:
+Statements:
+  Statement
+  | Statements Statement
+  ;
+
+Statement:
   ServiceConfiguration
-  | ServiceConfigurations ServiceConfiguration
+  | ProxyConfiguration
+  | GlobalOption
+  ;
+
+GlobalOption:
+  T_KEYWORD_TRANSMIT T_IDENTIFIER T_SEMICOLON
+  {
+    if ($2 == "per_interface")
+    {
+      c->setTransmitMode(config::model::Configuration::TransmitMode::PER_INTERFACE);
+    }
+    else if ($2 == "shared")
+    {
+      c->setTransmitMode(config::model::Configuration::TransmitMode::SHARED);
+    }
+    else if ($2 == "connected")
+    {
+      c->setTransmitMode(config::model::Configuration::TransmitMode::CONNECTED);
+    }
+    else
+    {
+      std::cerr << c->getFileName() << ':' << yyloc.first_line << ": error: unknown transmit mode: " << $2
+        << std::endl;
+      c->updateStatus(false);
+    }
+  }
+  | T_KEYWORD_IGMP_SNOOPING T_SEMICOLON
+  {
+    c->setIgmpSnooping(config::model::Configuration::IgmpSnooping::PASSIVE);
+  }
+  | T_KEYWORD_IGMP_SNOOPING T_IDENTIFIER T_SEMICOLON
+  {
+    if ($2 == "querier")
+    {
+      c->setIgmpSnooping(config::model::Configuration::IgmpSnooping::QUERIER);
+    }
+    else
+    {
+      std::cerr << c->getFileName() << ':' << yyloc.first_line << ": error: unknown IGMP snooping mode: " << $2
+        << std::endl;
+      c->updateStatus(false);
+    }
+  }
   ;
 
 ServiceConfiguration:
@@ -116,8 +175,43 @@ ServiceConfiguration:
     }
   }
   T_BLOCK_BEGIN
-    ForwardingRules
+    ServiceStatements
   T_BLOCK_END
+  {
+    c->finishServiceConfiguration();
+  }
+  ;
+
+ProxyConfiguration:
+  T_KEYWORD_PROXY
+  T_NETWORK_PORT
+  {
+    auto slash = $2.find('/');
+    auto colon = $2.find(':');
+    auto address = ip_address_v4::from_string($2.substr(0, slash));
+    config::model::Network groups(address, stoi($2.substr(slash + 1, colon - slash - 1)));
+    if (address != groups.getAddress())
+    {
+      std::cerr << c->getFileName() << ':' << yyloc.first_line << ": warning: address masked from "
+        << $2.substr(0, colon) << " to " << groups << std::endl;
+    }
+    try
+    {
+      c->addServiceConfiguration(groups, stoi($2.substr(colon + 1)));
+    }
+    catch (const std::invalid_argument &error)
+    {
+      std::cerr << c->getFileName() << ':' << yyloc.first_line << ": error: " << error.what() << ": " << $2
+        << std::endl;
+      c->updateStatus(false);
+    }
+  }
+  T_BLOCK_BEGIN
+    ServiceStatements
+  T_BLOCK_END
+  {
+    c->finishServiceConfiguration();
+  }
   ;
 
 Service:
@@ -133,9 +227,61 @@ ServiceAddressAndPort:
   T_IP_ADDRESS_PORT
   ;
 
-ForwardingRules:
+ServiceStatements:
+  ServiceStatement
+  | ServiceStatements ServiceStatement
+  ;
+
+ServiceStatement:
   ForwardingRule
-  | ForwardingRules ForwardingRule
+  | ServiceOption
+  | Stage
+  ;
+
+ServiceOption:
+  T_KEYWORD_COALESCE T_INTEGER T_SEMICOLON
+  {
+    try
+    {
+      c->setCoalescingWindow(std::stoul($2));
+    }
+    catch (const std::logic_error &)
+    {
+      std::cerr << c->getFileName() << ':' << yyloc.first_line << ": error: invalid coalescing window: " << $2
+        << std::endl;
+      c->updateStatus(false);
+    }
+  }
+  | T_KEYWORD_OFFLOAD T_SEMICOLON
+  {
+    c->setOffload(true);
+  }
+  | T_KEYWORD_RCVBUF T_INTEGER T_SEMICOLON
+  {
+    try
+    {
+      c->setReceiveBufferSize(std::stoul($2));
+    }
+    catch (const std::logic_error &)
+    {
+      std::cerr << c->getFileName() << ':' << yyloc.first_line << ": error: invalid receive buffer size: " << $2
+        << std::endl;
+      c->updateStatus(false);
+    }
+  }
+  | T_KEYWORD_SNDBUF T_INTEGER T_SEMICOLON
+  {
+    try
+    {
+      c->setSendBufferSize(std::stoul($2));
+    }
+    catch (const std::logic_error &)
+    {
+      std::cerr << c->getFileName() << ':' << yyloc.first_line << ": error: invalid send buffer size: " << $2
+        << std::endl;
+      c->updateStatus(false);
+    }
+  }
   ;
 
 ForwardingRule:
@@ -144,6 +290,9 @@ ForwardingRule:
     c->addForwardingRule($2, $4);
   }
   ForwardingRuleNetworks
+  {
+    c->finishForwardingRule();
+  }
   ;
 
 InterfaceName:
@@ -152,12 +301,18 @@ InterfaceName:
 
 ForwardingRuleNetworks:
   T_SEMICOLON
-  | T_BLOCK_BEGIN FromNetworks T_BLOCK_END
+  | T_BLOCK_BEGIN ForwardingRuleStatements T_BLOCK_END
   ;
 
-FromNetworks:
+ForwardingRuleStatements:
+  ForwardingRuleStatement
+  | ForwardingRuleStatements ForwardingRuleStatement
+  ;
+
+ForwardingRuleStatement:
   FromNetwork
-  | FromNetworks FromNetwork;
+  | Stage
+  ;
 
 FromNetwork:
   T_KEYWORD_FROM Network T_SEMICOLON
@@ -181,6 +336,32 @@ FromNetwork:
 Network:
   T_NETWORK;
 
+Stage:
+  T_KEYWORD_STAGE T_IDENTIFIER
+  {
+    c->addStage($2);
+  }
+  StageArguments T_SEMICOLON
+  {
+    c->finishStage();
+  }
+  ;
+
+StageArguments:
+  %empty
+  | StageArguments StageArgument
+  {
+    c->addStageArgument($2);
+  }
+  ;
+
+StageArgument:
+  T_IDENTIFIER
+  | T_INTEGER
+  | T_NETWORK
+  | T_STRING
+  ;
+
 %%
 
 bool
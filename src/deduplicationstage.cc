@@ -0,0 +1,131 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "deduplicationstage.h"
+
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include <syslog.h>
+
+#include "utility.h"
+
+
+DeduplicationStage::DeduplicationStage(const arguments_t &arguments):
+  m_table(),
+  m_hits(),
+  m_misses()
+{
+  if (arguments.size() > 3)
+  {
+    throw std::invalid_argument("expected at most a window in milliseconds, a capacity and a table name");
+  }
+  auto window = arguments.empty() ? DEFAULT_WINDOW : parsePositive(arguments[0], MAXIMUM_WINDOW);
+  auto capacity = arguments.size() < 2 ? std::size_t(DEFAULT_CAPACITY) : parsePositive(arguments[1], MAXIMUM_CAPACITY);
+  std::size_t slots = PROBE_LENGTH;
+  while (slots < capacity)
+  {
+    slots *= 2;
+  }
+  m_table = getTable(arguments.size() < 3 ? std::string_view() : arguments[2],
+    std::chrono::duration_cast<clock_t::duration>(std::chrono::milliseconds(window)), slots);
+}
+
+auto DeduplicationStage::getTable(std::string_view name, clock_t::duration window, std::size_t slots)
+  -> std::shared_ptr<Table>
+{
+  // Tables live as long as a stage refers to them, so that they do not outlive the router when it is set up again
+  static std::map<std::string, std::weak_ptr<Table>, std::less<>> tables;
+  std::shared_ptr<Table> table;
+  auto found = name.empty() ? std::end(tables) : tables.find(name);
+  if (found != std::end(tables))
+  {
+    table = found->second.lock();
+  }
+  if (table == nullptr)
+  {
+    // All memory is claimed up front, as stages must not allocate while forwarding
+    table = std::make_shared<Table>(Table{window, std::vector<Entry>(slots), 0});
+    if (!name.empty())
+    {
+      tables[std::string(name)] = table;
+    }
+  }
+  else if (table->window != window || table->entries.size() != slots)
+  {
+    throw std::invalid_argument("expected the same window and capacity as other stages sharing the table");
+  }
+  return table;
+}
+
+auto DeduplicationStage::process(DatagramView &datagram) -> Verdict
+{
+  // The group is left out, as copies of a datagram may have been sent to different ones; the source port is not, so
+  // that the same payload sent through different sockets of a host is not taken for a copy
+  const auto seed = (uint64_t(datagram.senderEndpoint.address().to_v4().to_uint()) << 32)
+    | (uint64_t(datagram.senderEndpoint.port()) << 16) | datagram.multicastEndpoint.port();
+  const auto hash = utility::hashPayload(datagram.data, datagram.length, seed);
+  const auto now = clock_t::now();
+  auto &entries = m_table->entries;
+  Entry *vacant = nullptr;
+  Entry *oldest = nullptr;
+  for (std::size_t i = 0; i < PROBE_LENGTH; ++i)
+  {
+    auto &entry = entries[(hash + i) & (entries.size() - 1)];
+    if (entry.expiry <= now)
+    {
+      vacant = vacant != nullptr ? vacant : &entry;
+    }
+    else if (entry.hash == hash)
+    {
+      // The window is not extended, such that datagrams repeated on purpose pass once in each window
+      ++m_hits;
+      return Verdict::DROP;
+    }
+    if (oldest == nullptr || entry.expiry < oldest->expiry)
+    {
+      oldest = &entry;
+    }
+  }
+  if (vacant == nullptr)
+  {
+    ++m_table->evictedEntries;
+  }
+  auto &entry = vacant != nullptr ? *vacant : *oldest;
+  entry.hash = hash;
+  entry.expiry = now + m_table->window;
+  ++m_misses;
+  return Verdict::PASS;
+}
+
+void DeduplicationStage::reportStatistics(const std::string &owner) const
+{
+  std::ostringstream oss;
+  oss << owner << ": " << m_misses << " datagrams first seen, " << m_hits << " dropped as copies; "
+    << m_table->evictedEntries << " datagrams evicted early";
+  if (m_table.use_count() > 1)
+  {
+    oss << " from the table shared with " << m_table.use_count() - 1 << " other stages";
+  }
+  syslog(LOG_INFO, "%s", oss.str().c_str());
+}
@@ -0,0 +1,94 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "pipeline.h"
+
+
+/**
+ * Stage dropping copies of a datagram received again within a time window, e.g. through redundant uplinks; it is
+ * configured as "stage deduplicate [WINDOW [CAPACITY [TABLE]]];" with a window of WINDOW milliseconds (100 by
+ * default), counted from the first copy, and room for about CAPACITY datagrams (4096 by default). Datagrams are told
+ * apart by a hash of their source address and port, destination port and payload only, such that stages of different
+ * services naming the same TABLE share it, and a datagram sent through one socket to both the SSDP group and the
+ * broadcast address is forwarded once; those stages must then agree on the window and the capacity.
+ */
+struct DeduplicationStage final: Stage
+{
+  explicit DeduplicationStage(const arguments_t &arguments);
+
+
+  Verdict process(DatagramView &datagram) override;
+
+  void reportStatistics(const std::string &owner) const override;
+
+
+private:
+
+  using clock_t = std::chrono::steady_clock;
+
+  enum: std::size_t
+  {
+    DEFAULT_CAPACITY = 4096,
+    MAXIMUM_CAPACITY = 1 << 20,
+    /** Number of consecutive slots that can hold a datagram */
+    PROBE_LENGTH = 16
+  };
+
+  /** Default window in milliseconds, and the largest one accepted */
+  static constexpr unsigned long DEFAULT_WINDOW = 100;
+  static constexpr unsigned long MAXIMUM_WINDOW = 60000;
+
+
+  /** Datagram seen during the window; identified by its hash alone */
+  struct Entry
+  {
+    uint64_t hash;
+    /** End of the window; the slot is unused once passed */
+    clock_t::time_point expiry;
+  };
+
+  /** Hashes of the datagrams seen, possibly shared by the stages of several services */
+  struct Table
+  {
+    clock_t::duration window;
+    /** Open addressing hash table, with a power of two slots */
+    std::vector<Entry> entries;
+    uint64_t evictedEntries;
+  };
+
+
+  /** Gets the table with the given name, creating it if needed; throws an std::invalid_argument if it differs */
+  static std::shared_ptr<Table> getTable(std::string_view name, clock_t::duration window, std::size_t slots);
+
+
+  std::shared_ptr<Table> m_table;
+
+  uint64_t m_hits;
+  uint64_t m_misses;
+};
@@ -0,0 +1,253 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "dnsmessage.h"
+
+#include <algorithm>
+#include <cstring>
+
+
+namespace
+{
+  constexpr uint8_t LABEL_POINTER = 0xc0;
+
+  uint8_t toLower(uint8_t c) noexcept
+  {
+    return c >= 'A' && c <= 'Z' ? static_cast<uint8_t>(c - 'A' + 'a') : c;
+  }
+}
+
+
+bool DnsMessage::equalNames(const uint8_t *name, std::size_t length, const uint8_t *otherName,
+  std::size_t otherLength) noexcept
+{
+  // Length octets never fall in the range of upper case letters, so the whole names can be compared alike
+  if (length != otherLength)
+  {
+    return false;
+  }
+  for (std::size_t i = 0; i < length; ++i)
+  {
+    if (toLower(name[i]) != toLower(otherName[i]))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool DnsMessage::expandData(const Record &record, uint8_t *out, std::size_t capacity, std::size_t &length) const
+  noexcept
+{
+  // Only the types defined by RFC 1035 may use compression, but Multicast DNS extends this to a few others
+  const std::size_t end = record.dataOffset + record.dataLength;
+  std::size_t nameOffset = record.dataOffset;
+  switch (record.type)
+  {
+    case TYPE_NS:
+    case TYPE_CNAME:
+    case TYPE_PTR:
+    case TYPE_NSEC:
+      break;
+    case TYPE_SRV:
+      // Priority, weight and port precede the target
+      nameOffset += 6;
+      break;
+    default:
+      if (record.dataLength > capacity)
+      {
+        return false;
+      }
+      std::memcpy(out, m_data + record.dataOffset, record.dataLength);
+      length = record.dataLength;
+      return true;
+  }
+
+  // Copy the fields ahead of the name, the name itself, and whatever follows it within the data
+  std::size_t nameEnd = nameOffset;
+  if (nameOffset >= end || nameOffset - record.dataOffset > capacity || !skipName(nameEnd) || nameEnd > end)
+  {
+    return false;
+  }
+  std::size_t prefixLength = nameOffset - record.dataOffset;
+  std::memcpy(out, m_data + record.dataOffset, prefixLength);
+  std::size_t nameLength = 0;
+  if (!expandName(nameOffset, out + prefixLength, capacity - prefixLength, nameLength))
+  {
+    return false;
+  }
+  std::size_t suffixLength = end - nameEnd;
+  if (prefixLength + nameLength + suffixLength > capacity)
+  {
+    return false;
+  }
+  std::memcpy(out + prefixLength + nameLength, m_data + nameEnd, suffixLength);
+  length = prefixLength + nameLength + suffixLength;
+  return true;
+}
+
+bool DnsMessage::expandName(std::size_t offset, uint8_t *out, std::size_t capacity, std::size_t &length) const
+  noexcept
+{
+  /* Compression pointers must point strictly before the labels read so far, which guarantees that following them
+   * terminates */
+  std::size_t limit = offset;
+  std::size_t written = 0;
+  while (offset < m_length)
+  {
+    auto labelLength = m_data[offset];
+    if ((labelLength & LABEL_POINTER) == LABEL_POINTER)
+    {
+      if (offset + 1 >= m_length)
+      {
+        return false;
+      }
+      std::size_t target = (std::size_t(labelLength & ~LABEL_POINTER) << 8) | m_data[offset + 1];
+      if (target >= limit)
+      {
+        return false;
+      }
+      offset = limit = target;
+      continue;
+    }
+    if ((labelLength & LABEL_POINTER) != 0 || offset + 1 + labelLength > m_length
+      || written + 1 + labelLength > std::min<std::size_t>(capacity, MAX_NAME_LENGTH))
+    {
+      return false;
+    }
+    std::memcpy(out + written, m_data + offset, 1 + labelLength);
+    written += 1 + labelLength;
+    offset += 1 + labelLength;
+    if (labelLength == 0)
+    {
+      length = written;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool DnsMessage::readQuestion(std::size_t &offset, Question &question) const noexcept
+{
+  question.nameOffset = offset;
+  if (!skipName(offset) || offset + 4 > m_length)
+  {
+    return false;
+  }
+  question.type = read16(offset);
+  question.klass = read16(offset + 2);
+  offset += 4;
+  return true;
+}
+
+bool DnsMessage::readRecord(std::size_t &offset, Record &record) const noexcept
+{
+  record.nameOffset = offset;
+  if (!skipName(offset) || offset + 10 > m_length)
+  {
+    return false;
+  }
+  record.type = read16(offset);
+  record.klass = read16(offset + 2);
+  record.ttl = read32(offset + 4);
+  record.dataLength = read16(offset + 8);
+  record.dataOffset = offset + 10;
+  if (record.dataOffset + record.dataLength > m_length)
+  {
+    return false;
+  }
+  offset = record.dataOffset + record.dataLength;
+  return true;
+}
+
+bool DnsMessage::skipName(std::size_t &offset) const noexcept
+{
+  while (offset < m_length)
+  {
+    auto labelLength = m_data[offset];
+    if ((labelLength & LABEL_POINTER) == LABEL_POINTER)
+    {
+      offset += 2;
+      return offset <= m_length;
+    }
+    if ((labelLength & LABEL_POINTER) != 0)
+    {
+      return false;
+    }
+    offset += 1 + labelLength;
+    if (labelLength == 0)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool DnsMessageWriter::addQuestion(const DnsMessage &message, const DnsMessage::Question &question) noexcept
+{
+  std::size_t nameLength = 0;
+  if (m_length > m_capacity || !message.expandName(question.nameOffset, m_data + m_length, m_capacity - m_length,
+    nameLength) || m_length + nameLength + 4 > m_capacity)
+  {
+    return false;
+  }
+  write16(m_length + nameLength, question.type);
+  write16(m_length + nameLength + 2, question.klass);
+  m_length += nameLength + 4;
+  ++m_questionCount;
+  return true;
+}
+
+bool DnsMessageWriter::addRecord(Section section, const DnsMessage &message, const DnsMessage::Record &record,
+  uint32_t ttl) noexcept
+{
+  std::size_t nameLength = 0;
+  std::size_t dataLength = 0;
+  if (m_length > m_capacity || !message.expandName(record.nameOffset, m_data + m_length, m_capacity - m_length,
+    nameLength) || m_length + nameLength + 10 > m_capacity)
+  {
+    return false;
+  }
+  auto fields = m_length + nameLength;
+  if (!message.expandData(record, m_data + fields + 10, m_capacity - fields - 10, dataLength))
+  {
+    return false;
+  }
+  write16(fields, record.type);
+  write16(fields + 2, record.klass);
+  write16(fields + 4, static_cast<uint16_t>(ttl >> 16));
+  write16(fields + 6, static_cast<uint16_t>(ttl));
+  write16(fields + 8, static_cast<uint16_t>(dataLength));
+  m_length = fields + 10 + dataLength;
+  ++m_recordCounts[section];
+  return true;
+}
+
+std::size_t DnsMessageWriter::finish(uint16_t id, uint16_t flags) noexcept
+{
+  write16(0, id);
+  write16(2, flags);
+  write16(4, m_questionCount);
+  write16(6, m_recordCounts[ANSWER]);
+  write16(8, m_recordCounts[AUTHORITY]);
+  write16(10, m_recordCounts[ADDITIONAL]);
+  return m_length;
+}
@@ -0,0 +1,299 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+
+/**
+ * Bounds-checked view of a DNS message (RFC 1035) in its wire format, as used by Multicast DNS (RFC 6762); nothing is
+ * copied until names or record data are expanded, which resolves name compression
+ */
+struct DnsMessage
+{
+  enum: uint16_t
+  {
+    TYPE_A = 1,
+    TYPE_NS = 2,
+    TYPE_CNAME = 5,
+    TYPE_PTR = 12,
+    TYPE_TXT = 16,
+    TYPE_AAAA = 28,
+    TYPE_SRV = 33,
+    TYPE_OPT = 41,
+    TYPE_NSEC = 47,
+    TYPE_ANY = 255
+  };
+
+  enum: uint16_t
+  {
+    CLASS_IN = 1,
+    CLASS_ANY = 255,
+    /** Top bit of the class; the cache flush bit in records, the unicast response bit in questions (RFC 6762) */
+    CLASS_FLAG = 0x8000
+  };
+
+  enum: uint16_t
+  {
+    FLAG_RESPONSE = 0x8000,
+    FLAG_AUTHORITATIVE = 0x0400,
+    FLAG_TRUNCATED = 0x0200,
+    OPCODE_MASK = 0x7800,
+    RCODE_MASK = 0x000f
+  };
+
+  enum: std::size_t
+  {
+    HEADER_SIZE = 12,
+    /** Longest name in its uncompressed wire format */
+    MAX_NAME_LENGTH = 255
+  };
+
+
+  /** Entry of the question section; the name remains in the message */
+  struct Question
+  {
+    std::size_t nameOffset;
+    uint16_t type;
+    uint16_t klass;
+  };
+
+  /** Entry of the answer, authority or additional section; the name and the data remain in the message */
+  struct Record
+  {
+    std::size_t nameOffset;
+    uint16_t type;
+    uint16_t klass;
+    uint32_t ttl;
+    std::size_t dataOffset;
+    uint16_t dataLength;
+  };
+
+
+  DnsMessage(const char *data, std::size_t length) noexcept;
+
+
+  /**
+   * Writes the data of the given record, with the names in it uncompressed for the types known to contain names;
+   * returns false if the data is malformed or does not fit
+   */
+  bool expandData(const Record &record, uint8_t *out, std::size_t capacity, std::size_t &length) const noexcept;
+
+  /**
+   * Writes the name at the given offset in its uncompressed wire format, following compression pointers; returns false
+   * if the name is malformed or does not fit
+   */
+  bool expandName(std::size_t offset, uint8_t *out, std::size_t capacity, std::size_t &length) const noexcept;
+
+  uint16_t getAdditionalCount() const noexcept;
+
+  uint16_t getAnswerCount() const noexcept;
+
+  uint16_t getAuthorityCount() const noexcept;
+
+  uint16_t getFlags() const noexcept;
+
+  uint16_t getId() const noexcept;
+
+  uint16_t getQuestionCount() const noexcept;
+
+  /** Whether this is a standard query or response without errors, i.e. a message worth looking into */
+  bool isStandard() const noexcept;
+
+  bool isResponse() const noexcept;
+
+  bool isTruncated() const noexcept;
+
+  /** Whether the message is long enough to hold its header; all other accessors require this */
+  bool isValid() const noexcept;
+
+  /** Reads the question at the given offset and moves the offset past it; returns false if it is truncated */
+  bool readQuestion(std::size_t &offset, Question &question) const noexcept;
+
+  /** Reads the record at the given offset and moves the offset past it; returns false if it is truncated */
+  bool readRecord(std::size_t &offset, Record &record) const noexcept;
+
+  /** Compares two uncompressed names, ignoring the case of ASCII letters as DNS does */
+  static bool equalNames(const uint8_t *name, std::size_t length, const uint8_t *otherName,
+    std::size_t otherLength) noexcept;
+
+
+private:
+
+  uint16_t read16(std::size_t offset) const noexcept;
+
+  uint32_t read32(std::size_t offset) const noexcept;
+
+  /** Moves the offset past the name at it, without following compression pointers */
+  bool skipName(std::size_t &offset) const noexcept;
+
+
+  const uint8_t *m_data;
+  std::size_t m_length;
+};
+
+
+/**
+ * Writes a DNS message into a fixed-size buffer from questions and records of other messages, which must be added in
+ * the order of the sections; names are written uncompressed, so that they do not depend on what is left out
+ */
+struct DnsMessageWriter
+{
+  enum Section
+  {
+    ANSWER,
+    AUTHORITY,
+    ADDITIONAL
+  };
+
+
+  DnsMessageWriter(char *data, std::size_t capacity) noexcept;
+
+
+  /** Copies the given question; returns false, leaving the message as it was, if it is malformed or does not fit */
+  bool addQuestion(const DnsMessage &message, const DnsMessage::Question &question) noexcept;
+
+  /**
+   * Copies the given record to the given section, with the given TTL; returns false, leaving the message as it was,
+   * if it is malformed or does not fit
+   */
+  bool addRecord(Section section, const DnsMessage &message, const DnsMessage::Record &record, uint32_t ttl) noexcept;
+
+  /** Writes the header, and returns the length of the message */
+  std::size_t finish(uint16_t id, uint16_t flags) noexcept;
+
+  uint16_t getRecordCount() const noexcept;
+
+
+private:
+
+  void write16(std::size_t offset, uint16_t value) noexcept;
+
+
+  uint8_t *m_data;
+  std::size_t m_capacity;
+  std::size_t m_length;
+  uint16_t m_questionCount;
+  uint16_t m_recordCounts[3];
+};
+
+
+inline
+DnsMessage::DnsMessage(const char *data, std::size_t length) noexcept:
+  m_data(reinterpret_cast<const uint8_t *>(data)),
+  m_length(length)
+{}
+
+inline
+uint16_t DnsMessage::getAdditionalCount() const noexcept
+{
+  return read16(10);
+}
+
+inline
+uint16_t DnsMessage::getAnswerCount() const noexcept
+{
+  return read16(6);
+}
+
+inline
+uint16_t DnsMessage::getAuthorityCount() const noexcept
+{
+  return read16(8);
+}
+
+inline
+uint16_t DnsMessage::getFlags() const noexcept
+{
+  return read16(2);
+}
+
+inline
+uint16_t DnsMessage::getId() const noexcept
+{
+  return read16(0);
+}
+
+inline
+uint16_t DnsMessage::getQuestionCount() const noexcept
+{
+  return read16(4);
+}
+
+inline
+bool DnsMessage::isResponse() const noexcept
+{
+  return (getFlags() & FLAG_RESPONSE) != 0;
+}
+
+inline
+bool DnsMessage::isStandard() const noexcept
+{
+  return (getFlags() & (OPCODE_MASK | RCODE_MASK)) == 0;
+}
+
+inline
+bool DnsMessage::isTruncated() const noexcept
+{
+  return (getFlags() & FLAG_TRUNCATED) != 0;
+}
+
+inline
+bool DnsMessage::isValid() const noexcept
+{
+  return m_length >= HEADER_SIZE;
+}
+
+inline
+uint16_t DnsMessage::read16(std::size_t offset) const noexcept
+{
+  return static_cast<uint16_t>((m_data[offset] << 8) | m_data[offset + 1]);
+}
+
+inline
+uint32_t DnsMessage::read32(std::size_t offset) const noexcept
+{
+  return (uint32_t(read16(offset)) << 16) | read16(offset + 2);
+}
+
+inline
+DnsMessageWriter::DnsMessageWriter(char *data, std::size_t capacity) noexcept:
+  m_data(reinterpret_cast<uint8_t *>(data)),
+  m_capacity(capacity),
+  m_length(DnsMessage::HEADER_SIZE),
+  m_questionCount(),
+  m_recordCounts()
+{}
+
+inline
+uint16_t DnsMessageWriter::getRecordCount() const noexcept
+{
+  return static_cast<uint16_t>(m_recordCounts[ANSWER] + m_recordCounts[AUTHORITY] + m_recordCounts[ADDITIONAL]);
+}
+
+inline
+void DnsMessageWriter::write16(std::size_t offset, uint16_t value) noexcept
+{
+  m_data[offset] = static_cast<uint8_t>(value >> 8);
+  m_data[offset + 1] = static_cast<uint8_t>(value);
+}
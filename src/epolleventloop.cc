@@ -0,0 +1,542 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "epolleventloop.h"
+
+#ifdef MCV4FWDD_EPOLL_EVENT_LOOP
+
+#include <algorithm>
+#include <cerrno>
+#include <initializer_list>
+
+#include <fcntl.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <boost/asio/error.hpp>
+
+
+namespace
+{
+  sigset_t makeSignalSet(std::initializer_list<int> signals) noexcept
+  {
+    sigset_t result;
+    sigemptyset(&result);
+    for (auto signal: signals)
+    {
+      sigaddset(&result, signal);
+    }
+    return result;
+  }
+}
+
+
+EpollEventLoop::EpollEventLoop():
+  m_epollFD(epoll_create1(EPOLL_CLOEXEC)),
+  m_stopped(false),
+  m_events(),
+  m_eventCount(0),
+  m_nextEvent(0),
+  m_posted(),
+  m_scheduled(),
+  m_dispatching()
+{
+  if (m_epollFD == -1)
+  {
+    throw boost::system::system_error(getLastError(), "epoll_create1");
+  }
+}
+
+EpollEventLoop::~EpollEventLoop()
+{
+  // Handlers that never ran are destroyed without being invoked, as with Boost.Asio
+  while (!m_posted.empty())
+  {
+    auto posted = m_posted.pop();
+    posted->m_complete(posted, false);
+  }
+  ::close(m_epollFD);
+}
+
+void EpollEventLoop::add(int fd, Source &source, uint32_t events)
+{
+  boost::system::error_code error;
+  add(fd, source, events, error);
+  if (error)
+  {
+    throw boost::system::system_error(error, "epoll_ctl");
+  }
+}
+
+void EpollEventLoop::add(int fd, Source &source, uint32_t events, boost::system::error_code &error) noexcept
+{
+  epoll_event event = epoll_event();
+  event.events = events | EPOLLET;
+  event.data.ptr = &source;
+  error = epoll_ctl(m_epollFD, EPOLL_CTL_ADD, fd, &event) != 0 ? getLastError() : boost::system::error_code();
+}
+
+boost::system::error_code EpollEventLoop::getLastError() noexcept
+{
+  return boost::system::error_code(errno, boost::system::system_category());
+}
+
+void EpollEventLoop::poll()
+{
+  while (!m_stopped && runOnce(0))
+  {
+  }
+}
+
+void EpollEventLoop::remove(int fd, Source &source) noexcept
+{
+  epoll_ctl(m_epollFD, EPOLL_CTL_DEL, fd, nullptr);
+  for (int i = m_nextEvent; i < m_eventCount; ++i)
+  {
+    if (m_events[i].data.ptr == &source)
+    {
+      m_events[i].data.ptr = nullptr;
+    }
+  }
+  if (source.m_scheduled)
+  {
+    m_scheduled.remove(source);
+    m_dispatching.remove(source);
+    source.m_scheduled = false;
+  }
+}
+
+void EpollEventLoop::run()
+{
+  m_stopped = false;
+  while (!m_stopped)
+  {
+    runOnce(-1);
+  }
+}
+
+bool EpollEventLoop::runOnce(int timeout)
+{
+  bool handled = false;
+
+  // Sources scheduled and handlers posted meanwhile get their turn in the next round, so that they cannot starve the
+  // handling of events. What is left when stopped, or when a handler throws, remains queued for the next round.
+  if (!m_scheduled.empty())
+  {
+    handled = true;
+    m_dispatching.prepend(m_scheduled);
+    try
+    {
+      while (!m_dispatching.empty() && !m_stopped)
+      {
+        auto source = m_dispatching.pop();
+        source->m_scheduled = false;
+        source->handleEvents(0);
+      }
+    }
+    catch (...)
+    {
+      m_scheduled.prepend(m_dispatching);
+      throw;
+    }
+    m_scheduled.prepend(m_dispatching);
+  }
+  if (!m_posted.empty() && !m_stopped)
+  {
+    handled = true;
+    Queue<Posted> running;
+    running.prepend(m_posted);
+    try
+    {
+      while (!running.empty() && !m_stopped)
+      {
+        auto posted = running.pop();
+        posted->m_complete(posted, true);
+      }
+    }
+    catch (...)
+    {
+      m_posted.prepend(running);
+      throw;
+    }
+    m_posted.prepend(running);
+  }
+  if (m_stopped)
+  {
+    return handled;
+  }
+
+  m_eventCount = epoll_wait(m_epollFD, m_events, MAX_EVENTS, m_posted.empty() && m_scheduled.empty() ? timeout : 0);
+  if (m_eventCount == -1)
+  {
+    m_eventCount = 0;
+    if (errno == EINTR)
+    {
+      return true;
+    }
+    throw boost::system::system_error(getLastError(), "epoll_wait");
+  }
+  handled = handled || m_eventCount != 0;
+  for (m_nextEvent = 0; m_nextEvent < m_eventCount && !m_stopped;)
+  {
+    const auto &event = m_events[m_nextEvent++];
+    if (event.data.ptr != nullptr)
+    {
+      static_cast<Source *>(event.data.ptr)->handleEvents(event.events);
+    }
+  }
+  m_eventCount = 0;
+  m_nextEvent = 0;
+  return handled;
+}
+
+void EpollEventLoop::schedule(Source &source) noexcept
+{
+  if (!source.m_scheduled)
+  {
+    source.m_scheduled = true;
+    m_scheduled.push(source);
+  }
+}
+
+
+EpollEventLoop::SignalSet::SignalSet(EpollEventLoop &eventLoop, int signal):
+  SignalSet(eventLoop, makeSignalSet({ signal }))
+{}
+
+EpollEventLoop::SignalSet::SignalSet(EpollEventLoop &eventLoop, int signal1, int signal2):
+  SignalSet(eventLoop, makeSignalSet({ signal1, signal2 }))
+{}
+
+EpollEventLoop::SignalSet::SignalSet(EpollEventLoop &eventLoop, const sigset_t &signals):
+  m_eventLoop(eventLoop),
+  m_signals(signals),
+  m_fd(-1),
+  m_handler(),
+  m_readable(false)
+{
+  // The signals must be blocked for delivery through the signalfd
+  if (sigprocmask(SIG_BLOCK, &m_signals, nullptr) != 0)
+  {
+    throw boost::system::system_error(getLastError(), "sigprocmask");
+  }
+  m_fd = signalfd(-1, &m_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (m_fd == -1)
+  {
+    auto error = getLastError();
+    sigprocmask(SIG_UNBLOCK, &m_signals, nullptr);
+    throw boost::system::system_error(error, "signalfd");
+  }
+  try
+  {
+    m_eventLoop.add(m_fd, *this, EPOLLIN);
+  }
+  catch (...)
+  {
+    ::close(m_fd);
+    sigprocmask(SIG_UNBLOCK, &m_signals, nullptr);
+    throw;
+  }
+}
+
+EpollEventLoop::SignalSet::~SignalSet()
+{
+  m_eventLoop.remove(m_fd, *this);
+  ::close(m_fd);
+  sigprocmask(SIG_UNBLOCK, &m_signals, nullptr);
+}
+
+void EpollEventLoop::SignalSet::deliver()
+{
+  if (!m_handler)
+  {
+    return;
+  }
+  signalfd_siginfo info;
+  if (read(m_fd, &info, sizeof(info)) != sizeof(info))
+  {
+    // Nothing left to read; wait for the next edge
+    m_readable = false;
+    return;
+  }
+  auto handler = std::move(m_handler);
+  handler(boost::system::error_code(), static_cast<int>(info.ssi_signo));
+}
+
+void EpollEventLoop::SignalSet::handleEvents(uint32_t events)
+{
+  if (events != 0)
+  {
+    m_readable = true;
+  }
+  deliver();
+}
+
+
+EpollEventLoop::Timer::Timer(EpollEventLoop &eventLoop):
+  m_eventLoop(eventLoop),
+  m_fd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)),
+  m_handler(),
+  m_canceledHandler(),
+  m_expired(false)
+{
+  if (m_fd == -1)
+  {
+    throw boost::system::system_error(getLastError(), "timerfd_create");
+  }
+  try
+  {
+    m_eventLoop.add(m_fd, *this, EPOLLIN);
+  }
+  catch (...)
+  {
+    ::close(m_fd);
+    throw;
+  }
+}
+
+EpollEventLoop::Timer::~Timer()
+{
+  m_eventLoop.remove(m_fd, *this);
+  ::close(m_fd);
+}
+
+std::size_t EpollEventLoop::Timer::cancel(boost::system::error_code &error)
+{
+  error = boost::system::error_code();
+  if (!m_handler)
+  {
+    return 0;
+  }
+  m_canceledHandler = std::move(m_handler);
+  m_eventLoop.schedule(*this);
+  return 1;
+}
+
+std::size_t EpollEventLoop::Timer::expires_from_now(const duration_type &expiry)
+{
+  std::size_t canceled = 0;
+  if (m_handler)
+  {
+    m_canceledHandler = std::move(m_handler);
+    m_eventLoop.schedule(*this);
+    canceled = 1;
+  }
+  m_expired = false;
+
+  // A zero expiry time disarms a timerfd, so round up to the smallest one that does not
+  auto nanoseconds = std::max<int64_t>(expiry.total_nanoseconds(), 1);
+  itimerspec spec = itimerspec();
+  spec.it_value.tv_sec = nanoseconds / 1000000000;
+  spec.it_value.tv_nsec = nanoseconds % 1000000000;
+  if (timerfd_settime(m_fd, 0, &spec, nullptr) != 0)
+  {
+    throw boost::system::system_error(getLastError(), "timerfd_settime");
+  }
+  return canceled;
+}
+
+void EpollEventLoop::Timer::handleEvents(uint32_t events)
+{
+  // Nothing to read when rearmed since the expiry was reported
+  uint64_t expirations;
+  if (events != 0 && read(m_fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+  {
+    m_expired = true;
+  }
+  if (m_canceledHandler)
+  {
+    auto handler = std::move(m_canceledHandler);
+    handler(boost::asio::error::operation_aborted);
+  }
+  if (m_expired && m_handler)
+  {
+    m_expired = false;
+    auto handler = std::move(m_handler);
+    handler(boost::system::error_code());
+  }
+}
+
+
+EpollEventLoop::UdpSocket::UdpSocket(EpollEventLoop &eventLoop) noexcept:
+  m_eventLoop(eventLoop),
+  m_fd(-1),
+  m_protocol(protocol_type::v4()),
+  m_receiveHandler(),
+  m_sendHandler(),
+  m_readable(false),
+  m_writable(false),
+  m_destroyed(nullptr)
+{}
+
+EpollEventLoop::UdpSocket::UdpSocket(EpollEventLoop &eventLoop, const protocol_type &protocol):
+  UdpSocket(eventLoop)
+{
+  open(protocol);
+}
+
+EpollEventLoop::UdpSocket::~UdpSocket()
+{
+  close();
+  if (m_destroyed != nullptr)
+  {
+    *m_destroyed = true;
+  }
+}
+
+void EpollEventLoop::UdpSocket::assign(const protocol_type &protocol, native_handle_type fd)
+{
+  close();
+  m_eventLoop.add(fd, *this, EPOLLIN | EPOLLOUT);
+  m_fd = fd;
+  m_protocol = protocol;
+}
+
+void EpollEventLoop::UdpSocket::bind(const endpoint_type &endpoint)
+{
+  if (::bind(m_fd, endpoint.data(), static_cast<socklen_t>(endpoint.size())) != 0)
+  {
+    throw boost::system::system_error(getLastError(), "bind");
+  }
+}
+
+void EpollEventLoop::UdpSocket::close() noexcept
+{
+  if (m_fd == -1)
+  {
+    return;
+  }
+  m_eventLoop.remove(m_fd, *this);
+  ::close(m_fd);
+  m_fd = -1;
+  m_receiveHandler = handler_t();
+  m_sendHandler = handler_t();
+  m_readable = false;
+  m_writable = false;
+}
+
+void EpollEventLoop::UdpSocket::close(boost::system::error_code &error) noexcept
+{
+  close();
+  error = boost::system::error_code();
+}
+
+void EpollEventLoop::UdpSocket::connect(const endpoint_type &endpoint)
+{
+  if (::connect(m_fd, endpoint.data(), static_cast<socklen_t>(endpoint.size())) != 0)
+  {
+    throw boost::system::system_error(getLastError(), "connect");
+  }
+}
+
+void EpollEventLoop::UdpSocket::connect(const endpoint_type &endpoint, boost::system::error_code &error) noexcept
+{
+  error = ::connect(m_fd, endpoint.data(), static_cast<socklen_t>(endpoint.size())) != 0 ? getLastError()
+    : boost::system::error_code();
+}
+
+void EpollEventLoop::UdpSocket::handleEvents(uint32_t events)
+{
+  // Without events, pass on the readiness recorded earlier
+  bool readable = m_readable || (events & (EPOLLIN | EPOLLERR | EPOLLHUP));
+  bool writable = m_writable || (events & (EPOLLOUT | EPOLLERR | EPOLLHUP));
+  m_readable = false;
+  m_writable = false;
+  if (readable)
+  {
+    // The receive handler may destroy the socket, after which it is not to be touched
+    bool destroyed = false;
+    m_destroyed = &destroyed;
+    try
+    {
+      notify(m_receiveHandler, m_readable);
+    }
+    catch (...)
+    {
+      if (!destroyed)
+      {
+        m_destroyed = nullptr;
+      }
+      throw;
+    }
+    if (destroyed)
+    {
+      return;
+    }
+    m_destroyed = nullptr;
+  }
+  // The receive handler may have closed the socket
+  if (writable && m_fd != -1)
+  {
+    notify(m_sendHandler, m_writable);
+  }
+}
+
+void EpollEventLoop::UdpSocket::non_blocking(bool mode)
+{
+  int flags = fcntl(m_fd, F_GETFL);
+  if (flags == -1 || fcntl(m_fd, F_SETFL, mode ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) == -1)
+  {
+    throw boost::system::system_error(getLastError(), "fcntl");
+  }
+}
+
+void EpollEventLoop::UdpSocket::notify(handler_t &waiting, bool &ready)
+{
+  if (!waiting)
+  {
+    ready = true;
+    return;
+  }
+  // The handler typically waits again, which stores its successor in the same place
+  auto handler = std::move(waiting);
+  handler(boost::system::error_code(), 0);
+}
+
+void EpollEventLoop::UdpSocket::open(const protocol_type &protocol)
+{
+  boost::system::error_code error;
+  open(protocol, error);
+  if (error)
+  {
+    throw boost::system::system_error(error, "open");
+  }
+}
+
+void EpollEventLoop::UdpSocket::open(const protocol_type &protocol, boost::system::error_code &error) noexcept
+{
+  close();
+  m_fd = socket(protocol.family(), protocol.type() | SOCK_CLOEXEC, protocol.protocol());
+  if (m_fd == -1)
+  {
+    error = getLastError();
+    return;
+  }
+  m_protocol = protocol;
+  m_eventLoop.add(m_fd, *this, EPOLLIN | EPOLLOUT, error);
+  if (error)
+  {
+    ::close(m_fd);
+    m_fd = -1;
+  }
+}
+
+#endif
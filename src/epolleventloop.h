@@ -0,0 +1,796 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
+
+
+template <class Signature>
+struct InplaceHandler;
+
+/** Type-erased handler stored in place, so that waiting for events never allocates memory */
+template <class... Args>
+struct InplaceHandler<void(Args...)>
+{
+  InplaceHandler() noexcept;
+
+  template <class Handler, class = std::enable_if_t<!std::is_same_v<std::decay_t<Handler>, InplaceHandler>>>
+  InplaceHandler(Handler &&handler);
+
+  InplaceHandler(InplaceHandler &&other) noexcept;
+  InplaceHandler &operator =(InplaceHandler &&other) noexcept;
+
+  ~InplaceHandler();
+
+
+  explicit operator bool() const noexcept;
+
+  void operator ()(Args... args);
+
+
+private:
+
+  enum
+  {
+    /** Large enough for a lambda capturing a few pointers, wrapped by makeCustomAllocHandler */
+    CAPACITY = 64
+  };
+
+  struct Operations
+  {
+    void (*invoke)(void *handler, Args... args);
+    void (*move)(void *from, void *to) noexcept;
+    void (*destroy)(void *handler) noexcept;
+  };
+
+
+  template <class Handler>
+  static void destroy(void *handler) noexcept;
+
+  template <class Handler>
+  static void invoke(void *handler, Args... args);
+
+  template <class Handler>
+  static void move(void *from, void *to) noexcept;
+
+  void reset() noexcept;
+
+
+  template <class Handler>
+  static constexpr Operations OPERATIONS = { &invoke<Handler>, &move<Handler>, &destroy<Handler> };
+
+  alignas(std::max_align_t) unsigned char m_storage[CAPACITY];
+  const Operations *m_operations;
+};
+
+
+/**
+ * Single-threaded event loop on top of edge-triggered epoll, using timerfd and signalfd for timers and signals. It
+ * mirrors the subset of the Boost.Asio interface used by the daemon, without its handler queues and locking.
+ */
+struct EpollEventLoop
+{
+  struct SignalSet;
+  struct Timer;
+  struct UdpSocket;
+
+
+  EpollEventLoop();
+
+  EpollEventLoop(const EpollEventLoop &) = delete;
+  EpollEventLoop &operator =(const EpollEventLoop &) = delete;
+
+  ~EpollEventLoop();
+
+
+  /** Invokes the given handler from the event loop, after handling the events that are pending now */
+  template <class Handler>
+  void post(Handler &&handler);
+
+  /** Handles the events and posted handlers that are ready, without waiting, until none are left or stopped */
+  void poll();
+
+  /** Allows polling again after having been stopped; running always resets */
+  void reset() noexcept;
+
+  /** Handles events until stopped; exceptions thrown by handlers propagate to the caller */
+  void run();
+
+  void stop() noexcept;
+
+
+private:
+
+  template <class Node>
+  struct Queue;
+
+  /** Anything registered with epoll */
+  struct Source
+  {
+    virtual void handleEvents(uint32_t events) = 0;
+
+  protected:
+    Source() noexcept;
+
+    ~Source() = default;
+
+  private:
+    friend struct EpollEventLoop;
+    friend struct Queue<Source>;
+
+    /** Link in the queue of scheduled sources, in which a source is at most once */
+    Source *m_next;
+    bool m_scheduled;
+  };
+
+  /** Handler posted to the event loop, which completes by invoking it or, when discarded, only destroying it */
+  struct Posted
+  {
+  protected:
+    explicit Posted(void (*complete)(Posted *posted, bool invoke)) noexcept;
+
+    ~Posted() = default;
+
+  private:
+    friend struct EpollEventLoop;
+    friend struct Queue<Posted>;
+
+    Posted *m_next;
+    void (*m_complete)(Posted *posted, bool invoke);
+  };
+
+  template <class Handler>
+  struct PostedHandler;
+
+  /** First-in first-out queue linked through its elements, so that queueing never allocates memory */
+  template <class Node>
+  struct Queue
+  {
+    Queue() noexcept;
+
+
+    bool empty() const noexcept;
+
+    /** Removes the first element; the queue must not be empty */
+    Node *pop() noexcept;
+
+    /** Moves the elements of the given queue in front of those of this one */
+    void prepend(Queue &other) noexcept;
+
+    void push(Node &node) noexcept;
+
+    /** Removes the given element, if queued */
+    void remove(Node &node) noexcept;
+
+
+  private:
+
+    Node *m_first;
+    Node *m_last;
+  };
+
+  enum
+  {
+    MAX_EVENTS = 64
+  };
+
+
+  /** Registers the given descriptor for edge-triggered notification of the given events */
+  void add(int fd, Source &source, uint32_t events);
+
+  void add(int fd, Source &source, uint32_t events, boost::system::error_code &error) noexcept;
+
+  /** Unregisters the given descriptor, and discards its events that are still to be handled */
+  void remove(int fd, Source &source) noexcept;
+
+  /**
+   * Dispatches the scheduled sources, invokes the posted handlers and handles the events that are ready, waiting up to
+   * the given timeout in milliseconds for events if there was nothing else; returns whether anything was handled
+   */
+  bool runOnce(int timeout);
+
+  /** Has the given source handle its events once more, for readiness it recorded while nothing was waiting */
+  void schedule(Source &source) noexcept;
+
+  static boost::system::error_code getLastError() noexcept;
+
+
+  int m_epollFD;
+  bool m_stopped;
+  epoll_event m_events[MAX_EVENTS];
+  int m_eventCount;
+  int m_nextEvent;
+  Queue<Posted> m_posted;
+  Queue<Source> m_scheduled;
+  /** Scheduled sources still to be handled in the current round */
+  Queue<Source> m_dispatching;
+};
+
+
+/**
+ * Posted handler along with its queue link, allocated through the allocator of the handler if it has one, as with the
+ * associated allocator in Boost.Asio; handlers wrapped by makeCustomAllocHandler are thus posted without allocating
+ */
+template <class Handler>
+struct EpollEventLoop::PostedHandler final: Posted
+{
+  template <class H>
+  static PostedHandler *create(H &&handler);
+
+
+private:
+
+  template <class H>
+  explicit PostedHandler(H &&handler);
+
+  static void complete(Posted *posted, bool invoke);
+
+  /** Gets the allocator of the handler, or the default one */
+  template <class H>
+  static auto getAllocator(const H &handler, int) noexcept -> decltype(handler.get_allocator());
+
+  template <class H>
+  static std::allocator<char> getAllocator(const H &handler, long) noexcept;
+
+  using allocator_type = typename std::allocator_traits<decltype(getAllocator(std::declval<const Handler &>(), 0))>
+    ::template rebind_alloc<PostedHandler>;
+
+
+  Handler m_handler;
+};
+
+
+/** Handles delivery of the given signals through a signalfd; the signals are blocked for as long as it exists */
+struct EpollEventLoop::SignalSet final: private Source
+{
+  SignalSet(EpollEventLoop &eventLoop, int signal);
+
+  SignalSet(EpollEventLoop &eventLoop, int signal1, int signal2);
+
+  SignalSet(const SignalSet &) = delete;
+  SignalSet &operator =(const SignalSet &) = delete;
+
+  ~SignalSet();
+
+
+  template <class Handler>
+  void async_wait(Handler &&handler);
+
+
+private:
+
+  using handler_t = InplaceHandler<void(const boost::system::error_code &, int)>;
+
+
+  SignalSet(EpollEventLoop &eventLoop, const sigset_t &signals);
+
+  /** Passes the next pending signal, if any, to the waiting handler */
+  void deliver();
+
+  void handleEvents(uint32_t events) override;
+
+
+  EpollEventLoop &m_eventLoop;
+  sigset_t m_signals;
+  int m_fd;
+  handler_t m_handler;
+  bool m_readable;
+};
+
+
+/** One-shot relative timer on a timerfd */
+struct EpollEventLoop::Timer final: private Source
+{
+  using duration_type = boost::posix_time::time_duration;
+
+
+  explicit Timer(EpollEventLoop &eventLoop);
+
+  Timer(const Timer &) = delete;
+  Timer &operator =(const Timer &) = delete;
+
+  ~Timer();
+
+
+  template <class Handler>
+  void async_wait(Handler &&handler);
+
+  /** Cancels a pending wait, if any, which has its handler invoked with operation_aborted */
+  std::size_t cancel(boost::system::error_code &error);
+
+  /** Sets the expiry time; a pending wait is canceled, and its handler invoked with operation_aborted */
+  std::size_t expires_from_now(const duration_type &expiry);
+
+
+private:
+
+  using handler_t = InplaceHandler<void(const boost::system::error_code &)>;
+
+
+  void handleEvents(uint32_t events) override;
+
+
+  EpollEventLoop &m_eventLoop;
+  int m_fd;
+  handler_t m_handler;
+  /** Handler of the wait canceled by expires_from_now, still to be invoked */
+  handler_t m_canceledHandler;
+  bool m_expired;
+};
+
+
+/**
+ * UDP socket registered with the event loop for as long as it is open. Waits report readiness only, as with
+ * null_buffers in Boost.Asio; closing a socket discards pending waits without invoking their handlers.
+ */
+struct EpollEventLoop::UdpSocket final: private Source
+{
+  using endpoint_type = boost::asio::ip::udp::endpoint;
+  using native_handle_type = int;
+  using protocol_type = boost::asio::ip::udp;
+
+
+  explicit UdpSocket(EpollEventLoop &eventLoop) noexcept;
+
+  UdpSocket(EpollEventLoop &eventLoop, const protocol_type &protocol);
+
+  UdpSocket(const UdpSocket &) = delete;
+  UdpSocket &operator =(const UdpSocket &) = delete;
+
+  ~UdpSocket();
+
+
+  /** Takes over the given open descriptor, which need not be a UDP socket; on failure, the caller still owns it */
+  void assign(const protocol_type &protocol, native_handle_type fd);
+
+  template <class Handler>
+  void async_receive(const boost::asio::null_buffers &, Handler &&handler);
+
+  template <class Handler>
+  void async_send(const boost::asio::null_buffers &, Handler &&handler);
+
+  void bind(const endpoint_type &endpoint);
+
+  void close() noexcept;
+
+  void close(boost::system::error_code &error) noexcept;
+
+  void connect(const endpoint_type &endpoint);
+
+  void connect(const endpoint_type &endpoint, boost::system::error_code &error) noexcept;
+
+  bool is_open() const noexcept;
+
+  native_handle_type native_handle() const noexcept;
+
+  void non_blocking(bool mode);
+
+  void open(const protocol_type &protocol);
+
+  /** Leaves the socket closed on failure */
+  void open(const protocol_type &protocol, boost::system::error_code &error) noexcept;
+
+  template <class Option>
+  void set_option(const Option &option);
+
+  template <class Option>
+  void set_option(const Option &option, boost::system::error_code &error) noexcept;
+
+
+private:
+
+  using handler_t = InplaceHandler<void(const boost::system::error_code &, std::size_t)>;
+
+
+  void handleEvents(uint32_t events) override;
+
+  /** Invokes the waiting handler, if any; otherwise, the readiness is passed on to the next handler to wait */
+  static void notify(handler_t &waiting, bool &ready);
+
+  /** Waits for readiness; the handler is invoked from the event loop right away if readiness was recorded */
+  template <class Handler>
+  void wait(handler_t &waiting, bool ready, Handler &&handler);
+
+
+  EpollEventLoop &m_eventLoop;
+  int m_fd;
+  protocol_type m_protocol;
+  handler_t m_receiveHandler;
+  handler_t m_sendHandler;
+  bool m_readable;
+  bool m_writable;
+  /** Set while handling events, to learn whether a handler destroyed the socket */
+  bool *m_destroyed;
+};
+
+
+template <class... Args>
+inline
+InplaceHandler<void(Args...)>::InplaceHandler() noexcept:
+  m_operations(nullptr)
+{}
+
+template <class... Args>
+template <class Handler, class>
+inline
+InplaceHandler<void(Args...)>::InplaceHandler(Handler &&handler):
+  m_operations(&OPERATIONS<std::decay_t<Handler>>)
+{
+  static_assert(sizeof(std::decay_t<Handler>) <= CAPACITY, "handler too large for in-place storage");
+  static_assert(alignof(std::decay_t<Handler>) <= alignof(std::max_align_t), "handler alignment too strict");
+  new (m_storage) std::decay_t<Handler>(std::forward<Handler>(handler));
+}
+
+template <class... Args>
+inline
+InplaceHandler<void(Args...)>::InplaceHandler(InplaceHandler &&other) noexcept:
+  m_operations(other.m_operations)
+{
+  if (m_operations != nullptr)
+  {
+    m_operations->move(other.m_storage, m_storage);
+    other.reset();
+  }
+}
+
+template <class... Args>
+inline
+auto InplaceHandler<void(Args...)>::operator =(InplaceHandler &&other) noexcept -> InplaceHandler &
+{
+  if (this != &other)
+  {
+    reset();
+    if (other.m_operations != nullptr)
+    {
+      m_operations = other.m_operations;
+      m_operations->move(other.m_storage, m_storage);
+      other.reset();
+    }
+  }
+  return *this;
+}
+
+template <class... Args>
+inline
+InplaceHandler<void(Args...)>::~InplaceHandler()
+{
+  reset();
+}
+
+template <class... Args>
+inline
+InplaceHandler<void(Args...)>::operator bool() const noexcept
+{
+  return m_operations != nullptr;
+}
+
+template <class... Args>
+inline
+void InplaceHandler<void(Args...)>::operator ()(Args... args)
+{
+  m_operations->invoke(m_storage, std::forward<Args>(args)...);
+}
+
+template <class... Args>
+template <class Handler>
+inline
+void InplaceHandler<void(Args...)>::destroy(void *handler) noexcept
+{
+  static_cast<Handler *>(handler)->~Handler();
+}
+
+template <class... Args>
+template <class Handler>
+inline
+void InplaceHandler<void(Args...)>::invoke(void *handler, Args... args)
+{
+  (*static_cast<Handler *>(handler))(std::forward<Args>(args)...);
+}
+
+template <class... Args>
+template <class Handler>
+inline
+void InplaceHandler<void(Args...)>::move(void *from, void *to) noexcept
+{
+  new (to) Handler(std::move(*static_cast<Handler *>(from)));
+}
+
+template <class... Args>
+inline
+void InplaceHandler<void(Args...)>::reset() noexcept
+{
+  if (m_operations != nullptr)
+  {
+    m_operations->destroy(m_storage);
+    m_operations = nullptr;
+  }
+}
+
+template <class Handler>
+inline
+void EpollEventLoop::post(Handler &&handler)
+{
+  m_posted.push(*PostedHandler<std::decay_t<Handler>>::create(std::forward<Handler>(handler)));
+}
+
+inline
+void EpollEventLoop::reset() noexcept
+{
+  m_stopped = false;
+}
+
+inline
+void EpollEventLoop::stop() noexcept
+{
+  m_stopped = true;
+}
+
+inline
+EpollEventLoop::Posted::Posted(void (*complete)(Posted *posted, bool invoke)) noexcept:
+  m_next(nullptr),
+  m_complete(complete)
+{}
+
+template <class Handler>
+template <class H>
+inline
+EpollEventLoop::PostedHandler<Handler>::PostedHandler(H &&handler):
+  Posted(&complete),
+  m_handler(std::forward<H>(handler))
+{}
+
+template <class Handler>
+inline
+void EpollEventLoop::PostedHandler<Handler>::complete(Posted *posted, bool invoke)
+{
+  // Free the memory before invoking the handler, so that it can post again from the same memory
+  auto self = static_cast<PostedHandler *>(posted);
+  Handler handler(std::move(self->m_handler));
+  allocator_type allocator(getAllocator(handler, 0));
+  self->~PostedHandler();
+  std::allocator_traits<allocator_type>::deallocate(allocator, self, 1);
+  if (invoke)
+  {
+    handler();
+  }
+}
+
+template <class Handler>
+template <class H>
+inline
+auto EpollEventLoop::PostedHandler<Handler>::create(H &&handler) -> PostedHandler *
+{
+  allocator_type allocator(getAllocator(handler, 0));
+  auto storage = std::allocator_traits<allocator_type>::allocate(allocator, 1);
+  try
+  {
+    return new (storage) PostedHandler(std::forward<H>(handler));
+  }
+  catch (...)
+  {
+    std::allocator_traits<allocator_type>::deallocate(allocator, storage, 1);
+    throw;
+  }
+}
+
+template <class Handler>
+template <class H>
+inline
+auto EpollEventLoop::PostedHandler<Handler>::getAllocator(const H &handler, int) noexcept
+  -> decltype(handler.get_allocator())
+{
+  return handler.get_allocator();
+}
+
+template <class Handler>
+template <class H>
+inline
+std::allocator<char> EpollEventLoop::PostedHandler<Handler>::getAllocator(const H &, long) noexcept
+{
+  return std::allocator<char>();
+}
+
+template <class Node>
+inline
+EpollEventLoop::Queue<Node>::Queue() noexcept:
+  m_first(nullptr),
+  m_last(nullptr)
+{}
+
+template <class Node>
+inline
+bool EpollEventLoop::Queue<Node>::empty() const noexcept
+{
+  return m_first == nullptr;
+}
+
+template <class Node>
+inline
+Node *EpollEventLoop::Queue<Node>::pop() noexcept
+{
+  auto node = m_first;
+  m_first = node->m_next;
+  if (m_first == nullptr)
+  {
+    m_last = nullptr;
+  }
+  node->m_next = nullptr;
+  return node;
+}
+
+template <class Node>
+inline
+void EpollEventLoop::Queue<Node>::prepend(Queue &other) noexcept
+{
+  if (other.m_first == nullptr)
+  {
+    return;
+  }
+  other.m_last->m_next = m_first;
+  if (m_first == nullptr)
+  {
+    m_last = other.m_last;
+  }
+  m_first = other.m_first;
+  other.m_first = nullptr;
+  other.m_last = nullptr;
+}
+
+template <class Node>
+inline
+void EpollEventLoop::Queue<Node>::push(Node &node) noexcept
+{
+  node.m_next = nullptr;
+  if (m_last == nullptr)
+  {
+    m_first = &node;
+  }
+  else
+  {
+    m_last->m_next = &node;
+  }
+  m_last = &node;
+}
+
+template <class Node>
+inline
+void EpollEventLoop::Queue<Node>::remove(Node &node) noexcept
+{
+  Node *previous = nullptr;
+  for (auto current = m_first; current != nullptr; previous = current, current = current->m_next)
+  {
+    if (current == &node)
+    {
+      (previous == nullptr ? m_first : previous->m_next) = node.m_next;
+      if (m_last == &node)
+      {
+        m_last = previous;
+      }
+      node.m_next = nullptr;
+      return;
+    }
+  }
+}
+
+inline
+EpollEventLoop::Source::Source() noexcept:
+  m_next(nullptr),
+  m_scheduled(false)
+{}
+
+template <class Handler>
+inline
+void EpollEventLoop::SignalSet::async_wait(Handler &&handler)
+{
+  m_handler = std::forward<Handler>(handler);
+  if (m_readable)
+  {
+    m_eventLoop.schedule(*this);
+  }
+}
+
+template <class Handler>
+inline
+void EpollEventLoop::Timer::async_wait(Handler &&handler)
+{
+  m_handler = std::forward<Handler>(handler);
+  if (m_expired)
+  {
+    m_eventLoop.schedule(*this);
+  }
+}
+
+template <class Handler>
+inline
+void EpollEventLoop::UdpSocket::async_receive(const boost::asio::null_buffers &, Handler &&handler)
+{
+  wait(m_receiveHandler, m_readable, std::forward<Handler>(handler));
+}
+
+template <class Handler>
+inline
+void EpollEventLoop::UdpSocket::async_send(const boost::asio::null_buffers &, Handler &&handler)
+{
+  wait(m_sendHandler, m_writable, std::forward<Handler>(handler));
+}
+
+inline
+bool EpollEventLoop::UdpSocket::is_open() const noexcept
+{
+  return m_fd != -1;
+}
+
+inline
+auto EpollEventLoop::UdpSocket::native_handle() const noexcept -> native_handle_type
+{
+  return m_fd;
+}
+
+template <class Option>
+inline
+void EpollEventLoop::UdpSocket::set_option(const Option &option)
+{
+  boost::system::error_code error;
+  set_option(option, error);
+  if (error)
+  {
+    throw boost::system::system_error(error, "set_option");
+  }
+}
+
+template <class Option>
+inline
+void EpollEventLoop::UdpSocket::set_option(const Option &option, boost::system::error_code &error) noexcept
+{
+  if (setsockopt(m_fd, option.level(m_protocol), option.name(m_protocol), option.data(m_protocol),
+    static_cast<socklen_t>(option.size(m_protocol))) != 0)
+  {
+    error = getLastError();
+    return;
+  }
+  error = boost::system::error_code();
+}
+
+template <class Handler>
+inline
+void EpollEventLoop::UdpSocket::wait(handler_t &waiting, bool ready, Handler &&handler)
+{
+  waiting = std::forward<Handler>(handler);
+  if (ready)
+  {
+    m_eventLoop.schedule(*this);
+  }
+}
@@ -0,0 +1,51 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/*
+ * Event loop backend, selected at compile time: Boost.Asio by default, or the built-in epoll event loop when built
+ * with MCV4FWDD_EPOLL_EVENT_LOOP. Both provide the subset of the Boost.Asio interface used by the daemon under the
+ * same names, so that the remainder of the code does not depend on the choice.
+ */
+
+#ifdef MCV4FWDD_EPOLL_EVENT_LOOP
+
+#include "epolleventloop.h"
+
+using EventLoop = EpollEventLoop;
+using SignalSet = EpollEventLoop::SignalSet;
+using Timer = EpollEventLoop::Timer;
+using UdpSocket = EpollEventLoop::UdpSocket;
+
+#else
+
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/signal_set.hpp>
+
+using EventLoop = boost::asio::io_service;
+using SignalSet = boost::asio::signal_set;
+using Timer = boost::asio::deadline_timer;
+using UdpSocket = boost::asio::ip::udp::socket;
+
+#endif
@@ -21,36 +21,118 @@
 
 #include "forwarder.h"
 
+#include <algorithm>
 #include <iostream>
+#include <sstream>
 
+#include <syslog.h>
 
-using Network = config::model::Network;
 
-
-void Forwarder::add(const Network &network, const std::shared_ptr<Sender> &sender)
+Forwarder::Forwarder(EventLoop &ioService, ReceiveBuffer &receiveBuffer, const endpoint_t &multicastEndpoint,
+  std::vector<Rule> rules):
+  Receiver(ioService, receiveBuffer, multicastEndpoint),
+  m_forwardedDatagrams(),
+  m_discardedDatagrams(),
+  m_prunedDatagrams(),
+  m_rules(std::move(rules)),
+  m_pipeline(),
+  m_matcher(),
+  m_matches(),
+  m_sharedOutInterfaces()
 {
-  m_sourceNetworksToSenders.emplace_back(network, sender);
+  for (auto &rule: m_rules)
+  {
+    assert(rule.sender->isShared() == (rule.outInterface.ipi_ifindex != 0));
+    m_matcher.add(rule.network);
+  }
+  m_matches.resize(m_matcher.getBitmapSize());
+  m_sharedOutInterfaces.reserve(m_rules.size());
 }
 
-void Forwarder::handlePacket(const endpoint_t &senderEndpoint, const char *data, std::size_t length)
+void Forwarder::handlePacket(const endpoint_t &senderEndpoint, address_t inInterfaceAddress, const char *data,
+  std::size_t length)
 {
 #ifndef NDEBUG
-  int forwarded = 0;
-  Receiver::handlePacket(senderEndpoint, data, length);
+  Receiver::handlePacket(senderEndpoint, inInterfaceAddress, data, length);
 #endif
 
-  // Don't bother with any fancy algorithms here -- m_sourceNetworksToSenders is going to be fairly small
-  const auto origin = senderEndpoint.address().to_v4();
-  for (auto iter = std::begin(m_sourceNetworksToSenders); iter != std::end(m_sourceNetworksToSenders); ++iter)
+  /* Match the source against all networks at once; datagrams that no rule accepts do not pass the stages, so that
+   * these neither spend time on them nor learn from them */
+  m_matcher.match(senderEndpoint.address().to_v4(), m_matches.data());
+  if (std::none_of(std::begin(m_matches), std::end(m_matches), [](uint64_t matches) { return matches != 0; }))
   {
-    if (iter->first.contains(origin))
-    {
+    ++m_discardedDatagrams;
 #ifndef NDEBUG
-      ++forwarded;
+    std::cout << "Datagram discarded" << std::endl;
 #endif
-      iter->second->send(data, length, getMulticastEndpoint());
+    return;
+  }
+
+  DatagramView datagram{senderEndpoint, getMulticastEndpoint(), data, length, inInterfaceAddress, this};
+  if (!m_pipeline.empty() && !m_pipeline.process(datagram))
+  {
+    ++m_discardedDatagrams;
+#ifndef NDEBUG
+    std::cout << "Datagram dropped by stages" << std::endl;
+#endif
+    return;
+  }
+
+  // Forward along the matching rules in order
+  unsigned forwarded = 0;
+  Sender *sharedSender = nullptr;
+  m_sharedOutInterfaces.clear();
+  for (std::size_t word = 0; word < m_matches.size(); ++word)
+  {
+    for (auto matches = m_matches[word]; matches != 0; matches &= matches - 1)
+    {
+      auto &rule = m_rules[word * 64 + static_cast<std::size_t>(__builtin_ctzll(matches))];
+      if (rule.listening != nullptr && !*rule.listening)
+      {
+        ++m_prunedDatagrams;
+        continue;
+      }
+      auto ruleDatagram = datagram;
+      if (rule.pipeline != nullptr && !rule.pipeline->process(ruleDatagram))
+      {
+        continue;
+      }
+      if (m_pipeline.hasEgress() && !m_pipeline.processEgress(ruleDatagram, rule.outInterfaceAddress))
+      {
+        continue;
+      }
+      ++forwarded;
+      if (!rule.sender->isShared())
+      {
+        rule.sender->send(ruleDatagram.data, ruleDatagram.length, getMulticastEndpoint());
+      }
+      else if (ruleDatagram.data != datagram.data || ruleDatagram.length != datagram.length)
+      {
+        // Stages changed the datagram for this rule only
+        rule.sender->send(ruleDatagram.data, ruleDatagram.length, getMulticastEndpoint(), &rule.outInterface, 1);
+      }
+      else
+      {
+        // Collect the copies, so that they can be sent all at once
+        assert(sharedSender == nullptr || sharedSender == rule.sender.get());
+        sharedSender = rule.sender.get();
+        m_sharedOutInterfaces.push_back(rule.outInterface);
+      }
     }
   }
+  if (sharedSender != nullptr)
+  {
+    sharedSender->send(datagram.data, datagram.length, getMulticastEndpoint(), m_sharedOutInterfaces.data(),
+      m_sharedOutInterfaces.size());
+  }
+  if (forwarded)
+  {
+    m_forwardedDatagrams += forwarded;
+  }
+  else
+  {
+    ++m_discardedDatagrams;
+  }
 #ifndef NDEBUG
   if (forwarded)
   {
@@ -63,23 +145,108 @@ void Forwarder::handlePacket(const endpoint_t &senderEndpoint, const char *data,
 #endif
 }
 
+void Forwarder::printVariant(std::ostream &os) const
+{
+  os << "generic, " << m_matcher.getImplementation() << " matching";
+  if (!m_pipeline.empty())
+  {
+    os << ", through " << m_pipeline;
+  }
+}
+
+void Forwarder::reportStatistics() const
+{
+  Receiver::reportStatistics();
+
+  std::ostringstream oss;
+  oss << "Forwarder for " << getMulticastEndpoint() << ": " << m_forwardedDatagrams << " datagrams forwarded, "
+    << m_discardedDatagrams << " discarded by rules, " << m_prunedDatagrams << " copies pruned for lack of listeners";
+  syslog(LOG_INFO, "%s", oss.str().c_str());
+
+  oss.str("");
+  oss << "Forwarder for " << getMulticastEndpoint();
+  m_pipeline.reportStatistics(oss.str());
+  const Pipeline *previous = nullptr;
+  for (auto &rule: m_rules)
+  {
+    // The rules for the networks of one forwarding rule are consecutive, and share its pipeline
+    if (rule.pipeline != nullptr && rule.pipeline.get() != previous)
+    {
+      oss.str("");
+      oss << "Forwarder for " << getMulticastEndpoint() << ", rule from " << rule.network << " to ";
+      if (rule.sender->isShared())
+      {
+        oss << "interface #" << rule.outInterface.ipi_ifindex;
+      }
+      else
+      {
+        oss << rule.sender->getOutInterfaceAddress();
+      }
+      rule.pipeline->reportStatistics(oss.str());
+      previous = rule.pipeline.get();
+    }
+  }
+}
+
+void Forwarder::setPipeline(Pipeline &&pipeline)
+{
+  m_pipeline = std::move(pipeline);
+}
+
 void Forwarder::start()
 {
   Receiver::start();
 }
 
+Forwarder::DedicatedSenders::DedicatedSenders(const std::vector<Rule> &rules):
+  m_senders()
+{
+  m_senders.reserve(rules.size());
+  for (auto &rule: rules)
+  {
+    m_senders.push_back(rule.sender.get());
+  }
+}
+
+Forwarder::SharedSender::SharedSender(const std::vector<Rule> &rules):
+  m_sender(rules.front().sender.get()),
+  m_outInterfaces()
+{
+  m_outInterfaces.reserve(rules.size());
+  for (auto &rule: rules)
+  {
+    assert(rule.sender.get() == m_sender);
+    m_outInterfaces.push_back(rule.outInterface);
+  }
+}
+
 std::ostream &operator <<(std::ostream &os, const Forwarder &forwarder)
 {
-  os << "Forwarder for " << forwarder.getMulticastEndpoint() << "; rules:" << std::endl;
-  if (std::empty(forwarder.m_sourceNetworksToSenders))
+  os << "Forwarder for " << forwarder.getMulticastEndpoint() << " (";
+  forwarder.printVariant(os);
+  os << "); rules:" << std::endl;
+  if (std::empty(forwarder.m_rules))
   {
     os << "\tNone" << std::endl;
   }
   else
   {
-    for (auto rule: forwarder.m_sourceNetworksToSenders)
+    for (auto &rule: forwarder.m_rules)
     {
-      os << "\t" << rule.first << " -> " << rule.second.get() << std::endl;
+      os << "\t" << rule.network << " -> " << rule.sender.get();
+      if (rule.sender->isShared())
+      {
+        os << " on interface #" << rule.outInterface.ipi_ifindex;
+      }
+      if (rule.pipeline != nullptr)
+      {
+        os << " through " << *rule.pipeline;
+      }
+      if (rule.listening != nullptr)
+      {
+        os << " if listened to";
+      }
+      os << std::endl;
     }
   }
   return os;
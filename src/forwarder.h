@@ -21,6 +21,12 @@
 
 #pragma once
 
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "networkmatcher.h"
+#include "pipeline.h"
 #include "receiver.h"
 #include "sender.h"
 #include "config/model/network.h"
@@ -31,24 +37,271 @@ struct Forwarder;
 std::ostream &operator <<(std::ostream &os, const Forwarder &forwarder);
 
 
-struct Forwarder final: Receiver
+/**
+ * Forwards datagrams received on one multicast endpoint according to its rules. This generic implementation matches
+ * the source of every datagram against the networks of all rules, and supports stages; SpecializedForwarder covers
+ * the common cases.
+ */
+struct Forwarder: Receiver
 {
-  using Receiver::Receiver;
+  struct AnySource;
+  struct DedicatedSender;
+  struct DedicatedSenders;
+  struct SharedSender;
+  struct SingleSourceNetwork;
+
+  /**
+   * Forwards datagrams from the given network, after passing the stages of the pipeline if any; shared senders also
+   * need the outgoing interface
+   */
+  struct Rule
+  {
+    config::model::Network network;
+    std::shared_ptr<Sender> sender;
+    Sender::out_interface_t outInterface;
+    /** Shared by the rules for all networks of one forwarding rule in the configuration */
+    std::shared_ptr<Pipeline> pipeline;
+    /** Address of the interface on which this rule forwards */
+    address_t outInterfaceAddress;
+    /** Whether the group has listeners on the outgoing interface as learned by IGMP snooping; null to always forward */
+    const bool *listening;
+  };
+
+
+  Forwarder(EventLoop &ioService, ReceiveBuffer &receiveBuffer, const endpoint_t &multicastEndpoint,
+    std::vector<Rule> rules);
+
 
+  const std::vector<Rule> &getRules() const noexcept;
 
-  void add(const config::model::Network &network, const std::shared_ptr<Sender> &sender);
+  void reportStatistics() const override;
+
+  /** Sets the stages that all datagrams accepted by any of the rules pass before being forwarded */
+  void setPipeline(Pipeline &&pipeline);
 
   void start() override;
 
 
 protected:
 
-  void handlePacket(const endpoint_t &senderEndpoint, const char *data, std::size_t length) override;
+  /** Describes how datagrams are matched and sent, for debug output */
+  virtual void printVariant(std::ostream &os) const;
+
+  void handlePacket(const endpoint_t &senderEndpoint, address_t inInterfaceAddress, const char *data,
+    std::size_t length) override;
+
+
+  uint64_t m_forwardedDatagrams;
+  /** Number of datagrams not matching any of the accepted source networks */
+  uint64_t m_discardedDatagrams;
+  /** Number of copies not sent for lack of listeners on the outgoing interface */
+  uint64_t m_prunedDatagrams;
 
 
 private:
 
   friend std::ostream &operator <<(std::ostream &os, const Forwarder &forwarder);
 
-  std::vector<std::pair<config::model::Network, std::shared_ptr<Sender>>> m_sourceNetworksToSenders;
+  std::vector<Rule> m_rules;
+  Pipeline m_pipeline;
+  NetworkMatcher m_matcher;
+  /** Bitmap of the rules matching the datagram being forwarded */
+  std::vector<uint64_t> m_matches;
+  /** Outgoing interfaces of the datagram being forwarded through a shared sender; sized up front for all rules */
+  std::vector<Sender::out_interface_t> m_sharedOutInterfaces;
+};
+
+
+/**
+ * Forwarder for rules that all accept the same source networks, with the matching and sending inlined; Match tells
+ * whether to forward a datagram from the given source address, FanOut sends the copies and returns their number
+ */
+template <class Match, class FanOut>
+struct SpecializedForwarder final: Forwarder
+{
+  SpecializedForwarder(EventLoop &ioService, ReceiveBuffer &receiveBuffer, const endpoint_t &multicastEndpoint,
+    std::vector<Rule> rules);
+
+
+protected:
+
+  void printVariant(std::ostream &os) const override;
+
+  void handlePacket(const endpoint_t &senderEndpoint, address_t inInterfaceAddress, const char *data,
+    std::size_t length) override;
+
+
+private:
+
+  Match m_match;
+  FanOut m_fanOut;
+};
+
+
+/** Match for rules accepting datagrams from any source */
+struct Forwarder::AnySource
+{
+  static constexpr const char *NAME = "any source";
+
+  explicit AnySource(const std::vector<Rule> &rules) noexcept;
+
+  bool matches(uint32_t sourceAddress) const noexcept;
+};
+
+
+/** Match for rules all accepting datagrams from the same, single network */
+struct Forwarder::SingleSourceNetwork
+{
+  static constexpr const char *NAME = "single source network";
+
+  explicit SingleSourceNetwork(const std::vector<Rule> &rules) noexcept;
+
+  bool matches(uint32_t sourceAddress) const noexcept;
+
+private:
+  uint32_t m_address;
+  uint32_t m_mask;
+};
+
+
+/** Fan-out to the one sender of the only rule, which owns its socket */
+struct Forwarder::DedicatedSender
+{
+  static constexpr const char *NAME = "one dedicated sender";
+
+  explicit DedicatedSender(const std::vector<Rule> &rules) noexcept;
+
+  std::size_t send(const char *data, std::size_t length, const endpoint_t &multicastEndpoint);
+
+private:
+  Sender *m_sender;
 };
+
+
+/** Fan-out to the senders of all rules, each owning its socket */
+struct Forwarder::DedicatedSenders
+{
+  static constexpr const char *NAME = "dedicated senders";
+
+  explicit DedicatedSenders(const std::vector<Rule> &rules);
+
+  std::size_t send(const char *data, std::size_t length, const endpoint_t &multicastEndpoint);
+
+private:
+  std::vector<Sender *> m_senders;
+};
+
+
+/** Fan-out through the shared sender, to the outgoing interfaces of all rules at once */
+struct Forwarder::SharedSender
+{
+  static constexpr const char *NAME = "shared sender";
+
+  explicit SharedSender(const std::vector<Rule> &rules);
+
+  std::size_t send(const char *data, std::size_t length, const endpoint_t &multicastEndpoint);
+
+private:
+  Sender *m_sender;
+  std::vector<Sender::out_interface_t> m_outInterfaces;
+};
+
+
+inline
+auto Forwarder::getRules() const noexcept -> const std::vector<Rule> &
+{
+  return m_rules;
+}
+
+template <class Match, class FanOut>
+inline
+SpecializedForwarder<Match, FanOut>::SpecializedForwarder(EventLoop &ioService, ReceiveBuffer &receiveBuffer,
+  const endpoint_t &multicastEndpoint, std::vector<Rule> rules):
+  Forwarder(ioService, receiveBuffer, multicastEndpoint, std::move(rules)),
+  m_match(getRules()),
+  m_fanOut(getRules())
+{}
+
+template <class Match, class FanOut>
+inline
+void SpecializedForwarder<Match, FanOut>::printVariant(std::ostream &os) const
+{
+  os << Match::NAME << " to " << FanOut::NAME;
+}
+
+template <class Match, class FanOut>
+inline
+void SpecializedForwarder<Match, FanOut>::handlePacket(const endpoint_t &senderEndpoint,
+  [[maybe_unused]] address_t inInterfaceAddress, const char *data, std::size_t length)
+{
+#ifndef NDEBUG
+  Receiver::handlePacket(senderEndpoint, inInterfaceAddress, data, length);
+#endif
+
+  if (!m_match.matches(static_cast<uint32_t>(senderEndpoint.address().to_v4().to_ulong())))
+  {
+    ++m_discardedDatagrams;
+#ifndef NDEBUG
+    std::cout << "Datagram discarded" << std::endl;
+#endif
+    return;
+  }
+  auto forwarded = m_fanOut.send(data, length, getMulticastEndpoint());
+  m_forwardedDatagrams += forwarded;
+#ifndef NDEBUG
+  std::cout << "Datagram queued for forwarding " << forwarded << " times" << std::endl;
+#endif
+}
+
+inline
+Forwarder::AnySource::AnySource(const std::vector<Rule> &) noexcept
+{}
+
+inline
+bool Forwarder::AnySource::matches(uint32_t) const noexcept
+{
+  return true;
+}
+
+inline
+Forwarder::SingleSourceNetwork::SingleSourceNetwork(const std::vector<Rule> &rules) noexcept:
+  m_address(static_cast<uint32_t>(rules.front().network.getMaskedAddress().to_ulong())),
+  m_mask(rules.front().network.getPrefixLength() == 0 ? 0
+    : ~((uint32_t(1) << (32 - rules.front().network.getPrefixLength())) - 1))
+{}
+
+inline
+bool Forwarder::SingleSourceNetwork::matches(uint32_t sourceAddress) const noexcept
+{
+  return (sourceAddress & m_mask) == m_address;
+}
+
+inline
+Forwarder::DedicatedSender::DedicatedSender(const std::vector<Rule> &rules) noexcept:
+  m_sender(rules.front().sender.get())
+{}
+
+inline
+std::size_t Forwarder::DedicatedSender::send(const char *data, std::size_t length, const endpoint_t &multicastEndpoint)
+{
+  m_sender->send(data, length, multicastEndpoint);
+  return 1;
+}
+
+inline
+std::size_t Forwarder::DedicatedSenders::send(const char *data, std::size_t length,
+  const endpoint_t &multicastEndpoint)
+{
+  for (auto sender: m_senders)
+  {
+    sender->send(data, length, multicastEndpoint);
+  }
+  return m_senders.size();
+}
+
+inline
+std::size_t Forwarder::SharedSender::send(const char *data, std::size_t length, const endpoint_t &multicastEndpoint)
+{
+  m_sender->send(data, length, multicastEndpoint, m_outInterfaces.data(), m_outInterfaces.size());
+  return m_outInterfaces.size();
+}
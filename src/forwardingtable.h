@@ -0,0 +1,63 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+
+/**
+ * Layout of the forwarding table written by mcv4fwdd -e, for building a daemon with the rules of one configuration
+ * compiled in (see MCV4FWDD_FORWARDING_TABLE)
+ */
+struct ForwardingTable
+{
+  /** Multicast endpoint with its rules, which are consecutive in the table of rules */
+  struct Endpoint
+  {
+    uint32_t address;
+    uint16_t port;
+    std::size_t firstRule;
+    std::size_t ruleCount;
+  };
+
+  /** Rule accepting datagrams from one network, with the interface it forwards them to */
+  struct Rule
+  {
+    uint32_t networkAddress;
+    uint8_t prefixLength;
+    uint32_t outInterfaceAddress;
+    unsigned outInterfaceIndex;
+  };
+
+
+  ForwardingTable() = delete;
+
+  static constexpr uint32_t getMask(uint8_t prefixLength) noexcept;
+};
+
+
+inline
+constexpr uint32_t ForwardingTable::getMask(uint8_t prefixLength) noexcept
+{
+  return prefixLength == 0 ? 0 : ~((uint32_t(1) << (32 - prefixLength)) - 1);
+}
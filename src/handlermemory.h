@@ -0,0 +1,258 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+
+/**
+ * Storage for the handler of one outstanding asynchronous operation, reused from one operation to the next; falls back
+ * to the heap when the storage is too small or still in use
+ */
+struct HandlerMemory
+{
+  HandlerMemory() noexcept;
+
+  HandlerMemory(const HandlerMemory &) = delete;
+  HandlerMemory &operator =(const HandlerMemory &) = delete;
+
+
+  void *allocate(std::size_t size);
+
+  void deallocate(void *pointer) noexcept;
+
+  /** Gets the number of allocations served from the reusable storage */
+  uint64_t getAllocations() const noexcept;
+
+  /** Gets the number of allocations that had to fall back to the heap */
+  uint64_t getHeapAllocations() const noexcept;
+
+
+private:
+
+  enum
+  {
+    /** Large enough for the operation objects of Asio's reactive socket operations, including our handlers */
+    STORAGE_SIZE = 256
+  };
+
+
+  std::aligned_storage_t<STORAGE_SIZE> m_storage;
+  bool m_inUse;
+  uint64_t m_allocations;
+  uint64_t m_heapAllocations;
+};
+
+
+/** Minimal allocator for use as associated allocator of handlers (Boost >= 1.66) */
+template <class T>
+struct HandlerAllocator
+{
+  using value_type = T;
+
+
+  explicit HandlerAllocator(HandlerMemory &memory) noexcept;
+
+  template <class U>
+  HandlerAllocator(const HandlerAllocator<U> &other) noexcept;
+
+
+  T *allocate(std::size_t count);
+
+  void deallocate(T *pointer, std::size_t count) noexcept;
+
+  template <class U>
+  bool operator ==(const HandlerAllocator<U> &other) const noexcept;
+
+  template <class U>
+  bool operator !=(const HandlerAllocator<U> &other) const noexcept;
+
+
+private:
+
+  template <class U>
+  friend struct HandlerAllocator;
+
+  HandlerMemory &m_memory;
+};
+
+
+/** Wraps a completion handler such that Asio allocates the operation holding it from the given HandlerMemory */
+template <class Handler>
+struct CustomAllocHandler
+{
+  using allocator_type = HandlerAllocator<Handler>;
+
+
+  CustomAllocHandler(HandlerMemory &memory, Handler handler);
+
+
+  allocator_type get_allocator() const noexcept;
+
+  template <class... Args>
+  void operator ()(Args &&... args);
+
+
+  // Allocation hooks for Boost < 1.66, which has no notion of associated allocators
+
+  friend void *asio_handler_allocate(std::size_t size, CustomAllocHandler *self)
+  {
+    return self->m_memory.allocate(size);
+  }
+
+  friend void asio_handler_deallocate(void *pointer, std::size_t, CustomAllocHandler *self) noexcept
+  {
+    self->m_memory.deallocate(pointer);
+  }
+
+
+private:
+
+  HandlerMemory &m_memory;
+  Handler m_handler;
+};
+
+
+template <class Handler>
+CustomAllocHandler<Handler> makeCustomAllocHandler(HandlerMemory &memory, Handler handler);
+
+
+inline
+HandlerMemory::HandlerMemory() noexcept:
+  m_storage(),
+  m_inUse(false),
+  m_allocations(),
+  m_heapAllocations()
+{}
+
+inline
+void *HandlerMemory::allocate(std::size_t size)
+{
+  if (!m_inUse && size <= sizeof(m_storage))
+  {
+    m_inUse = true;
+    ++m_allocations;
+    return &m_storage;
+  }
+  ++m_heapAllocations;
+  return ::operator new(size);
+}
+
+inline
+void HandlerMemory::deallocate(void *pointer) noexcept
+{
+  if (pointer == &m_storage)
+  {
+    m_inUse = false;
+  }
+  else
+  {
+    ::operator delete(pointer);
+  }
+}
+
+inline
+uint64_t HandlerMemory::getAllocations() const noexcept
+{
+  return m_allocations;
+}
+
+inline
+uint64_t HandlerMemory::getHeapAllocations() const noexcept
+{
+  return m_heapAllocations;
+}
+
+template <class T>
+inline
+HandlerAllocator<T>::HandlerAllocator(HandlerMemory &memory) noexcept:
+  m_memory(memory)
+{}
+
+template <class T>
+template <class U>
+inline
+HandlerAllocator<T>::HandlerAllocator(const HandlerAllocator<U> &other) noexcept:
+  m_memory(other.m_memory)
+{}
+
+template <class T>
+inline
+T *HandlerAllocator<T>::allocate(std::size_t count)
+{
+  return static_cast<T *>(m_memory.allocate(sizeof(T) * count));
+}
+
+template <class T>
+inline
+void HandlerAllocator<T>::deallocate(T *pointer, std::size_t) noexcept
+{
+  m_memory.deallocate(pointer);
+}
+
+template <class T>
+template <class U>
+inline
+bool HandlerAllocator<T>::operator ==(const HandlerAllocator<U> &other) const noexcept
+{
+  return &m_memory == &other.m_memory;
+}
+
+template <class T>
+template <class U>
+inline
+bool HandlerAllocator<T>::operator !=(const HandlerAllocator<U> &other) const noexcept
+{
+  return &m_memory != &other.m_memory;
+}
+
+template <class Handler>
+inline
+CustomAllocHandler<Handler>::CustomAllocHandler(HandlerMemory &memory, Handler handler):
+  m_memory(memory),
+  m_handler(std::move(handler))
+{}
+
+template <class Handler>
+inline
+auto CustomAllocHandler<Handler>::get_allocator() const noexcept -> allocator_type
+{
+  return allocator_type(m_memory);
+}
+
+template <class Handler>
+template <class... Args>
+inline
+void CustomAllocHandler<Handler>::operator ()(Args &&... args)
+{
+  m_handler(std::forward<Args>(args)...);
+}
+
+template <class Handler>
+inline
+CustomAllocHandler<Handler> makeCustomAllocHandler(HandlerMemory &memory, Handler handler)
+{
+  return CustomAllocHandler<Handler>(memory, std::move(handler));
+}
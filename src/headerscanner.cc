@@ -0,0 +1,113 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "headerscanner.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+
+namespace
+{
+  void findLineEndsScalar(const char *data, std::size_t length, uint64_t *bitmap)
+  {
+    for (std::size_t i = 0; i < length; i += 64)
+    {
+      uint64_t bits = 0;
+      for (std::size_t j = 0; j < 64 && i + j < length; ++j)
+      {
+        bits |= uint64_t(data[i + j] == '\n') << j;
+      }
+      *bitmap++ = bits;
+    }
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+
+  __attribute__((target("sse2")))
+  void findLineEndsSse2(const char *data, std::size_t length, uint64_t *bitmap)
+  {
+    const __m128i lineFeed = _mm_set1_epi8('\n');
+    std::size_t i = 0;
+    for (; i + 64 <= length; i += 64)
+    {
+      uint64_t bits = 0;
+      for (std::size_t j = 0; j < 64; j += 16)
+      {
+        auto equal = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + j)), lineFeed);
+        bits |= uint64_t(static_cast<uint32_t>(_mm_movemask_epi8(equal))) << j;
+      }
+      *bitmap++ = bits;
+    }
+    if (i < length)
+    {
+      // Scan the tail from a padded copy, rather than byte by byte
+      alignas(16) char tail[64] = {};
+      std::memcpy(tail, data + i, length - i);
+      findLineEndsSse2(tail, sizeof(tail), bitmap);
+    }
+  }
+
+  __attribute__((target("avx2")))
+  void findLineEndsAvx2(const char *data, std::size_t length, uint64_t *bitmap)
+  {
+    const __m256i lineFeed = _mm256_set1_epi8('\n');
+    std::size_t i = 0;
+    for (; i + 64 <= length; i += 64)
+    {
+      auto low = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i)), lineFeed);
+      auto high = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 32)), lineFeed);
+      *bitmap++ = uint64_t(static_cast<uint32_t>(_mm256_movemask_epi8(low)))
+        | (uint64_t(static_cast<uint32_t>(_mm256_movemask_epi8(high))) << 32);
+    }
+    if (i < length)
+    {
+      alignas(32) char tail[64] = {};
+      std::memcpy(tail, data + i, length - i);
+      findLineEndsAvx2(tail, sizeof(tail), bitmap);
+    }
+  }
+
+#endif
+}
+
+
+auto HeaderScanner::getBestImplementation() noexcept -> const Implementation &
+{
+  static const Implementation implementation = [] {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+      return Implementation{"AVX2", &findLineEndsAvx2};
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+      return Implementation{"SSE2", &findLineEndsSse2};
+    }
+#endif
+    return Implementation{"scalar", &findLineEndsScalar};
+  }();
+  return implementation;
+}
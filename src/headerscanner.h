@@ -0,0 +1,79 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+
+/**
+ * Locates the line ends in HTTP-like messages such as those of SSDP, several bytes per instruction where the CPU
+ * supports AVX2 or SSE2, so that headers can be found without looking at every byte; the implementation is picked at
+ * run time
+ */
+struct HeaderScanner
+{
+  HeaderScanner() = delete;
+
+
+  /** Gets the number of words in a bitmap with one bit for each byte of a message of the given length */
+  static std::size_t getBitmapSize(std::size_t length) noexcept;
+
+  /** Gets the name of the implementation used on this CPU */
+  static const char *getImplementation() noexcept;
+
+  /** Fills the given bitmap of getBitmapSize() words such that bit i is set iff byte i is a line feed */
+  static void findLineEnds(const char *data, std::size_t length, uint64_t *bitmap) noexcept;
+
+
+private:
+
+  using find_function_t = void (*)(const char *data, std::size_t length, uint64_t *bitmap);
+
+  struct Implementation
+  {
+    const char *name;
+    find_function_t findLineEnds;
+  };
+
+
+  static const Implementation &getBestImplementation() noexcept;
+};
+
+
+inline
+void HeaderScanner::findLineEnds(const char *data, std::size_t length, uint64_t *bitmap) noexcept
+{
+  getBestImplementation().findLineEnds(data, length, bitmap);
+}
+
+inline
+std::size_t HeaderScanner::getBitmapSize(std::size_t length) noexcept
+{
+  return (length + 63) / 64;
+}
+
+inline
+const char *HeaderScanner::getImplementation() noexcept
+{
+  return getBestImplementation().name;
+}
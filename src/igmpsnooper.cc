@@ -0,0 +1,636 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "igmpsnooper.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <syslog.h>
+#include <boost/asio.hpp>
+
+#include "utility.h"
+
+using Network = config::model::Network;
+
+
+namespace
+{
+  using address_t = IgmpSnooper::address_t;
+
+
+  // Timers and counts of RFC 3376 8, at their defaults
+  constexpr unsigned ROBUSTNESS = 2;
+  constexpr auto QUERY_INTERVAL = std::chrono::seconds(125);
+  constexpr auto QUERY_RESPONSE_INTERVAL = std::chrono::seconds(10);
+  constexpr auto GROUP_MEMBERSHIP_INTERVAL = ROBUSTNESS * QUERY_INTERVAL + QUERY_RESPONSE_INTERVAL;
+  constexpr auto OTHER_QUERIER_PRESENT_INTERVAL = ROBUSTNESS * QUERY_INTERVAL + QUERY_RESPONSE_INTERVAL / 2;
+  constexpr auto STARTUP_QUERY_INTERVAL = QUERY_INTERVAL / 4;
+  constexpr auto LAST_MEMBER_QUERY_INTERVAL = std::chrono::seconds(1);
+  constexpr auto LAST_MEMBER_QUERY_TIME = ROBUSTNESS * LAST_MEMBER_QUERY_INTERVAL;
+
+  /** Resolution of the listener timeouts */
+  const auto TICK = boost::posix_time::seconds(1);
+
+  enum: uint8_t
+  {
+    MEMBERSHIP_QUERY = 0x11,
+    V1_MEMBERSHIP_REPORT = 0x12,
+    V2_MEMBERSHIP_REPORT = 0x16,
+    LEAVE_GROUP = 0x17,
+    V3_MEMBERSHIP_REPORT = 0x22
+  };
+
+  /** Types of the group records in IGMPv3 reports (RFC 3376 4.2.12) */
+  enum: uint8_t
+  {
+    MODE_IS_INCLUDE = 1,
+    MODE_IS_EXCLUDE = 2,
+    CHANGE_TO_INCLUDE_MODE = 3,
+    CHANGE_TO_EXCLUDE_MODE = 4,
+    ALLOW_NEW_SOURCES = 5
+  };
+
+  const address_t ALL_SYSTEMS(0xe0000001UL);
+
+
+  void attachFilter(int fd, sock_filter *code, std::size_t length)
+  {
+    sock_fprog program;
+    program.len = static_cast<unsigned short>(length);
+    program.filter = code;
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) != 0)
+    {
+      throw std::runtime_error("attaching filter to IGMP socket failed: " + utility::getErrorString(errno));
+    }
+  }
+
+  /** Computes the Internet checksum; over data including a valid checksum, it is zero */
+  uint16_t getChecksum(const uint8_t *data, std::size_t length) noexcept
+  {
+    uint32_t sum = 0;
+    for (std::size_t i = 0; i + 1 < length; i += 2)
+    {
+      sum += (uint32_t(data[i]) << 8) | data[i + 1];
+    }
+    if (length % 2 != 0)
+    {
+      sum += uint32_t(data[length - 1]) << 8;
+    }
+    while (sum >> 16 != 0)
+    {
+      sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return static_cast<uint16_t>(~sum);
+  }
+
+  uint16_t read16(const uint8_t *data) noexcept
+  {
+    return static_cast<uint16_t>((data[0] << 8) | data[1]);
+  }
+
+  uint32_t read32(const uint8_t *data) noexcept
+  {
+    return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | data[3];
+  }
+
+  /** Encodes the given time as a maximum response code, which is exact up to 12.7 seconds */
+  template <class Duration>
+  uint8_t toMaxResponseCode(Duration duration) noexcept
+  {
+    return static_cast<uint8_t>(std::chrono::duration_cast<std::chrono::duration<unsigned, std::deci>>(duration)
+      .count());
+  }
+}
+
+
+IgmpSnooper::IgmpSnooper(EventLoop &ioService, ReceiveBuffer &receiveBuffer, bool querier):
+  m_ioService(ioService),
+  m_receiveBuffer(receiveBuffer),
+  m_querier(querier),
+  m_interfaces(),
+  m_groupHandler(),
+  m_timerHandlerMemory(),
+  m_timer(ioService),
+  m_startupQueries(),
+  m_nextQuery()
+{}
+
+const bool *IgmpSnooper::addGroup(address_t group, address_t interfaceAddress, unsigned interfaceIndex)
+{
+  assert(!isLinkLocal(group));
+  // Until the listeners had the chance to report, assume there are some rather than dropping datagrams
+  auto &groups = getInterface(interfaceAddress, interfaceIndex).groups;
+  return &groups.emplace(group, Group{true, false, clock_t::time_point()}).first->second.listening;
+}
+
+void IgmpSnooper::addGroups(const Network &groups, address_t interfaceAddress, unsigned interfaceIndex)
+{
+  getInterface(interfaceAddress, interfaceIndex).proxiedGroups.push_back(groups.getMaskedNetwork());
+}
+
+void IgmpSnooper::beginReceive(Interface &interface)
+{
+  interface.socket.async_receive(boost::asio::null_buffers(), makeCustomAllocHandler(interface.handlerMemory,
+    [this, &interface](const boost::system::error_code &error, std::size_t) {
+      // Only aborted when stopped, after which the snooper is not to be touched
+      if (error != boost::asio::error::operation_aborted)
+      {
+        endReceive(interface, error);
+      }
+    }));
+}
+
+void IgmpSnooper::beginWaitForTick()
+{
+  m_timer.expires_from_now(TICK);
+  m_timer.async_wait(makeCustomAllocHandler(m_timerHandlerMemory,
+    [this](const boost::system::error_code &error) {
+      if (error != boost::asio::error::operation_aborted)
+      {
+        handleTick(error);
+      }
+    }));
+}
+
+void IgmpSnooper::endReceive(Interface &interface, const boost::system::error_code &error)
+{
+  if (!interface.socket.is_open())
+  {
+    // Stopped while this handler was pending
+    return;
+  }
+  if (error)
+  {
+    std::ostringstream msg;
+    msg << "receive of IGMP messages on " << interface.address << " failed: " << error.message();
+    throw std::runtime_error(msg.str());
+  }
+
+  unsigned messages = 0;
+  for (; messages < MAX_MESSAGES_PER_WAKEUP; ++messages)
+  {
+    auto length = recv(interface.socket.native_handle(), m_receiveBuffer.getData(), m_receiveBuffer.getSize(), 0);
+    if (length < 0)
+    {
+      auto receiveError = errno;
+      if (receiveError == EAGAIN || receiveError == EWOULDBLOCK)
+      {
+        break;
+      }
+      if (receiveError == EINTR)
+      {
+        continue;
+      }
+      std::ostringstream msg;
+      msg << "receive of IGMP messages on " << interface.address << " failed: "
+        << utility::getErrorString(receiveError);
+      throw std::runtime_error(msg.str());
+    }
+    handleMessage(interface, reinterpret_cast<const uint8_t *>(m_receiveBuffer.getData()),
+      static_cast<std::size_t>(length));
+  }
+
+  if (messages == MAX_MESSAGES_PER_WAKEUP)
+  {
+    // Readiness is reported on edges only, so rather than waiting, resume once other pending handlers had their turn
+    m_ioService.post(makeCustomAllocHandler(interface.handlerMemory,
+      [this, &interface] { endReceive(interface, boost::system::error_code()); }));
+    return;
+  }
+  beginReceive(interface);
+}
+
+const bool *IgmpSnooper::findGroup(address_t group, unsigned interfaceIndex) const
+{
+  for (auto &interface: m_interfaces)
+  {
+    if (interface.index == interfaceIndex)
+    {
+      auto iter = interface.groups.find(group);
+      return iter == std::end(interface.groups) ? nullptr : &iter->second.listening;
+    }
+  }
+  return nullptr;
+}
+
+auto IgmpSnooper::getInterface(address_t address, unsigned index) -> Interface &
+{
+  auto interface = std::find_if(std::begin(m_interfaces), std::end(m_interfaces),
+    [index](const Interface &interface) { return interface.index == index; });
+  if (interface == std::end(m_interfaces))
+  {
+    interface = m_interfaces.emplace(std::end(m_interfaces), m_ioService, address, index);
+    openSockets(*interface);
+  }
+  return *interface;
+}
+
+void IgmpSnooper::handleLeave(Interface &interface, address_t group)
+{
+  auto iter = interface.groups.find(group);
+  if (iter == std::end(interface.groups))
+  {
+    return;
+  }
+  ++interface.leaves;
+
+  // Remaining listeners report in answer to the group-specific query of the querier (RFC 3376 6.4.2)
+  auto now = clock_t::now();
+  auto &listeners = iter->second;
+  if (listeners.listening)
+  {
+    listeners.expiry = std::min(listeners.expiry, now + LAST_MEMBER_QUERY_TIME);
+  }
+  if (m_querier && interface.otherQuerierExpiry <= now)
+  {
+    sendQuery(interface, group);
+  }
+}
+
+void IgmpSnooper::handleMessage(Interface &interface, const uint8_t *data, std::size_t length)
+{
+  // Skip the IP header, and the link padding after the datagram; messages sent by this host tell nothing about the
+  // listeners, and IGMP messages are never fragmented
+  if (length < 20 || data[0] >> 4 != 4 || (read16(data + 6) & 0x3fffU) != 0)
+  {
+    return;
+  }
+  length = std::min<std::size_t>(length, read16(data + 2));
+  std::size_t headerLength = (data[0] & 0x0fU) * 4U;
+  address_t source(read32(data + 12));
+  if (headerLength < 20 || length < headerLength + 8 || source == interface.address)
+  {
+    return;
+  }
+  data += headerLength;
+  length -= headerLength;
+  if (getChecksum(data, length) != 0)
+  {
+    return;
+  }
+
+  switch (data[0])
+  {
+    case MEMBERSHIP_QUERY:
+      // Of several queriers on a network, the one with the lowest address queries (RFC 3376 6.6.2)
+      if (!source.is_unspecified() && source.to_ulong() < interface.address.to_ulong())
+      {
+        interface.otherQuerierExpiry = clock_t::now() + OTHER_QUERIER_PRESENT_INTERVAL;
+      }
+      break;
+    case V1_MEMBERSHIP_REPORT:
+    case V2_MEMBERSHIP_REPORT:
+      handleReport(interface, address_t(read32(data + 4)));
+      break;
+    case LEAVE_GROUP:
+      handleLeave(interface, address_t(read32(data + 4)));
+      break;
+    case V3_MEMBERSHIP_REPORT:
+    {
+      // Any record with sources to receive from, or excluding sources, means there are listeners
+      std::size_t recordCount = read16(data + 6);
+      std::size_t offset = 8;
+      for (std::size_t i = 0; i < recordCount && offset + 8 <= length; ++i)
+      {
+        auto record = data + offset;
+        std::size_t sourceCount = read16(record + 2);
+        offset += 8 + 4 * (sourceCount + record[1]);
+        if (offset > length)
+        {
+          break;
+        }
+        const auto type = record[0];
+        if (type == MODE_IS_EXCLUDE || type == CHANGE_TO_EXCLUDE_MODE
+          || (sourceCount != 0
+            && (type == MODE_IS_INCLUDE || type == CHANGE_TO_INCLUDE_MODE || type == ALLOW_NEW_SOURCES)))
+        {
+          handleReport(interface, address_t(read32(record + 4)));
+        }
+        else if (type == CHANGE_TO_INCLUDE_MODE)
+        {
+          handleLeave(interface, address_t(read32(record + 4)));
+        }
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+void IgmpSnooper::handleReport(Interface &interface, address_t group)
+{
+  auto iter = interface.groups.find(group);
+  if (iter == std::end(interface.groups))
+  {
+    // Track groups of proxied ranges from their first report on, at once on all interfaces proxying them
+    auto proxies = [group](const Interface &interface) {
+      return std::any_of(std::begin(interface.proxiedGroups), std::end(interface.proxiedGroups),
+        [group](const Network &groups) { return groups.contains(group); });
+    };
+    if (isLinkLocal(group) || !proxies(interface))
+    {
+      return;
+    }
+    for (auto &proxy: m_interfaces)
+    {
+      if (proxies(proxy))
+      {
+        proxy.groups.emplace(group, Group{false, true, clock_t::time_point()});
+      }
+    }
+    iter = interface.groups.find(group);
+  }
+  ++interface.reports;
+
+  auto &listeners = iter->second;
+  listeners.expiry = clock_t::now() + GROUP_MEMBERSHIP_INTERVAL;
+  if (!listeners.listening)
+  {
+#ifndef NDEBUG
+    std::cout << "Listeners for " << group << " on " << interface.address << " reported" << std::endl;
+#endif
+    listeners.listening = true;
+  }
+  if (listeners.dynamic && m_groupHandler)
+  {
+    m_groupHandler(group);
+  }
+}
+
+void IgmpSnooper::handleTick(const boost::system::error_code &error)
+{
+  if (error)
+  {
+    return;
+  }
+
+  auto now = clock_t::now();
+  for (auto &interface: m_interfaces)
+  {
+    for (auto &group: interface.groups)
+    {
+      if (group.second.listening && group.second.expiry <= now)
+      {
+        group.second.listening = false;
+#ifndef NDEBUG
+        std::cout << "Listeners for " << group.first << " on " << interface.address << " gone" << std::endl;
+#endif
+        if (group.second.dynamic && m_groupHandler)
+        {
+          m_groupHandler(group.first);
+        }
+      }
+    }
+  }
+
+  // The handlers let go of dynamic groups without listeners anywhere
+  for (auto &interface: m_interfaces)
+  {
+    for (auto iter = std::begin(interface.groups); iter != std::end(interface.groups);)
+    {
+      iter = iter->second.dynamic && !isListened(iter->first) ? interface.groups.erase(iter) : std::next(iter);
+    }
+  }
+
+  if (m_querier && m_nextQuery <= now)
+  {
+    for (auto &interface: m_interfaces)
+    {
+      if (interface.otherQuerierExpiry <= now)
+      {
+        sendQuery(interface, address_t());
+      }
+    }
+    // Query more often at startup, so that listeners are found sooner (RFC 3376 8.6)
+    if (m_startupQueries < STARTUP_QUERY_COUNT)
+    {
+      ++m_startupQueries;
+    }
+    m_nextQuery = now + (m_startupQueries < STARTUP_QUERY_COUNT ? STARTUP_QUERY_INTERVAL : QUERY_INTERVAL);
+  }
+
+  beginWaitForTick();
+}
+
+bool IgmpSnooper::isListened(address_t group) const noexcept
+{
+  return std::any_of(std::begin(m_interfaces), std::end(m_interfaces), [group](const Interface &interface) {
+    auto iter = interface.groups.find(group);
+    return iter != std::end(interface.groups) && iter->second.listening;
+  });
+}
+
+void IgmpSnooper::openSockets(Interface &interface)
+{
+  /* A raw IGMP socket only receives the messages to groups that this host joined, which are not known up front for
+   * proxied ranges; take all IGMP messages arriving on the interface from the link instead */
+  auto fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+  {
+    throw std::runtime_error("opening IGMP socket failed: " + utility::getErrorString(errno));
+  }
+  try
+  {
+    interface.socket.assign(boost::asio::ip::udp::v4(), fd);
+  }
+  catch (...)
+  {
+    close(fd);
+    throw;
+  }
+
+  // Filter before binding, so that no other packets queue up in between
+  sock_filter igmp[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_PKTTYPE)),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 2, 0),
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_IGMP, 1, 0),
+    BPF_STMT(BPF_RET | BPF_K, 0),
+    BPF_STMT(BPF_RET | BPF_K, 0xffff)
+  };
+  attachFilter(fd, igmp, sizeof(igmp) / sizeof(igmp[0]));
+  sockaddr_ll link;
+  memset(&link, 0, sizeof(link));
+  link.sll_family = AF_PACKET;
+  link.sll_protocol = htons(ETH_P_IP);
+  link.sll_ifindex = static_cast<int>(interface.index);
+  if (bind(fd, reinterpret_cast<const sockaddr *>(&link), sizeof(link)) != 0)
+  {
+    throw std::runtime_error("binding IGMP socket failed: " + utility::getErrorString(errno));
+  }
+
+  // IGMPv2 reports go to the group itself, which the interface would otherwise filter
+  packet_mreq membership;
+  memset(&membership, 0, sizeof(membership));
+  membership.mr_ifindex = static_cast<int>(interface.index);
+  membership.mr_type = PACKET_MR_ALLMULTI;
+  if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0)
+  {
+    throw std::runtime_error("receiving all multicast on " + interface.address.to_string() + " failed: "
+      + utility::getErrorString(errno));
+  }
+  interface.socket.non_blocking(true);
+
+  if (!m_querier)
+  {
+    return;
+  }
+  fd = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_IGMP);
+  if (fd == -1)
+  {
+    throw std::runtime_error("opening IGMP socket failed: " + utility::getErrorString(errno));
+  }
+  try
+  {
+    interface.querySocket.assign(boost::asio::ip::udp::v4(), fd);
+  }
+  catch (...)
+  {
+    close(fd);
+    throw;
+  }
+
+  // Only sends, so drop whatever would be received
+  sock_filter none[] = {
+    BPF_STMT(BPF_RET | BPF_K, 0)
+  };
+  attachFilter(fd, none, sizeof(none) / sizeof(none[0]));
+
+  // Queries stay on the link, and carry the router alert option that IGMPv3 listeners require (RFC 3376 4)
+  interface.querySocket.set_option(boost::asio::ip::multicast::outbound_interface(interface.address));
+  interface.querySocket.set_option(boost::asio::ip::multicast::hops(1));
+  interface.querySocket.set_option(boost::asio::ip::multicast::enable_loopback(false));
+  const uint8_t routerAlert[] = { 0x94, 0x04, 0x00, 0x00 };
+  if (setsockopt(fd, IPPROTO_IP, IP_OPTIONS, routerAlert, sizeof(routerAlert)) != 0)
+  {
+    throw std::runtime_error(utility::getErrorString(errno));
+  }
+}
+
+void IgmpSnooper::reportStatistics() const
+{
+  auto now = clock_t::now();
+  for (auto &interface: m_interfaces)
+  {
+    auto listened = std::count_if(std::begin(interface.groups), std::end(interface.groups),
+      [](const std::pair<const address_t, Group> &group) { return group.second.listening; });
+    std::ostringstream oss;
+    oss << "IGMP snooping on " << interface.address << ": listeners for " << listened << " of "
+      << interface.groups.size() << " groups, " << interface.reports << " reports and " << interface.leaves
+      << " leaves received";
+    if (m_querier)
+    {
+      oss << ", " << interface.sentQueries << " queries sent";
+      if (interface.otherQuerierExpiry > now)
+      {
+        oss << ", another querier present";
+      }
+    }
+    syslog(LOG_INFO, "%s", oss.str().c_str());
+  }
+}
+
+void IgmpSnooper::sendQuery(Interface &interface, address_t group)
+{
+  // IGMPv3 queries, which earlier listeners take for their own (RFC 3376 7.1)
+  const bool general = group.is_unspecified();
+  uint8_t query[12] = {};
+  query[0] = MEMBERSHIP_QUERY;
+  query[1] = toMaxResponseCode(general ? QUERY_RESPONSE_INTERVAL : LAST_MEMBER_QUERY_INTERVAL);
+  auto groupValue = static_cast<uint32_t>(group.to_ulong());
+  for (std::size_t i = 0; i < 4; ++i)
+  {
+    query[4 + i] = static_cast<uint8_t>(groupValue >> (24 - 8 * i));
+  }
+  query[8] = ROBUSTNESS;
+  query[9] = static_cast<uint8_t>(QUERY_INTERVAL.count());
+  auto checksum = getChecksum(query, sizeof(query));
+  query[2] = static_cast<uint8_t>(checksum >> 8);
+  query[3] = static_cast<uint8_t>(checksum);
+
+  // General queries go to all systems, group-specific ones to the group itself
+  sockaddr_in destination;
+  memset(&destination, 0, sizeof(destination));
+  destination.sin_family = AF_INET;
+  destination.sin_addr.s_addr = htonl(static_cast<uint32_t>((general ? ALL_SYSTEMS : group).to_ulong()));
+  auto sent = sendto(interface.querySocket.native_handle(), query, sizeof(query), MSG_DONTWAIT,
+    reinterpret_cast<const sockaddr *>(&destination), sizeof(destination));
+  if (sent == static_cast<ssize_t>(sizeof(query)))
+  {
+    ++interface.sentQueries;
+  }
+}
+
+void IgmpSnooper::setGroupHandler(GroupHandler handler)
+{
+  m_groupHandler = std::move(handler);
+}
+
+void IgmpSnooper::start()
+{
+  // Listeners assumed at first expire unless they report in answer to the startup queries, or to those of the querier
+  auto expiry = clock_t::now() + (m_querier ? STARTUP_QUERY_INTERVAL + QUERY_RESPONSE_INTERVAL
+    : GROUP_MEMBERSHIP_INTERVAL);
+  for (auto &interface: m_interfaces)
+  {
+    for (auto &group: interface.groups)
+    {
+      group.second.expiry = expiry;
+    }
+    beginReceive(interface);
+  }
+
+  // Expire listeners from here on, sending the first general query right away
+  handleTick(boost::system::error_code());
+}
+
+void IgmpSnooper::stop() noexcept
+{
+  boost::system::error_code error;
+  m_timer.cancel(error);
+  for (auto &interface: m_interfaces)
+  {
+    interface.socket.close(error);
+    interface.querySocket.close(error);
+  }
+}
+
+IgmpSnooper::Interface::Interface(EventLoop &ioService, address_t address, unsigned index):
+  address(address),
+  index(index),
+  handlerMemory(),
+  socket(ioService),
+  querySocket(ioService),
+  groups(),
+  proxiedGroups(),
+  otherQuerierExpiry(),
+  reports(),
+  leaves(),
+  sentQueries()
+{}
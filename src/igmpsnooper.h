@@ -0,0 +1,196 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <vector>
+
+#include <boost/asio/ip/address_v4.hpp>
+
+#include "eventloop.h"
+#include "handlermemory.h"
+#include "receivebuffer.h"
+#include "config/model/network.h"
+
+
+/**
+ * Learns which groups have listeners on the outgoing interfaces from the IGMP membership reports and leaves seen there
+ * (IGMP snooping, RFC 4541), so that forwarders skip interfaces where nobody listens. Listeners keep reporting only in
+ * answer to the queries of a querier on their network; unless there is one, the snooper has to act as querier itself.
+ * Memberships are tracked per group, regardless of the sources that IGMPv3 listeners include or exclude. For ranges
+ * of groups, as proxied, the listeners are tracked as they report, and the snooper tells when they come and go.
+ */
+struct IgmpSnooper
+{
+  using address_t = boost::asio::ip::address_v4;
+  using GroupHandler = std::function<void(address_t group)>;
+
+
+  /**
+   * Receives IGMP messages into the given buffer, shared with the forwarders; when acting as querier, sends general
+   * queries on the interfaces, unless another querier takes precedence
+   */
+  IgmpSnooper(EventLoop &ioService, ReceiveBuffer &receiveBuffer, bool querier);
+
+  IgmpSnooper(const IgmpSnooper &) = delete;
+  IgmpSnooper &operator =(const IgmpSnooper &) = delete;
+
+
+  /**
+   * Tracks the listeners for the given group on the interface with the given address and index; returns whether there
+   * are any, which the snooper keeps up to date for as long as it exists
+   */
+  const bool *addGroup(address_t group, address_t interfaceAddress, unsigned interfaceIndex);
+
+  /**
+   * Tracks the listeners for any of the given groups on the interface with the given address and index, from their
+   * first report on; the group handler is called when a group of these gets its first listeners on any interface, and
+   * when it has none left on some interface, after which findGroup returns null once it has none anywhere. It is also
+   * called for each further report while listeners remain, so that it can retry what failed when they came.
+   */
+  void addGroups(const config::model::Network &groups, address_t interfaceAddress, unsigned interfaceIndex);
+
+  /**
+   * Returns whether the given group has listeners on the interface with the given index, like addGroup, or null if the
+   * group is not tracked there; valid until the group handler returns for a group no longer listened to anywhere
+   */
+  const bool *findGroup(address_t group, unsigned interfaceIndex) const;
+
+  /** Returns true for the groups that IGMP does not cover, i.e. those in 224.0.0.0/24, which go to all interfaces */
+  static bool isLinkLocal(address_t group) noexcept;
+
+  /** Logs the listeners and counters for each interface */
+  void reportStatistics() const;
+
+  /** Sets the handler for changes in the listeners of groups added as ranges */
+  void setGroupHandler(GroupHandler handler);
+
+  /** Starts receiving IGMP messages and, as querier, querying */
+  void start();
+
+  /**
+   * Closes the sockets and cancels the timer; handlers still pending return without effect, so the snooper must
+   * outlive them
+   */
+  void stop() noexcept;
+
+
+private:
+
+  using clock_t = std::chrono::steady_clock;
+
+  enum
+  {
+    /** Upper bound on the number of messages handled per wake-up, so that a flood cannot starve forwarding */
+    MAX_MESSAGES_PER_WAKEUP = 64,
+    /** Number of general queries sent at startup, the first of which right away */
+    STARTUP_QUERY_COUNT = 2
+  };
+
+  /** Listeners for one group on one interface */
+  struct Group
+  {
+    bool listening;
+    /** Whether the group is tracked for a range of groups only, for as long as it has listeners on any interface */
+    bool dynamic;
+    /** When the listeners are considered gone, unless they report again */
+    clock_t::time_point expiry;
+  };
+
+  struct Interface
+  {
+    Interface(EventLoop &ioService, address_t address, unsigned index);
+
+    address_t address;
+    unsigned index;
+    /** Declared before the sockets, as operations still pending when these close are freed into it */
+    HandlerMemory handlerMemory;
+    /**
+     * Packet socket bound to the interface, receiving all IGMP messages there, including reports to groups this host
+     * did not join
+     */
+    UdpSocket socket;
+    /** Raw socket bound to the interface for sending queries, when acting as querier */
+    UdpSocket querySocket;
+    std::map<address_t, Group> groups;
+    std::vector<config::model::Network> proxiedGroups;
+    /** Until when another querier with a lower address is considered present, suppressing the queries of our own */
+    clock_t::time_point otherQuerierExpiry;
+    uint64_t reports;
+    uint64_t leaves;
+    uint64_t sentQueries;
+  };
+
+
+  void beginReceive(Interface &interface);
+
+  void beginWaitForTick();
+
+  void endReceive(Interface &interface, const boost::system::error_code &error);
+
+  /** Returns the interface with the given index, setting it up if new */
+  Interface &getInterface(address_t address, unsigned index);
+
+  /** Handles one IGMP message, including its IP header */
+  void handleMessage(Interface &interface, const uint8_t *data, std::size_t length);
+
+  /** Expires listeners, drops dynamic groups no longer listened to, and sends the queries due */
+  void handleTick(const boost::system::error_code &error);
+
+  /** Handles a leave for the given group, or an IGMPv3 report that no longer includes any sources for it */
+  void handleLeave(Interface &interface, address_t group);
+
+  void handleReport(Interface &interface, address_t group);
+
+  /** Returns whether listeners for the given group have reported on any interface */
+  bool isListened(address_t group) const noexcept;
+
+  /** Opens the sockets of the given interface */
+  void openSockets(Interface &interface);
+
+  /** Sends a general query, or a group-specific one for the given group */
+  void sendQuery(Interface &interface, address_t group);
+
+
+  EventLoop &m_ioService;
+  ReceiveBuffer &m_receiveBuffer;
+  bool m_querier;
+  std::list<Interface> m_interfaces;
+  GroupHandler m_groupHandler;
+  /** Declared before the timer, as a wait still pending when it is destroyed is freed into it */
+  HandlerMemory m_timerHandlerMemory;
+  Timer m_timer;
+  /** Number of general queries sent so far, up to the startup query count */
+  unsigned m_startupQueries;
+  clock_t::time_point m_nextQuery;
+};
+
+
+inline
+bool IgmpSnooper::isLinkLocal(address_t group) noexcept
+{
+  return (group.to_ulong() & 0xffffff00UL) == 0xe0000000UL;
+}
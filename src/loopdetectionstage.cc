@@ -0,0 +1,163 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "loopdetectionstage.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#include <syslog.h>
+
+#include "utility.h"
+
+
+LoopDetectionStage::LoopDetectionStage(const arguments_t &arguments):
+  m_window(),
+  m_entries(),
+  m_interfaces(),
+  m_interfaceCount(),
+  m_hashedData(),
+  m_hashedLength(),
+  m_hash(),
+  m_now(),
+  m_loopedDatagrams(),
+  m_evictedDatagrams()
+{
+  if (arguments.size() > 2)
+  {
+    throw std::invalid_argument("expected at most a window in milliseconds and a capacity");
+  }
+  auto window = arguments.empty() ? DEFAULT_WINDOW : parsePositive(arguments[0], MAXIMUM_WINDOW);
+  m_window = std::chrono::duration_cast<clock_t::duration>(std::chrono::milliseconds(window));
+  auto capacity = arguments.size() < 2 ? std::size_t(DEFAULT_CAPACITY) : parsePositive(arguments[1], MAXIMUM_CAPACITY);
+  std::size_t slots = PROBE_LENGTH;
+  while (slots < capacity)
+  {
+    slots *= 2;
+  }
+  // All memory is claimed up front, as stages must not allocate while forwarding
+  m_entries.resize(slots);
+}
+
+uint64_t LoopDetectionStage::getInterfaceBit(address_t interfaceAddress) noexcept
+{
+  std::size_t index = 0;
+  while (index < m_interfaceCount && m_interfaces[index] != interfaceAddress)
+  {
+    ++index;
+  }
+  if (index == m_interfaceCount && m_interfaceCount < MAX_INTERFACES)
+  {
+    m_interfaces[m_interfaceCount++] = interfaceAddress;
+  }
+  return uint64_t(1) << std::min<std::size_t>(index, MAX_INTERFACES - 1);
+}
+
+uint64_t LoopDetectionStage::hash(const DatagramView &datagram) noexcept
+{
+  if (datagram.data != m_hashedData || datagram.length != m_hashedLength)
+  {
+    // Copies forwarded back keep the payload and the group, but not the source
+    auto seed = (uint64_t(datagram.multicastEndpoint.address().to_v4().to_uint()) << 16)
+      | datagram.multicastEndpoint.port();
+    m_hash = utility::hashPayload(datagram.data, datagram.length, seed);
+    m_hashedData = datagram.data;
+    m_hashedLength = datagram.length;
+  }
+  return m_hash;
+}
+
+bool LoopDetectionStage::hasEgress() const noexcept
+{
+  return true;
+}
+
+auto LoopDetectionStage::process(DatagramView &datagram) -> Verdict
+{
+  m_now = clock_t::now();
+  m_hashedData = nullptr;
+  const auto hash = this->hash(datagram);
+  for (std::size_t i = 0; i < PROBE_LENGTH; ++i)
+  {
+    auto &entry = m_entries[(hash + i) & (m_entries.size() - 1)];
+    if (entry.hash == hash && entry.expiry > m_now)
+    {
+      if (entry.source != datagram.senderEndpoint.address().to_v4()
+        && (entry.outInterfaces & ~getInterfaceBit(datagram.inInterfaceAddress)) != 0)
+      {
+        ++m_loopedDatagrams;
+        return Verdict::DROP;
+      }
+      break;
+    }
+  }
+  return Verdict::PASS;
+}
+
+auto LoopDetectionStage::processEgress(const DatagramView &datagram, address_t outInterfaceAddress) -> Verdict
+{
+  const auto hash = this->hash(datagram);
+  Entry *existing = nullptr;
+  Entry *vacant = nullptr;
+  Entry *oldest = nullptr;
+  for (std::size_t i = 0; i < PROBE_LENGTH && existing == nullptr; ++i)
+  {
+    auto &entry = m_entries[(hash + i) & (m_entries.size() - 1)];
+    if (entry.expiry <= m_now)
+    {
+      vacant = vacant != nullptr ? vacant : &entry;
+    }
+    else if (entry.hash == hash)
+    {
+      existing = &entry;
+    }
+    if (oldest == nullptr || entry.expiry < oldest->expiry)
+    {
+      oldest = &entry;
+    }
+  }
+
+  auto entry = existing;
+  if (entry == nullptr)
+  {
+    if (vacant == nullptr)
+    {
+      ++m_evictedDatagrams;
+    }
+    entry = vacant != nullptr ? vacant : oldest;
+    entry->hash = hash;
+    entry->outInterfaces = 0;
+    entry->source = datagram.senderEndpoint.address().to_v4();
+  }
+  // Copies that passed, e.g. coming in on the interface they were sent on, keep the original source
+  entry->outInterfaces |= getInterfaceBit(outInterfaceAddress);
+  entry->expiry = m_now + m_window;
+  return Verdict::PASS;
+}
+
+void LoopDetectionStage::reportStatistics(const std::string &owner) const
+{
+  std::ostringstream oss;
+  oss << owner << ": " << m_loopedDatagrams << " datagrams dropped as forwarded back; " << m_evictedDatagrams
+    << " datagrams evicted early";
+  syslog(LOG_INFO, "%s", oss.str().c_str());
+}
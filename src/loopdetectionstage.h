@@ -0,0 +1,111 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "pipeline.h"
+
+
+/**
+ * Stage dropping datagrams that return after being forwarded, e.g. through another forwarder bridging the same
+ * interfaces; it is configured as "stage loop_detection [WINDOW [CAPACITY]];" for a service, with a window of WINDOW
+ * milliseconds (1000 by default) and room for about CAPACITY datagrams (4096 by default). The payloads sent on each
+ * outgoing interface are remembered along with their source. One that comes in again during the window from another
+ * source, having been sent on some other interface than the one it comes in on, is a copy forwarded back and is
+ * dropped; datagrams that their original sender repeats pass. An identical datagram sent by another host during the
+ * window cannot be told apart from such a copy, and is dropped as well; e.g. a second host asking the same SSDP search
+ * or mDNS query on the same link, which is common. The window is best kept short where that matters. The stage is
+ * best placed first, so that no other stage sees such copies.
+ */
+struct LoopDetectionStage final: Stage
+{
+  explicit LoopDetectionStage(const arguments_t &arguments);
+
+
+  bool hasEgress() const noexcept override;
+
+  Verdict process(DatagramView &datagram) override;
+
+  Verdict processEgress(const DatagramView &datagram, address_t outInterfaceAddress) override;
+
+  void reportStatistics(const std::string &owner) const override;
+
+
+private:
+
+  using clock_t = std::chrono::steady_clock;
+
+  enum: std::size_t
+  {
+    DEFAULT_CAPACITY = 4096,
+    MAXIMUM_CAPACITY = 1 << 20,
+    /** Number of consecutive slots that can hold a datagram */
+    PROBE_LENGTH = 16,
+    /** Number of interfaces told apart; any further ones share the last bit of the interface masks */
+    MAX_INTERFACES = 64
+  };
+
+  /** Default window in milliseconds, and the largest one accepted */
+  static constexpr unsigned long DEFAULT_WINDOW = 1000;
+  static constexpr unsigned long MAXIMUM_WINDOW = 60000;
+
+
+  /** Datagram forwarded during the window; identified by the hash of its payload alone */
+  struct Entry
+  {
+    uint64_t hash;
+    /** End of the window; the slot is unused once passed */
+    clock_t::time_point expiry;
+    /** Bits of the interfaces it was sent on */
+    uint64_t outInterfaces;
+    /** Address of its original sender */
+    address_t source;
+  };
+
+
+  /** Gets the bit of the given interface in the interface masks */
+  uint64_t getInterfaceBit(address_t interfaceAddress) noexcept;
+
+  /** Hashes the payload of the given datagram unless it is the one hashed last, and returns its hash */
+  uint64_t hash(const DatagramView &datagram) noexcept;
+
+
+  clock_t::duration m_window;
+  /** Open addressing hash table, with a power of two slots */
+  std::vector<Entry> m_entries;
+  /** Interfaces in the order seen, giving their bits in the interface masks */
+  std::array<address_t, MAX_INTERFACES> m_interfaces;
+  std::size_t m_interfaceCount;
+  /** Datagram hashed last, which the forwarder asks about for each outgoing interface in turn */
+  const char *m_hashedData;
+  std::size_t m_hashedLength;
+  uint64_t m_hash;
+  /** Time at which the datagram being forwarded came in */
+  clock_t::time_point m_now;
+
+  uint64_t m_loopedDatagrams;
+  uint64_t m_evictedDatagrams;
+};
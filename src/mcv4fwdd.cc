@@ -180,6 +180,13 @@ int main(int argc, char* argv[])
     return 1;
   }
 
+  if (!commandLine.getForwardingTableFileName().empty())
+  {
+    openlog(argv[0], LOG_PID | LOG_PERROR, LOG_USER);
+    return Application::emitForwardingTable(std::move(configuration), commandLine.getConfigurationFileName(),
+      commandLine.getForwardingTableFileName());
+  }
+
   if (commandLine.getTestConfigurationOnly())
   {
     openlog(argv[0], LOG_PID | LOG_PERROR, LOG_USER);
@@ -0,0 +1,433 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "mdnscachestage.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <syslog.h>
+
+#include "receiver.h"
+
+using namespace std::chrono_literals;
+
+
+namespace
+{
+  void write16(uint8_t *out, uint16_t value) noexcept
+  {
+    out[0] = static_cast<uint8_t>(value >> 8);
+    out[1] = static_cast<uint8_t>(value);
+  }
+
+  void write32(uint8_t *out, uint32_t value) noexcept
+  {
+    write16(out, static_cast<uint16_t>(value >> 16));
+    write16(out + 2, static_cast<uint16_t>(value));
+  }
+}
+
+
+MdnsCacheStage::MdnsCacheStage(const arguments_t &arguments):
+  m_entries(),
+  m_knownAnswers(),
+  m_answers(),
+  m_additionals(),
+  m_reply(),
+  m_answeredQueries(),
+  m_forwardedQueries(),
+  m_cachedRecords(),
+  m_evictedRecords(),
+  m_failedReplies()
+{
+  if (arguments.size() > 1)
+  {
+    throw std::invalid_argument("expected at most a capacity");
+  }
+  auto capacity = arguments.empty() ? std::size_t(DEFAULT_CAPACITY) : parsePositive(arguments[0], MAXIMUM_CAPACITY);
+  std::size_t slots = PROBE_LENGTH;
+  while (slots < capacity)
+  {
+    slots *= 2;
+  }
+  // All memory is claimed up front, as stages must not allocate while forwarding
+  m_entries.resize(slots);
+  m_knownAnswers.reserve(MAX_KNOWN_ANSWERS);
+  m_answers.reserve(MAX_ANSWERS);
+  m_additionals.reserve(MAX_ANSWERS);
+}
+
+void MdnsCacheStage::addRecord(const DnsMessage &message, const DnsMessage::Record &record,
+  address_t inInterfaceAddress, clock_t::time_point now)
+{
+  if (record.type == DnsMessage::TYPE_OPT || (record.klass & ~DnsMessage::CLASS_FLAG) != DnsMessage::CLASS_IN)
+  {
+    return;
+  }
+  uint8_t buffer[MAX_RECORD_SIZE];
+  std::size_t nameLength = 0;
+  std::size_t dataLength = 0;
+  if (!message.expandName(record.nameOffset, buffer, sizeof(buffer), nameLength)
+    || !message.expandData(record, buffer + nameLength, sizeof(buffer) - nameLength, dataLength))
+  {
+    return;
+  }
+  auto keyHash = hashKey(buffer, nameLength, record.type, DnsMessage::CLASS_IN);
+  auto recordHash = hashRecord(keyHash, buffer + nameLength, dataLength);
+  bool cacheFlush = (record.klass & DnsMessage::CLASS_FLAG) != 0;
+
+  Entry *existing = nullptr;
+  Entry *vacant = nullptr;
+  Entry *oldest = nullptr;
+  for (std::size_t i = 0; i < PROBE_LENGTH; ++i)
+  {
+    auto &entry = m_entries[(keyHash + i) & (m_entries.size() - 1)];
+    if (entry.nameLength != 0 && entry.keyHash == keyHash && entry.type == record.type
+      && DnsMessage::equalNames(entry.record, entry.nameLength, buffer, nameLength))
+    {
+      if (entry.recordHash == recordHash && entry.dataLength == dataLength
+        && std::memcmp(entry.record + entry.nameLength, buffer + nameLength, dataLength) == 0)
+      {
+        existing = &entry;
+        continue;
+      }
+      // Unique records replace the others of their name and type, except those that just came along (RFC 6762 10.2)
+      if (cacheFlush && entry.received + 1s < now)
+      {
+        entry.expiry = std::min(entry.expiry, now + 1s);
+      }
+    }
+    if (vacant == nullptr && (entry.nameLength == 0 || entry.expiry <= now))
+    {
+      vacant = &entry;
+    }
+    if (oldest == nullptr || entry.expiry < oldest->expiry)
+    {
+      oldest = &entry;
+    }
+  }
+
+  if (record.ttl == 0)
+  {
+    // Goodbye packets have the record expire after one second (RFC 6762 10.1)
+    if (existing != nullptr)
+    {
+      existing->expiry = std::min(existing->expiry, now + 1s);
+    }
+    return;
+  }
+  auto entry = existing;
+  if (entry == nullptr)
+  {
+    if (vacant == nullptr)
+    {
+      ++m_evictedRecords;
+    }
+    ++m_cachedRecords;
+    entry = vacant != nullptr ? vacant : oldest;
+    entry->keyHash = keyHash;
+    entry->recordHash = recordHash;
+    entry->type = record.type;
+    entry->klass = DnsMessage::CLASS_IN;
+    entry->nameLength = static_cast<uint16_t>(nameLength);
+    entry->dataLength = static_cast<uint16_t>(dataLength);
+    std::memcpy(entry->record, buffer, nameLength + dataLength);
+  }
+  entry->received = now;
+  entry->expiry = now + std::chrono::seconds(record.ttl);
+  entry->ttl = record.ttl;
+  entry->inInterfaceAddress = inInterfaceAddress;
+  entry->cacheFlush = cacheFlush;
+}
+
+bool MdnsCacheStage::answer(const DnsMessage &message, const DatagramView &datagram, clock_t::time_point now)
+{
+  // The remainder of a truncated query, with more known answers, follows in other datagrams
+  if (datagram.inInterfaceAddress.is_unspecified() || message.isTruncated() || message.getQuestionCount() == 0)
+  {
+    return false;
+  }
+  std::size_t offset = DnsMessage::HEADER_SIZE;
+  DnsMessage::Question question;
+  for (uint16_t i = 0; i < message.getQuestionCount(); ++i)
+  {
+    if (!message.readQuestion(offset, question))
+    {
+      return false;
+    }
+  }
+  const std::size_t questionsEnd = offset;
+  if (!readKnownAnswers(message, questionsEnd))
+  {
+    return false;
+  }
+
+  // Every question needs at least one fresh record learned elsewhere, or the owners of the records must answer
+  m_answers.clear();
+  m_additionals.clear();
+  offset = DnsMessage::HEADER_SIZE;
+  for (uint16_t i = 0; i < message.getQuestionCount(); ++i)
+  {
+    message.readQuestion(offset, question);
+    auto klass = question.klass & ~DnsMessage::CLASS_FLAG;
+    uint8_t name[DnsMessage::MAX_NAME_LENGTH];
+    std::size_t nameLength = 0;
+    if (question.type == DnsMessage::TYPE_ANY || (klass != DnsMessage::CLASS_IN && klass != DnsMessage::CLASS_ANY)
+      || !message.expandName(question.nameOffset, name, sizeof(name), nameLength)
+      || !lookUp(name, nameLength, question.type, datagram.inInterfaceAddress, now, m_answers))
+    {
+      return false;
+    }
+  }
+
+  // Add what responders add for service discovery (RFC 6763 12), as far as known; the list grows while walking it
+  for (std::size_t i = 0; i < m_answers.size() + m_additionals.size(); ++i)
+  {
+    auto entry = i < m_answers.size() ? m_answers[i] : m_additionals[i - m_answers.size()];
+    auto data = entry->record + entry->nameLength;
+    if (entry->type == DnsMessage::TYPE_PTR)
+    {
+      lookUp(data, entry->dataLength, DnsMessage::TYPE_SRV, datagram.inInterfaceAddress, now, m_additionals);
+      lookUp(data, entry->dataLength, DnsMessage::TYPE_TXT, datagram.inInterfaceAddress, now, m_additionals);
+    }
+    else if (entry->type == DnsMessage::TYPE_SRV && entry->dataLength > 6)
+    {
+      lookUp(data + 6, entry->dataLength - 6u, DnsMessage::TYPE_A, datagram.inInterfaceAddress, now, m_additionals);
+    }
+  }
+
+  // The querier may know all answers already
+  if (m_answers.empty())
+  {
+    return true;
+  }
+  auto length = writeReply(message, datagram, questionsEnd, now);
+  if (length == 0)
+  {
+    return false;
+  }
+  if (!datagram.receiver->reply(datagram.senderEndpoint, m_reply.data(), length))
+  {
+    ++m_failedReplies;
+  }
+  return true;
+}
+
+uint64_t MdnsCacheStage::hashKey(const uint8_t *name, std::size_t length, uint16_t type, uint16_t klass) noexcept
+{
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  auto add = [&hash](uint8_t c) {
+    hash = (hash ^ c) * 0x100000001b3ULL;
+  };
+  for (std::size_t i = 0; i < length; ++i)
+  {
+    add(name[i] >= 'A' && name[i] <= 'Z' ? static_cast<uint8_t>(name[i] - 'A' + 'a') : name[i]);
+  }
+  add(static_cast<uint8_t>(type >> 8));
+  add(static_cast<uint8_t>(type));
+  add(static_cast<uint8_t>(klass >> 8));
+  add(static_cast<uint8_t>(klass));
+  return hash;
+}
+
+bool MdnsCacheStage::lookUp(const uint8_t *name, std::size_t nameLength, uint16_t type, address_t inInterfaceAddress,
+  clock_t::time_point now, std::vector<const Entry *> &records)
+{
+  auto keyHash = hashKey(name, nameLength, type, DnsMessage::CLASS_IN);
+  bool found = false;
+  for (std::size_t i = 0; i < PROBE_LENGTH; ++i)
+  {
+    auto &entry = m_entries[(keyHash + i) & (m_entries.size() - 1)];
+    if (entry.nameLength == 0 || entry.keyHash != keyHash || entry.expiry <= now || entry.type != type
+      || entry.inInterfaceAddress == inInterfaceAddress
+      || !DnsMessage::equalNames(entry.record, entry.nameLength, name, nameLength))
+    {
+      continue;
+    }
+    // Records close to expiry are left to their owners, whose answers refresh the cache
+    if (entry.expiry - now < std::chrono::seconds(entry.ttl) / 5)
+    {
+      continue;
+    }
+    found = true;
+    // Known answers with at least half of the TTL left need not be repeated (RFC 6762 7.1)
+    auto known = std::find_if(std::begin(m_knownAnswers), std::end(m_knownAnswers),
+      [&entry](const KnownAnswer &knownAnswer) {
+        return knownAnswer.recordHash == entry.recordHash && uint64_t(knownAnswer.ttl) * 2 >= entry.ttl;
+      });
+    if (known == std::end(m_knownAnswers) && m_answers.size() + m_additionals.size() < MAX_ANSWERS
+      && std::find(std::begin(m_answers), std::end(m_answers), &entry) == std::end(m_answers)
+      && std::find(std::begin(m_additionals), std::end(m_additionals), &entry) == std::end(m_additionals))
+    {
+      records.push_back(&entry);
+    }
+  }
+  return found;
+}
+
+uint64_t MdnsCacheStage::hashRecord(uint64_t keyHash, const uint8_t *data, std::size_t length) noexcept
+{
+  uint64_t hash = keyHash;
+  for (std::size_t i = 0; i < length; ++i)
+  {
+    hash = (hash ^ data[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+auto MdnsCacheStage::process(DatagramView &datagram) -> Verdict
+{
+  DnsMessage message(datagram.data, datagram.length);
+  if (!message.isValid() || !message.isStandard())
+  {
+    return Verdict::PASS;
+  }
+  auto now = clock_t::now();
+  if (!message.isResponse())
+  {
+    if (answer(message, datagram, now))
+    {
+      ++m_answeredQueries;
+      return Verdict::DROP;
+    }
+    ++m_forwardedQueries;
+    return Verdict::PASS;
+  }
+
+  // Only Multicast DNS responders speak for their link; the records of the authority section are not cached either
+  if (datagram.senderEndpoint.port() != MDNS_PORT || datagram.inInterfaceAddress.is_unspecified())
+  {
+    return Verdict::PASS;
+  }
+  std::size_t offset = DnsMessage::HEADER_SIZE;
+  DnsMessage::Question question;
+  for (uint16_t i = 0; i < message.getQuestionCount(); ++i)
+  {
+    if (!message.readQuestion(offset, question))
+    {
+      return Verdict::PASS;
+    }
+  }
+  const std::size_t answerCount = message.getAnswerCount();
+  const std::size_t authorityEnd = answerCount + message.getAuthorityCount();
+  const std::size_t recordCount = authorityEnd + message.getAdditionalCount();
+  DnsMessage::Record record;
+  for (std::size_t i = 0; i < recordCount && message.readRecord(offset, record); ++i)
+  {
+    if (i < answerCount || i >= authorityEnd)
+    {
+      addRecord(message, record, datagram.inInterfaceAddress, now);
+    }
+  }
+  return Verdict::PASS;
+}
+
+bool MdnsCacheStage::readKnownAnswers(const DnsMessage &message, std::size_t offset)
+{
+  m_knownAnswers.clear();
+  DnsMessage::Record record;
+  for (uint16_t i = 0; i < message.getAnswerCount(); ++i)
+  {
+    if (!message.readRecord(offset, record))
+    {
+      return false;
+    }
+    uint8_t buffer[MAX_RECORD_SIZE];
+    std::size_t nameLength = 0;
+    std::size_t dataLength = 0;
+    if (m_knownAnswers.size() < MAX_KNOWN_ANSWERS
+      && message.expandName(record.nameOffset, buffer, sizeof(buffer), nameLength)
+      && message.expandData(record, buffer + nameLength, sizeof(buffer) - nameLength, dataLength))
+    {
+      auto keyHash = hashKey(buffer, nameLength, record.type, record.klass & ~DnsMessage::CLASS_FLAG);
+      m_knownAnswers.push_back(KnownAnswer{hashRecord(keyHash, buffer + nameLength, dataLength), record.ttl});
+    }
+  }
+  return true;
+}
+
+void MdnsCacheStage::reportStatistics(const std::string &owner) const
+{
+  std::ostringstream oss;
+  oss << owner << ": " << m_answeredQueries << " queries answered from cache, " << m_forwardedQueries
+    << " forwarded; " << m_cachedRecords << " records cached, " << m_evictedRecords << " evicted early; "
+    << m_failedReplies << " replies failed";
+  syslog(LOG_INFO, "%s", oss.str().c_str());
+}
+
+std::size_t MdnsCacheStage::writeReply(const DnsMessage &message, const DatagramView &datagram,
+  std::size_t questionsEnd, clock_t::time_point now)
+{
+  // Replies to legacy queriers repeat the questions, and must not have them cache the records long (RFC 6762 6.7)
+  const bool legacy = datagram.senderEndpoint.port() != MDNS_PORT;
+  auto out = reinterpret_cast<uint8_t *>(m_reply.data());
+  std::size_t length = DnsMessage::HEADER_SIZE;
+  if (legacy)
+  {
+    // Compression pointers within the questions remain valid, as they start at the same offset
+    if (questionsEnd > m_reply.size())
+    {
+      return 0;
+    }
+    std::memcpy(out + length, datagram.data + length, questionsEnd - length);
+    length = questionsEnd;
+  }
+  // Names are written uncompressed, as cached
+  uint16_t counts[2] = { 0, 0 };
+  const std::vector<const Entry *> *sections[2] = { &m_answers, &m_additionals };
+  for (std::size_t section = 0; section < 2; ++section)
+  {
+    for (auto entry: *sections[section])
+    {
+      if (length + entry->nameLength + 10 + entry->dataLength > m_reply.size())
+      {
+        break;
+      }
+      auto ttl = static_cast<uint32_t>(std::chrono::ceil<std::chrono::seconds>(entry->expiry - now).count());
+      std::memcpy(out + length, entry->record, entry->nameLength);
+      length += entry->nameLength;
+      write16(out + length, entry->type);
+      write16(out + length + 2, static_cast<uint16_t>(entry->klass
+        | (entry->cacheFlush && !legacy ? DnsMessage::CLASS_FLAG : 0)));
+      write32(out + length + 4, legacy ? std::min<uint32_t>(ttl, 10) : ttl);
+      write16(out + length + 8, entry->dataLength);
+      length += 10;
+      std::memcpy(out + length, entry->record + entry->nameLength, entry->dataLength);
+      length += entry->dataLength;
+      ++counts[section];
+    }
+  }
+  if (counts[0] == 0)
+  {
+    return 0;
+  }
+  write16(out, legacy ? message.getId() : 0);
+  write16(out + 2, DnsMessage::FLAG_RESPONSE | DnsMessage::FLAG_AUTHORITATIVE);
+  write16(out + 4, legacy ? message.getQuestionCount() : 0);
+  write16(out + 6, counts[0]);
+  write16(out + 8, 0);
+  write16(out + 10, counts[1]);
+  return length;
+}
@@ -0,0 +1,148 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "dnsmessage.h"
+#include "pipeline.h"
+
+
+/**
+ * Stage turning the forwarder of a Multicast DNS service into a caching gateway; it is configured as
+ * "stage mdns_cache [CAPACITY];", with room for about CAPACITY records (1024 by default). The records of passing
+ * responses are kept for as long as their TTL allows. Queries that can be answered entirely from records learned on
+ * other interfaces are answered by unicast to the querier and dropped; all other datagrams pass.
+ */
+struct MdnsCacheStage final: Stage
+{
+  explicit MdnsCacheStage(const arguments_t &arguments);
+
+
+  Verdict process(DatagramView &datagram) override;
+
+  void reportStatistics(const std::string &owner) const override;
+
+
+private:
+
+  using address_t = DatagramView::address_t;
+  using clock_t = std::chrono::steady_clock;
+
+  enum: std::size_t
+  {
+    DEFAULT_CAPACITY = 1024,
+    /** At 568 bytes per entry on 64-bit hosts, the largest cache takes 37 MB */
+    MAXIMUM_CAPACITY = 1 << 16,
+    /** Room for the uncompressed name and data of a record; larger records are not cached */
+    MAX_RECORD_SIZE = 512,
+    /** Number of consecutive slots that can hold the records of one name and type */
+    PROBE_LENGTH = 16,
+    /** Largest number of known answers of a query taken into account */
+    MAX_KNOWN_ANSWERS = 64,
+    /** Largest number of records in a reply */
+    MAX_ANSWERS = 128,
+    /** Largest reply, such that it fits in an Ethernet frame */
+    MAX_REPLY_SIZE = 1472
+  };
+
+  /** Port on which queriers that are full Multicast DNS implementations send from; others get legacy replies */
+  static constexpr unsigned short MDNS_PORT = 5353;
+
+
+  /** Cached record, with its name and data uncompressed */
+  struct Entry
+  {
+    /** Hash of the name, type and class, which determines the slot */
+    uint64_t keyHash;
+    /** Hash of the whole record, to recognize it quickly */
+    uint64_t recordHash;
+    clock_t::time_point received;
+    clock_t::time_point expiry;
+    uint32_t ttl;
+    /** Interface on which the response with this record came in; queries from there are not answered with it */
+    address_t inInterfaceAddress;
+    uint16_t type;
+    /** Class without the cache flush bit, which is kept separately */
+    uint16_t klass;
+    bool cacheFlush;
+    /** Length of the name, or zero if the slot is unused */
+    uint16_t nameLength;
+    uint16_t dataLength;
+    /** Name followed by data */
+    uint8_t record[MAX_RECORD_SIZE];
+  };
+
+  struct KnownAnswer
+  {
+    uint64_t recordHash;
+    uint32_t ttl;
+  };
+
+
+  /** Stores or refreshes the given record of a response, or removes it if its TTL is zero */
+  void addRecord(const DnsMessage &message, const DnsMessage::Record &record, address_t inInterfaceAddress,
+    clock_t::time_point now);
+
+  /** Replies to the given query from the cache; returns false if it cannot answer all questions */
+  bool answer(const DnsMessage &message, const DatagramView &datagram, clock_t::time_point now);
+
+  /**
+   * Adds the fresh records of the given name and type learned on other interfaces than the given one to the given
+   * list, unless the querier knows them already; returns false if there are none at all
+   */
+  bool lookUp(const uint8_t *name, std::size_t nameLength, uint16_t type, address_t inInterfaceAddress,
+    clock_t::time_point now, std::vector<const Entry *> &records);
+
+  /** Collects the known answers of the given query, which start at the given offset; returns false if truncated */
+  bool readKnownAnswers(const DnsMessage &message, std::size_t offset);
+
+  /**
+   * Writes the reply with the collected answers and additional records; returns its length, or zero if not even one
+   * answer fits
+   */
+  std::size_t writeReply(const DnsMessage &message, const DatagramView &datagram, std::size_t questionsEnd,
+    clock_t::time_point now);
+
+  /** Hashes the given name in a case insensitive way, followed by the type and class */
+  static uint64_t hashKey(const uint8_t *name, std::size_t length, uint16_t type, uint16_t klass) noexcept;
+
+  static uint64_t hashRecord(uint64_t keyHash, const uint8_t *data, std::size_t length) noexcept;
+
+
+  /** Open addressing hash table, with a power of two slots */
+  std::vector<Entry> m_entries;
+  std::vector<KnownAnswer> m_knownAnswers;
+  std::vector<const Entry *> m_answers;
+  /** Records that the querier will likely ask for next, such as the targets of service instances */
+  std::vector<const Entry *> m_additionals;
+  std::array<char, MAX_REPLY_SIZE> m_reply;
+
+  uint64_t m_answeredQueries;
+  uint64_t m_forwardedQueries;
+  uint64_t m_cachedRecords;
+  uint64_t m_evictedRecords;
+  uint64_t m_failedReplies;
+};
@@ -0,0 +1,183 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "mdnscoalescer.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+
+MdnsCoalescer::MdnsCoalescer(std::size_t maxSize):
+  m_maxSize(std::min<std::size_t>(maxSize, MAX_MESSAGE_SIZE)),
+  m_message(m_maxSize),
+  m_additionals(m_maxSize),
+  m_answerWriter(m_message.data(), m_maxSize),
+  m_additionalWriter(m_additionals.data(), m_maxSize),
+  m_length(DnsMessage::HEADER_SIZE),
+  m_first(m_maxSize),
+  m_firstLength(),
+  m_responses(),
+  m_recordHashes(),
+  m_keep(),
+  m_record(MAX_MESSAGE_SIZE),
+  m_duplicateRecords(),
+  m_mergedResponses(),
+  m_messages()
+{
+  assert(m_maxSize >= DnsMessage::HEADER_SIZE);
+  // All memory is claimed up front, as responses are merged while forwarding
+  m_recordHashes.reserve(MAX_RECORDS);
+  m_keep.reserve(MAX_RECORDS);
+}
+
+auto MdnsCoalescer::add(const char *data, std::size_t length) noexcept -> Result
+{
+  // Multicast responses carry neither questions nor authority records (RFC 6762 6)
+  DnsMessage message(data, length);
+  if (length > m_maxSize || !message.isValid() || !message.isStandard() || !message.isResponse()
+    || message.isTruncated() || message.getId() != 0 || message.getQuestionCount() != 0
+    || message.getAuthorityCount() != 0)
+  {
+    return Result::UNMERGEABLE;
+  }
+
+  // Measure the records that are not pending yet, including those earlier in the same response
+  const std::size_t answerCount = message.getAnswerCount();
+  const std::size_t recordCount = answerCount + message.getAdditionalCount();
+  const auto pendingRecords = m_recordHashes.size();
+  if (recordCount > MAX_RECORDS)
+  {
+    return Result::UNMERGEABLE;
+  }
+  auto rollBack = [this, pendingRecords](Result result) {
+    m_recordHashes.resize(pendingRecords);
+    return m_responses == 0 ? Result::UNMERGEABLE : result;
+  };
+  if (pendingRecords + recordCount > MAX_RECORDS)
+  {
+    return rollBack(Result::FULL);
+  }
+  m_keep.clear();
+  std::size_t addedLength = 0;
+  std::size_t offset = DnsMessage::HEADER_SIZE;
+  DnsMessage::Record record;
+  for (std::size_t i = 0; i < recordCount; ++i)
+  {
+    std::size_t nameLength = 0;
+    std::size_t dataLength = 0;
+    if (!message.readRecord(offset, record)
+      || !message.expandName(record.nameOffset, m_record.data(), m_record.size() - 10, nameLength)
+      || !message.expandData(record, m_record.data() + nameLength + 10, m_record.size() - nameLength - 10,
+        dataLength))
+    {
+      return rollBack(Result::UNMERGEABLE);
+    }
+    auto fields = m_record.data() + nameLength;
+    const uint16_t values[] = { record.type, record.klass, static_cast<uint16_t>(record.ttl >> 16),
+      static_cast<uint16_t>(record.ttl), static_cast<uint16_t>(dataLength) };
+    for (auto value: values)
+    {
+      *fields++ = static_cast<uint8_t>(value >> 8);
+      *fields++ = static_cast<uint8_t>(value);
+    }
+    auto hash = hashRecord(m_record.data(), nameLength + 10 + dataLength);
+    bool keep = std::find(std::begin(m_recordHashes), std::end(m_recordHashes), hash) == std::end(m_recordHashes);
+    m_keep.push_back(keep);
+    if (keep)
+    {
+      m_recordHashes.push_back(hash);
+      addedLength += nameLength + 10 + dataLength;
+    }
+  }
+  if (m_length + addedLength > m_maxSize)
+  {
+    return rollBack(Result::FULL);
+  }
+
+  // Copy the records that are new
+  offset = DnsMessage::HEADER_SIZE;
+  for (std::size_t i = 0; i < recordCount; ++i)
+  {
+    message.readRecord(offset, record);
+    if (!m_keep[i])
+    {
+      ++m_duplicateRecords;
+      continue;
+    }
+    bool added = i < answerCount
+      ? m_answerWriter.addRecord(DnsMessageWriter::ANSWER, message, record, record.ttl)
+      : m_additionalWriter.addRecord(DnsMessageWriter::ADDITIONAL, message, record, record.ttl);
+    assert(added);
+    (void)added;
+  }
+  if (m_responses == 0)
+  {
+    std::memcpy(m_first.data(), data, length);
+    m_firstLength = length;
+  }
+  m_length += addedLength;
+  ++m_responses;
+  ++m_mergedResponses;
+  return Result::MERGED;
+}
+
+uint64_t MdnsCoalescer::hashRecord(const uint8_t *record, std::size_t length) noexcept
+{
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (std::size_t i = 0; i < length; ++i)
+  {
+    hash = (hash ^ record[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+std::size_t MdnsCoalescer::take(const char *&data) noexcept
+{
+  if (m_responses == 0)
+  {
+    return 0;
+  }
+  std::size_t length = m_firstLength;
+  data = m_first.data();
+  if (m_responses > 1)
+  {
+    // Append the additional records to the answers, with the flags of the first response
+    DnsMessage first(m_first.data(), m_firstLength);
+    length = m_answerWriter.finish(0, first.getFlags());
+    auto additionalsLength = m_additionalWriter.finish(0, 0) - DnsMessage::HEADER_SIZE;
+    assert(length + additionalsLength == m_length);
+    std::memcpy(m_message.data() + length, m_additionals.data() + DnsMessage::HEADER_SIZE, additionalsLength);
+    length += additionalsLength;
+    auto additionalCount = m_additionalWriter.getRecordCount();
+    m_message[10] = static_cast<char>(additionalCount >> 8);
+    m_message[11] = static_cast<char>(additionalCount);
+    data = m_message.data();
+  }
+  m_answerWriter = DnsMessageWriter(m_message.data(), m_maxSize);
+  m_additionalWriter = DnsMessageWriter(m_additionals.data(), m_maxSize);
+  m_length = DnsMessage::HEADER_SIZE;
+  m_responses = 0;
+  m_recordHashes.clear();
+  ++m_messages;
+  return length;
+}
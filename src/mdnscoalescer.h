@@ -0,0 +1,137 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "dnsmessage.h"
+
+
+/**
+ * Merges Multicast DNS responses bound for one interface into as few messages as fit in the given size, leaving out
+ * records identical to ones already pending; the records of a response are kept together. Names are written
+ * uncompressed, so a single pending response is passed on as it came in.
+ */
+struct MdnsCoalescer
+{
+  enum class Result
+  {
+    /** The records of the response are now pending */
+    MERGED,
+    /** The response does not fit with those pending, which must be taken first */
+    FULL,
+    /** The datagram is not a response that can be merged, so it must be sent as it is */
+    UNMERGEABLE
+  };
+
+
+  /** Merges responses into messages of up to the given size, which must be at least DnsMessage::HEADER_SIZE */
+  explicit MdnsCoalescer(std::size_t maxSize);
+
+  MdnsCoalescer(const MdnsCoalescer &) = delete;
+  MdnsCoalescer &operator =(const MdnsCoalescer &) = delete;
+
+
+  Result add(const char *data, std::size_t length) noexcept;
+
+  bool empty() const noexcept;
+
+  /** Gets the number of records left out as identical to pending ones */
+  uint64_t getDuplicateRecords() const noexcept;
+
+  /** Gets the number of responses merged */
+  uint64_t getMergedResponses() const noexcept;
+
+  /** Gets the number of messages taken */
+  uint64_t getMessages() const noexcept;
+
+  /**
+   * Takes the message with all pending records, leaving none pending; returns its length, or zero if none are pending.
+   * The message remains valid until the next response is added.
+   */
+  std::size_t take(const char *&data) noexcept;
+
+
+private:
+
+  enum: std::size_t
+  {
+    /** Largest Multicast DNS message (RFC 6762 17) */
+    MAX_MESSAGE_SIZE = 9000,
+    /** Largest number of pending records, which is plenty for the largest message */
+    MAX_RECORDS = 1024
+  };
+
+
+  /** Hashes the given uncompressed record */
+  static uint64_t hashRecord(const uint8_t *record, std::size_t length) noexcept;
+
+
+  std::size_t m_maxSize;
+  /** Header and answers of the merged message, followed by the additional records when taken */
+  std::vector<char> m_message;
+  /** Room for a header, which is not used, followed by the additional records of the merged message */
+  std::vector<char> m_additionals;
+  DnsMessageWriter m_answerWriter;
+  DnsMessageWriter m_additionalWriter;
+  /** Length of the merged message taken so far */
+  std::size_t m_length;
+  /** First pending response, as it came in */
+  std::vector<char> m_first;
+  std::size_t m_firstLength;
+  std::size_t m_responses;
+  /** Hashes of the pending records, to leave out identical ones */
+  std::vector<uint64_t> m_recordHashes;
+  /** For each record of the response being added, whether it is not identical to one pending */
+  std::vector<bool> m_keep;
+  std::vector<uint8_t> m_record;
+
+  uint64_t m_duplicateRecords;
+  uint64_t m_mergedResponses;
+  uint64_t m_messages;
+};
+
+
+inline
+bool MdnsCoalescer::empty() const noexcept
+{
+  return m_responses == 0;
+}
+
+inline
+uint64_t MdnsCoalescer::getDuplicateRecords() const noexcept
+{
+  return m_duplicateRecords;
+}
+
+inline
+uint64_t MdnsCoalescer::getMergedResponses() const noexcept
+{
+  return m_mergedResponses;
+}
+
+inline
+uint64_t MdnsCoalescer::getMessages() const noexcept
+{
+  return m_messages;
+}
@@ -0,0 +1,263 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "mdnsfilterstage.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#include <syslog.h>
+
+
+namespace
+{
+  uint8_t toLower(uint8_t c) noexcept
+  {
+    return c >= 'A' && c <= 'Z' ? static_cast<uint8_t>(c - 'A' + 'a') : c;
+  }
+}
+
+
+MdnsFilterStage::MdnsFilterStage(const arguments_t &arguments):
+  m_serviceTypes(),
+  m_entries(),
+  m_targets(),
+  m_message(),
+  m_strippedMessages(),
+  m_strippedRecords(),
+  m_unstrippedMessages(),
+  m_oversizedMessages()
+{
+  if (arguments.empty())
+  {
+    throw std::invalid_argument("expected service types such as \"_ipp._tcp\"");
+  }
+  for (auto argument: arguments)
+  {
+    // For example "_ipp._tcp", which becomes "\4_ipp\4_tcp"; a trailing dot is optional
+    auto name = argument;
+    if (!name.empty() && name.back() == '.')
+    {
+      name.remove_suffix(1);
+    }
+    std::string serviceType;
+    bool valid = !name.empty();
+    while (valid && !name.empty())
+    {
+      auto dot = name.find('.');
+      auto label = name.substr(0, dot);
+      valid = !label.empty() && label.size() <= 63;
+      serviceType += static_cast<char>(label.size());
+      std::transform(std::begin(label), std::end(label), std::back_inserter(serviceType), [](char c) {
+        return static_cast<char>(toLower(static_cast<uint8_t>(c)));
+      });
+      name = dot != std::string_view::npos ? name.substr(dot + 1) : std::string_view();
+      valid = valid && (dot == std::string_view::npos || !name.empty());
+    }
+    if (!valid || serviceType.size() >= DnsMessage::MAX_NAME_LENGTH)
+    {
+      std::ostringstream oss;
+      oss << "expected service types such as \"_ipp._tcp\" instead of \"" << argument << "\"";
+      throw std::invalid_argument(oss.str());
+    }
+    m_serviceTypes.push_back(std::move(serviceType));
+  }
+  // All memory is claimed up front, as stages must not allocate while forwarding
+  m_entries.reserve(MAX_ENTRIES);
+  m_targets.reserve(MAX_ENTRIES);
+}
+
+uint64_t MdnsFilterStage::hashName(const uint8_t *name, std::size_t length) noexcept
+{
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (std::size_t i = 0; i < length; ++i)
+  {
+    hash = (hash ^ toLower(name[i])) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+bool MdnsFilterStage::isRelevant(const uint8_t *name, std::size_t length) const noexcept
+{
+  // Look for the labels of a service type, followed by at least one more label for the domain
+  for (std::size_t i = 0; i < length && name[i] != 0; i += 1 + name[i])
+  {
+    for (auto &serviceType: m_serviceTypes)
+    {
+      if (i + serviceType.size() + 1 >= length || name[i + serviceType.size()] == 0)
+      {
+        continue;
+      }
+      std::size_t j = 0;
+      while (j < serviceType.size() && toLower(name[i + j]) == static_cast<uint8_t>(serviceType[j]))
+      {
+        ++j;
+      }
+      if (j == serviceType.size())
+      {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool MdnsFilterStage::isRelevantName(const DnsMessage &message, std::size_t offset) const noexcept
+{
+  uint8_t name[DnsMessage::MAX_NAME_LENGTH];
+  std::size_t length = 0;
+  return message.expandName(offset, name, sizeof(name), length) && isRelevant(name, length);
+}
+
+auto MdnsFilterStage::process(DatagramView &datagram) -> Verdict
+{
+  DnsMessage message(datagram.data, datagram.length);
+  if (!message.isValid() || !select(message))
+  {
+    return Verdict::DROP;
+  }
+
+  // Queries are about their questions; the known answers only matter along with those
+  const bool response = message.isResponse();
+  auto isRelevantEntry = [response](const Entry &entry) {
+    return entry.relevant && (response || entry.question);
+  };
+  if (std::none_of(std::begin(m_entries), std::end(m_entries), isRelevantEntry))
+  {
+    return Verdict::DROP;
+  }
+  auto relevant = static_cast<std::size_t>(std::count_if(std::begin(m_entries), std::end(m_entries),
+    [](const Entry &entry) { return entry.relevant; }));
+  if (relevant == m_entries.size())
+  {
+    return Verdict::PASS;
+  }
+  // With its names uncompressed, the stripped message may be longer than the original, and no longer fit the path
+  auto length = strip(message, datagram.length);
+  if (length == 0)
+  {
+    ++m_unstrippedMessages;
+    return Verdict::PASS;
+  }
+  ++m_strippedMessages;
+  m_strippedRecords += m_entries.size() - relevant;
+  datagram.data = m_message.data();
+  datagram.length = length;
+  return Verdict::PASS;
+}
+
+void MdnsFilterStage::reportStatistics(const std::string &owner) const
+{
+  std::ostringstream oss;
+  oss << owner << ": " << m_strippedRecords << " questions and records stripped from " << m_strippedMessages
+    << " messages; " << m_unstrippedMessages << " messages forwarded whole as stripping would not shorten them, "
+    << m_oversizedMessages << " dropped for having more than " << MAX_ENTRIES << " questions and records";
+  syslog(LOG_INFO, "%s", oss.str().c_str());
+}
+
+bool MdnsFilterStage::select(const DnsMessage &message)
+{
+  m_entries.clear();
+  m_targets.clear();
+  const std::size_t questionCount = message.getQuestionCount();
+  const std::size_t answerEnd = questionCount + message.getAnswerCount();
+  const std::size_t authorityEnd = answerEnd + message.getAuthorityCount();
+  const std::size_t count = authorityEnd + message.getAdditionalCount();
+  if (count > MAX_ENTRIES)
+  {
+    ++m_oversizedMessages;
+    return false;
+  }
+
+  std::size_t offset = DnsMessage::HEADER_SIZE;
+  for (std::size_t i = 0; i < count; ++i)
+  {
+    Entry entry{DnsMessage::Record(), i < questionCount, DnsMessageWriter::ANSWER, false};
+    if (entry.question)
+    {
+      DnsMessage::Question question;
+      if (!message.readQuestion(offset, question))
+      {
+        return false;
+      }
+      entry.record.nameOffset = question.nameOffset;
+      entry.record.type = question.type;
+      entry.record.klass = question.klass;
+      entry.relevant = isRelevantName(message, question.nameOffset);
+    }
+    else
+    {
+      if (!message.readRecord(offset, entry.record))
+      {
+        return false;
+      }
+      entry.section = i < answerEnd ? DnsMessageWriter::ANSWER
+        : i < authorityEnd ? DnsMessageWriter::AUTHORITY : DnsMessageWriter::ADDITIONAL;
+      entry.relevant = isRelevantName(message, entry.record.nameOffset)
+        || (entry.record.type == DnsMessage::TYPE_PTR && isRelevantName(message, entry.record.dataOffset));
+      uint8_t target[DnsMessage::MAX_NAME_LENGTH];
+      std::size_t targetLength = 0;
+      if (entry.relevant && entry.record.type == DnsMessage::TYPE_SRV && entry.record.dataLength > 6
+        && message.expandName(entry.record.dataOffset + 6, target, sizeof(target), targetLength))
+      {
+        m_targets.push_back(hashName(target, targetLength));
+      }
+    }
+    m_entries.push_back(entry);
+  }
+
+  // Keep the addresses of the hosts that relevant services point to
+  for (auto &entry: m_entries)
+  {
+    uint8_t name[DnsMessage::MAX_NAME_LENGTH];
+    std::size_t nameLength = 0;
+    if (!entry.question && !entry.relevant && (entry.record.type == DnsMessage::TYPE_A
+      || entry.record.type == DnsMessage::TYPE_AAAA || entry.record.type == DnsMessage::TYPE_NSEC)
+      && message.expandName(entry.record.nameOffset, name, sizeof(name), nameLength))
+    {
+      entry.relevant = std::find(std::begin(m_targets), std::end(m_targets), hashName(name, nameLength))
+        != std::end(m_targets);
+    }
+  }
+  return true;
+}
+
+std::size_t MdnsFilterStage::strip(const DnsMessage &message, std::size_t length)
+{
+  // Anything shorter than the original fits wherever the original did
+  DnsMessageWriter writer(m_message.data(), std::min(length - 1, m_message.size()));
+  for (auto &entry: m_entries)
+  {
+    if (!entry.relevant)
+    {
+      continue;
+    }
+    DnsMessage::Question question{entry.record.nameOffset, entry.record.type, entry.record.klass};
+    if (entry.question ? !writer.addQuestion(message, question)
+      : !writer.addRecord(entry.section, message, entry.record, entry.record.ttl))
+    {
+      return 0;
+    }
+  }
+  return writer.finish(message.getId(), message.getFlags());
+}
@@ -0,0 +1,104 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "dnsmessage.h"
+#include "pipeline.h"
+
+
+/**
+ * Stage passing only the parts of Multicast DNS messages that concern the given service types; it is configured as
+ * "stage mdns_filter SERVICE_TYPE...;", e.g. "stage mdns_filter "_airplay._tcp" "_ipp._tcp";". Questions and records
+ * are relevant when their name is that of a service type, of an instance or of a subtype of one, or when they point
+ * to such a name; so are the address records of the targets of relevant services. Messages without anything relevant
+ * are dropped, and irrelevant records are stripped from the others; messages that cannot be walked are dropped. As the
+ * stripped names are written uncompressed, messages that would not become shorter are forwarded whole instead.
+ */
+struct MdnsFilterStage final: Stage
+{
+  explicit MdnsFilterStage(const arguments_t &arguments);
+
+
+  Verdict process(DatagramView &datagram) override;
+
+  void reportStatistics(const std::string &owner) const override;
+
+
+private:
+
+  enum: std::size_t
+  {
+    /** Largest Multicast DNS message (RFC 6762 17) */
+    MAX_MESSAGE_SIZE = 9000,
+    /** Largest number of questions and records in a message, which is plenty for the largest message */
+    MAX_ENTRIES = 1024
+  };
+
+
+  /** Question or record; questions only use the name, type and class */
+  struct Entry
+  {
+    DnsMessage::Record record;
+    bool question;
+    DnsMessageWriter::Section section;
+    bool relevant;
+  };
+
+
+  /** Hashes the given uncompressed name, ignoring case */
+  static uint64_t hashName(const uint8_t *name, std::size_t length) noexcept;
+
+  /** Whether the given uncompressed name is that of one of the service types, or lies below one */
+  bool isRelevant(const uint8_t *name, std::size_t length) const noexcept;
+
+  /** Whether the name at the given offset is relevant; false if it cannot be expanded */
+  bool isRelevantName(const DnsMessage &message, std::size_t offset) const noexcept;
+
+  /** Reads all questions and records of the given message, and tells which are relevant; false if malformed */
+  bool select(const DnsMessage &message);
+
+  /**
+   * Writes the relevant entries; returns the length of the result, or zero if it would not be shorter than the given
+   * length of the original message
+   */
+  std::size_t strip(const DnsMessage &message, std::size_t length);
+
+
+  /** Service types as sequences of labels in wire format, in lower case */
+  std::vector<std::string> m_serviceTypes;
+  std::vector<Entry> m_entries;
+  /** Hashes of the targets of the relevant services in the message being filtered */
+  std::vector<uint64_t> m_targets;
+  std::array<char, MAX_MESSAGE_SIZE> m_message;
+
+  uint64_t m_strippedMessages;
+  uint64_t m_strippedRecords;
+  /** Number of messages forwarded whole, as they would not have become shorter */
+  uint64_t m_unstrippedMessages;
+  /** Number of messages dropped for having more than MAX_ENTRIES questions and records */
+  uint64_t m_oversizedMessages;
+};
@@ -0,0 +1,294 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "mdnssuppressstage.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#include <syslog.h>
+
+
+MdnsSuppressStage::MdnsSuppressStage(const arguments_t &arguments):
+  m_window(),
+  m_entries(),
+  m_questions(),
+  m_knownAnswers(),
+  m_knownAnswersComplete(),
+  m_readData(),
+  m_readLength(),
+  m_query(),
+  m_buffer(),
+  m_forwardedQueries(),
+  m_suppressedQueries(),
+  m_evictedQuestions()
+{
+  if (arguments.size() > 2)
+  {
+    throw std::invalid_argument("expected at most a window in milliseconds and a capacity");
+  }
+  auto window = arguments.empty() ? DEFAULT_WINDOW : parsePositive(arguments[0], MAXIMUM_WINDOW);
+  m_window = std::chrono::duration_cast<clock_t::duration>(std::chrono::milliseconds(window));
+  auto capacity = arguments.size() < 2 ? std::size_t(DEFAULT_CAPACITY) : parsePositive(arguments[1], MAXIMUM_CAPACITY);
+  std::size_t slots = PROBE_LENGTH;
+  while (slots < capacity)
+  {
+    slots *= 2;
+  }
+  // All memory is claimed up front, as stages must not allocate while forwarding
+  m_entries.resize(slots);
+  m_questions.reserve(MAX_QUESTIONS);
+  m_knownAnswers.reserve(MAX_KNOWN_ANSWERS);
+}
+
+uint64_t MdnsSuppressStage::hashInterface(address_t interfaceAddress) noexcept
+{
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (auto byte: interfaceAddress.to_bytes())
+  {
+    hash = (hash ^ byte) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+uint64_t MdnsSuppressStage::hashKey(const uint8_t *name, std::size_t length, uint16_t type, uint16_t klass) noexcept
+{
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  auto add = [&hash](uint8_t c) {
+    hash = (hash ^ c) * 0x100000001b3ULL;
+  };
+  for (std::size_t i = 0; i < length; ++i)
+  {
+    add(name[i] >= 'A' && name[i] <= 'Z' ? static_cast<uint8_t>(name[i] - 'A' + 'a') : name[i]);
+  }
+  add(static_cast<uint8_t>(type >> 8));
+  add(static_cast<uint8_t>(type));
+  add(static_cast<uint8_t>(klass >> 8));
+  add(static_cast<uint8_t>(klass));
+  return hash;
+}
+
+uint64_t MdnsSuppressStage::hashRecord(uint64_t keyHash, const uint8_t *data, std::size_t length) noexcept
+{
+  uint64_t hash = keyHash;
+  for (std::size_t i = 0; i < length; ++i)
+  {
+    hash = (hash ^ data[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+bool MdnsSuppressStage::hasEgress() const noexcept
+{
+  return true;
+}
+
+bool MdnsSuppressStage::isDuplicate(address_t interfaceAddress, clock_t::time_point now) const noexcept
+{
+  const auto interfaceHash = hashInterface(interfaceAddress);
+  for (auto question: m_questions)
+  {
+    const auto keyHash = interfaceHash ^ question;
+    const Entry *found = nullptr;
+    for (std::size_t i = 0; i < PROBE_LENGTH && found == nullptr; ++i)
+    {
+      auto &entry = m_entries[(keyHash + i) & (m_entries.size() - 1)];
+      if (entry.keyHash == keyHash && entry.expiry > now)
+      {
+        found = &entry;
+      }
+    }
+    // Responders left out the records that the earlier queries knew, so this querier must know them too
+    if (found == nullptr || found->incomplete)
+    {
+      return false;
+    }
+    for (std::size_t i = 0; i < found->knownAnswerCount; ++i)
+    {
+      if (std::find(std::begin(m_knownAnswers), std::end(m_knownAnswers), found->knownAnswers[i])
+        == std::end(m_knownAnswers))
+      {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+auto MdnsSuppressStage::process(DatagramView &datagram) -> Verdict
+{
+  m_query = readQuery(datagram);
+  m_readData = datagram.data;
+  m_readLength = datagram.length;
+  if (m_query && !datagram.inInterfaceAddress.is_unspecified())
+  {
+    // Whoever else asks the same on the interface on which this query came in, is answered along
+    remember(datagram.inInterfaceAddress, clock_t::now());
+  }
+  return Verdict::PASS;
+}
+
+auto MdnsSuppressStage::processEgress(const DatagramView &datagram, address_t outInterfaceAddress) -> Verdict
+{
+  // Stages of the rule may have rewritten the datagram
+  if (datagram.data != m_readData || datagram.length != m_readLength)
+  {
+    m_query = readQuery(datagram);
+    m_readData = datagram.data;
+    m_readLength = datagram.length;
+  }
+  if (!m_query || outInterfaceAddress.is_unspecified())
+  {
+    return Verdict::PASS;
+  }
+  auto now = clock_t::now();
+  if (isDuplicate(outInterfaceAddress, now))
+  {
+    ++m_suppressedQueries;
+    return Verdict::DROP;
+  }
+  remember(outInterfaceAddress, now);
+  ++m_forwardedQueries;
+  return Verdict::PASS;
+}
+
+bool MdnsSuppressStage::readQuery(const DatagramView &datagram)
+{
+  m_questions.clear();
+  m_knownAnswers.clear();
+  m_knownAnswersComplete = true;
+
+  // Legacy queriers and those asking for unicast responses do not see the multicast responses to others
+  DnsMessage message(datagram.data, datagram.length);
+  if (datagram.senderEndpoint.port() != MDNS_PORT || !message.isValid() || !message.isStandard()
+    || message.isResponse() || message.isTruncated() || message.getQuestionCount() == 0
+    || message.getQuestionCount() > MAX_QUESTIONS)
+  {
+    return false;
+  }
+  std::size_t offset = DnsMessage::HEADER_SIZE;
+  DnsMessage::Question question;
+  for (uint16_t i = 0; i < message.getQuestionCount(); ++i)
+  {
+    std::size_t nameLength = 0;
+    if (!message.readQuestion(offset, question) || (question.klass & DnsMessage::CLASS_FLAG) != 0
+      || !message.expandName(question.nameOffset, m_buffer.data(), m_buffer.size(), nameLength))
+    {
+      return false;
+    }
+    m_questions.push_back(hashKey(m_buffer.data(), nameLength, question.type, question.klass));
+  }
+
+  // Known answers are compared uncompressed, as queries may compress their names differently
+  DnsMessage::Record record;
+  for (uint16_t i = 0; i < message.getAnswerCount(); ++i)
+  {
+    if (!message.readRecord(offset, record))
+    {
+      return false;
+    }
+    std::size_t nameLength = 0;
+    std::size_t dataLength = 0;
+    if (m_knownAnswers.size() == MAX_KNOWN_ANSWERS
+      || !message.expandName(record.nameOffset, m_buffer.data(), m_buffer.size(), nameLength)
+      || !message.expandData(record, m_buffer.data() + nameLength, m_buffer.size() - nameLength, dataLength))
+    {
+      m_knownAnswersComplete = false;
+      continue;
+    }
+    auto keyHash = hashKey(m_buffer.data(), nameLength, record.type, record.klass & ~DnsMessage::CLASS_FLAG);
+    m_knownAnswers.push_back(hashRecord(keyHash, m_buffer.data() + nameLength, dataLength));
+  }
+  return true;
+}
+
+void MdnsSuppressStage::remember(address_t interfaceAddress, clock_t::time_point now)
+{
+  const auto interfaceHash = hashInterface(interfaceAddress);
+  const bool storable = m_knownAnswersComplete && m_knownAnswers.size() <= MAX_REMEMBERED_ANSWERS;
+  for (auto question: m_questions)
+  {
+    const auto keyHash = interfaceHash ^ question;
+    Entry *existing = nullptr;
+    Entry *vacant = nullptr;
+    Entry *oldest = nullptr;
+    for (std::size_t i = 0; i < PROBE_LENGTH && existing == nullptr; ++i)
+    {
+      auto &entry = m_entries[(keyHash + i) & (m_entries.size() - 1)];
+      if (entry.expiry <= now)
+      {
+        vacant = vacant != nullptr ? vacant : &entry;
+      }
+      else if (entry.keyHash == keyHash)
+      {
+        existing = &entry;
+      }
+      if (oldest == nullptr || entry.expiry < oldest->expiry)
+      {
+        oldest = &entry;
+      }
+    }
+
+    auto entry = existing;
+    if (entry == nullptr)
+    {
+      if (vacant == nullptr)
+      {
+        ++m_evictedQuestions;
+      }
+      entry = vacant != nullptr ? vacant : oldest;
+      entry->keyHash = keyHash;
+      entry->incomplete = true;
+    }
+    /* Responders only left out what all queries in the window knew, so the known answers are intersected. Where that
+     * is not possible, a superset is kept instead, as that only suppresses fewer queries. */
+    if (entry->incomplete)
+    {
+      if (storable)
+      {
+        entry->incomplete = false;
+        entry->knownAnswerCount = static_cast<uint8_t>(m_knownAnswers.size());
+        std::copy(std::begin(m_knownAnswers), std::end(m_knownAnswers), std::begin(entry->knownAnswers));
+      }
+    }
+    else if (m_knownAnswersComplete)
+    {
+      auto end = std::remove_if(std::begin(entry->knownAnswers), std::begin(entry->knownAnswers)
+        + entry->knownAnswerCount, [this](uint64_t knownAnswer) {
+          return std::find(std::begin(m_knownAnswers), std::end(m_knownAnswers), knownAnswer)
+            == std::end(m_knownAnswers);
+        });
+      entry->knownAnswerCount = static_cast<uint8_t>(end - std::begin(entry->knownAnswers));
+    }
+    entry->expiry = now + m_window;
+  }
+}
+
+void MdnsSuppressStage::reportStatistics(const std::string &owner) const
+{
+  std::ostringstream oss;
+  oss << owner << ": " << m_forwardedQueries << " queries forwarded to an interface, " << m_suppressedQueries
+    << " suppressed as duplicates there; " << m_evictedQuestions << " questions evicted early";
+  syslog(LOG_INFO, "%s", oss.str().c_str());
+}
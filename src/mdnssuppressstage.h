@@ -0,0 +1,135 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "dnsmessage.h"
+#include "pipeline.h"
+
+
+/**
+ * Stage suppressing duplicate Multicast DNS queries for each interface (RFC 6762 7.3); it is configured as
+ * "stage mdns_suppress [WINDOW [CAPACITY]];" for a service, with a window of WINDOW milliseconds (1000 by default) and
+ * room for about CAPACITY questions (1024 by default). Questions are remembered for each interface on which they were
+ * asked, or to which they were forwarded, together with the known answers of those queries, intersected when asked
+ * again. A query is not forwarded to an interface on which all of its questions were asked during the window with at
+ * most the known answers of the query itself, as responders have answered them there already. Queries asking for
+ * unicast responses, from legacy queriers or truncated are neither remembered nor suppressed.
+ */
+struct MdnsSuppressStage final: Stage
+{
+  explicit MdnsSuppressStage(const arguments_t &arguments);
+
+
+  bool hasEgress() const noexcept override;
+
+  Verdict process(DatagramView &datagram) override;
+
+  Verdict processEgress(const DatagramView &datagram, address_t outInterfaceAddress) override;
+
+  void reportStatistics(const std::string &owner) const override;
+
+
+private:
+
+  using clock_t = std::chrono::steady_clock;
+
+  enum: std::size_t
+  {
+    DEFAULT_CAPACITY = 1024,
+    MAXIMUM_CAPACITY = 1 << 20,
+    /** Number of consecutive slots that can hold a question */
+    PROBE_LENGTH = 16,
+    /** Largest number of known answers remembered for a question; questions with more are never suppressed */
+    MAX_REMEMBERED_ANSWERS = 16,
+    /** Largest number of known answers of a query taken into account */
+    MAX_KNOWN_ANSWERS = 64,
+    /** Largest number of questions of a query to suppress */
+    MAX_QUESTIONS = 64,
+    /** Largest Multicast DNS message (RFC 6762 17) */
+    MAX_MESSAGE_SIZE = 9000
+  };
+
+  /** Default suppression window in milliseconds, and the largest one accepted */
+  static constexpr unsigned long DEFAULT_WINDOW = 1000;
+  static constexpr unsigned long MAXIMUM_WINDOW = 3600000;
+
+  /** Port on which queriers that are full Multicast DNS implementations send from */
+  static constexpr unsigned short MDNS_PORT = 5353;
+
+
+  /** Question asked on, or forwarded to, an interface; identified by its hash alone */
+  struct Entry
+  {
+    /** Hash of the interface address, and of the name, type and class of the question */
+    uint64_t keyHash;
+    /** End of the window; the slot is unused once passed */
+    clock_t::time_point expiry;
+    /** Whether the known answers did not all fit, such that the question cannot be suppressed */
+    bool incomplete;
+    uint8_t knownAnswerCount;
+    /** Hashes of the records that all queries with this question in the window knew */
+    std::array<uint64_t, MAX_REMEMBERED_ANSWERS> knownAnswers;
+  };
+
+
+  /** Whether a query with all questions remembered for the given interface is a duplicate there */
+  bool isDuplicate(address_t interfaceAddress, clock_t::time_point now) const noexcept;
+
+  /** Reads the questions and known answers of the given query; returns false if it is not one to suppress */
+  bool readQuery(const DatagramView &datagram);
+
+  /** Remembers the questions of the query just read as asked on the given interface */
+  void remember(address_t interfaceAddress, clock_t::time_point now);
+
+  /** Hashes the given address, to be combined with the hashes of the questions asked on its interface */
+  static uint64_t hashInterface(address_t interfaceAddress) noexcept;
+
+  /** Hashes the given name in a case insensitive way, followed by the type and class */
+  static uint64_t hashKey(const uint8_t *name, std::size_t length, uint16_t type, uint16_t klass) noexcept;
+
+  static uint64_t hashRecord(uint64_t keyHash, const uint8_t *data, std::size_t length) noexcept;
+
+
+  clock_t::duration m_window;
+  /** Open addressing hash table, with a power of two slots */
+  std::vector<Entry> m_entries;
+  /** Hashes of the names, types and classes of the questions of the query just read, without the interface */
+  std::vector<uint64_t> m_questions;
+  std::vector<uint64_t> m_knownAnswers;
+  /** Whether all known answers of the query just read were taken into account */
+  bool m_knownAnswersComplete;
+  /** Datagram read last, which the forwarder asks about for each outgoing interface in turn */
+  const char *m_readData;
+  std::size_t m_readLength;
+  /** Whether the datagram read last is a query to suppress */
+  bool m_query;
+  std::array<uint8_t, MAX_MESSAGE_SIZE> m_buffer;
+
+  uint64_t m_forwardedQueries;
+  uint64_t m_suppressedQueries;
+  uint64_t m_evictedQuestions;
+};
@@ -0,0 +1,158 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "networkmatcher.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+
+namespace
+{
+  /** Never matches: no address masked with zero equals one */
+  const uint32_t PADDING_ADDRESS = 1;
+  const uint32_t PADDING_MASK = 0;
+
+
+  void matchScalar(const uint32_t *addresses, const uint32_t *masks, std::size_t count, uint32_t address,
+    uint64_t *bitmap)
+  {
+    for (std::size_t i = 0; i < count; i += 64)
+    {
+      uint64_t bits = 0;
+      for (std::size_t j = 0; j < 64 && i + j < count; ++j)
+      {
+        bits |= uint64_t((address & masks[i + j]) == addresses[i + j]) << j;
+      }
+      *bitmap++ = bits;
+    }
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+
+  __attribute__((target("sse2")))
+  void matchSse2(const uint32_t *addresses, const uint32_t *masks, std::size_t count, uint32_t address,
+    uint64_t *bitmap)
+  {
+    const __m128i broadcast = _mm_set1_epi32(static_cast<int>(address));
+    for (std::size_t i = 0; i < count; i += 64)
+    {
+      uint64_t bits = 0;
+      for (std::size_t j = 0; j < 64 && i + j < count; j += 4)
+      {
+        auto masked = _mm_and_si128(broadcast, _mm_loadu_si128(reinterpret_cast<const __m128i *>(masks + i + j)));
+        auto equal = _mm_cmpeq_epi32(masked, _mm_loadu_si128(reinterpret_cast<const __m128i *>(addresses + i + j)));
+        bits |= uint64_t(_mm_movemask_ps(_mm_castsi128_ps(equal))) << j;
+      }
+      *bitmap++ = bits;
+    }
+  }
+
+  __attribute__((target("avx2")))
+  void matchAvx2(const uint32_t *addresses, const uint32_t *masks, std::size_t count, uint32_t address,
+    uint64_t *bitmap)
+  {
+    const __m256i broadcast = _mm256_set1_epi32(static_cast<int>(address));
+    for (std::size_t i = 0; i < count; i += 64)
+    {
+      uint64_t bits = 0;
+      for (std::size_t j = 0; j < 64 && i + j < count; j += 8)
+      {
+        auto mask = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(masks + i + j));
+        auto equal = _mm256_cmpeq_epi32(_mm256_and_si256(broadcast, mask),
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(addresses + i + j)));
+        bits |= uint64_t(_mm256_movemask_ps(_mm256_castsi256_ps(equal))) << j;
+      }
+      *bitmap++ = bits;
+    }
+  }
+
+#endif
+}
+
+
+NetworkMatcher::NetworkMatcher():
+  m_addresses(),
+  m_masks(),
+  m_size(),
+  m_implementation(getBestImplementation().name),
+  m_match(getBestImplementation().match)
+{}
+
+void NetworkMatcher::add(const config::model::Network &network)
+{
+  // Replace the first padding entry, or grow by another set of lanes
+  if (m_size == m_addresses.size())
+  {
+    m_addresses.resize(m_size + LANES, PADDING_ADDRESS);
+    m_masks.resize(m_size + LANES, PADDING_MASK);
+  }
+  auto prefixLength = network.getPrefixLength();
+  m_masks[m_size] = prefixLength == 0 ? 0 : ~((uint32_t(1) << (32 - prefixLength)) - 1);
+  m_addresses[m_size] = static_cast<uint32_t>(network.getMaskedAddress().to_ulong()) & m_masks[m_size];
+  ++m_size;
+}
+
+std::vector<const char *> NetworkMatcher::getImplementations()
+{
+  std::vector<const char *> names;
+  for (auto &implementation: getSupportedImplementations())
+  {
+    names.push_back(implementation.name);
+  }
+  return names;
+}
+
+auto NetworkMatcher::getSupportedImplementations() noexcept -> const std::vector<Implementation> &
+{
+  static const std::vector<Implementation> implementations = [] {
+    std::vector<Implementation> supported;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+      supported.push_back(Implementation{"AVX2", &matchAvx2});
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+      supported.push_back(Implementation{"SSE2", &matchSse2});
+    }
+#endif
+    supported.push_back(Implementation{"scalar", &matchScalar});
+    return supported;
+  }();
+  return implementations;
+}
+
+bool NetworkMatcher::setImplementation(std::string_view name) noexcept
+{
+  for (auto &implementation: getSupportedImplementations())
+  {
+    if (name == implementation.name)
+    {
+      m_implementation = implementation.name;
+      m_match = implementation.match;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,127 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include <boost/asio/ip/address_v4.hpp>
+
+#include "config/model/network.h"
+
+
+/**
+ * Networks compiled for matching an address against all of them at once, several networks per instruction where the
+ * CPU supports AVX2 or SSE2; the implementation is picked at run time
+ */
+struct NetworkMatcher
+{
+  using address_t = boost::asio::ip::address_v4;
+
+
+  NetworkMatcher();
+
+
+  void add(const config::model::Network &network);
+
+  /** Gets the number of words in a bitmap with one bit for each network */
+  std::size_t getBitmapSize() const noexcept;
+
+  /** Gets the name of the implementation in use, the best one this CPU supports unless switched */
+  const char *getImplementation() const noexcept;
+
+  /** Gets the names of the implementations this CPU supports, from the one used by default down to the scalar one */
+  static std::vector<const char *> getImplementations();
+
+  /** Fills the given bitmap of getBitmapSize() words such that bit i is set iff network i contains the address */
+  void match(address_t address, uint64_t *bitmap) const noexcept;
+
+  /** Switches to the implementation of the given name, to compare them; returns whether this CPU supports it */
+  bool setImplementation(std::string_view name) noexcept;
+
+  std::size_t size() const noexcept;
+
+
+private:
+
+  enum
+  {
+    /** Networks are stored in multiples of the widest vector, padded with networks that never match */
+    LANES = 8
+  };
+
+  using match_function_t = void (*)(const uint32_t *addresses, const uint32_t *masks, std::size_t count,
+    uint32_t address, uint64_t *bitmap);
+
+  struct Implementation
+  {
+    const char *name;
+    match_function_t match;
+  };
+
+
+  static const Implementation &getBestImplementation() noexcept;
+
+  static const std::vector<Implementation> &getSupportedImplementations() noexcept;
+
+
+  /** Masked addresses and masks of the networks, in host byte order */
+  std::vector<uint32_t> m_addresses;
+  std::vector<uint32_t> m_masks;
+  std::size_t m_size;
+  /** Implementation in use */
+  const char *m_implementation;
+  match_function_t m_match;
+};
+
+
+inline
+auto NetworkMatcher::getBestImplementation() noexcept -> const Implementation &
+{
+  return getSupportedImplementations().front();
+}
+
+inline
+std::size_t NetworkMatcher::getBitmapSize() const noexcept
+{
+  return (m_addresses.size() + 63) / 64;
+}
+
+inline
+const char *NetworkMatcher::getImplementation() const noexcept
+{
+  return m_implementation;
+}
+
+inline
+void NetworkMatcher::match(address_t address, uint64_t *bitmap) const noexcept
+{
+  m_match(m_addresses.data(), m_masks.data(), m_addresses.size(), static_cast<uint32_t>(address.to_ulong()), bitmap);
+}
+
+inline
+std::size_t NetworkMatcher::size() const noexcept
+{
+  return m_size;
+}
@@ -0,0 +1,81 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "packetqueue.h"
+
+#include <algorithm>
+#include <cassert>
+#include <new>
+
+
+PacketQueue::PacketQueue(std::size_t capacity):
+  m_storage(std::make_unique<char[]>(capacity)),
+  m_capacity(capacity),
+  m_head(),
+  m_tail(),
+  m_end(),
+  m_wrapped(false),
+  m_size()
+{}
+
+void PacketQueue::pop() noexcept
+{
+  assert(!empty());
+  m_head += getItemSize(front().getLength());
+  if (--m_size == 0)
+  {
+    m_head = m_tail = 0;
+    m_wrapped = false;
+  }
+  else if (m_wrapped && m_head == m_end)
+  {
+    m_head = 0;
+    m_wrapped = false;
+  }
+}
+
+bool PacketQueue::push(const char *data, std::size_t length, const endpoint_t &multicastEndpoint,
+  const in_pktinfo &outInterface) noexcept
+{
+  auto itemSize = getItemSize(length);
+  if (!m_wrapped && m_capacity - m_tail < itemSize)
+  {
+    // Not enough space at the end; continue at the start if the items in front have been sent by now
+    if (m_head < itemSize)
+    {
+      return false;
+    }
+    m_end = m_tail;
+    m_tail = 0;
+    m_wrapped = true;
+  }
+  else if (m_wrapped && m_head - m_tail < itemSize)
+  {
+    return false;
+  }
+
+  // Items are suitably aligned, as the storage is aligned for any fundamental type and item sizes are rounded up
+  new (m_storage.get() + m_tail) Item(length, multicastEndpoint, outInterface);
+  std::copy_n(data, length, m_storage.get() + m_tail + sizeof(Item));
+  m_tail += itemSize;
+  ++m_size;
+  return true;
+}
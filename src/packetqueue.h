@@ -0,0 +1,176 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+
+#include <netinet/in.h>
+#include <boost/asio/ip/udp.hpp>
+
+
+/**
+ * FIFO of datagrams awaiting transmission, stored back to back in a circular buffer that is allocated up front, so
+ * that queueing never touches the heap
+ */
+struct PacketQueue
+{
+  using endpoint_t = boost::asio::ip::udp::endpoint;
+
+  struct Item;
+
+
+  explicit PacketQueue(std::size_t capacity);
+
+  PacketQueue(const PacketQueue &) = delete;
+  PacketQueue &operator =(const PacketQueue &) = delete;
+
+
+  bool empty() const noexcept;
+
+  const Item &front() const noexcept;
+
+  /** Gets the item following the given one, or nullptr when the given item is the last one */
+  const Item *next(const Item &item) const noexcept;
+
+  void pop() noexcept;
+
+  /**
+   * Appends a copy of the given datagram, along with the outgoing interface for shared sockets; returns false when
+   * there is not enough space left
+   */
+  bool push(const char *data, std::size_t length, const endpoint_t &multicastEndpoint,
+    const in_pktinfo &outInterface = in_pktinfo()) noexcept;
+
+  /** Gets the number of datagrams in the queue */
+  std::size_t size() const noexcept;
+
+
+private:
+
+  static std::size_t getItemSize(std::size_t length) noexcept;
+
+
+  std::unique_ptr<char[]> m_storage;
+  std::size_t m_capacity;
+  /** Offset of the first item */
+  std::size_t m_head;
+  /** Offset past the last item */
+  std::size_t m_tail;
+  /** When wrapped, items from m_head up to m_end precede those from the start of the storage up to m_tail */
+  std::size_t m_end;
+  bool m_wrapped;
+  std::size_t m_size;
+};
+
+
+/** Header preceding the datagram in the storage of a PacketQueue */
+struct PacketQueue::Item
+{
+  Item(std::size_t length, const endpoint_t &multicastEndpoint, const in_pktinfo &outInterface) noexcept;
+
+  Item(const Item &) = delete;
+  Item &operator =(const Item &) = delete;
+
+
+  const char *getData() const noexcept;
+  std::size_t getLength() const noexcept;
+  const endpoint_t &getMulticastEndpoint() const noexcept;
+  const in_pktinfo &getOutInterface() const noexcept;
+
+
+private:
+
+  std::size_t m_length;
+  endpoint_t m_multicastEndpoint;
+  in_pktinfo m_outInterface;
+};
+
+
+inline
+bool PacketQueue::empty() const noexcept
+{
+  return m_size == 0;
+}
+
+inline
+auto PacketQueue::front() const noexcept -> const Item &
+{
+  return *reinterpret_cast<const Item *>(m_storage.get() + m_head);
+}
+
+inline
+std::size_t PacketQueue::getItemSize(std::size_t length) noexcept
+{
+  auto size = sizeof(Item) + length;
+  return (size + alignof(Item) - 1) & ~(alignof(Item) - 1);
+}
+
+inline
+auto PacketQueue::next(const Item &item) const noexcept -> const Item *
+{
+  auto offset = static_cast<std::size_t>(reinterpret_cast<const char *>(&item) - m_storage.get())
+    + getItemSize(item.getLength());
+  if (m_wrapped && offset == m_end)
+  {
+    offset = 0;
+  }
+  return offset == m_tail ? nullptr : reinterpret_cast<const Item *>(m_storage.get() + offset);
+}
+
+inline
+std::size_t PacketQueue::size() const noexcept
+{
+  return m_size;
+}
+
+inline
+PacketQueue::Item::Item(std::size_t length, const endpoint_t &multicastEndpoint,
+  const in_pktinfo &outInterface) noexcept:
+  m_length(length),
+  m_multicastEndpoint(multicastEndpoint),
+  m_outInterface(outInterface)
+{}
+
+inline
+const char *PacketQueue::Item::getData() const noexcept
+{
+  return reinterpret_cast<const char *>(this + 1);
+}
+
+inline
+std::size_t PacketQueue::Item::getLength() const noexcept
+{
+  return m_length;
+}
+
+inline
+auto PacketQueue::Item::getMulticastEndpoint() const noexcept -> const endpoint_t &
+{
+  return m_multicastEndpoint;
+}
+
+inline
+const in_pktinfo &PacketQueue::Item::getOutInterface() const noexcept
+{
+  return m_outInterface;
+}
@@ -0,0 +1,55 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "payloadstage.h"
+
+#include <cstring>
+#include <stdexcept>
+
+
+PayloadStage::PayloadStage(const arguments_t &arguments):
+  m_patterns()
+{
+  if (arguments.empty())
+  {
+    throw std::invalid_argument("expected at least one pattern");
+  }
+  for (auto argument: arguments)
+  {
+    if (argument.empty())
+    {
+      throw std::invalid_argument("patterns cannot be empty");
+    }
+    m_patterns.emplace_back(argument);
+  }
+}
+
+auto PayloadStage::process(DatagramView &datagram) -> Verdict
+{
+  for (auto &pattern: m_patterns)
+  {
+    if (memmem(datagram.data, datagram.length, pattern.data(), pattern.size()) != nullptr)
+    {
+      return Verdict::PASS;
+    }
+  }
+  return Verdict::DROP;
+}
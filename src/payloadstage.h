@@ -19,22 +19,27 @@
  */
 
 
-#include "config/model/forwardingrule.h"
+#pragma once
 
-#include <algorithm>
-#include <iterator>
-#include <iostream>
+#include <string>
+#include <vector>
 
+#include "pipeline.h"
 
-std::ostream &operator <<(std::ostream &os, const config::model::ForwardingRule &forwardingRule)
+
+/**
+ * Stage passing only datagrams whose payload contains at least one of the given byte strings; it is configured as
+ * "stage payload_contains PATTERN...;", with patterns in quotes when they are not plain words or numbers
+ */
+struct PayloadStage final: Stage
 {
-  os << "Forward from '" << forwardingRule.getFromInterface() << "' to '" << forwardingRule.getToInterface() << "'";
-  if (!forwardingRule.getNetworks().empty())
-  {
-    os << " limited to: " ;
-    std::for_each(std::begin(forwardingRule.getNetworks()), std::end(forwardingRule.getNetworks()),
-      [&](auto &network) { os << network << ' '; });
-  }
-  os << std::endl;
-  return os;
-}
+  explicit PayloadStage(const arguments_t &arguments);
+
+
+  Verdict process(DatagramView &datagram) override;
+
+
+private:
+
+  std::vector<std::string> m_patterns;
+};
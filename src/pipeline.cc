@@ -0,0 +1,189 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "pipeline.h"
+
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+#include <syslog.h>
+
+#include "deduplicationstage.h"
+#include "loopdetectionstage.h"
+#include "mdnscachestage.h"
+#include "mdnsfilterstage.h"
+#include "mdnssuppressstage.h"
+#include "payloadstage.h"
+#include "ratelimitstage.h"
+#include "ssdpcachestage.h"
+#include "ssdpfilterstage.h"
+
+
+namespace
+{
+  template <class T>
+  std::unique_ptr<Stage> createStage(const Stage::arguments_t &arguments)
+  {
+    return std::make_unique<T>(arguments);
+  }
+
+  struct StageType
+  {
+    const char *name;
+    std::unique_ptr<Stage> (*create)(const Stage::arguments_t &arguments);
+
+    bool operator <(std::string_view other) const noexcept;
+    [[maybe_unused]] bool operator <(const StageType &other) const noexcept;
+  };
+
+  bool StageType::operator <(std::string_view other) const noexcept
+  {
+    return std::string_view(name) < other;
+  }
+
+  bool StageType::operator <(const StageType &other) const noexcept
+  {
+    return operator <(other.name);
+  }
+
+  /** All stages that the configuration can refer to, sorted by name */
+  constexpr const StageType STAGE_TYPES[] = {
+    { "deduplicate",      &createStage<DeduplicationStage> },
+    { "loop_detection",   &createStage<LoopDetectionStage> },
+    { "mdns_cache",       &createStage<MdnsCacheStage> },
+    { "mdns_filter",      &createStage<MdnsFilterStage> },
+    { "mdns_suppress",    &createStage<MdnsSuppressStage> },
+    { "payload_contains", &createStage<PayloadStage> },
+    { "rate_limit",       &createStage<RateLimitStage> },
+    { "ssdp_cache",       &createStage<SsdpCacheStage> },
+    { "ssdp_filter",      &createStage<SsdpFilterStage> }
+  };
+}
+
+
+Pipeline::Pipeline(const stages_t &stages):
+  m_steps(),
+  m_egressStages()
+{
+  assert(std::is_sorted(std::begin(STAGE_TYPES), std::end(STAGE_TYPES)));
+  m_steps.reserve(stages.size());
+  for (auto &stage: stages)
+  {
+    auto type = std::lower_bound(std::begin(STAGE_TYPES), std::end(STAGE_TYPES), stage.getName());
+    if (type == std::end(STAGE_TYPES) || type->name != stage.getName())
+    {
+      std::ostringstream oss;
+      oss << "Unknown stage: " << stage.getName();
+      throw std::runtime_error(oss.str());
+    }
+    try
+    {
+      m_steps.push_back(Step{type->name, type->create(stage.getArguments()), 0, 0, 0});
+    }
+    catch (const std::invalid_argument &e)
+    {
+      std::ostringstream oss;
+      oss << "Invalid stage '" << stage << "': " << e.what();
+      throw std::runtime_error(oss.str());
+    }
+    if (m_steps.back().stage->hasEgress())
+    {
+      m_egressStages.push_back(m_steps.back().stage.get());
+    }
+  }
+}
+
+void Pipeline::append(Pipeline &&pipeline)
+{
+  std::move(std::begin(pipeline.m_steps), std::end(pipeline.m_steps), std::back_inserter(m_steps));
+  pipeline.m_steps.clear();
+  m_egressStages.insert(std::end(m_egressStages), std::begin(pipeline.m_egressStages),
+    std::end(pipeline.m_egressStages));
+  pipeline.m_egressStages.clear();
+}
+
+void Pipeline::reportStatistics(const std::string &owner) const
+{
+  for (auto &step: m_steps)
+  {
+    std::ostringstream oss;
+    oss << owner << ": stage " << step.name << ": " << step.datagrams << " datagrams, " << step.droppedDatagrams
+      << " dropped, "
+#if defined(__x86_64__) || defined(__i386__)
+      << (step.datagrams != 0 ? step.cycles / step.datagrams : 0) << " cycles per datagram";
+#else
+      << (step.datagrams != 0 ? step.cycles / step.datagrams : 0) << " ns per datagram";
+#endif
+    syslog(LOG_INFO, "%s", oss.str().c_str());
+    step.stage->reportStatistics(owner + ": stage " + step.name);
+  }
+}
+
+bool Stage::hasEgress() const noexcept
+{
+  return false;
+}
+
+auto Stage::processEgress(const DatagramView &, address_t) -> Verdict
+{
+  return Verdict::PASS;
+}
+
+void Stage::reportStatistics(const std::string &) const
+{}
+
+unsigned long Stage::parsePositive(std::string_view argument, unsigned long maximum)
+{
+  unsigned long value = 0;
+  for (auto c: argument)
+  {
+    if (c < '0' || c > '9')
+    {
+      throw std::invalid_argument("expected a positive integer");
+    }
+    value = value * 10 + static_cast<unsigned long>(c - '0');
+    if (value > maximum)
+    {
+      std::ostringstream oss;
+      oss << "expected at most " << maximum;
+      throw std::invalid_argument(oss.str());
+    }
+  }
+  if (value == 0)
+  {
+    throw std::invalid_argument("expected a positive integer");
+  }
+  return value;
+}
+
+std::ostream &operator <<(std::ostream &os, const Pipeline &pipeline)
+{
+  const char *separator = "";
+  for (auto &step: pipeline.m_steps)
+  {
+    os << separator << step.name;
+    separator = ", ";
+  }
+  return os;
+}
@@ -0,0 +1,228 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <boost/asio/ip/udp.hpp>
+
+#include "config/model/arena.h"
+#include "config/model/stageconfiguration.h"
+
+
+struct Pipeline;
+struct Receiver;
+
+std::ostream &operator <<(std::ostream &os, const Pipeline &pipeline);
+
+
+/** Non-owning view of a received datagram, as passed along the stages of a pipeline */
+struct DatagramView
+{
+  using address_t = boost::asio::ip::address_v4;
+  using endpoint_t = boost::asio::ip::udp::endpoint;
+
+  endpoint_t senderEndpoint;
+  /** Group and port on which the datagram was received */
+  endpoint_t multicastEndpoint;
+  const char *data;
+  std::size_t length;
+  /** Address of the interface on which the datagram came in, as joined; unspecified if not known */
+  address_t inInterfaceAddress;
+  /** Receiver of the datagram, through which stages can reply to its sender */
+  Receiver *receiver;
+};
+
+
+/**
+ * Step that datagrams pass before being forwarded, once at least one rule accepted their source. A stage either drops
+ * a datagram, or passes it on; it may narrow the view, or point it to a rewritten copy that it owns. Stages of a
+ * service may also decide for each outgoing interface separately, through processEgress(). Stages run on the
+ * forwarding path, so they must not allocate memory once forwarding has started.
+ */
+struct Stage
+{
+  using address_t = DatagramView::address_t;
+  using arguments_t = config::model::StageConfiguration::arguments_t;
+
+  enum class Verdict
+  {
+    PASS,
+    DROP
+  };
+
+
+  virtual ~Stage() = default;
+
+
+  /** Whether this stage decides on the outgoing interfaces too; defaults to false */
+  virtual bool hasEgress() const noexcept;
+
+  virtual Verdict process(DatagramView &datagram) = 0;
+
+  /**
+   * Decides whether the given datagram, which passed all stages, is sent on the interface with the given address;
+   * only asked of the stages of a service that have hasEgress() hold, once for each rule about to forward it
+   */
+  virtual Verdict processEgress(const DatagramView &datagram, address_t outInterfaceAddress);
+
+  /** Logs counters specific to this stage, if any, mentioning the given owner */
+  virtual void reportStatistics(const std::string &owner) const;
+
+
+protected:
+
+  /** Parses the given argument as a positive integer up to the given maximum; throws an std::invalid_argument if not */
+  static unsigned long parsePositive(std::string_view argument, unsigned long maximum);
+};
+
+
+/**
+ * Stages that datagrams pass in order, with counters of how many datagrams each of them processed and dropped, and
+ * of the time spent in each of them
+ */
+struct Pipeline
+{
+  using stages_t = config::model::ArenaArray<config::model::StageConfiguration>;
+
+
+  Pipeline() = default;
+
+  /** Creates the given stages from the registry; throws an std::runtime_error if one is unknown or misconfigured */
+  explicit Pipeline(const stages_t &stages);
+
+  Pipeline(const Pipeline &) = delete;
+  Pipeline &operator =(const Pipeline &) = delete;
+
+  Pipeline(Pipeline &&) = default;
+  Pipeline &operator =(Pipeline &&) = default;
+
+
+  /** Appends the stages of the given pipeline to this one */
+  void append(Pipeline &&pipeline);
+
+  bool empty() const noexcept;
+
+  /** Whether any of the stages decides on the outgoing interfaces too */
+  bool hasEgress() const noexcept;
+
+  /** Passes the given datagram along all stages; returns false as soon as one of them drops it */
+  bool process(DatagramView &datagram);
+
+  /**
+   * Asks the stages deciding on outgoing interfaces whether the given datagram is sent on the interface with the given
+   * address; returns false as soon as one of them drops it
+   */
+  bool processEgress(const DatagramView &datagram, Stage::address_t outInterfaceAddress);
+
+  /** Logs the counters of all stages, mentioning the given owner of this pipeline */
+  void reportStatistics(const std::string &owner) const;
+
+
+private:
+
+  friend std::ostream &operator <<(std::ostream &os, const Pipeline &pipeline);
+
+  struct Step
+  {
+    const char *name;
+    std::unique_ptr<Stage> stage;
+    uint64_t datagrams;
+    uint64_t droppedDatagrams;
+    uint64_t cycles;
+  };
+
+
+  /** Reads the time stamp counter on x86, to measure the cost of stages in CPU cycles; nanoseconds elsewhere */
+  static uint64_t readCycleCounter() noexcept;
+
+
+  std::vector<Step> m_steps;
+  /** Stages among those of the steps that decide on the outgoing interfaces too */
+  std::vector<Stage *> m_egressStages;
+};
+
+
+inline
+bool Pipeline::empty() const noexcept
+{
+  return m_steps.empty();
+}
+
+inline
+bool Pipeline::hasEgress() const noexcept
+{
+  return !m_egressStages.empty();
+}
+
+inline
+bool Pipeline::process(DatagramView &datagram)
+{
+  for (auto &step: m_steps)
+  {
+    auto start = readCycleCounter();
+    auto verdict = step.stage->process(datagram);
+    step.cycles += readCycleCounter() - start;
+    ++step.datagrams;
+    if (verdict == Stage::Verdict::DROP)
+    {
+      ++step.droppedDatagrams;
+      return false;
+    }
+  }
+  return true;
+}
+
+inline
+bool Pipeline::processEgress(const DatagramView &datagram, Stage::address_t outInterfaceAddress)
+{
+  for (auto stage: m_egressStages)
+  {
+    if (stage->processEgress(datagram, outInterfaceAddress) == Stage::Verdict::DROP)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline
+uint64_t Pipeline::readCycleCounter() noexcept
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
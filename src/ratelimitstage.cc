@@ -0,0 +1,55 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "ratelimitstage.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+
+RateLimitStage::RateLimitStage(const arguments_t &arguments):
+  m_interval(),
+  m_tolerance(),
+  m_theoreticalArrival()
+{
+  if (arguments.empty() || arguments.size() > 2)
+  {
+    throw std::invalid_argument("expected a rate and optionally a burst size");
+  }
+  // Limited such that the interval remains at least one tick, and the tolerance cannot overflow
+  auto rate = static_cast<clock_t::rep>(parsePositive(arguments[0], MAXIMUM));
+  auto burst = arguments.size() > 1 ? static_cast<clock_t::rep>(parsePositive(arguments[1], MAXIMUM)) : rate;
+  m_interval = std::max(clock_t::duration(std::chrono::seconds(1)) / rate, clock_t::duration(1));
+  m_tolerance = m_interval * (burst - 1);
+}
+
+auto RateLimitStage::process(DatagramView &) -> Verdict
+{
+  // Generic cell rate algorithm, i.e. a token bucket that only needs to track a single point in time
+  auto now = clock_t::now();
+  auto arrival = std::max(m_theoreticalArrival, now);
+  if (arrival - now > m_tolerance)
+  {
+    return Verdict::DROP;
+  }
+  m_theoreticalArrival = arrival + m_interval;
+  return Verdict::PASS;
+}
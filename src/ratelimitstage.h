@@ -0,0 +1,55 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <chrono>
+
+#include "pipeline.h"
+
+
+/**
+ * Stage passing at most RATE datagrams per second, allowing bursts of up to BURST datagrams (RATE by default); it is
+ * configured as "stage rate_limit RATE [BURST];"
+ */
+struct RateLimitStage final: Stage
+{
+  explicit RateLimitStage(const arguments_t &arguments);
+
+
+  Verdict process(DatagramView &datagram) override;
+
+
+private:
+
+  using clock_t = std::chrono::steady_clock;
+
+  /** Largest rate and burst size accepted */
+  static constexpr unsigned long MAXIMUM = 1000000;
+
+
+  /** Time between datagrams at the configured rate */
+  clock_t::duration m_interval;
+  /** How far the theoretical arrival time can run ahead of the actual time, to allow for bursts */
+  clock_t::duration m_tolerance;
+  /** When the next datagram would be due if all passed datagrams had arrived at exactly the configured rate */
+  clock_t::time_point m_theoreticalArrival;
+};
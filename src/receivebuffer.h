@@ -0,0 +1,75 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <limits>
+
+
+/**
+ * Datagram buffer shared by all receivers running on the same event loop; as only one completion handler runs at a
+ * time, a single buffer suffices regardless of the number of multicast endpoints.
+ */
+struct ReceiveBuffer
+{
+  ReceiveBuffer() = default;
+
+  ReceiveBuffer(const ReceiveBuffer &) = delete;
+  ReceiveBuffer &operator =(const ReceiveBuffer &) = delete;
+
+
+  char *getData() noexcept;
+
+  static constexpr std::size_t getSize() noexcept;
+
+
+private:
+
+  enum
+  {
+    /** IPv4 headers take at least 20 bytes */
+    IPV4_MINIMUM_HEADER_SIZE = 20,
+
+    /** UDP headers have a fixed length of 8 bytes */
+    UDP_HEADER_SIZE = 8,
+
+    /** The maximum size of IPv4 datagrams is limited by the 16-bit length field in the IPv4 header */
+    MAX_IPV4_UDP_DATAGRAM_SIZE = std::numeric_limits<uint16_t>::max() - IPV4_MINIMUM_HEADER_SIZE - UDP_HEADER_SIZE
+  };
+
+
+  std::array<char, MAX_IPV4_UDP_DATAGRAM_SIZE> m_data;
+};
+
+
+inline
+char *ReceiveBuffer::getData() noexcept
+{
+  return m_data.data();
+}
+
+inline
+constexpr std::size_t ReceiveBuffer::getSize() noexcept
+{
+  return MAX_IPV4_UDP_DATAGRAM_SIZE;
+}
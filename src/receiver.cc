@@ -21,29 +21,127 @@
 
 #include "receiver.h"
 
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
 #include <iostream>
 
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/udp.h>
+#include <syslog.h>
 #include <boost/asio.hpp>
-#include <boost/bind.hpp>
 
+#include "allocationaudit.h"
+#include "utility.h"
 
-Receiver::Receiver(boost::asio::io_service &ioService, const endpoint_t &multicastEndpoint):
-  m_socket(ioService, boost::asio::ip::udp::v4()),
-  m_multicastEndpoint(multicastEndpoint)
+
+namespace
+{
+  /** Gets the index of the interface that has the given address, or zero if there is none */
+  int getInterfaceIndex(boost::asio::ip::address_v4 address)
+  {
+    ifaddrs *interfaceAddressList = nullptr;
+    if (getifaddrs(&interfaceAddressList) == -1)
+    {
+      throw std::runtime_error(utility::getErrorString(errno));
+    }
+    unsigned index = 0;
+    for (const ifaddrs *item = interfaceAddressList; item != nullptr && index == 0; item = item->ifa_next)
+    {
+      if (item->ifa_addr != nullptr && item->ifa_addr->sa_family == AF_INET
+        && reinterpret_cast<const sockaddr_in *>(item->ifa_addr)->sin_addr.s_addr == htonl(address.to_uint()))
+      {
+        index = if_nametoindex(item->ifa_name);
+      }
+    }
+    freeifaddrs(interfaceAddressList);
+    return static_cast<int>(index);
+  }
+}
+
+
+Receiver::Receiver(EventLoop &ioService, ReceiveBuffer &receiveBuffer,
+  const endpoint_t &multicastEndpoint):
+  m_ioService(ioService),
+  m_multicastEndpoint(multicastEndpoint),
+  m_receiveBuffer(receiveBuffer),
+  m_receiveBufferSize(),
+  m_receiveOffload(false),
+  m_shards(),
+  m_interfaces(),
+  m_interfaceIndices(),
+  m_localAddresses(),
+  m_receivedDatagrams(),
+  m_localDatagrams(),
+  m_coalescedReceives(),
+  m_coalescedDatagrams()
 {
+  addShard();
+}
+
+auto Receiver::addShard() -> Shard &
+{
+  auto &shard = m_shards.emplace_back(m_ioService);
+  auto &socket = shard.socket;
+
   // Don't get in the way of others listening on the same multicast endpoint
-  m_socket.set_option(boost::asio::ip::udp::socket::reuse_address(true));
-  m_socket.bind(boost::asio::ip::udp::endpoint(boost::asio::ip::address_v4::any(), multicastEndpoint.port()));
+  socket.set_option(boost::asio::ip::udp::socket::reuse_address(true));
+  socket.bind(boost::asio::ip::udp::endpoint(boost::asio::ip::address_v4::any(), m_multicastEndpoint.port()));
+
+  /* Only deliver datagrams for memberships of this very socket; by default, sockets bound to the wildcard address
+   * receive datagrams for groups joined by any socket on the system, so that shards would see each other's traffic. */
+  int disable = 0;
+  if (setsockopt(socket.native_handle(), IPPROTO_IP, IP_MULTICAST_ALL, &disable, sizeof(disable)) != 0)
+  {
+    throw std::runtime_error(utility::getErrorString(errno));
+  }
+
+  // Datagrams are read synchronously once the socket is readable, until the kernel has no more of them queued
+  socket.non_blocking(true);
+
+  /* Have the kernel report how many datagrams it dropped on this socket along with every datagram received, and the
+   * interface on which each came in */
+  int enable = 1;
+  if (setsockopt(socket.native_handle(), SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable)) != 0
+    || setsockopt(socket.native_handle(), IPPROTO_IP, IP_PKTINFO, &enable, sizeof(enable)) != 0)
+  {
+    throw std::runtime_error(utility::getErrorString(errno));
+  }
+
+  if (m_receiveBufferSize != 0)
+  {
+    setReceiveBufferSize(shard);
+  }
+  if (m_receiveOffload)
+  {
+    enableReceiveOffload(shard);
+  }
+  return shard;
 }
 
-void Receiver::beginReceive()
+void Receiver::beginReceive(Shard &shard)
 {
-  m_socket.async_receive_from(boost::asio::buffer(m_buffer), m_senderEndpoint,
-    boost::bind(&Receiver::endReceive, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+  // Wait for readability only; the datagram is read into the shared buffer once this receiver gets to handle it
+  shard.socket.async_receive(boost::asio::null_buffers(), makeCustomAllocHandler(shard.handlerMemory,
+    [this, &shard](const boost::system::error_code &error, std::size_t) {
+      // Only aborted when stopped, after which the receiver is not to be touched
+      if (error != boost::asio::error::operation_aborted)
+      {
+        endReceive(shard, error);
+      }
+    }));
 }
 
-void Receiver::endReceive(const boost::system::error_code &error, std::size_t length)
+void Receiver::endReceive(Shard &shard, const boost::system::error_code &error)
 {
+  AllocationAudit::Scope allocationAuditScope;
+
+  if (!shard.socket.is_open())
+  {
+    // Stopped while this handler was pending
+    return;
+  }
   if (error)
   {
     std::ostringstream msg;
@@ -51,33 +149,280 @@ void Receiver::endReceive(const boost::system::error_code &error, std::size_t le
     throw std::runtime_error(msg.str());
   }
 
-  if (length > 0)
+  unsigned datagrams = 0;
+  for (; datagrams < MAX_DATAGRAMS_PER_WAKEUP; ++datagrams)
   {
-    handlePacket(m_senderEndpoint, m_buffer.data(), length);
+    sockaddr_in source;
+    iovec buffer = { m_receiveBuffer.getData(), m_receiveBuffer.getSize() };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(shard.kernelDrops)) + CMSG_SPACE(sizeof(in_pktinfo))
+      + CMSG_SPACE(sizeof(int))];
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_name = &source;
+    message.msg_namelen = sizeof(source);
+    message.msg_iov = &buffer;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    auto length = recvmsg(shard.socket.native_handle(), &message, 0);
+    if (length < 0)
+    {
+      auto receiveError = errno;
+      if (receiveError == EAGAIN || receiveError == EWOULDBLOCK)
+      {
+        break;
+      }
+      if (receiveError == EINTR)
+      {
+        continue;
+      }
+      std::ostringstream msg;
+      msg << "receive from " << m_multicastEndpoint << " failed: " << utility::getErrorString(receiveError);
+      throw std::runtime_error(msg.str());
+    }
+
+    int interfaceIndex = 0;
+    auto segmentSize = handleControlMessages(shard, message, interfaceIndex);
+    if (length == 0)
+    {
+      ++m_receivedDatagrams;
+      continue;
+    }
+
+    // Split coalesced datagrams at their original boundaries; only the last segment can be shorter
+    endpoint_t senderEndpoint(address_t(ntohl(source.sin_addr.s_addr)), ntohs(source.sin_port));
+    auto remaining = static_cast<std::size_t>(length);
+    if (segmentSize != 0 && segmentSize < remaining)
+    {
+      auto segments = (remaining + segmentSize - 1) / segmentSize;
+      m_receivedDatagrams += segments;
+      m_coalescedDatagrams += segments;
+      ++m_coalescedReceives;
+    }
+    else
+    {
+      ++m_receivedDatagrams;
+      segmentSize = remaining;
+    }
+    if (std::find(std::begin(m_localAddresses), std::end(m_localAddresses), source.sin_addr.s_addr)
+      != std::end(m_localAddresses))
+    {
+      m_localDatagrams += (remaining + segmentSize - 1) / segmentSize;
+      continue;
+    }
+    auto inInterfaceAddress = getInterfaceAddress(interfaceIndex);
+    for (auto data = m_receiveBuffer.getData(); remaining != 0; data += segmentSize, remaining -= segmentSize)
+    {
+      segmentSize = std::min(segmentSize, remaining);
+      handlePacket(senderEndpoint, inInterfaceAddress, data, segmentSize);
+    }
   }
 
-  beginReceive();
+  if (datagrams == MAX_DATAGRAMS_PER_WAKEUP)
+  {
+    // Readiness is reported on edges only, so rather than waiting, resume once other pending handlers had their turn
+    m_ioService.post(makeCustomAllocHandler(shard.handlerMemory,
+      [this, &shard] { endReceive(shard, boost::system::error_code()); }));
+    return;
+  }
+  beginReceive(shard);
+}
+
+void Receiver::enableReceiveOffload()
+{
+  if (m_receiveOffload)
+  {
+    return;
+  }
+  m_receiveOffload = true;
+  for (auto &shard: m_shards)
+  {
+    enableReceiveOffload(shard);
+  }
 }
 
-void Receiver::handlePacket(const endpoint_t &senderEndpoint, const char *data, std::size_t length)
+void Receiver::enableReceiveOffload(Shard &shard)
+{
+  int enable = 1;
+  if (setsockopt(shard.socket.native_handle(), SOL_UDP, UDP_GRO, &enable, sizeof(enable)) != 0)
+  {
+    auto error = errno;
+    syslog(LOG_WARNING, "Receive offload for %s:%u unavailable: %s",
+      m_multicastEndpoint.address().to_string().c_str(), m_multicastEndpoint.port(),
+      utility::getErrorString(error).c_str());
+  }
+}
+
+auto Receiver::getInterfaceAddress(int interfaceIndex) const noexcept -> address_t
+{
+  for (auto &interface: m_interfaceIndices)
+  {
+    if (interface.first == interfaceIndex)
+    {
+      return interface.second;
+    }
+  }
+  return address_t();
+}
+
+void Receiver::handlePacket(const endpoint_t &senderEndpoint, address_t inInterfaceAddress, const char *data,
+  std::size_t length)
 {
 #ifdef NDEBUG
   (void)senderEndpoint;
+  (void)inInterfaceAddress;
   (void)data;
   (void)length;
 #else
-  std::cout << "Received datagram of " << length << " bytes from " << senderEndpoint << ": " << std::endl
-    << std::string(data, length) << std::endl;
+  AllocationAudit::Exemption allocationAuditExemption;
+  std::cout << "Received datagram of " << length << " bytes from " << senderEndpoint << " on interface "
+    << inInterfaceAddress << ": " << std::endl << std::string(data, length) << std::endl;
 #endif
 }
 
 void Receiver::joinOnInterface(boost::asio::ip::address_v4 interfaceAddress)
 {
-  m_socket.set_option(boost::asio::ip::multicast::join_group(m_multicastEndpoint.address().to_v4(), interfaceAddress));
+  // Several forwarding rules can share the same source interface, but the kernel refuses duplicate memberships
+  if (!m_interfaces.insert(interfaceAddress).second)
+  {
+    return;
+  }
+
+  boost::asio::ip::multicast::join_group membership(m_multicastEndpoint.address().to_v4(), interfaceAddress);
+  boost::system::error_code error;
+  m_shards.back().socket.set_option(membership, error);
+  if (error == boost::asio::error::no_buffer_space && m_shards.back().memberships != 0)
+  {
+    // Socket reached net.ipv4.igmp_max_memberships; continue on a fresh one
+    addShard().socket.set_option(membership, error);
+  }
+  if (error)
+  {
+    m_interfaces.erase(interfaceAddress);
+    throw boost::system::system_error(error);
+  }
+  ++m_shards.back().memberships;
+
+  // Datagrams tell the index of the interface they came in on; keep the address with which it was joined along
+  auto interfaceIndex = getInterfaceIndex(interfaceAddress);
+  if (interfaceIndex != 0)
+  {
+    m_interfaceIndices.emplace_back(interfaceIndex, interfaceAddress);
+  }
+}
+
+bool Receiver::reply(const endpoint_t &destination, const char *data, std::size_t length) noexcept
+{
+  auto sent = sendto(m_shards.front().socket.native_handle(), data, length, MSG_DONTWAIT, destination.data(),
+    destination.size());
+  return sent >= 0 && static_cast<std::size_t>(sent) == length;
+}
+
+void Receiver::reportStatistics() const
+{
+  // Kernel counters are cumulative and wrap around; unsigned arithmetic yields the correct difference
+  uint64_t kernelDrops = 0;
+  uint64_t newKernelDrops = 0;
+  uint64_t handlerAllocations = 0;
+  uint64_t handlerHeapAllocations = 0;
+  for (auto &shard: m_shards)
+  {
+    handlerAllocations += shard.handlerMemory.getAllocations();
+    handlerHeapAllocations += shard.handlerMemory.getHeapAllocations();
+    kernelDrops += shard.kernelDrops;
+    newKernelDrops += shard.kernelDrops - shard.reportedKernelDrops;
+    shard.reportedKernelDrops = shard.kernelDrops;
+  }
+
+  std::ostringstream oss;
+  oss << "Receiver for " << m_multicastEndpoint << " (" << m_interfaces.size() << " interfaces on "
+    << m_shards.size() << " sockets): " << m_receivedDatagrams << " datagrams received, " << kernelDrops
+    << " dropped by kernel (" << newKernelDrops << " since last report), " << m_localDatagrams
+    << " ignored as sent from this host, " << m_coalescedDatagrams
+    << " received in " << m_coalescedReceives << " coalesced datagrams";
+  if (m_coalescedReceives != 0)
+  {
+    oss << " (" << std::setprecision(3) << static_cast<double>(m_coalescedDatagrams) / m_coalescedReceives
+      << " datagrams per receive)";
+  }
+  oss << "; handler allocations: " << handlerAllocations << " reused, " << handlerHeapAllocations << " from heap";
+  syslog(newKernelDrops != 0 ? LOG_WARNING : LOG_INFO, "%s", oss.str().c_str());
+}
+
+void Receiver::setLocalAddresses(const std::vector<address_t> &addresses)
+{
+  m_localAddresses.clear();
+  for (auto address: addresses)
+  {
+    m_localAddresses.push_back(htonl(address.to_uint()));
+  }
+}
+
+void Receiver::setReceiveBufferSize(std::size_t size)
+{
+  if (size <= m_receiveBufferSize)
+  {
+    return;
+  }
+  m_receiveBufferSize = size;
+  for (auto &shard: m_shards)
+  {
+    setReceiveBufferSize(shard);
+  }
+}
+
+void Receiver::setReceiveBufferSize(Shard &shard)
+{
+  auto effectiveSize = utility::setSocketBufferSize(shard.socket.native_handle(), SO_RCVBUF, SO_RCVBUFFORCE,
+    m_receiveBufferSize);
+  if (effectiveSize < m_receiveBufferSize)
+  {
+    syslog(LOG_WARNING, "Receive buffer for %s:%u limited to %zu bytes instead of %zu; see net.core.rmem_max",
+      m_multicastEndpoint.address().to_string().c_str(), m_multicastEndpoint.port(), effectiveSize,
+      m_receiveBufferSize);
+  }
 }
 
 void Receiver::start()
 {
   // TODO: check if not already started
-  beginReceive();
+  for (auto &shard: m_shards)
+  {
+    beginReceive(shard);
+  }
+}
+
+void Receiver::stop() noexcept
+{
+  for (auto &shard: m_shards)
+  {
+    boost::system::error_code error;
+    shard.socket.close(error);
+  }
+}
+
+std::size_t Receiver::handleControlMessages(Shard &shard, msghdr &message, int &interfaceIndex) noexcept
+{
+  std::size_t segmentSize = 0;
+  for (auto *header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header))
+  {
+    if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SO_RXQ_OVFL)
+    {
+      memcpy(&shard.kernelDrops, CMSG_DATA(header), sizeof(shard.kernelDrops));
+    }
+    else if (header->cmsg_level == SOL_UDP && header->cmsg_type == UDP_GRO)
+    {
+      int size;
+      memcpy(&size, CMSG_DATA(header), sizeof(size));
+      segmentSize = size > 0 ? static_cast<std::size_t>(size) : 0;
+    }
+    else if (header->cmsg_level == IPPROTO_IP && header->cmsg_type == IP_PKTINFO)
+    {
+      in_pktinfo packetInfo;
+      memcpy(&packetInfo, CMSG_DATA(header), sizeof(packetInfo));
+      interfaceIndex = packetInfo.ipi_ifindex;
+    }
+  }
+  return segmentSize;
 }
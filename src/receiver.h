@@ -21,62 +21,159 @@
 
 #pragma once
 
-#include <boost/asio/io_service.hpp>
+#include <list>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include <sys/socket.h>
+
 #include <boost/asio/ip/udp.hpp>
 
+#include "eventloop.h"
+#include "handlermemory.h"
+#include "receivebuffer.h"
+
 
-/** One receiver per multicast endpoint */
+/**
+ * One receiver per multicast endpoint; memberships are spread over as many sockets as needed to stay within the
+ * per-socket limit (net.ipv4.igmp_max_memberships)
+ */
 struct Receiver
 {
   using address_t = boost::asio::ip::address_v4;
   using endpoint_t = boost::asio::ip::udp::endpoint;
 
 
-  Receiver(boost::asio::io_service &ioService, const endpoint_t &multicastEndpoint);
+  Receiver(EventLoop &ioService, ReceiveBuffer &receiveBuffer, const endpoint_t &multicastEndpoint);
 
   Receiver(const Receiver &) = delete;
   Receiver &operator =(const Receiver &) = delete;
 
+  /** Forwarders are owned through pointers to their base */
+  virtual ~Receiver() = default;
+
+
+  /** Has the kernel coalesce consecutive datagrams from the same sender (UDP_GRO); these are split up again here */
+  void enableReceiveOffload();
 
   const endpoint_t &getMulticastEndpoint() const noexcept;
 
+  /** Joins the multicast group on the given interface; joining the same interface again has no effect */
   void joinOnInterface(address_t interfaceAddress);
 
+  /**
+   * Sends a unicast datagram to the given endpoint from the port of this receiver, without blocking; returns false if
+   * the kernel did not take it
+   */
+  bool reply(const endpoint_t &destination, const char *data, std::size_t length) noexcept;
+
+  /** Logs the receive counters, including datagrams dropped by the kernel because the socket buffer was full */
+  virtual void reportStatistics() const;
+
+  /**
+   * Ignores datagrams from the given addresses, i.e. those of this host; they were sent by another forwarder on it,
+   * and forwarding them again could start a loop
+   */
+  void setLocalAddresses(const std::vector<address_t> &addresses);
+
+  /** Grows the socket receive buffer to at least the given size in bytes */
+  void setReceiveBufferSize(std::size_t size);
+
   virtual void start();
 
+  /**
+   * Stops receiving, leaving the multicast groups; handlers still pending return without effect, so the receiver must
+   * outlive them
+   */
+  void stop() noexcept;
+
 
 protected:
 
-  virtual void handlePacket(const endpoint_t &senderEndpoint, const char *data, std::size_t length);
+  /**
+   * Handles a datagram that came in on the interface with the given address, as joined; the address is unspecified if
+   * the interface is not known
+   */
+  virtual void handlePacket(const endpoint_t &senderEndpoint, address_t inInterfaceAddress, const char *data,
+    std::size_t length);
 
 
 private:
 
   enum
   {
-    /** IPv4 headers take at least 20 bytes */
-    IPV4_MINIMUM_HEADER_SIZE = 20,
+    /** Upper bound on the number of datagrams handled per wake-up, so that one busy endpoint cannot starve others */
+    MAX_DATAGRAMS_PER_WAKEUP = 64
+  };
 
-    /** UDP headers have a fixed length of 8 bytes */
-    UDP_HEADER_SIZE = 8,
 
-    /** The maximum size of IPv4 datagrams is limited by the 16-bit length field in the IPv4 header */
-    MAX_IPV4_UDP_DATAGRAM_SIZE = std::numeric_limits<uint16_t>::max() - IPV4_MINIMUM_HEADER_SIZE - UDP_HEADER_SIZE
+  /** Socket joined to the multicast group on a subset of the interfaces */
+  struct Shard
+  {
+    explicit Shard(EventLoop &ioService);
+
+    /** Declared before the socket, as operations still pending when the socket closes are freed into it */
+    HandlerMemory handlerMemory;
+    UdpSocket socket;
+    std::size_t memberships;
+    /** Cumulative number of datagrams dropped by the kernel for this socket, as reported through SO_RXQ_OVFL */
+    uint32_t kernelDrops;
+    mutable uint32_t reportedKernelDrops;
   };
 
 
-  void beginReceive();
+  Shard &addShard();
+
+  void beginReceive(Shard &shard);
+
+  void endReceive(Shard &shard, const boost::system::error_code &error);
 
-  void endReceive(const boost::system::error_code &error, std::size_t length);
+  void enableReceiveOffload(Shard &shard);
 
+  void setReceiveBufferSize(Shard &shard);
 
-  boost::asio::ip::udp::socket m_socket;
+  /** Gets the address with which the interface of the given index was joined; unspecified if it was not */
+  address_t getInterfaceAddress(int interfaceIndex) const noexcept;
+
+  /**
+   * Updates the kernel drop counter from the SO_RXQ_OVFL control message, if any, stores the index of the interface
+   * on which the datagram came in from the IP_PKTINFO control message, and returns the segment size from the UDP_GRO
+   * control message, or zero when the datagram was not coalesced
+   */
+  static std::size_t handleControlMessages(Shard &shard, msghdr &message, int &interfaceIndex) noexcept;
+
+
+  EventLoop &m_ioService;
   endpoint_t m_multicastEndpoint;
-  std::array<char, MAX_IPV4_UDP_DATAGRAM_SIZE> m_buffer;
-  endpoint_t m_senderEndpoint;
+  ReceiveBuffer &m_receiveBuffer;
+  std::size_t m_receiveBufferSize;
+  bool m_receiveOffload;
+  std::list<Shard> m_shards;
+  std::set<address_t> m_interfaces;
+  /** Indices of the interfaces joined, along with their addresses */
+  std::vector<std::pair<int, address_t>> m_interfaceIndices;
+  /** Addresses of this host, in network byte order */
+  std::vector<uint32_t> m_localAddresses;
+
+  uint64_t m_receivedDatagrams;
+  /** Number of datagrams ignored as sent from this host */
+  uint64_t m_localDatagrams;
+  /** Number of coalesced datagrams received, and the number of datagrams they carried */
+  uint64_t m_coalescedReceives;
+  uint64_t m_coalescedDatagrams;
 };
 
 
+inline
+Receiver::Shard::Shard(EventLoop &ioService):
+  handlerMemory(),
+  socket(ioService, boost::asio::ip::udp::v4()),
+  memberships(),
+  kernelDrops(),
+  reportedKernelDrops()
+{}
+
 inline
 auto Receiver::getMulticastEndpoint() const noexcept -> const endpoint_t &
 {
@@ -21,47 +21,333 @@
 
 #include "router.h"
 
+#include <algorithm>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
+
+#include <syslog.h>
+
+#include "allocationaudit.h"
+#include "compiledforwarder.h"
 
 using Network = config::model::Network;
 
 
+namespace
+{
+  /** Wait before retrying a proxied group whose forwarder could not be set up, doubled after each further failure */
+  constexpr auto PROXY_RETRY_BACKOFF = std::chrono::seconds(1);
+  constexpr auto MAX_PROXY_RETRY_BACKOFF = std::chrono::seconds(64);
+
+
+  /** Picks the fan-out for rules that all accept the same source networks */
+  template <class Match>
+  std::unique_ptr<Forwarder> createSpecializedForwarder(EventLoop &ioService, ReceiveBuffer &receiveBuffer,
+    const Router::endpoint_t &multicastEndpoint, std::vector<Forwarder::Rule> &&rules)
+  {
+    // In shared transmit mode, all rules refer to the one shared sender
+    if (rules.front().sender->isShared())
+    {
+      return std::make_unique<SpecializedForwarder<Match, Forwarder::SharedSender>>(ioService, receiveBuffer,
+        multicastEndpoint, std::move(rules));
+    }
+    if (rules.size() == 1)
+    {
+      return std::make_unique<SpecializedForwarder<Match, Forwarder::DedicatedSender>>(ioService, receiveBuffer,
+        multicastEndpoint, std::move(rules));
+    }
+    return std::make_unique<SpecializedForwarder<Match, Forwarder::DedicatedSenders>>(ioService, receiveBuffer,
+      multicastEndpoint, std::move(rules));
+  }
+}
+
+
+void Router::addPipeline(const endpoint_t &multicastEndpoint, Pipeline &&pipeline)
+{
+  m_forwarderConfigurations[multicastEndpoint].pipeline.append(std::move(pipeline));
+}
+
+void Router::addProxyRule(const Network &groups, uint16_t port, address_t fromInterfaceAddress,
+  const Network *fromInterfaceAcceptedNetworks, std::size_t fromInterfaceAcceptedNetworkCount,
+  address_t toInterfaceAddress, unsigned toInterfaceIndex, std::size_t receiveBufferSize, std::size_t sendBufferSize,
+  bool offload, const Pipeline::stages_t &stages, const Pipeline::stages_t &ruleStages)
+{
+  assert(m_igmpSnooper != nullptr && m_transmitMode != TransmitMode::CONNECTED);
+  if (std::empty(m_proxies))
+  {
+    m_igmpSnooper->setGroupHandler([this](address_t group) { updateProxiedGroup(group); });
+  }
+  auto proxy = std::find_if(std::begin(m_proxies), std::end(m_proxies), [&groups, port](const Proxy &proxy) {
+    return proxy.port == port && proxy.groups.getMaskedAddress() == groups.getMaskedAddress()
+      && proxy.groups.getPrefixLength() == groups.getPrefixLength();
+  });
+  if (proxy == std::end(m_proxies))
+  {
+    proxy = m_proxies.insert(std::end(m_proxies),
+      Proxy{groups.getMaskedNetwork(), port, {}, 0, false, stages, 0, 0, {}, 0});
+  }
+  proxy->receiveBufferSize = std::max(proxy->receiveBufferSize, receiveBufferSize);
+  proxy->offload = proxy->offload || offload;
+
+  // Senders are set up front, as for other rules; the forwarders come later
+  auto &sender = getSender(toInterfaceAddress, sendBufferSize);
+  Sender::out_interface_t outInterface = Sender::out_interface_t();
+  if (sender->isShared())
+  {
+    outInterface.ipi_ifindex = static_cast<int>(toInterfaceIndex);
+    outInterface.ipi_spec_dst.s_addr = htonl(toInterfaceAddress.to_ulong());
+  }
+  proxy->rules.push_back(ProxyRule{fromInterfaceAddress, std::vector<Network>(fromInterfaceAcceptedNetworks,
+    fromInterfaceAcceptedNetworks + fromInterfaceAcceptedNetworkCount), sender, outInterface, toInterfaceAddress,
+    toInterfaceIndex, ruleStages});
+  m_igmpSnooper->addGroups(groups, toInterfaceAddress, toInterfaceIndex);
+}
+
 void Router::addRule(const endpoint_t &multicastEndpoint, address_t fromInterfaceAddress,
-  const std::list<Network> &fromInterfaceAcceptedNetworks, address_t toInterfaceAddress)
+  const Network *fromInterfaceAcceptedNetworks, std::size_t fromInterfaceAcceptedNetworkCount,
+  address_t toInterfaceAddress, unsigned toInterfaceIndex, std::size_t toInterfaceMtu,
+  std::size_t receiveBufferSize, std::size_t sendBufferSize, bool offload, unsigned coalescingWindow,
+  const std::shared_ptr<Pipeline> &pipeline)
+{
+  /* Use one forwarder for each multicast endpoint, as one receiver can join this endpoint on several interfaces; it
+   * spreads its memberships over multiple sockets when exceeding the per-socket limit. The forwarder itself is only
+   * created when starting, once all of its rules are known. */
+  auto &configuration = m_forwarderConfigurations[multicastEndpoint];
+  if (std::find(std::begin(configuration.fromInterfaceAddresses), std::end(configuration.fromInterfaceAddresses),
+    fromInterfaceAddress) == std::end(configuration.fromInterfaceAddresses))
+  {
+    configuration.fromInterfaceAddresses.push_back(fromInterfaceAddress);
+  }
+  configuration.receiveBufferSize = std::max(configuration.receiveBufferSize, receiveBufferSize);
+  configuration.offload = configuration.offload || offload;
+
+  const bool shared = m_transmitMode == TransmitMode::SHARED;
+  auto &sender = getSender(toInterfaceAddress, sendBufferSize);
+  if (offload)
+  {
+    sender->enableSegmentationOffload(multicastEndpoint);
+  }
+  if (m_transmitMode == TransmitMode::CONNECTED)
+  {
+    sender->addConnection(multicastEndpoint);
+  }
+
+  // Set up the forwarding
+  Sender::out_interface_t outInterface = Sender::out_interface_t();
+  outInterface.ipi_ifindex = static_cast<int>(toInterfaceIndex);
+  outInterface.ipi_spec_dst.s_addr = htonl(toInterfaceAddress.to_ulong());
+  if (coalescingWindow != 0)
+  {
+    // Merged datagrams must fit the MTU along with the IP and UDP headers
+    sender->enableCoalescing(multicastEndpoint, shared ? outInterface : Sender::out_interface_t(),
+      boost::posix_time::milliseconds(coalescingWindow), std::max<std::size_t>(toInterfaceMtu, 576) - 28);
+  }
+  const bool *listening = nullptr;
+  auto group = multicastEndpoint.address().to_v4();
+  if (m_igmpSnooper != nullptr && !IgmpSnooper::isLinkLocal(group))
+  {
+    listening = m_igmpSnooper->addGroup(group, toInterfaceAddress, toInterfaceIndex);
+  }
+  for (std::size_t i = 0; i < fromInterfaceAcceptedNetworkCount; ++i)
+  {
+    configuration.rules.push_back(Forwarder::Rule{fromInterfaceAcceptedNetworks[i], sender,
+      shared ? outInterface : Sender::out_interface_t(), pipeline, toInterfaceAddress, listening});
+    configuration.outInterfaces.push_back(outInterface);
+  }
+}
+
+std::unique_ptr<Forwarder> Router::createForwarder(const endpoint_t &multicastEndpoint,
+  ForwarderConfiguration &&configuration)
 {
-  /* Use one forwarder for each multicast endpoint, as one receiver can join this endpoint on several interfaces (at
-   * most IP_MAX_MEMBERSHIPS). */
-  auto forwarderIter = m_forwarders.find(multicastEndpoint);
-  if (forwarderIter == std::end(m_forwarders))
+  // Only the generic forwarder passes datagrams through stages, and skips interfaces without listeners
+  auto &rules = configuration.rules;
+  auto needsGeneric = [](const Forwarder::Rule &rule) { return rule.pipeline != nullptr || rule.listening != nullptr; };
+  std::unique_ptr<Forwarder> forwarder;
+  if (!configuration.pipeline.empty() || std::any_of(std::begin(rules), std::end(rules), needsGeneric))
+  {
+    forwarder = std::make_unique<Forwarder>(m_ioService, m_receiveBuffer, multicastEndpoint, std::move(rules));
+    forwarder->setPipeline(std::move(configuration.pipeline));
+  }
+  else
+  {
+    // Prefer the rules compiled in from the forwarding table, if any
+    forwarder = createCompiledForwarder(m_ioService, m_receiveBuffer, multicastEndpoint, rules,
+      configuration.outInterfaces);
+  }
+  if (forwarder == nullptr)
   {
-    forwarderIter = m_forwarders.emplace(multicastEndpoint,
-      std::make_unique<Forwarder>(m_ioService, multicastEndpoint)).first;
+    // Rules that all accept the same network need only one match per datagram, and have a fixed fan-out
+    auto sameNetwork = [&rules](const Forwarder::Rule &rule) {
+      return rule.network.getMaskedAddress() == rules.front().network.getMaskedAddress()
+        && rule.network.getPrefixLength() == rules.front().network.getPrefixLength();
+    };
+    if (std::empty(rules) || !std::all_of(std::begin(rules), std::end(rules), sameNetwork))
+    {
+      forwarder = std::make_unique<Forwarder>(m_ioService, m_receiveBuffer, multicastEndpoint, std::move(rules));
+    }
+    else if (rules.front().network.getPrefixLength() == 0)
+    {
+      forwarder = createSpecializedForwarder<Forwarder::AnySource>(m_ioService, m_receiveBuffer, multicastEndpoint,
+        std::move(rules));
+    }
+    else
+    {
+      forwarder = createSpecializedForwarder<Forwarder::SingleSourceNetwork>(m_ioService, m_receiveBuffer,
+        multicastEndpoint, std::move(rules));
+    }
   }
-  assert(forwarderIter != std::end(m_forwarders));
-  auto &forwarder = forwarderIter->second;
 
   // Set up the receiver
-  forwarder->joinOnInterface(fromInterfaceAddress);
-  // TODO: check IP_MAX_MEMBERSHIPS
+  for (auto fromInterfaceAddress: configuration.fromInterfaceAddresses)
+  {
+    forwarder->joinOnInterface(fromInterfaceAddress);
+  }
+  forwarder->setLocalAddresses(m_localAddresses);
+  if (configuration.receiveBufferSize != 0)
+  {
+    forwarder->setReceiveBufferSize(configuration.receiveBufferSize);
+  }
+  if (configuration.offload)
+  {
+    forwarder->enableReceiveOffload();
+  }
+  return forwarder;
+}
 
-  // Use one sender for each outgoing interface
-  auto senderIter = m_senders.find(toInterfaceAddress);
+void Router::emitForwardingTable(std::ostream &os, const std::string &source) const
+{
+  os << "/*" << std::endl
+     << " * Forwarding table generated by mcv4fwdd -e from " << source << ";" << std::endl
+     << " * build with -DMCV4FWDD_FORWARDING_TABLE=<path of this file>, and regenerate when" << std::endl
+     << " * the configuration or the interface addresses change." << std::endl
+     << " */" << std::endl
+     << std::endl
+     << std::endl
+     << "#pragma once" << std::endl
+     << std::endl
+     << "#include <array>" << std::endl
+     << std::endl
+     << "#include \"forwardingtable.h\"" << std::endl
+     << std::endl
+     << std::endl
+     << "constexpr bool FORWARDING_TABLE_SHARED = " << std::boolalpha << (m_transmitMode == TransmitMode::SHARED)
+     << ";" << std::endl
+     << std::endl;
+
+  std::size_t ruleCount = 0;
+  for (auto &configuration: m_forwarderConfigurations)
+  {
+    ruleCount += configuration.second.rules.size();
+  }
+
+  auto hex = [](uint32_t value) {
+    std::ostringstream oss;
+    oss << "0x" << std::hex << std::setw(8) << std::setfill('0') << value;
+    return oss.str();
+  };
+
+  std::size_t firstRule = 0;
+  os << "constexpr std::array<ForwardingTable::Endpoint, " << m_forwarderConfigurations.size()
+     << "> FORWARDING_TABLE_ENDPOINTS = {{" << std::endl;
+  for (auto &configuration: m_forwarderConfigurations)
+  {
+    auto &multicastEndpoint = configuration.first;
+    os << "  { " << hex(static_cast<uint32_t>(multicastEndpoint.address().to_v4().to_ulong())) << ", "
+       << multicastEndpoint.port() << ", " << firstRule << ", " << configuration.second.rules.size() << " }, // "
+       << multicastEndpoint << std::endl;
+    firstRule += configuration.second.rules.size();
+  }
+  os << "}};" << std::endl
+     << std::endl;
+
+  os << "constexpr std::array<ForwardingTable::Rule, " << ruleCount << "> FORWARDING_TABLE_RULES = {{" << std::endl;
+  for (auto &configuration: m_forwarderConfigurations)
+  {
+    for (std::size_t i = 0; i < configuration.second.rules.size(); ++i)
+    {
+      auto &network = configuration.second.rules[i].network;
+      auto &outInterface = configuration.second.outInterfaces[i];
+      os << "  { " << hex(static_cast<uint32_t>(network.getMaskedAddress().to_ulong())) << ", "
+         << unsigned(network.getPrefixLength()) << ", " << hex(ntohl(outInterface.ipi_spec_dst.s_addr)) << ", "
+         << outInterface.ipi_ifindex << " }, // " << configuration.first << " from " << network.getMaskedNetwork()
+         << " to interface #" << outInterface.ipi_ifindex << std::endl;
+    }
+  }
+  os << "}};" << std::endl;
+}
+
+void Router::enableIgmpSnooping(bool querier)
+{
+  assert(std::empty(m_forwarderConfigurations));
+  m_igmpSnooper = std::make_unique<IgmpSnooper>(m_ioService, m_receiveBuffer, querier);
+}
+
+const std::shared_ptr<Sender> &Router::getSender(address_t toInterfaceAddress, std::size_t sendBufferSize)
+{
+  // Use one sender for each outgoing interface, or a single one that selects the interface for each datagram
+  const bool shared = m_transmitMode == TransmitMode::SHARED;
+  auto senderIter = m_senders.find(shared ? address_t() : toInterfaceAddress);
   if (senderIter == std::end(m_senders))
   {
-    senderIter = m_senders.emplace(toInterfaceAddress, std::make_shared<Sender>(m_ioService, toInterfaceAddress)).first;
+    senderIter = shared
+      ? m_senders.emplace(address_t(), std::make_shared<Sender>(m_ioService)).first
+      : m_senders.emplace(toInterfaceAddress, std::make_shared<Sender>(m_ioService, toInterfaceAddress)).first;
   }
   assert(senderIter != std::end(m_senders));
   auto &sender = senderIter->second;
+  if (sendBufferSize != 0)
+  {
+    sender->setSendBufferSize(sendBufferSize);
+  }
+  return sender;
+}
 
-  // Set up the forwarding
-  for (auto &fromAcceptedNetwork: fromInterfaceAcceptedNetworks)
+void Router::reportStatistics() const
+{
+  for (auto &forwarder: m_forwarders)
   {
-    forwarder->add(fromAcceptedNetwork, sender);
+    forwarder.second->reportStatistics();
   }
+  for (auto &forwarder: m_proxiedForwarders)
+  {
+    forwarder.second->reportStatistics();
+  }
+  for (auto &proxy: m_proxies)
+  {
+    auto active = std::count_if(std::begin(m_proxiedForwarders), std::end(m_proxiedForwarders),
+      [&proxy](const std::pair<const endpoint_t, std::unique_ptr<Forwarder>> &forwarder) {
+        return forwarder.first.port() == proxy.port && proxy.groups.contains(forwarder.first.address().to_v4());
+      });
+    std::ostringstream oss;
+    oss << "Proxy for " << proxy.groups << ':' << proxy.port << ": " << active << " groups forwarded, "
+      << proxy.createdForwarders << " forwarders created and " << proxy.retiredForwarders << " retired, "
+      << proxy.failedForwarders << " failed";
+    syslog(LOG_INFO, "%s", oss.str().c_str());
+  }
+  for (auto &sender: m_senders)
+  {
+    sender.second->reportStatistics();
+  }
+  if (m_igmpSnooper != nullptr)
+  {
+    m_igmpSnooper->reportStatistics();
+  }
+}
+
+void Router::setLocalAddresses(std::vector<address_t> addresses)
+{
+  m_localAddresses = std::move(addresses);
 }
 
 void Router::start()
 {
+  for (auto &configuration: m_forwarderConfigurations)
+  {
+    m_forwarders.emplace(configuration.first, createForwarder(configuration.first, std::move(configuration.second)));
+  }
+  m_forwarderConfigurations.clear();
+
 #ifndef NDEBUG
   std::cout << "Router configuration:" << std::endl;
 #endif
@@ -72,11 +358,160 @@ void Router::start()
     std::cout << *forwarder.second << std::endl;
 #endif
   }
-#ifndef NDEBUG
   for (auto &sender: m_senders)
   {
+    sender.second->start();
+#ifndef NDEBUG
     std::cout << "Sender on " << sender.first << " = " << sender.second.get() << std::endl;
+#endif
+  }
+  if (m_igmpSnooper != nullptr)
+  {
+    m_igmpSnooper->start();
   }
+#ifndef NDEBUG
   std::cout << "End of router configuration" << std::endl;
 #endif
+
+  // From here on, forwarding datagrams must not allocate memory
+  AllocationAudit::arm();
+}
+
+void Router::stop() noexcept
+{
+  for (auto &forwarder: m_forwarders)
+  {
+    forwarder.second->stop();
+  }
+  for (auto &forwarder: m_proxiedForwarders)
+  {
+    forwarder.second->stop();
+  }
+  for (auto &sender: m_senders)
+  {
+    sender.second->stop();
+  }
+  if (m_igmpSnooper != nullptr)
+  {
+    m_igmpSnooper->stop();
+  }
+}
+
+void Router::updateProxiedGroup(address_t group)
+{
+  for (auto &proxy: m_proxies)
+  {
+    endpoint_t multicastEndpoint(group, proxy.port);
+    if (!proxy.groups.contains(group) || m_forwarders.find(multicastEndpoint) != std::end(m_forwarders))
+    {
+      continue;
+    }
+    auto isListened = [this, group](const ProxyRule &rule) {
+      auto listening = m_igmpSnooper->findGroup(group, rule.toInterfaceIndex);
+      return listening != nullptr && *listening;
+    };
+    const bool listened = std::any_of(std::begin(proxy.rules), std::end(proxy.rules), isListened);
+    auto forwarder = m_proxiedForwarders.find(multicastEndpoint);
+    auto retry = proxy.retries.find(group);
+    const auto now = clock_t::now();
+    if (!listened && retry != std::end(proxy.retries))
+    {
+      proxy.retries.erase(retry);
+    }
+    else if (listened && forwarder == std::end(m_proxiedForwarders)
+      && (retry == std::end(proxy.retries) || retry->second.next <= now))
+    {
+      // Set up the rules of the proxy for this group; they skip the interfaces without listeners as usual
+      ForwarderConfiguration configuration{};
+      configuration.receiveBufferSize = proxy.receiveBufferSize;
+      configuration.offload = proxy.offload;
+      configuration.pipeline.append(Pipeline(proxy.stages));
+      for (auto &rule: proxy.rules)
+      {
+        if (std::find(std::begin(configuration.fromInterfaceAddresses), std::end(configuration.fromInterfaceAddresses),
+          rule.fromInterfaceAddress) == std::end(configuration.fromInterfaceAddresses))
+        {
+          configuration.fromInterfaceAddresses.push_back(rule.fromInterfaceAddress);
+        }
+        if (proxy.offload)
+        {
+          rule.sender->enableSegmentationOffload(multicastEndpoint);
+        }
+        std::shared_ptr<Pipeline> pipeline;
+        if (!rule.stages.empty())
+        {
+          pipeline = std::make_shared<Pipeline>(rule.stages);
+        }
+        auto listening = m_igmpSnooper->findGroup(group, rule.toInterfaceIndex);
+        assert(listening != nullptr);
+        for (auto &network: rule.fromInterfaceAcceptedNetworks)
+        {
+          configuration.rules.push_back(Forwarder::Rule{network, rule.sender, rule.outInterface, pipeline,
+            rule.toInterfaceAddress, listening});
+        }
+      }
+      std::unique_ptr<Forwarder> created;
+      try
+      {
+        created = createForwarder(multicastEndpoint, std::move(configuration));
+        created->start();
+      }
+      catch (const std::exception &e)
+      {
+        // E.g. the incoming interface went away or lost its address; rather than taking down forwarding for
+        // everything else, leave the group unproxied until a report after the backoff
+        auto backoff = retry == std::end(proxy.retries) ? clock_t::duration(PROXY_RETRY_BACKOFF)
+          : std::min<clock_t::duration>(2 * retry->second.backoff, MAX_PROXY_RETRY_BACKOFF);
+        proxy.retries[group] = ProxyRetry{now + backoff, backoff};
+        std::ostringstream oss;
+        oss << "Proxying " << multicastEndpoint << " failed: " << e.what() << "; retrying on reports after "
+          << std::chrono::duration_cast<std::chrono::seconds>(backoff).count() << " s";
+        syslog(LOG_ERR, "%s", oss.str().c_str());
+        if (created != nullptr)
+        {
+          created->stop();
+          std::shared_ptr<Forwarder> retired(std::move(created));
+          m_ioService.post([retired] {});
+        }
+        if (proxy.offload)
+        {
+          for (auto &rule: proxy.rules)
+          {
+            rule.sender->disableSegmentationOffload(multicastEndpoint);
+          }
+        }
+        ++proxy.failedForwarders;
+        continue;
+      }
+      if (retry != std::end(proxy.retries))
+      {
+        proxy.retries.erase(retry);
+      }
+      auto &inserted = m_proxiedForwarders[multicastEndpoint];
+      inserted = std::move(created);
+      ++proxy.createdForwarders;
+#ifndef NDEBUG
+      std::cout << "Proxied " << *inserted << std::endl;
+#endif
+    }
+    else if (!listened && forwarder != std::end(m_proxiedForwarders))
+    {
+      // Handlers of the forwarder may still be pending; only destroy it once these had their turn
+      forwarder->second->stop();
+      std::shared_ptr<Forwarder> retired(std::move(forwarder->second));
+      m_proxiedForwarders.erase(forwarder);
+      m_ioService.post([retired] {});
+      if (proxy.offload)
+      {
+        for (auto &rule: proxy.rules)
+        {
+          rule.sender->disableSegmentationOffload(multicastEndpoint);
+        }
+      }
+      ++proxy.retiredForwarders;
+#ifndef NDEBUG
+      std::cout << "Proxied forwarder for " << multicastEndpoint << " retired" << std::endl;
+#endif
+    }
+  }
 }
@@ -21,13 +21,19 @@
 
 #pragma once
 
-#include <list>
+#include <chrono>
 #include <map>
+#include <ostream>
+#include <string>
+#include <vector>
 
-#include <boost/asio/io_service.hpp>
-
+#include "eventloop.h"
 #include "forwarder.h"
+#include "igmpsnooper.h"
+#include "pipeline.h"
+#include "receivebuffer.h"
 #include "sender.h"
+#include "config/model/configuration.h"
 #include "config/model/network.h"
 
 
@@ -35,31 +41,170 @@ struct Router
 {
   using address_t = boost::asio::ip::address_v4;
   using endpoint_t = boost::asio::ip::udp::endpoint;
+  using TransmitMode = config::model::Configuration::TransmitMode;
 
 
-  Router(boost::asio::io_service &ioService);
+  Router(EventLoop &ioService, TransmitMode transmitMode);
 
   Router(const Router &) = delete;
   Router &operator =(const Router &) = delete;
 
+  /** Adds stages that all datagrams accepted by the rules for the given endpoint pass before being forwarded */
+  void addPipeline(const endpoint_t &multicastEndpoint, Pipeline &&pipeline);
+
+  /**
+   * Sets up forwarding for a range of groups on the given port like addRule, except that each group is only joined
+   * while it has listeners on the outgoing interfaces of any rule, as learned by IGMP snooping, which must be enabled.
+   * Each forwarder created for a group gets its own pipelines, with the stages given for all of its datagrams and for
+   * those along this rule. Groups of services added as such are left to those. Not available in connected transmit
+   * mode, as its sockets are set up front for each endpoint.
+   */
+  void addProxyRule(const config::model::Network &groups, uint16_t port, address_t fromInterfaceAddress,
+    const config::model::Network *fromInterfaceAcceptedNetworks, std::size_t fromInterfaceAcceptedNetworkCount,
+    address_t toInterfaceAddress, unsigned toInterfaceIndex, std::size_t receiveBufferSize,
+    std::size_t sendBufferSize, bool offload, const Pipeline::stages_t &stages, const Pipeline::stages_t &ruleStages);
+
+  /**
+   * Sets up forwarding; buffer sizes of zero leave the system defaults, and shared sockets get the largest size.
+   * Offload enables UDP receive offload for the multicast endpoint, and segmentation offload for its datagrams. A
+   * non-zero coalescing window in milliseconds has Multicast DNS responses merged into datagrams that fit the MTU of
+   * the outgoing interface. Datagrams from the accepted networks pass the stages of the given pipeline, if any, before
+   * being forwarded.
+   */
   void addRule(const endpoint_t &multicastEndpoint, address_t fromInterfaceAddress,
-    const std::list<config::model::Network> &fromInterfaceAcceptedNetworks, address_t toInterfaceAddress);
-
+    const config::model::Network *fromInterfaceAcceptedNetworks, std::size_t fromInterfaceAcceptedNetworkCount,
+    address_t toInterfaceAddress, unsigned toInterfaceIndex, std::size_t toInterfaceMtu,
+    std::size_t receiveBufferSize, std::size_t sendBufferSize, bool offload, unsigned coalescingWindow,
+    const std::shared_ptr<Pipeline> &pipeline);
+
+  /**
+   * Writes the rules added as a forwarding table, i.e. a C++ header to build a daemon with these rules compiled in;
+   * the given source is mentioned in its header comment
+   */
+  void emitForwardingTable(std::ostream &os, const std::string &source) const;
+
+  /**
+   * Forwards datagrams only to the interfaces where their group has listeners, as learned from IGMP; optionally acts
+   * as querier there. Must be enabled before adding rules; link-local groups are always forwarded.
+   */
+  void enableIgmpSnooping(bool querier);
+
+  /** Logs the counters of all receivers and senders */
+  void reportStatistics() const;
+
+  /** Sets the addresses of this host; datagrams from these are not forwarded */
+  void setLocalAddresses(std::vector<address_t> addresses);
+
+  /** Creates the forwarders for the rules added, and starts forwarding */
   void start();
 
+  /**
+   * Stops forwarding, closing all sockets and canceling all timers; handlers still pending return without effect once
+   * they run, so the router must outlive them
+   */
+  void stop() noexcept;
 
-private:
 
-  boost::asio::io_service &m_ioService;
+private:
 
+  using clock_t = std::chrono::steady_clock;
+
+
+  /** Rules and receive settings collected for one multicast endpoint, until its forwarder is created */
+  struct ForwarderConfiguration
+  {
+    std::vector<address_t> fromInterfaceAddresses;
+    std::vector<Forwarder::Rule> rules;
+    /** Outgoing interface of each rule, also for senders that are not shared */
+    std::vector<Sender::out_interface_t> outInterfaces;
+    std::size_t receiveBufferSize;
+    bool offload;
+    /** Stages for all datagrams, before matching */
+    Pipeline pipeline;
+  };
+
+
+  /** Forwarding rule of a proxy, set up for each of its groups while listened to */
+  struct ProxyRule
+  {
+    address_t fromInterfaceAddress;
+    std::vector<config::model::Network> fromInterfaceAcceptedNetworks;
+    std::shared_ptr<Sender> sender;
+    /** Only set for a shared sender, as in Forwarder::Rule */
+    Sender::out_interface_t outInterface;
+    address_t toInterfaceAddress;
+    unsigned toInterfaceIndex;
+    Pipeline::stages_t stages;
+  };
+
+  /** When to try again to set up the forwarder for a proxied group, and how long to wait after failing once more */
+  struct ProxyRetry
+  {
+    clock_t::time_point next;
+    clock_t::duration backoff;
+  };
+
+  /** Rules and receive settings for a range of groups, from which forwarders are created as listeners come and go */
+  struct Proxy
+  {
+    config::model::Network groups;
+    uint16_t port;
+    std::vector<ProxyRule> rules;
+    std::size_t receiveBufferSize;
+    bool offload;
+    Pipeline::stages_t stages;
+    uint64_t createdForwarders;
+    uint64_t retiredForwarders;
+    /** Groups listened to whose forwarder could not be set up, e.g. as an interface went away */
+    std::map<address_t, ProxyRetry> retries;
+    /** Number of times that setting up the forwarder for a group failed */
+    uint64_t failedForwarders;
+  };
+
+
+  /** Creates the forwarder for the given configuration, specialized for its rules where possible */
+  std::unique_ptr<Forwarder> createForwarder(const endpoint_t &multicastEndpoint,
+    ForwarderConfiguration &&configuration);
+
+  /** Returns the sender for the given outgoing interface, creating it if needed */
+  const std::shared_ptr<Sender> &getSender(address_t toInterfaceAddress, std::size_t sendBufferSize);
+
+  /**
+   * Creates or retires the forwarders of the proxies for the given group, after its listeners changed or reported
+   * again; a forwarder that could not be set up is retried on later reports, backing off after each failure
+   */
+  void updateProxiedGroup(address_t group);
+
+
+  EventLoop &m_ioService;
+  TransmitMode m_transmitMode;
+
+  /** Shared by all forwarders; declared first as it must outlive them */
+  ReceiveBuffer m_receiveBuffer;
+  /** Declared before the forwarders, as their rules refer to its listener state */
+  std::unique_ptr<IgmpSnooper> m_igmpSnooper;
+
+  std::map<endpoint_t, ForwarderConfiguration> m_forwarderConfigurations;
   std::map<endpoint_t, std::unique_ptr<Forwarder>> m_forwarders;
+  std::vector<Proxy> m_proxies;
+  /** Forwarders of the proxied groups currently listened to */
+  std::map<endpoint_t, std::unique_ptr<Forwarder>> m_proxiedForwarders;
+  /** In shared transmit mode, the only sender is stored under the unspecified address */
   std::map<address_t, std::shared_ptr<Sender>> m_senders;
+  std::vector<address_t> m_localAddresses;
 };
 
 
 inline
-Router::Router(boost::asio::io_service &ioService):
+Router::Router(EventLoop &ioService, TransmitMode transmitMode):
   m_ioService(ioService),
+  m_transmitMode(transmitMode),
+  m_receiveBuffer(),
+  m_igmpSnooper(),
+  m_forwarderConfigurations(),
   m_forwarders(),
-  m_senders()
+  m_proxies(),
+  m_proxiedForwarders(),
+  m_senders(),
+  m_localAddresses()
 {}
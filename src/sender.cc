@@ -21,14 +21,42 @@
 
 #include "sender.h"
 
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
 
+#include <netinet/udp.h>
+#include <syslog.h>
 #include <boost/asio.hpp>
-#include <boost/bind.hpp>
+
+#include "allocationaudit.h"
+#include "receivebuffer.h"
+#include "utility.h"
 
 
 namespace
 {
+  /** Connected sockets without traffic for this long are closed, and reopened on demand */
+  const auto CONNECTION_IDLE_TIMEOUT = boost::posix_time::seconds(60);
+
+
+  /** Control message buffer for a single IP_PKTINFO message */
+  union OutInterfaceControl
+  {
+    char buffer[CMSG_SPACE(sizeof(in_pktinfo))];
+    cmsghdr header;
+  };
+
+  /** Control message buffer for an IP_PKTINFO message followed by a UDP_SEGMENT message */
+  union SegmentedControl
+  {
+    char buffer[CMSG_SPACE(sizeof(in_pktinfo)) + CMSG_SPACE(sizeof(uint16_t))];
+    cmsghdr header;
+  };
+
+
   std::string getOutInterface(int socket)
   {
     in_addr outInterfaceAddress;
@@ -40,11 +68,83 @@ namespace
     }
     return inet_ntoa(outInterfaceAddress);
   }
+
+  std::string getOutInterface(int socket, const in_pktinfo &outInterface)
+  {
+    if (outInterface.ipi_ifindex == 0)
+    {
+      return getOutInterface(socket);
+    }
+    std::ostringstream oss;
+    oss << inet_ntoa(outInterface.ipi_spec_dst) << " (interface #" << outInterface.ipi_ifindex << ')';
+    return oss.str();
+  }
+
+  /** Selects the outgoing interface of the given message, unless the index of the interface is zero */
+  void setOutInterface(msghdr &message, OutInterfaceControl &control, const in_pktinfo &outInterface)
+  {
+    if (outInterface.ipi_ifindex == 0)
+    {
+      message.msg_control = nullptr;
+      message.msg_controllen = 0;
+      return;
+    }
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+    auto header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = IPPROTO_IP;
+    header->cmsg_type = IP_PKTINFO;
+    header->cmsg_len = CMSG_LEN(sizeof(in_pktinfo));
+    memcpy(CMSG_DATA(header), &outInterface, sizeof(in_pktinfo));
+  }
 }
 
 
-Sender::Sender(boost::asio::io_service &ioService, address_t outInterfaceAddress):
-  m_socket(ioService, boost::asio::ip::udp::v4())
+Sender::Sender(EventLoop &ioService):
+  m_ioService(ioService),
+  m_outInterfaceAddress(),
+  m_handlerMemory(),
+  m_idleConnectionHandlerMemory(),
+  m_socket(ioService, boost::asio::ip::udp::v4()),
+  m_connections(),
+  m_idleConnectionTimer(ioService),
+  m_queue(SHARED_QUEUE_CAPACITY),
+  m_sendBufferSize(),
+  m_segmentationEndpoints(),
+  m_coalescings(),
+  m_sentDatagrams(),
+  m_queueDrops(),
+  m_kernelDrops(),
+  m_reportedKernelDrops(),
+  m_segmentedSends(),
+  m_segmentedDatagrams(),
+  m_closedIdleConnections(),
+  m_connectionDrops()
+{
+  // Outgoing multicast packets default to TTL=1, with loopback to the sending host; disable loopback
+  m_socket.set_option(boost::asio::ip::multicast::enable_loopback(false));
+}
+
+Sender::Sender(EventLoop &ioService, address_t outInterfaceAddress):
+  m_ioService(ioService),
+  m_outInterfaceAddress(outInterfaceAddress),
+  m_handlerMemory(),
+  m_idleConnectionHandlerMemory(),
+  m_socket(ioService, boost::asio::ip::udp::v4()),
+  m_connections(),
+  m_idleConnectionTimer(ioService),
+  m_queue(QUEUE_CAPACITY),
+  m_sendBufferSize(),
+  m_segmentationEndpoints(),
+  m_coalescings(),
+  m_sentDatagrams(),
+  m_queueDrops(),
+  m_kernelDrops(),
+  m_reportedKernelDrops(),
+  m_segmentedSends(),
+  m_segmentedDatagrams(),
+  m_closedIdleConnections(),
+  m_connectionDrops()
 {
   // Outgoing multicast packets default to TTL=1, with loopback to the sending host; disable loopback
   m_socket.set_option(boost::asio::ip::multicast::enable_loopback(false));
@@ -53,47 +153,624 @@ Sender::Sender(boost::asio::io_service &ioService, address_t outInterfaceAddress
   m_socket.set_option(boost::asio::ip::multicast::outbound_interface(outInterfaceAddress));
 }
 
+void Sender::addConnection(const endpoint_t &multicastEndpoint)
+{
+  assert(!isShared());
+  if (findConnection(multicastEndpoint) == nullptr)
+  {
+    boost::system::error_code error;
+    openConnection(m_connections.emplace_back(m_ioService, multicastEndpoint), error);
+    if (error)
+    {
+      throw boost::system::system_error(error, "connect");
+    }
+  }
+}
+
 void Sender::beginSend()
 {
   assert(!std::empty(m_queue));
 
-  auto &item = m_queue.front();
-#ifndef NDEBUG
-  std::cout << "Sending datagram of " << item.getLength() << " bytes to " << item.getMulticastEndpoint()
-    << " from interface " << getOutInterface(m_socket.native_handle()) << ": " << std::endl
-    << std::string(item.getData(), item.getLength()) << std::endl;
-#endif
-  m_socket.async_send_to(boost::asio::buffer(item.getData(), item.getLength()), item.getMulticastEndpoint(),
-    boost::bind(&Sender::endSend, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+  // Wait for room in the buffer of the socket that the first queued datagram goes out on
+  auto connection = findConnection(m_queue.front().getMulticastEndpoint());
+  auto &socket = connection != nullptr ? connection->socket : m_socket;
+  socket.async_send(boost::asio::null_buffers(), makeCustomAllocHandler(m_handlerMemory,
+    [this](const boost::system::error_code &error, std::size_t) {
+      // Only aborted when stopped, after which the sender is not to be touched
+      if (error != boost::asio::error::operation_aborted)
+      {
+        endSend(error);
+      }
+    }));
+}
+
+void Sender::beginWaitForIdleConnections()
+{
+  m_idleConnectionTimer.expires_from_now(CONNECTION_IDLE_TIMEOUT);
+  m_idleConnectionTimer.async_wait(makeCustomAllocHandler(m_idleConnectionHandlerMemory,
+    [this](const boost::system::error_code &error) {
+      if (error != boost::asio::error::operation_aborted)
+      {
+        closeIdleConnections(error);
+      }
+    }));
+}
+
+void Sender::closeIdleConnections(const boost::system::error_code &error)
+{
+  if (error)
+  {
+    return;
+  }
+
+  // Queued datagrams may be waiting for a connection to become writable; leave all of them alone until drained
+  if (std::empty(m_queue))
+  {
+    for (auto &connection: m_connections)
+    {
+      if (connection.recentSends == 0 && connection.socket.is_open())
+      {
+        connection.socket.close();
+        ++m_closedIdleConnections;
+      }
+      connection.recentSends = 0;
+    }
+  }
+  beginWaitForIdleConnections();
+}
+
+bool Sender::coalesce(const char *data, std::size_t length, const endpoint_t &multicastEndpoint,
+  const out_interface_t &outInterface)
+{
+  auto coalescing = findCoalescing(multicastEndpoint, outInterface);
+  if (coalescing == nullptr)
+  {
+    return false;
+  }
+  auto result = coalescing->coalescer.add(data, length);
+  if (result == MdnsCoalescer::Result::FULL)
+  {
+    // The window keeps running for the responses held back from now on
+    flush(*coalescing);
+    result = coalescing->coalescer.add(data, length);
+  }
+  if (result != MdnsCoalescer::Result::MERGED)
+  {
+    return false;
+  }
+  if (!coalescing->waiting)
+  {
+    coalescing->waiting = true;
+    coalescing->timer.expires_from_now(coalescing->window);
+    coalescing->timer.async_wait(makeCustomAllocHandler(coalescing->handlerMemory,
+      [this, coalescing](const boost::system::error_code &error) {
+        // Only aborted when stopped, after which the sender is not to be touched
+        if (error != boost::asio::error::operation_aborted)
+        {
+          endCoalescing(*coalescing, error);
+        }
+      }));
+  }
+  return true;
+}
+
+void Sender::disableSegmentationOffload(const endpoint_t &multicastEndpoint)
+{
+  m_segmentationEndpoints.erase(multicastEndpoint);
+}
+
+void Sender::enableCoalescing(const endpoint_t &multicastEndpoint, const out_interface_t &outInterface,
+  const Timer::duration_type &window, std::size_t maxSize)
+{
+  if (findCoalescing(multicastEndpoint, outInterface) == nullptr)
+  {
+    m_coalescings.emplace_back(m_ioService, multicastEndpoint, outInterface, window, maxSize);
+  }
 }
 
-void Sender::endSend(const boost::system::error_code &error, std::size_t bytesTransferred)
+void Sender::endCoalescing(Coalescing &coalescing, const boost::system::error_code &error)
 {
+  AllocationAudit::Scope allocationAuditScope;
+
+  coalescing.waiting = false;
+  if (!error)
+  {
+    flush(coalescing);
+  }
+}
+
+void Sender::endSend(const boost::system::error_code &error)
+{
+  AllocationAudit::Scope allocationAuditScope;
+
   if (error)
   {
     std::ostringstream msg;
-    msg << "send to " << getOutInterface(m_socket.native_handle()) << " failed: " << error.message();
+    msg << "send on " << (isShared() ? "shared socket" : getOutInterface(m_socket.native_handle())) << " failed: "
+      << error.message();
     throw std::runtime_error(msg.str());
   }
-  auto bytesRequested = m_queue.front().getLength();
-  if (bytesTransferred != bytesRequested)
+
+  while (!std::empty(m_queue))
   {
-    std::cerr << "Warning: datagram truncated: only sent " << bytesTransferred << " out of "
-      << bytesRequested << " bytes" << std::endl;
+    auto &item = m_queue.front();
+    auto count = getSegmentCount(item);
+    auto handled = count > 1 ? trySendSegmented(item, count)
+      : trySend(item.getData(), item.getLength(), item.getMulticastEndpoint(), &item.getOutInterface(), 1);
+    if (handled == 0)
+    {
+      beginSend();
+      return;
+    }
+    for (; handled != 0; --handled)
+    {
+      m_queue.pop();
+    }
   }
-  m_queue.pop();
-  if (!std::empty(m_queue))
+}
+
+auto Sender::findCoalescing(const endpoint_t &multicastEndpoint, const out_interface_t &outInterface) noexcept
+  -> Coalescing *
+{
+  for (auto &coalescing: m_coalescings)
+  {
+    if (coalescing.multicastEndpoint == multicastEndpoint
+      && coalescing.outInterface.ipi_ifindex == outInterface.ipi_ifindex)
+    {
+      return &coalescing;
+    }
+  }
+  return nullptr;
+}
+
+auto Sender::findConnection(const endpoint_t &multicastEndpoint) noexcept -> Connection *
+{
+  // Only a handful of endpoints are forwarded to any interface; a linear search is fast enough
+  for (auto &connection: m_connections)
+  {
+    if (connection.multicastEndpoint == multicastEndpoint)
+    {
+      return &connection;
+    }
+  }
+  return nullptr;
+}
+
+void Sender::flush(Coalescing &coalescing)
+{
+  const char *data = nullptr;
+  auto length = coalescing.coalescer.take(data);
+  if (length != 0)
+  {
+    transmit(data, length, coalescing.multicastEndpoint, &coalescing.outInterface, 1);
+  }
+}
+
+auto Sender::getConnection(const endpoint_t &multicastEndpoint, boost::system::error_code &error) noexcept
+  -> Connection *
+{
+  error = boost::system::error_code();
+  auto connection = findConnection(multicastEndpoint);
+  if (connection != nullptr)
+  {
+    if (!connection->socket.is_open())
+    {
+      openConnection(*connection, error);
+    }
+    ++connection->recentSends;
+  }
+  return connection;
+}
+
+void Sender::enableSegmentationOffload(const endpoint_t &multicastEndpoint)
+{
+  m_segmentationEndpoints.insert(multicastEndpoint);
+}
+
+void Sender::enqueue(const char *data, std::size_t length, const endpoint_t &multicastEndpoint,
+  const out_interface_t &outInterface)
+{
+  if (!m_queue.push(data, length, multicastEndpoint, outInterface))
+  {
+    ++m_queueDrops;
+    return;
+  }
+  if (m_queue.size() == 1)
   {
     beginSend();
   }
 }
 
+std::size_t Sender::getSegmentCount(const PacketQueue::Item &first) const
+{
+  if (first.getLength() == 0
+    || m_segmentationEndpoints.find(first.getMulticastEndpoint()) == std::end(m_segmentationEndpoints))
+  {
+    return 1;
+  }
+
+  /* Segments must share destination and outgoing interface, and all but the last one must have the same size; the
+   * total is limited like any datagram */
+  const auto maxCount = std::min<std::size_t>(MAX_SEGMENTS, ReceiveBuffer::getSize() / first.getLength());
+  std::size_t count = 1;
+  for (auto item = m_queue.next(first); item != nullptr && count < maxCount; item = m_queue.next(*item))
+  {
+    if (item->getLength() > first.getLength() || item->getLength() == 0
+      || item->getMulticastEndpoint() != first.getMulticastEndpoint()
+      || item->getOutInterface().ipi_ifindex != first.getOutInterface().ipi_ifindex)
+    {
+      break;
+    }
+    ++count;
+    if (item->getLength() < first.getLength())
+    {
+      break;
+    }
+  }
+  return count;
+}
+
+void Sender::openConnection(Connection &connection, boost::system::error_code &error) noexcept
+{
+  // Connections are reopened on the data path, where a failure, e.g. because the interface went away, must not throw
+  auto &socket = connection.socket;
+  socket.open(boost::asio::ip::udp::v4(), error);
+  if (!error)
+  {
+    socket.set_option(boost::asio::ip::multicast::enable_loopback(false), error);
+  }
+  if (!error)
+  {
+    socket.set_option(boost::asio::ip::multicast::outbound_interface(m_outInterfaceAddress), error);
+  }
+  if (!error && m_sendBufferSize != 0)
+  {
+    try
+    {
+      utility::setSocketBufferSize(socket.native_handle(), SO_SNDBUF, SO_SNDBUFFORCE, m_sendBufferSize);
+    }
+    catch (const std::runtime_error &)
+    {
+      error = boost::asio::error::no_buffer_space;
+    }
+  }
+  if (!error)
+  {
+    // Fixes the route, and thereby the outgoing interface; datagrams are then sent without destination address
+    socket.connect(connection.multicastEndpoint, error);
+  }
+  if (error)
+  {
+    boost::system::error_code ignored;
+    socket.close(ignored);
+  }
+}
+
+void Sender::reportStatistics() const
+{
+  auto newKernelDrops = m_kernelDrops - m_reportedKernelDrops;
+  m_reportedKernelDrops = m_kernelDrops;
+
+  std::ostringstream oss;
+  if (isShared())
+  {
+    oss << "Shared sender: ";
+  }
+  else
+  {
+    oss << "Sender on " << m_outInterfaceAddress << ": ";
+  }
+  oss << m_sentDatagrams << " datagrams sent, " << m_kernelDrops << " dropped by kernel (" << newKernelDrops
+    << " since last report), " << m_queueDrops << " dropped on full queue, " << m_queue.size()
+    << " queued, " << m_segmentedDatagrams << " sent in " << m_segmentedSends << " segmented sends";
+  if (m_segmentedSends != 0)
+  {
+    oss << " (" << std::setprecision(3) << static_cast<double>(m_segmentedDatagrams) / m_segmentedSends
+      << " datagrams per send)";
+  }
+  if (!std::empty(m_coalescings))
+  {
+    uint64_t responses = 0;
+    uint64_t messages = 0;
+    uint64_t duplicateRecords = 0;
+    for (auto &coalescing: m_coalescings)
+    {
+      responses += coalescing.coalescer.getMergedResponses();
+      messages += coalescing.coalescer.getMessages();
+      duplicateRecords += coalescing.coalescer.getDuplicateRecords();
+    }
+    oss << "; " << responses << " mDNS responses coalesced into " << messages << " datagrams, leaving out "
+      << duplicateRecords << " duplicate records";
+  }
+  oss << "; handler allocations: " << m_handlerMemory.getAllocations() << " reused, "
+    << m_handlerMemory.getHeapAllocations() << " from heap";
+  if (!std::empty(m_connections))
+  {
+    auto openConnections = std::count_if(std::begin(m_connections), std::end(m_connections),
+      [](auto &connection) { return connection.socket.is_open(); });
+    oss << "; " << openConnections << " of " << m_connections.size() << " connected sockets open, "
+      << m_closedIdleConnections << " closed when idle, " << m_connectionDrops
+      << " datagrams dropped as their connection could not be reopened";
+  }
+  syslog(newKernelDrops != 0 ? LOG_WARNING : LOG_INFO, "%s", oss.str().c_str());
+}
+
 void Sender::send(const char *data, size_t length, const endpoint_t &multicastEndpoint)
 {
-  bool sendNow = std::empty(m_queue);
-  m_queue.emplace(data, length, multicastEndpoint);
-  if (sendNow)
+  assert(!isShared());
+  const out_interface_t defaultOutInterface = out_interface_t();
+
+  if (!std::empty(m_coalescings) && coalesce(data, length, multicastEndpoint, defaultOutInterface))
   {
-    beginSend();
+    return;
   }
+
+  // Common case: nothing pending, so hand the datagram to the kernel straight from the receive buffer
+  if (std::empty(m_queue) && trySend(data, length, multicastEndpoint, &defaultOutInterface, 1) != 0)
+  {
+    return;
+  }
+
+  // Socket buffer full, or earlier datagrams still pending; queue to preserve ordering
+  enqueue(data, length, multicastEndpoint, defaultOutInterface);
+}
+
+void Sender::send(const char *data, std::size_t length, const endpoint_t &multicastEndpoint,
+  const out_interface_t *outInterfaces, std::size_t count)
+{
+  assert(isShared());
+
+  // Responses are coalesced for all outgoing interfaces of an endpoint or for none; the others go out as usual
+  if (!std::empty(m_coalescings))
+  {
+    for (; count != 0 && coalesce(data, length, multicastEndpoint, *outInterfaces); --count)
+    {
+      ++outInterfaces;
+    }
+  }
+  if (count != 0)
+  {
+    transmit(data, length, multicastEndpoint, outInterfaces, count);
+  }
+}
+
+void Sender::setSendBufferSize(std::size_t size)
+{
+  if (size <= m_sendBufferSize)
+  {
+    return;
+  }
+  m_sendBufferSize = size;
+  for (auto &connection: m_connections)
+  {
+    if (connection.socket.is_open())
+    {
+      utility::setSocketBufferSize(connection.socket.native_handle(), SO_SNDBUF, SO_SNDBUFFORCE, size);
+    }
+  }
+  auto effectiveSize = utility::setSocketBufferSize(m_socket.native_handle(), SO_SNDBUF, SO_SNDBUFFORCE, size);
+  if (effectiveSize < size)
+  {
+    syslog(LOG_WARNING, "Send buffer on %s limited to %zu bytes instead of %zu; see net.core.wmem_max",
+      isShared() ? "shared socket" : m_outInterfaceAddress.to_string().c_str(), effectiveSize, size);
+  }
+}
+
+void Sender::start()
+{
+  if (!std::empty(m_connections))
+  {
+    beginWaitForIdleConnections();
+  }
+}
+
+void Sender::stop() noexcept
+{
+  boost::system::error_code error;
+  m_idleConnectionTimer.cancel(error);
+  for (auto &coalescing: m_coalescings)
+  {
+    coalescing.timer.cancel(error);
+  }
+  for (auto &connection: m_connections)
+  {
+    connection.socket.close(error);
+  }
+  m_socket.close(error);
+}
+
+void Sender::transmit(const char *data, std::size_t length, const endpoint_t &multicastEndpoint,
+  const out_interface_t *outInterfaces, std::size_t count)
+{
+  std::size_t handled = 0;
+  if (std::empty(m_queue))
+  {
+    handled = trySend(data, length, multicastEndpoint, outInterfaces, count);
+  }
+  for (; handled != count; ++handled)
+  {
+    enqueue(data, length, multicastEndpoint, outInterfaces[handled]);
+  }
+}
+
+std::size_t Sender::trySend(const char *data, std::size_t length, const endpoint_t &multicastEndpoint,
+  const out_interface_t *outInterfaces, std::size_t count)
+{
+  // Connected sockets need no destination address, which spares the kernel a route lookup
+  boost::system::error_code connectionError;
+  auto connection = getConnection(multicastEndpoint, connectionError);
+  if (connectionError)
+  {
+    // The copies are handled by dropping them; the next datagram tries to reopen the connection again
+    m_connectionDrops += count;
+    return count;
+  }
+  auto socketFD = connection != nullptr ? connection->socket.native_handle() : m_socket.native_handle();
+
+  iovec buffer = { const_cast<char *>(data), length };
+  mmsghdr messages[MAX_DATAGRAMS_PER_CALL];
+  OutInterfaceControl controls[MAX_DATAGRAMS_PER_CALL];
+
+  std::size_t handled = 0;
+  while (handled != count)
+  {
+    // All copies share the payload and destination; only the outgoing interface differs
+    auto batchSize = std::min<std::size_t>(count - handled, MAX_DATAGRAMS_PER_CALL);
+    for (std::size_t i = 0; i != batchSize; ++i)
+    {
+      auto &message = messages[i].msg_hdr;
+      message.msg_name = connection != nullptr ? nullptr : const_cast<sockaddr *>(multicastEndpoint.data());
+      message.msg_namelen = connection != nullptr ? 0 : static_cast<socklen_t>(multicastEndpoint.size());
+      message.msg_iov = &buffer;
+      message.msg_iovlen = 1;
+      message.msg_flags = 0;
+      setOutInterface(message, controls[i], outInterfaces[handled + i]);
+#ifndef NDEBUG
+      AllocationAudit::Exemption allocationAuditExemption;
+      std::cout << "Sending datagram of " << length << " bytes to " << multicastEndpoint
+        << " from interface " << getOutInterface(socketFD, outInterfaces[handled + i]) << ": "
+        << std::endl << std::string(data, length) << std::endl;
+#endif
+    }
+
+    int sent;
+    do
+    {
+      sent = sendmmsg(socketFD, messages, static_cast<unsigned>(batchSize), MSG_DONTWAIT);
+    }
+    while (sent < 0 && errno == EINTR);
+
+    if (sent < 0)
+    {
+      auto error = errno;
+      if (error == EAGAIN || error == EWOULDBLOCK)
+      {
+        break;
+      }
+      if (error == ENOBUFS)
+      {
+        // The datagram is lost, but there is no point in retrying while the interface queue is full
+        ++m_kernelDrops;
+        ++handled;
+        continue;
+      }
+      std::ostringstream msg;
+      msg << "send on " << getOutInterface(socketFD, outInterfaces[handled]) << " failed: "
+        << utility::getErrorString(error);
+      throw std::runtime_error(msg.str());
+    }
+
+    for (int i = 0; i != sent; ++i)
+    {
+      if (messages[i].msg_len != length)
+      {
+        std::cerr << "Warning: datagram truncated: only sent " << messages[i].msg_len << " out of " << length
+          << " bytes" << std::endl;
+      }
+    }
+    m_sentDatagrams += static_cast<unsigned>(sent);
+    handled += static_cast<unsigned>(sent);
+  }
+  return handled;
+}
+
+std::size_t Sender::trySendSegmented(const PacketQueue::Item &first, std::size_t count)
+{
+  assert(count > 1 && count <= MAX_SEGMENTS);
+
+  iovec buffers[MAX_SEGMENTS];
+  auto item = &first;
+  for (std::size_t i = 0; i != count; ++i, item = m_queue.next(*item))
+  {
+    buffers[i] = { const_cast<char *>(item->getData()), item->getLength() };
+  }
+
+  boost::system::error_code connectionError;
+  auto connection = getConnection(first.getMulticastEndpoint(), connectionError);
+  if (connectionError)
+  {
+    m_connectionDrops += count;
+    return count;
+  }
+  auto socketFD = connection != nullptr ? connection->socket.native_handle() : m_socket.native_handle();
+
+  msghdr message;
+  memset(&message, 0, sizeof(message));
+  if (connection == nullptr)
+  {
+    message.msg_name = const_cast<sockaddr *>(first.getMulticastEndpoint().data());
+    message.msg_namelen = static_cast<socklen_t>(first.getMulticastEndpoint().size());
+  }
+  message.msg_iov = buffers;
+  message.msg_iovlen = count;
+
+  // The kernel splits the payload into datagrams of the segment size, restoring the original boundaries
+  SegmentedControl control;
+  memset(&control, 0, sizeof(control));
+  message.msg_control = control.buffer;
+  message.msg_controllen = sizeof(control.buffer);
+  auto header = CMSG_FIRSTHDR(&message);
+  if (first.getOutInterface().ipi_ifindex != 0)
+  {
+    header->cmsg_level = IPPROTO_IP;
+    header->cmsg_type = IP_PKTINFO;
+    header->cmsg_len = CMSG_LEN(sizeof(in_pktinfo));
+    memcpy(CMSG_DATA(header), &first.getOutInterface(), sizeof(in_pktinfo));
+    header = CMSG_NXTHDR(&message, header);
+  }
+  const uint16_t segmentSize = static_cast<uint16_t>(first.getLength());
+  header->cmsg_level = SOL_UDP;
+  header->cmsg_type = UDP_SEGMENT;
+  header->cmsg_len = CMSG_LEN(sizeof(segmentSize));
+  memcpy(CMSG_DATA(header), &segmentSize, sizeof(segmentSize));
+  message.msg_controllen = static_cast<std::size_t>(reinterpret_cast<char *>(header) - control.buffer)
+    + CMSG_SPACE(sizeof(segmentSize));
+
+#ifndef NDEBUG
+  {
+    AllocationAudit::Exemption allocationAuditExemption;
+    std::cout << "Sending " << count << " datagrams of " << first.getLength() << " bytes to "
+      << first.getMulticastEndpoint() << " from interface "
+      << getOutInterface(socketFD, first.getOutInterface()) << " in a single segmented send"
+      << std::endl;
+  }
+#endif
+  ssize_t sent;
+  do
+  {
+    sent = sendmsg(socketFD, &message, MSG_DONTWAIT);
+  }
+  while (sent < 0 && errno == EINTR);
+
+  if (sent < 0)
+  {
+    auto error = errno;
+    if (error == EAGAIN || error == EWOULDBLOCK)
+    {
+      return 0;
+    }
+    if (error == ENOBUFS)
+    {
+      m_kernelDrops += count;
+      return count;
+    }
+    if (error == EIO || error == EINVAL || error == ENOPROTOOPT)
+    {
+      // Segmentation unavailable on this path, e.g. for lack of checksum offload; send datagrams one by one
+      syslog(LOG_WARNING, "Segmentation offload on %s failed: %s; disabled",
+        getOutInterface(socketFD, first.getOutInterface()).c_str(),
+        utility::getErrorString(error).c_str());
+      m_segmentationEndpoints.clear();
+      return trySend(first.getData(), first.getLength(), first.getMulticastEndpoint(), &first.getOutInterface(), 1);
+    }
+    std::ostringstream msg;
+    msg << "send on " << getOutInterface(socketFD, first.getOutInterface()) << " failed: "
+      << utility::getErrorString(error);
+    throw std::runtime_error(msg.str());
+  }
+
+  m_sentDatagrams += count;
+  m_segmentedDatagrams += count;
+  ++m_segmentedSends;
+  return count;
 }
@@ -21,85 +21,252 @@
 
 #pragma once
 
-#include <algorithm>
-#include <queue>
+#include <list>
+#include <set>
 
-#include <boost/asio/io_service.hpp>
+#include <netinet/in.h>
 #include <boost/asio/ip/udp.hpp>
 
+#include "eventloop.h"
+#include "handlermemory.h"
+#include "mdnscoalescer.h"
+#include "packetqueue.h"
 
-/** One sender per outgoing interface */
+
+/**
+ * One sender per outgoing interface, or a single shared sender that selects the outgoing interface for each
+ * datagram separately
+ */
 struct Sender
 {
   using address_t = boost::asio::ip::address_v4;
   using endpoint_t = boost::asio::ip::udp::endpoint;
+  /** Outgoing interface of a datagram on a shared sender, as passed to the kernel in an IP_PKTINFO message */
+  using out_interface_t = in_pktinfo;
+
 
+  /** Creates a shared sender */
+  explicit Sender(EventLoop &ioService);
 
-  Sender(boost::asio::io_service &ioService, address_t outInterfaceAddress);
+  Sender(EventLoop &ioService, address_t outInterfaceAddress);
 
   Sender(const Sender &) = delete;
   Sender &operator =(const Sender &) = delete;
 
+  /**
+   * Sends datagrams for the given endpoint through a socket connected to it, so that the kernel looks up the route
+   * once instead of for every datagram; not available on a shared sender
+   */
+  void addConnection(const endpoint_t &multicastEndpoint);
+
+  /** Sends the datagrams for the given endpoint one by one again, as before enabling segmentation offload for it */
+  void disableSegmentationOffload(const endpoint_t &multicastEndpoint);
+
+  /**
+   * Holds back Multicast DNS responses for the given endpoint and outgoing interface for up to the given window, to
+   * merge them with the responses that follow into messages of up to the given size; other datagrams are sent as
+   * usual. The outgoing interface only matters for a shared sender.
+   */
+  void enableCoalescing(const endpoint_t &multicastEndpoint, const out_interface_t &outInterface,
+    const Timer::duration_type &window, std::size_t maxSize);
+
+  /**
+   * Allows consecutive queued datagrams of equal size bound for the given endpoint to be handed to the kernel
+   * together, which splits them up again as late as possible (UDP_SEGMENT)
+   */
+  void enableSegmentationOffload(const endpoint_t &multicastEndpoint);
+
+  /** Gets the address of the interface this sender sends on; unspecified for a shared sender */
+  address_t getOutInterfaceAddress() const noexcept;
+
+  /** Logs the send counters, including datagrams the kernel refused for lack of buffer space */
+  void reportStatistics() const;
+
+  bool isShared() const noexcept;
+
   void send(const char *data, std::size_t length, const endpoint_t &multicastEndpoint);
 
+  /** Sends a copy of the datagram on each of the given interfaces, using as few system calls as possible */
+  void send(const char *data, std::size_t length, const endpoint_t &multicastEndpoint,
+    const out_interface_t *outInterfaces, std::size_t count);
 
-private:
+  /** Grows the socket send buffer to at least the given size in bytes */
+  void setSendBufferSize(std::size_t size);
 
-  struct QueueItem
-  {
-    QueueItem(const char *data, std::size_t length, const endpoint_t &multicastEndpoint);
+  void start();
+
+  /**
+   * Closes the sockets and cancels the timers; handlers still pending return without effect, so the sender must
+   * outlive them
+   */
+  void stop() noexcept;
 
-    QueueItem(const QueueItem &) = delete;
-    QueueItem &operator =(const QueueItem &) = delete;
 
-    QueueItem(QueueItem &&) = default;
-    QueueItem &operator =(QueueItem &&) = default;
+private:
+
+  enum
+  {
+    /** Room for four datagrams of maximum size, or a few hundred typical ones */
+    QUEUE_CAPACITY = 256 * 1024,
+    /** A shared sender queues for all outgoing interfaces */
+    SHARED_QUEUE_CAPACITY = 4 * QUEUE_CAPACITY,
+    /** Upper bound on the number of datagrams passed to a single sendmmsg call */
+    MAX_DATAGRAMS_PER_CALL = 64,
+    /** Upper bound on the number of datagrams in a single segmented send, as imposed by the kernel */
+    MAX_SEGMENTS = 64
+  };
 
 
-    const char *getData() const noexcept;
-    std::size_t getLength() const noexcept;
-    const endpoint_t &getMulticastEndpoint() const noexcept;
+  /** Socket connected to a single multicast endpoint */
+  struct Connection
+  {
+    Connection(EventLoop &ioService, const endpoint_t &multicastEndpoint);
 
+    UdpSocket socket;
+    endpoint_t multicastEndpoint;
+    /** Number of sends through this connection since the last check for idle connections */
+    uint64_t recentSends;
+  };
 
-  private:
+  /** Responses held back for a single endpoint and outgoing interface */
+  struct Coalescing
+  {
+    Coalescing(EventLoop &ioService, const endpoint_t &multicastEndpoint, const out_interface_t &outInterface,
+      const Timer::duration_type &window, std::size_t maxSize);
 
-    std::unique_ptr<char[]> m_data;
-    std::size_t m_length;
-    endpoint_t m_multicastEndpoint;
+    endpoint_t multicastEndpoint;
+    out_interface_t outInterface;
+    Timer::duration_type window;
+    MdnsCoalescer coalescer;
+    /** Declared before the timer, as a wait still pending when it is destroyed is freed into it */
+    HandlerMemory handlerMemory;
+    /** Runs from the first response held back, until they are sent */
+    Timer timer;
+    bool waiting;
   };
 
+
   void beginSend();
 
-  void endSend(const boost::system::error_code &error, std::size_t bytesTransferred);
+  void beginWaitForIdleConnections();
+
+  /** Holds back the given datagram to be merged with others, if it can be; returns false if it must be sent now */
+  bool coalesce(const char *data, std::size_t length, const endpoint_t &multicastEndpoint,
+    const out_interface_t &outInterface);
+
+  /** Closes connections that have been idle since the last check */
+  void closeIdleConnections(const boost::system::error_code &error);
+
+  /** Sends the responses held back once the window has passed */
+  void endCoalescing(Coalescing &coalescing, const boost::system::error_code &error);
+
+  void endSend(const boost::system::error_code &error);
+
+  /** Finds the responses held back for the given endpoint and outgoing interface, if they are coalesced */
+  Coalescing *findCoalescing(const endpoint_t &multicastEndpoint, const out_interface_t &outInterface) noexcept;
+
+  /** Finds the connection for the given endpoint, if any, without reopening it */
+  Connection *findConnection(const endpoint_t &multicastEndpoint) noexcept;
+
+  /** Sends the responses held back, if any */
+  void flush(Coalescing &coalescing);
+
+  /**
+   * Gets the connection for the given endpoint, reopening it if it was closed; returns nullptr if there is none.
+   * Reports a failure to reopen through the given error, and leaves the connection closed for the next attempt.
+   */
+  Connection *getConnection(const endpoint_t &multicastEndpoint, boost::system::error_code &error) noexcept;
+
+  /**
+   * Gets the number of datagrams, starting at the given one, that can be sent together through segmentation
+   * offload; returns one when segmentation offload does not apply
+   */
+  std::size_t getSegmentCount(const PacketQueue::Item &first) const;
 
-  boost::asio::ip::udp::socket m_socket;
-  std::queue<QueueItem> m_queue;
+  /** Opens and connects the socket of the given connection; on failure, the socket is left closed */
+  void openConnection(Connection &connection, boost::system::error_code &error) noexcept;
+
+  /** Queues the given datagram, or drops it when the queue is full */
+  void enqueue(const char *data, std::size_t length, const endpoint_t &multicastEndpoint,
+    const out_interface_t &outInterface);
+
+  /**
+   * Sends a copy of the given datagram on each of the given interfaces without blocking, where an interface index of
+   * zero selects the default interface of the socket. Returns the number of copies handled; the remaining ones must
+   * be retried once the socket is writable again.
+   */
+  std::size_t trySend(const char *data, std::size_t length, const endpoint_t &multicastEndpoint,
+    const out_interface_t *outInterfaces, std::size_t count);
+
+  /**
+   * Sends the given number of queued datagrams, starting at the given one, as a single segmented send without
+   * blocking; returns the number of datagrams handled, like trySend
+   */
+  std::size_t trySendSegmented(const PacketQueue::Item &first, std::size_t count);
+
+  /** Sends a copy of the given datagram on each of the given interfaces, or queues those that cannot go out now */
+  void transmit(const char *data, std::size_t length, const endpoint_t &multicastEndpoint,
+    const out_interface_t *outInterfaces, std::size_t count);
+
+  EventLoop &m_ioService;
+  /** Unspecified for a shared sender */
+  address_t m_outInterfaceAddress;
+  /**
+   * Only one wait for writability is outstanding at any time, on any socket; declared before the sockets and the
+   * timer, as operations still pending when these close are freed into it
+   */
+  HandlerMemory m_handlerMemory;
+  HandlerMemory m_idleConnectionHandlerMemory;
+  UdpSocket m_socket;
+  std::list<Connection> m_connections;
+  Timer m_idleConnectionTimer;
+  PacketQueue m_queue;
+  std::size_t m_sendBufferSize;
+  std::set<endpoint_t> m_segmentationEndpoints;
+  std::list<Coalescing> m_coalescings;
+
+  uint64_t m_sentDatagrams;
+  /** Number of datagrams dropped because the queue was full */
+  uint64_t m_queueDrops;
+  /** Number of datagrams dropped because the kernel reported ENOBUFS, i.e. the interface queue was full */
+  uint64_t m_kernelDrops;
+  mutable uint64_t m_reportedKernelDrops;
+  /** Number of segmented sends, and the number of datagrams they carried */
+  uint64_t m_segmentedSends;
+  uint64_t m_segmentedDatagrams;
+  uint64_t m_closedIdleConnections;
+  /** Number of datagrams dropped because their connection could not be reopened */
+  uint64_t m_connectionDrops;
 };
 
 
 inline
-Sender::QueueItem::QueueItem(const char *data, size_t length, const endpoint_t &multicastEndpoint):
-  m_data(std::make_unique<char[]>(length)),
-  m_length(length),
-  m_multicastEndpoint(multicastEndpoint)
-{
-  std::copy_n(data, length, m_data.get());
-}
+Sender::Connection::Connection(EventLoop &ioService, const endpoint_t &multicastEndpoint):
+  socket(ioService),
+  multicastEndpoint(multicastEndpoint),
+  recentSends()
+{}
 
 inline
-const char *Sender::QueueItem::getData() const noexcept
-{
-  return m_data.get();
-}
+Sender::Coalescing::Coalescing(EventLoop &ioService, const endpoint_t &multicastEndpoint,
+  const out_interface_t &outInterface, const Timer::duration_type &window, std::size_t maxSize):
+  multicastEndpoint(multicastEndpoint),
+  outInterface(outInterface),
+  window(window),
+  coalescer(maxSize),
+  handlerMemory(),
+  timer(ioService),
+  waiting()
+{}
 
 inline
-std::size_t Sender::QueueItem::getLength() const noexcept
+auto Sender::getOutInterfaceAddress() const noexcept -> address_t
 {
-  return m_length;
+  return m_outInterfaceAddress;
 }
 
 inline
-auto Sender::QueueItem::getMulticastEndpoint() const noexcept -> const endpoint_t &
+bool Sender::isShared() const noexcept
 {
-  return m_multicastEndpoint;
+  return m_outInterfaceAddress.is_unspecified();
 }
@@ -0,0 +1,348 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "ssdpcachestage.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <syslog.h>
+
+#include "receiver.h"
+
+
+namespace
+{
+  /** Headers of announcements that responses to searches do not repeat, or replace */
+  constexpr std::string_view ANNOUNCEMENT_ONLY_HEADERS[] = { "CACHE-CONTROL", "HOST", "NT", "NTS" };
+
+
+  /** Appends to a fixed-size buffer, remembering whether everything fit */
+  struct Writer
+  {
+    char *data;
+    std::size_t capacity;
+    std::size_t length;
+    bool overflow;
+
+    Writer &operator <<(std::string_view string) noexcept;
+    Writer &operator <<(unsigned long value) noexcept;
+  };
+
+  Writer &Writer::operator <<(std::string_view string) noexcept
+  {
+    if (overflow || string.size() > capacity - length)
+    {
+      overflow = true;
+      return *this;
+    }
+    if (!string.empty())
+    {
+      std::memcpy(data + length, string.data(), string.size());
+      length += string.size();
+    }
+    return *this;
+  }
+
+  Writer &Writer::operator <<(unsigned long value) noexcept
+  {
+    char digits[20];
+    std::size_t count = 0;
+    do
+    {
+      digits[sizeof(digits) - ++count] = static_cast<char>('0' + value % 10);
+      value /= 10;
+    }
+    while (value != 0);
+    return *this << std::string_view(digits + sizeof(digits) - count, count);
+  }
+}
+
+
+SsdpCacheStage::SsdpCacheStage(const arguments_t &arguments):
+  m_entries(),
+  m_typeBuckets(),
+  m_inUse(NONE),
+  m_response(),
+  m_passedAnnouncements(),
+  m_suppressedAnnouncements(),
+  m_answeredSearches(),
+  m_forwardedSearches(),
+  m_responses(),
+  m_evictedAnnouncements(),
+  m_failedResponses()
+{
+  if (arguments.size() > 1)
+  {
+    throw std::invalid_argument("expected at most a capacity");
+  }
+  auto capacity = arguments.empty() ? std::size_t(DEFAULT_CAPACITY) : parsePositive(arguments[0], MAXIMUM_CAPACITY);
+  std::size_t slots = PROBE_LENGTH;
+  while (slots < capacity)
+  {
+    slots *= 2;
+  }
+  // All memory is claimed up front, as stages must not allocate while forwarding
+  m_entries.resize(slots);
+  m_typeBuckets.resize(slots, NONE);
+}
+
+bool SsdpCacheStage::answer(const SsdpMessage &message, const DatagramView &datagram, clock_t::time_point now)
+{
+  auto searchTarget = message.getHeader("ST");
+  if (!SsdpMessage::equalsIgnoringCase(message.getHeader("MAN"), "\"ssdp:discover\"") || searchTarget.empty()
+    || datagram.inInterfaceAddress.is_unspecified())
+  {
+    return false;
+  }
+
+  // Devices respond once for each of their matching announcements, which is what the cache holds
+  const bool all = searchTarget == "ssdp:all";
+  const auto searchTargetHash = hash(searchTarget);
+  const auto links = all ? &Entry::inUse : &Entry::ofType;
+  std::size_t responses = 0;
+  for (auto index = all ? m_inUse : m_typeBuckets[searchTargetHash & (m_typeBuckets.size() - 1)]; index != NONE;
+    index = (m_entries[index].*links).next)
+  {
+    auto &entry = m_entries[index];
+    if (entry.expiry <= now || entry.inInterfaceAddress == datagram.inInterfaceAddress
+      || (!all && (entry.notificationTypeHash != searchTargetHash || entry.getNotificationType() != searchTarget)))
+    {
+      continue;
+    }
+    if (responses == MAX_RESPONSES)
+    {
+      break;
+    }
+    auto length = writeResponse(entry, all ? entry.getNotificationType() : searchTarget, now);
+    if (length == 0)
+    {
+      continue;
+    }
+    ++responses;
+    if (!datagram.receiver->reply(datagram.senderEndpoint, m_response.data(), length))
+    {
+      ++m_failedResponses;
+    }
+  }
+  m_responses += responses;
+  return responses != 0;
+}
+
+auto SsdpCacheStage::find(std::string_view usn, uint64_t usnHash, clock_t::time_point now) -> Entry &
+{
+  Entry *vacant = nullptr;
+  Entry *oldest = nullptr;
+  for (std::size_t i = 0; i < PROBE_LENGTH; ++i)
+  {
+    auto &entry = m_entries[(usnHash + i) & (m_entries.size() - 1)];
+    if (entry.usnLength != 0 && entry.usnHash == usnHash && entry.getUsn() == usn)
+    {
+      return entry;
+    }
+    if (vacant == nullptr && (entry.usnLength == 0 || entry.expiry <= now))
+    {
+      vacant = &entry;
+    }
+    if (oldest == nullptr || entry.expiry < oldest->expiry)
+    {
+      oldest = &entry;
+    }
+  }
+  return vacant != nullptr ? *vacant : *oldest;
+}
+
+uint64_t SsdpCacheStage::hash(std::string_view string) noexcept
+{
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (auto c: string)
+  {
+    hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+void SsdpCacheStage::insert(uint32_t &head, Links Entry::*links, uint32_t index) noexcept
+{
+  m_entries[index].*links = Links{NONE, head};
+  if (head != NONE)
+  {
+    (m_entries[head].*links).previous = index;
+  }
+  head = index;
+}
+
+void SsdpCacheStage::link(Entry &entry) noexcept
+{
+  auto index = static_cast<uint32_t>(&entry - m_entries.data());
+  insert(m_typeBuckets[entry.notificationTypeHash & (m_typeBuckets.size() - 1)], &Entry::ofType, index);
+  insert(m_inUse, &Entry::inUse, index);
+}
+
+bool SsdpCacheStage::notify(const SsdpMessage &message, const DatagramView &datagram, clock_t::time_point now)
+{
+  auto usn = message.getHeader("USN");
+  auto notificationType = message.getHeader("NT");
+  if (usn.empty() || notificationType.empty() || datagram.inInterfaceAddress.is_unspecified())
+  {
+    return true;
+  }
+  const auto usnHash = hash(usn);
+  auto &entry = find(usn, usnHash, now);
+  const bool existing = entry.usnLength != 0 && entry.usnHash == usnHash && entry.getUsn() == usn;
+  if (message.getHeader("NTS") == "ssdp:byebye")
+  {
+    if (existing)
+    {
+      unlink(entry);
+      entry.usnLength = 0;
+    }
+    return true;
+  }
+  const std::chrono::seconds maxAge(message.getMaxAge());
+  if (maxAge.count() == 0)
+  {
+    return true;
+  }
+
+  // What a response would repeat, to tell whether anything changed since the last announcement
+  char text[MAX_ANNOUNCEMENT_SIZE];
+  Writer writer{text, sizeof(text), 0, false};
+  writer << usn << notificationType;
+  for (auto &header: message)
+  {
+    auto skip = [&header](std::string_view name) { return SsdpMessage::equalsIgnoringCase(header.name, name); };
+    if (std::none_of(std::begin(ANNOUNCEMENT_ONLY_HEADERS), std::end(ANNOUNCEMENT_ONLY_HEADERS), skip))
+    {
+      writer << header.name << ": " << header.value << "\r\n";
+    }
+  }
+  if (writer.overflow)
+  {
+    return true;
+  }
+  const auto headersLength = writer.length - usn.size() - notificationType.size();
+  if (existing && entry.inInterfaceAddress == datagram.inInterfaceAddress
+    && entry.notificationTypeLength == notificationType.size() && entry.headersLength == headersLength
+    && std::memcmp(entry.text, text, writer.length) == 0 && now + maxAge / 2 < entry.passedExpiry)
+  {
+    // Those who saw the last announcement that passed still have it cached for a while
+    entry.expiry = now + maxAge;
+    entry.maxAge = maxAge;
+    return false;
+  }
+
+  if (!existing && entry.usnLength != 0 && entry.expiry > now)
+  {
+    ++m_evictedAnnouncements;
+  }
+  if (entry.usnLength != 0)
+  {
+    unlink(entry);
+  }
+  entry.usnHash = usnHash;
+  entry.notificationTypeHash = hash(notificationType);
+  entry.expiry = entry.passedExpiry = now + maxAge;
+  entry.maxAge = maxAge;
+  entry.inInterfaceAddress = datagram.inInterfaceAddress;
+  entry.usnLength = static_cast<uint16_t>(usn.size());
+  entry.notificationTypeLength = static_cast<uint16_t>(notificationType.size());
+  entry.headersLength = static_cast<uint16_t>(headersLength);
+  std::memcpy(entry.text, text, writer.length);
+  link(entry);
+  return true;
+}
+
+auto SsdpCacheStage::process(DatagramView &datagram) -> Verdict
+{
+  SsdpMessage message(datagram.data, datagram.length);
+  switch (message.getKind())
+  {
+    case SsdpMessage::Kind::NOTIFY:
+      if (!notify(message, datagram, clock_t::now()))
+      {
+        ++m_suppressedAnnouncements;
+        return Verdict::DROP;
+      }
+      ++m_passedAnnouncements;
+      return Verdict::PASS;
+    case SsdpMessage::Kind::SEARCH:
+      if (answer(message, datagram, clock_t::now()))
+      {
+        ++m_answeredSearches;
+        return Verdict::DROP;
+      }
+      ++m_forwardedSearches;
+      return Verdict::PASS;
+    default:
+      return Verdict::PASS;
+  }
+}
+
+void SsdpCacheStage::remove(uint32_t &head, Links Entry::*links, uint32_t index) noexcept
+{
+  auto &removed = m_entries[index].*links;
+  if (removed.previous != NONE)
+  {
+    (m_entries[removed.previous].*links).next = removed.next;
+  }
+  else
+  {
+    head = removed.next;
+  }
+  if (removed.next != NONE)
+  {
+    (m_entries[removed.next].*links).previous = removed.previous;
+  }
+}
+
+void SsdpCacheStage::reportStatistics(const std::string &owner) const
+{
+  std::ostringstream oss;
+  oss << owner << ": " << m_passedAnnouncements << " announcements passed, " << m_suppressedAnnouncements
+    << " suppressed, " << m_evictedAnnouncements << " evicted early; " << m_answeredSearches
+    << " searches answered from cache with " << m_responses << " responses, " << m_forwardedSearches
+    << " forwarded; " << m_failedResponses << " responses failed";
+  syslog(LOG_INFO, "%s", oss.str().c_str());
+}
+
+void SsdpCacheStage::unlink(Entry &entry) noexcept
+{
+  auto index = static_cast<uint32_t>(&entry - m_entries.data());
+  remove(m_typeBuckets[entry.notificationTypeHash & (m_typeBuckets.size() - 1)], &Entry::ofType, index);
+  remove(m_inUse, &Entry::inUse, index);
+}
+
+std::size_t SsdpCacheStage::writeResponse(const Entry &entry, std::string_view searchTarget, clock_t::time_point now)
+{
+  auto maxAge = static_cast<unsigned long>(std::chrono::ceil<std::chrono::seconds>(entry.expiry - now).count());
+  Writer writer{m_response.data(), m_response.size(), 0, false};
+  writer << "HTTP/1.1 200 OK\r\n"
+    << "CACHE-CONTROL: max-age=" << maxAge << "\r\n"
+    << "EXT:\r\n"
+    << "ST: " << searchTarget << "\r\n"
+    << entry.getHeaders()
+    << "\r\n";
+  return writer.overflow ? 0 : writer.length;
+}
@@ -0,0 +1,175 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "pipeline.h"
+#include "ssdpmessage.h"
+
+
+/**
+ * Stage turning the forwarder of an SSDP service into a caching proxy; it is configured as
+ * "stage ssdp_cache [CAPACITY];", with room for about CAPACITY announcements (1024 by default). NOTIFY announcements
+ * are kept by USN for their max-age, and only pass when new, changed, or when the last one passed is more than half
+ * way to expiry. M-SEARCH requests that match announcements learned on other interfaces are answered by unicast to
+ * the searcher and dropped; all other datagrams pass.
+ */
+struct SsdpCacheStage final: Stage
+{
+  explicit SsdpCacheStage(const arguments_t &arguments);
+
+
+  Verdict process(DatagramView &datagram) override;
+
+  void reportStatistics(const std::string &owner) const override;
+
+
+private:
+
+  using address_t = DatagramView::address_t;
+  using clock_t = std::chrono::steady_clock;
+
+  enum: std::size_t
+  {
+    DEFAULT_CAPACITY = 1024,
+    MAXIMUM_CAPACITY = 1 << 16,
+    /** Room for the USN, the notification type and the headers repeated in responses; larger ones are not cached */
+    MAX_ANNOUNCEMENT_SIZE = 1024,
+    /** Number of consecutive slots that can hold the announcement of one USN */
+    PROBE_LENGTH = 16,
+    /** Largest number of responses to one search */
+    MAX_RESPONSES = 256,
+    /** Largest response, such that it fits in an Ethernet frame */
+    MAX_RESPONSE_SIZE = 1472
+  };
+
+  /** Index of no entry, at either end of a list */
+  static constexpr uint32_t NONE = UINT32_MAX;
+
+  /** Links of an entry in a doubly linked list of entries, by index */
+  struct Links
+  {
+    uint32_t previous;
+    uint32_t next;
+  };
+
+
+  /** Cached announcement */
+  struct Entry
+  {
+    uint64_t usnHash;
+    uint64_t notificationTypeHash;
+    /** When the announcement expires, and when the last one that passed does */
+    clock_t::time_point expiry;
+    clock_t::time_point passedExpiry;
+    std::chrono::seconds maxAge;
+    /** Interface on which the announcement came in; searches from there are not answered with it */
+    address_t inInterfaceAddress;
+    /** Length of the USN, or zero if the slot is unused */
+    uint16_t usnLength;
+    uint16_t notificationTypeLength;
+    uint16_t headersLength;
+    /**
+     * Links in the list of the bucket for its notification type, and in the list of all entries in use; only entries
+     * in use are linked
+     */
+    Links ofType;
+    Links inUse;
+    /** USN, followed by the notification type, followed by the header lines to repeat in responses */
+    char text[MAX_ANNOUNCEMENT_SIZE];
+
+    std::string_view getHeaders() const noexcept;
+    std::string_view getNotificationType() const noexcept;
+    std::string_view getUsn() const noexcept;
+  };
+
+
+  /** Answers the given search from the cache; returns false if no announcement matches */
+  bool answer(const SsdpMessage &message, const DatagramView &datagram, clock_t::time_point now);
+
+  /** Finds the entry for the given USN, or the slot to store it in if there is none */
+  Entry &find(std::string_view usn, uint64_t usnHash, clock_t::time_point now);
+
+  /** Adds the given entry, just taken in use, to the lists */
+  void link(Entry &entry) noexcept;
+
+  /** Removes the given entry from the lists, before it goes out of use or changes notification type */
+  void unlink(Entry &entry) noexcept;
+
+  /** Stores the given announcement; returns whether it should pass */
+  bool notify(const SsdpMessage &message, const DatagramView &datagram, clock_t::time_point now);
+
+  /** Writes a response to a search for the given target, with the given announcement; returns its length */
+  std::size_t writeResponse(const Entry &entry, std::string_view searchTarget, clock_t::time_point now);
+
+  static uint64_t hash(std::string_view string) noexcept;
+
+  /** Inserts the entry of the given index at the head of the list linked through the given member */
+  void insert(uint32_t &head, Links Entry::*links, uint32_t index) noexcept;
+
+  /** Removes the entry of the given index from the list linked through the given member */
+  void remove(uint32_t &head, Links Entry::*links, uint32_t index) noexcept;
+
+
+  /** Open addressing hash table, with a power of two slots */
+  std::vector<Entry> m_entries;
+  /**
+   * Heads of the lists of entries by notification type, with as many buckets as slots, so that a search visits only
+   * the entries that can match it
+   */
+  std::vector<uint32_t> m_typeBuckets;
+  /** Head of the list of all entries in use, which searches for ssdp:all visit */
+  uint32_t m_inUse;
+  std::array<char, MAX_RESPONSE_SIZE> m_response;
+
+  uint64_t m_passedAnnouncements;
+  uint64_t m_suppressedAnnouncements;
+  uint64_t m_answeredSearches;
+  uint64_t m_forwardedSearches;
+  uint64_t m_responses;
+  uint64_t m_evictedAnnouncements;
+  uint64_t m_failedResponses;
+};
+
+
+inline
+std::string_view SsdpCacheStage::Entry::getHeaders() const noexcept
+{
+  return std::string_view(text + usnLength + notificationTypeLength, headersLength);
+}
+
+inline
+std::string_view SsdpCacheStage::Entry::getNotificationType() const noexcept
+{
+  return std::string_view(text + usnLength, notificationTypeLength);
+}
+
+inline
+std::string_view SsdpCacheStage::Entry::getUsn() const noexcept
+{
+  return std::string_view(text, usnLength);
+}
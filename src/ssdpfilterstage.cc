@@ -0,0 +1,195 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "ssdpfilterstage.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include "headerscanner.h"
+#include "ssdpmessage.h"
+
+
+namespace
+{
+  /** Headers that patterns can apply to */
+  constexpr std::string_view HEADERS[] = { "NT", "SERVER", "ST", "USN" };
+
+  bool isSpace(char c) noexcept
+  {
+    return c == ' ' || c == '\t' || c == '\r';
+  }
+
+  char toLower(char c) noexcept
+  {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+  }
+}
+
+
+SsdpFilterStage::SsdpFilterStage(const arguments_t &arguments):
+  m_patterns(),
+  m_firstLetters(),
+  m_lineEnds()
+{
+  if (arguments.empty() || arguments.size() % 2 != 0)
+  {
+    throw std::invalid_argument("expected pairs of a header and a pattern");
+  }
+  for (std::size_t i = 0; i < arguments.size(); i += 2)
+  {
+    auto header = std::find_if(std::begin(HEADERS), std::end(HEADERS), [&arguments, i](std::string_view header) {
+      return SsdpMessage::equalsIgnoringCase(header, arguments[i]);
+    });
+    if (header == std::end(HEADERS))
+    {
+      std::ostringstream oss;
+      oss << "expected one of the headers st, nt, usn or server instead of " << arguments[i];
+      throw std::invalid_argument(oss.str());
+    }
+    std::string pattern(arguments[i + 1]);
+    std::transform(std::begin(pattern), std::end(pattern), std::begin(pattern), toLower);
+    m_patterns.push_back(Pattern{*header, std::move(pattern)});
+    m_firstLetters |= uint32_t(1) << (toLower(header->front()) - 'a');
+  }
+}
+
+bool SsdpFilterStage::matches(const char *line, const char *end) const noexcept
+{
+  // Split the line at the colon, and strip whitespace around the name and the value
+  auto colon = static_cast<const char *>(std::memchr(line, ':', static_cast<std::size_t>(end - line)));
+  if (colon == nullptr)
+  {
+    return false;
+  }
+  auto nameEnd = colon;
+  while (nameEnd != line && isSpace(nameEnd[-1]))
+  {
+    --nameEnd;
+  }
+  auto value = colon + 1;
+  while (value != end && isSpace(*value))
+  {
+    ++value;
+  }
+  while (end != value && isSpace(end[-1]))
+  {
+    --end;
+  }
+  const std::string_view name(line, static_cast<std::size_t>(nameEnd - line));
+  for (auto &pattern: m_patterns)
+  {
+    if (SsdpMessage::equalsIgnoringCase(name, pattern.header)
+      && matches(pattern.pattern, std::string_view(value, static_cast<std::size_t>(end - value))))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool SsdpFilterStage::matches(std::string_view pattern, std::string_view value) noexcept
+{
+  // Greedy matching that backtracks to the last star only, which suffices as a star matches anything
+  std::size_t p = 0;
+  std::size_t v = 0;
+  std::size_t star = std::string_view::npos;
+  std::size_t starValue = 0;
+  while (v < value.size())
+  {
+    if (p < pattern.size() && pattern[p] == '*')
+    {
+      star = p++;
+      starValue = v;
+    }
+    else if (p < pattern.size() && pattern[p] == toLower(value[v]))
+    {
+      ++p;
+      ++v;
+    }
+    else if (star != std::string_view::npos)
+    {
+      p = star + 1;
+      v = ++starValue;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  while (p < pattern.size() && pattern[p] == '*')
+  {
+    ++p;
+  }
+  return p == pattern.size();
+}
+
+auto SsdpFilterStage::process(DatagramView &datagram) -> Verdict
+{
+  const auto length = std::min<std::size_t>(datagram.length, MAX_SCANNED_LENGTH);
+  const auto words = HeaderScanner::getBitmapSize(length);
+  HeaderScanner::findLineEnds(datagram.data, length, m_lineEnds.data());
+
+  // Headers start after each line end; only look closer at lines starting like one of the headers of interest
+  for (std::size_t word = 0; word < words; ++word)
+  {
+    for (auto lineEnds = m_lineEnds[word]; lineEnds != 0; lineEnds &= lineEnds - 1)
+    {
+      auto start = word * 64 + static_cast<std::size_t>(__builtin_ctzll(lineEnds)) + 1;
+      if (start >= length || datagram.data[start] == '\r' || datagram.data[start] == '\n')
+      {
+        // End of the headers
+        return Verdict::DROP;
+      }
+      auto letter = static_cast<unsigned>(toLower(datagram.data[start]) - 'a');
+      if (letter >= 26 || (m_firstLetters & (uint32_t(1) << letter)) == 0)
+      {
+        continue;
+      }
+
+      // The line ends at the next line end, which may be in a later word
+      auto next = lineEnds & (lineEnds - 1);
+      std::size_t end = length;
+      if (next != 0)
+      {
+        end = word * 64 + static_cast<std::size_t>(__builtin_ctzll(next));
+      }
+      else
+      {
+        for (std::size_t later = word + 1; later < words; ++later)
+        {
+          if (m_lineEnds[later] != 0)
+          {
+            end = later * 64 + static_cast<std::size_t>(__builtin_ctzll(m_lineEnds[later]));
+            break;
+          }
+        }
+      }
+      if (matches(datagram.data + start, datagram.data + end))
+      {
+        return Verdict::PASS;
+      }
+    }
+  }
+  return Verdict::DROP;
+}
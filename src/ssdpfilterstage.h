@@ -0,0 +1,77 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "pipeline.h"
+
+
+/**
+ * Stage passing only SSDP messages with a header matching one of the given patterns; it is configured as
+ * "stage ssdp_filter HEADER PATTERN [HEADER PATTERN]...;", where HEADER is one of st, nt, usn and server, and * in
+ * PATTERN stands for any sequence of characters, e.g.
+ * "stage ssdp_filter nt "urn:schemas-upnp-org:device:MediaRenderer:*" st "ssdp:all";". Header values are compared
+ * ignoring case. The line ends are located by HeaderScanner, so that only the first character of most lines needs a
+ * look.
+ */
+struct SsdpFilterStage final: Stage
+{
+  explicit SsdpFilterStage(const arguments_t &arguments);
+
+
+  Verdict process(DatagramView &datagram) override;
+
+
+private:
+
+  enum: std::size_t
+  {
+    /** Headers further into a message are not looked at */
+    MAX_SCANNED_LENGTH = 8192
+  };
+
+
+  struct Pattern
+  {
+    std::string_view header;
+    /** In lower case */
+    std::string pattern;
+  };
+
+
+  /** Whether the line from line up to end is a header matching one of the patterns */
+  bool matches(const char *line, const char *end) const noexcept;
+
+  /** Matches the given value against the given pattern in lower case, where * stands for any sequence */
+  static bool matches(std::string_view pattern, std::string_view value) noexcept;
+
+
+  std::vector<Pattern> m_patterns;
+  /** First letters of the headers of the patterns, as bits 0 to 25 for a to z */
+  uint32_t m_firstLetters;
+  std::array<uint64_t, MAX_SCANNED_LENGTH / 64> m_lineEnds;
+};
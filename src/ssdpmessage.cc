@@ -0,0 +1,153 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "ssdpmessage.h"
+
+#include <cstring>
+
+
+namespace
+{
+  constexpr std::string_view WHITESPACE = " \t";
+
+
+  /** Removes leading and trailing spaces and tabs */
+  std::string_view trim(std::string_view string) noexcept
+  {
+    auto first = string.find_first_not_of(WHITESPACE);
+    if (first == std::string_view::npos)
+    {
+      return std::string_view();
+    }
+    return string.substr(first, string.find_last_not_of(WHITESPACE) - first + 1);
+  }
+}
+
+
+SsdpMessage::SsdpMessage(const char *data, std::size_t length) noexcept:
+  m_kind(Kind::OTHER),
+  m_headers(),
+  m_headerCount()
+{
+  // Lines end in CRLF, but a bare LF is tolerated as well
+  std::string_view remainder(data, length);
+  bool startLine = true;
+  while (!remainder.empty())
+  {
+    auto lineEnd = static_cast<const char *>(std::memchr(remainder.data(), '\n', remainder.size()));
+    auto lineLength = lineEnd != nullptr ? static_cast<std::size_t>(lineEnd - remainder.data()) : remainder.size();
+    auto line = remainder.substr(0, lineLength);
+    remainder.remove_prefix(lineEnd != nullptr ? lineLength + 1 : lineLength);
+    if (!line.empty() && line.back() == '\r')
+    {
+      line.remove_suffix(1);
+    }
+
+    if (startLine)
+    {
+      startLine = false;
+      if (line.compare(0, 7, "NOTIFY ") == 0)
+      {
+        m_kind = Kind::NOTIFY;
+      }
+      else if (line.compare(0, 9, "M-SEARCH ") == 0)
+      {
+        m_kind = Kind::SEARCH;
+      }
+      else if (line.compare(0, 5, "HTTP/") == 0)
+      {
+        m_kind = Kind::RESPONSE;
+      }
+      else
+      {
+        return;
+      }
+      continue;
+    }
+    // Headers end at the first empty line
+    if (line.empty() || m_headerCount == MAX_HEADERS)
+    {
+      return;
+    }
+    auto colon = line.find(':');
+    if (colon != std::string_view::npos)
+    {
+      m_headers[m_headerCount++] = Header{trim(line.substr(0, colon)), trim(line.substr(colon + 1))};
+    }
+  }
+}
+
+bool SsdpMessage::equalsIgnoringCase(std::string_view string, std::string_view other) noexcept
+{
+  if (string.size() != other.size())
+  {
+    return false;
+  }
+  for (std::size_t i = 0; i < string.size(); ++i)
+  {
+    auto c = string[i];
+    auto d = other[i];
+    if (c != d && ((c | 0x20) != (d | 0x20) || (c | 0x20) < 'a' || (c | 0x20) > 'z'))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string_view SsdpMessage::getHeader(std::string_view name) const noexcept
+{
+  for (auto &header: *this)
+  {
+    if (equalsIgnoringCase(header.name, name))
+    {
+      return header.value;
+    }
+  }
+  return std::string_view();
+}
+
+unsigned long SsdpMessage::getMaxAge() const noexcept
+{
+  // For example "max-age=1800", possibly among other directives and with spaces around the equals sign
+  auto cacheControl = getHeader("CACHE-CONTROL");
+  constexpr std::string_view DIRECTIVE = "max-age";
+  for (std::size_t i = 0; i + DIRECTIVE.size() <= cacheControl.size(); ++i)
+  {
+    if (!equalsIgnoringCase(cacheControl.substr(i, DIRECTIVE.size()), DIRECTIVE))
+    {
+      continue;
+    }
+    auto value = trim(cacheControl.substr(i + DIRECTIVE.size()));
+    if (value.empty() || value.front() != '=')
+    {
+      return 0;
+    }
+    value = trim(value.substr(1));
+    unsigned long maxAge = 0;
+    for (std::size_t j = 0; j < value.size() && value[j] >= '0' && value[j] <= '9' && maxAge < 1000000000UL; ++j)
+    {
+      maxAge = maxAge * 10 + static_cast<unsigned long>(value[j] - '0');
+    }
+    return maxAge;
+  }
+  return 0;
+}
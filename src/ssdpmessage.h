@@ -0,0 +1,102 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <string_view>
+
+
+/**
+ * View of an SSDP message (UPnP Device Architecture), i.e. HTTP over UDP: a start line followed by header lines. Only
+ * the kind of message and the headers are looked into; nothing is copied.
+ */
+struct SsdpMessage
+{
+  enum class Kind
+  {
+    OTHER,
+    /** NOTIFY request, announcing a device or service */
+    NOTIFY,
+    /** M-SEARCH request, looking for devices or services */
+    SEARCH,
+    /** Response to an M-SEARCH request */
+    RESPONSE
+  };
+
+  enum: std::size_t
+  {
+    /** Largest number of headers looked into; further ones are ignored */
+    MAX_HEADERS = 32
+  };
+
+  struct Header
+  {
+    std::string_view name;
+    std::string_view value;
+  };
+
+
+  SsdpMessage(const char *data, std::size_t length) noexcept;
+
+
+  const Header *begin() const noexcept;
+
+  const Header *end() const noexcept;
+
+  /** Gets the value of the first header with the given name, ignoring case; empty if there is none */
+  std::string_view getHeader(std::string_view name) const noexcept;
+
+  Kind getKind() const noexcept;
+
+  /** Gets the max-age directive of the CACHE-CONTROL header in seconds, or zero if there is none */
+  unsigned long getMaxAge() const noexcept;
+
+  /** Compares two strings, ignoring the case of ASCII letters as HTTP does for header names */
+  static bool equalsIgnoringCase(std::string_view string, std::string_view other) noexcept;
+
+
+private:
+
+  Kind m_kind;
+  std::array<Header, MAX_HEADERS> m_headers;
+  std::size_t m_headerCount;
+};
+
+
+inline
+auto SsdpMessage::begin() const noexcept -> const Header *
+{
+  return m_headers.data();
+}
+
+inline
+auto SsdpMessage::end() const noexcept -> const Header *
+{
+  return m_headers.data() + m_headerCount;
+}
+
+inline
+auto SsdpMessage::getKind() const noexcept -> Kind
+{
+  return m_kind;
+}
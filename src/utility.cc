@@ -23,7 +23,53 @@
 
 #include <array>
 #include <cassert>
+#include <climits>
 #include <cstring>
+#include <stdexcept>
+
+#include <sys/socket.h>
+
+
+namespace
+{
+  constexpr uint64_t PRIME1 = 0x9e3779b185ebca87ULL;
+  constexpr uint64_t PRIME2 = 0xc2b2ae3d27d4eb4fULL;
+  constexpr uint64_t PRIME3 = 0x165667b19e3779f9ULL;
+  constexpr uint64_t PRIME4 = 0x85ebca77c2b2ae63ULL;
+  constexpr uint64_t PRIME5 = 0x27d4eb2f165667c5ULL;
+
+  uint64_t mix(uint64_t accumulator, uint64_t input) noexcept
+  {
+    accumulator += input * PRIME2;
+    accumulator = (accumulator << 31) | (accumulator >> 33);
+    return accumulator * PRIME1;
+  }
+
+  uint64_t merge(uint64_t accumulator, uint64_t lane) noexcept
+  {
+    accumulator ^= mix(0, lane);
+    return accumulator * PRIME1 + PRIME4;
+  }
+
+  uint32_t read32(const char *data) noexcept
+  {
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+  }
+
+  uint64_t read64(const char *data) noexcept
+  {
+    uint64_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+  }
+
+  uint64_t rotate(uint64_t value, unsigned bits) noexcept
+  {
+    return (value << bits) | (value >> (64 - bits));
+  }
+}
 
 
 std::string utility::getErrorString(int error)
@@ -47,3 +93,70 @@ std::string utility::getErrorString(int error)
   assert(written > 0 && static_cast<size_t>(written) < buffer.size());
   return buffer.data();
 }
+
+uint64_t utility::hashPayload(const char *data, std::size_t length, uint64_t seed) noexcept
+{
+  const auto end = data + length;
+  uint64_t hash;
+  if (length >= 32)
+  {
+    uint64_t lanes[] = { seed + PRIME1 + PRIME2, seed + PRIME2, seed, seed - PRIME1 };
+    for (; end - data >= 32; data += 32)
+    {
+      for (std::size_t i = 0; i < 4; ++i)
+      {
+        lanes[i] = mix(lanes[i], read64(data + i * 8));
+      }
+    }
+    hash = rotate(lanes[0], 1) + rotate(lanes[1], 7) + rotate(lanes[2], 12) + rotate(lanes[3], 18);
+    for (auto lane: lanes)
+    {
+      hash = merge(hash, lane);
+    }
+  }
+  else
+  {
+    hash = seed + PRIME5;
+  }
+  hash += length;
+  for (; end - data >= 8; data += 8)
+  {
+    hash = rotate(hash ^ mix(0, read64(data)), 27) * PRIME1 + PRIME4;
+  }
+  if (end - data >= 4)
+  {
+    hash = rotate(hash ^ (read32(data) * PRIME1), 23) * PRIME2 + PRIME3;
+    data += 4;
+  }
+  for (; data != end; ++data)
+  {
+    hash = rotate(hash ^ (static_cast<uint8_t>(*data) * PRIME5), 11) * PRIME1;
+  }
+  hash ^= hash >> 33;
+  hash *= PRIME2;
+  hash ^= hash >> 29;
+  hash *= PRIME3;
+  return hash ^ (hash >> 32);
+}
+
+std::size_t utility::setSocketBufferSize(int socket, int option, int forceOption, std::size_t size)
+{
+  assert(size <= INT_MAX / 2);
+  int value = static_cast<int>(size);
+  // Forcing requires CAP_NET_ADMIN; the regular option silently caps the value at net.core.[rw]mem_max
+  if (setsockopt(socket, SOL_SOCKET, forceOption, &value, sizeof(value)) != 0)
+  {
+    if (errno != EPERM || setsockopt(socket, SOL_SOCKET, option, &value, sizeof(value)) != 0)
+    {
+      throw std::runtime_error(getErrorString(errno));
+    }
+  }
+
+  // The kernel doubles the requested value to allow for bookkeeping overhead
+  socklen_t length = sizeof(value);
+  if (getsockopt(socket, SOL_SOCKET, option, &value, &length) != 0)
+  {
+    throw std::runtime_error(getErrorString(errno));
+  }
+  return static_cast<std::size_t>(value) / 2;
+}
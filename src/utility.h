@@ -21,6 +21,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <cstdio>
 #include <memory>
 #include <string>
@@ -33,6 +34,15 @@ namespace utility
   using UniqueFilePtr = std::unique_ptr<FILE, CFileDeleter>;
 
   std::string getErrorString(int error);
+
+  /** Hashes the given payload with XXH64 (in host byte order), seeded with e.g. a hash of its source or destination */
+  uint64_t hashPayload(const char *data, std::size_t length, uint64_t seed) noexcept;
+
+  /**
+   * Sets the SO_RCVBUF or SO_SNDBUF socket option, trying the given forcing variant first to exceed the system-wide
+   * maximum when privileged; returns the size in bytes that is effectively available to the socket
+   */
+  std::size_t setSocketBufferSize(int socket, int option, int forceOption, std::size_t size);
 }
 
 
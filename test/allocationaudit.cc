@@ -0,0 +1,252 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Replays traffic through routers forwarding on the loopback interface, in each transmit mode, with the data path
+ * built with the allocation audit: a heap allocation while handling any of the datagrams aborts, failing the test.
+ * The datagrams come from a second loopback address, which the rules accept; the copies forwarded come from the
+ * first, which they do not, so that these are received once more but discarded.
+ */
+
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <string_view>
+#include <thread>
+
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "eventloop.h"
+#include "pipeline.h"
+#include "router.h"
+#include "config/model/network.h"
+#include "config/model/stageconfiguration.h"
+
+
+namespace
+{
+  using address_t = Router::address_t;
+  using endpoint_t = Router::endpoint_t;
+  using Network = config::model::Network;
+  using StageConfiguration = config::model::StageConfiguration;
+  using TransmitMode = Router::TransmitMode;
+
+
+  const address_t REPLAY_SOURCE(0x7f000002);
+  const uint16_t PORT = 47000;
+  /** Forwarded by a single rule without stages, and by a forwarder with stages and offload, respectively */
+  const endpoint_t SIMPLE_ENDPOINT(address_t(0xefff4601), PORT);
+  const endpoint_t STAGED_ENDPOINT(address_t(0xefff4602), PORT);
+
+  enum
+  {
+    DATAGRAMS = 20000,
+    /** Datagrams sent before waiting for their forwarded copies, so that receivers handle several per wake-up */
+    BURST = 16,
+    LOOPBACK_MTU = 65536,
+    /** Exit status that CTest counts as a skipped test */
+    SKIPPED = 77
+  };
+
+
+  /** Returns whether the loopback interface is up, which it is not in a network namespace just created */
+  bool loopbackIsUp()
+  {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    ifreq request = ifreq();
+    std::strncpy(request.ifr_name, "lo", sizeof(request.ifr_name) - 1);
+    bool up = fd != -1 && ioctl(fd, SIOCGIFFLAGS, &request) == 0 && (request.ifr_flags & IFF_UP) != 0;
+    if (fd != -1)
+    {
+      close(fd);
+    }
+    return up;
+  }
+
+  /** Opens a UDP socket bound to the given address and port, sending on the loopback interface */
+  int openSocket(address_t address, uint16_t port)
+  {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    int enable = 1;
+    sockaddr_in local = sockaddr_in();
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(static_cast<uint32_t>(address.to_ulong()));
+    local.sin_port = htons(port);
+    timeval timeout = { 1, 0 };
+    in_addr loopback = { htonl(INADDR_LOOPBACK) };
+    if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) != 0
+      || bind(fd, reinterpret_cast<sockaddr *>(&local), sizeof(local)) != 0
+      || setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0
+      || setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &loopback, sizeof(loopback)) != 0)
+    {
+      std::perror("opening socket failed");
+      std::exit(1);
+    }
+    return fd;
+  }
+
+  /** Joins the given socket to the groups of both endpoints on the loopback interface */
+  void joinGroups(int fd)
+  {
+    for (auto &endpoint: { SIMPLE_ENDPOINT, STAGED_ENDPOINT })
+    {
+      ip_mreq membership = { { htonl(static_cast<uint32_t>(endpoint.address().to_v4().to_ulong())) },
+        { htonl(INADDR_LOOPBACK) } };
+      if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0)
+      {
+        std::perror("joining group failed");
+        std::exit(1);
+      }
+    }
+  }
+
+  /**
+   * Sends the datagrams in bursts, of sizes up to a few kilobytes, alternating between the endpoints; returns the
+   * number of forwarded copies received
+   */
+  unsigned replay()
+  {
+    auto source = openSocket(REPLAY_SOURCE, 0);
+    auto listener = openSocket(address_t::any(), PORT);
+    joinGroups(listener);
+    static char data[8192];
+    static char received[LOOPBACK_MTU];
+    unsigned forwarded = 0;
+    for (unsigned i = 0; i < DATAGRAMS; i += BURST)
+    {
+      for (unsigned j = i; j < i + BURST; ++j)
+      {
+        // Unique for the deduplication stage, and matched by the payload stage
+        std::size_t length = j % 64 == 0 ? sizeof(data) : 16 + j % 1400;
+        std::snprintf(data, sizeof(data), "replay %u", j);
+        auto &endpoint = j % 2 == 0 ? SIMPLE_ENDPOINT : STAGED_ENDPOINT;
+        sendto(source, data, length, 0, endpoint.data(), static_cast<socklen_t>(endpoint.size()));
+      }
+      for (unsigned copies = 0; copies < BURST;)
+      {
+        sockaddr_in sender;
+        socklen_t senderLength = sizeof(sender);
+        if (recvfrom(listener, received, sizeof(received), 0, reinterpret_cast<sockaddr *>(&sender),
+          &senderLength) < 0)
+        {
+          // Lost, or not forwarded at all
+          break;
+        }
+        if (sender.sin_addr.s_addr == htonl(INADDR_LOOPBACK))
+        {
+          ++copies;
+          ++forwarded;
+        }
+      }
+    }
+    close(listener);
+    close(source);
+    return forwarded;
+  }
+
+  /** Forwards the replayed traffic with a router in the given transmit mode; returns whether all of it came through */
+  bool run(TransmitMode transmitMode, const char *name)
+  {
+    EventLoop eventLoop;
+    Router router(eventLoop, transmitMode);
+    const address_t loopback = address_t::loopback();
+    const auto loopbackIndex = if_nametoindex("lo");
+    const Network accepted(REPLAY_SOURCE, 32);
+
+    router.addRule(SIMPLE_ENDPOINT, loopback, &accepted, 1, loopback, loopbackIndex, LOOPBACK_MTU, 0, 0, false, 0,
+      nullptr);
+
+    static const std::string_view noArguments[1] = {};
+    static const std::string_view rateLimitArguments[] = { "1000000" };
+    static const StageConfiguration serviceStages[] = {
+      { "loop_detection", { noArguments, 0 } },
+      { "deduplicate", { noArguments, 0 } },
+      { "rate_limit", { rateLimitArguments, 1 } }
+    };
+    static const std::string_view payloadArguments[] = { "replay" };
+    static const StageConfiguration ruleStages[] = {
+      { "payload_contains", { payloadArguments, 1 } }
+    };
+    router.addPipeline(STAGED_ENDPOINT, Pipeline(Pipeline::stages_t(serviceStages, std::size(serviceStages))));
+    router.addRule(STAGED_ENDPOINT, loopback, &accepted, 1, loopback, loopbackIndex, LOOPBACK_MTU, 0, 0, true, 0,
+      std::make_shared<Pipeline>(Pipeline::stages_t(ruleStages, std::size(ruleStages))));
+
+    // From here on, the audit is armed
+    router.start();
+
+    std::atomic<unsigned> forwarded(0);
+    std::atomic<bool> done(false);
+    std::thread replayer([&forwarded, &done] {
+      forwarded = replay();
+      done = true;
+    });
+
+    Timer timer(eventLoop);
+    std::function<void(const boost::system::error_code &)> poll = [&](const boost::system::error_code &) {
+      if (done)
+      {
+        eventLoop.stop();
+        return;
+      }
+      timer.expires_from_now(boost::posix_time::milliseconds(50));
+      timer.async_wait(poll);
+    };
+    poll(boost::system::error_code());
+    eventLoop.run();
+    replayer.join();
+
+    router.stop();
+    eventLoop.reset();
+    eventLoop.poll();
+
+    std::printf("%s: %u of %u datagrams forwarded without heap allocations\n", name, forwarded.load(),
+      unsigned(DATAGRAMS));
+    return forwarded == DATAGRAMS;
+  }
+}
+
+
+int main()
+{
+  // The audit reports through syslog; show its alert along with the test output
+  openlog("allocationaudit", LOG_PERROR, LOG_USER);
+  if (!loopbackIsUp())
+  {
+    std::printf("skipped: the loopback interface is down\n");
+    return SKIPPED;
+  }
+
+  bool passed = run(TransmitMode::PER_INTERFACE, "per-interface sockets");
+  passed = run(TransmitMode::SHARED, "shared socket") && passed;
+  passed = run(TransmitMode::CONNECTED, "connected sockets") && passed;
+  return passed ? 0 : 1;
+}
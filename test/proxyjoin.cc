@@ -0,0 +1,278 @@
+/*
+ * mcv4fwdd: IPv4 Multicast Forwarding Daemon
+ * Copyright (C) 2018  Niels Penneman
+ *
+ * This file is part of mcv4fwdd.
+ *
+ * mcv4fwdd is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU Affero General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * mcv4fwdd is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with mcv4fwdd. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Has a router proxy two ranges of groups on the loopback interface, the first from an incoming interface address
+ * that this host does not have, and reports listeners for a group of each: joining the first fails, which must leave
+ * that group unproxied instead of stopping the router, so that the second still forwards.
+ */
+
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <thread>
+
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "eventloop.h"
+#include "pipeline.h"
+#include "router.h"
+#include "config/model/network.h"
+
+
+namespace
+{
+  using address_t = Router::address_t;
+  using endpoint_t = Router::endpoint_t;
+  using Network = config::model::Network;
+  using TransmitMode = Router::TransmitMode;
+
+
+  const address_t SOURCE(0x7f000002);
+  /** From TEST-NET-1, which no interface has */
+  const address_t MISSING_INTERFACE_ADDRESS(0xc0000201);
+  const uint16_t PORT = 47100;
+  const Network FAILING_GROUPS(address_t(0xefff4700), 24);
+  const Network PROXIED_GROUPS(address_t(0xefff4800), 24);
+  const endpoint_t FAILING_ENDPOINT(address_t(0xefff4701), PORT);
+  const endpoint_t PROXIED_ENDPOINT(address_t(0xefff4801), PORT);
+
+  enum
+  {
+    DATAGRAMS = 16,
+    /** IGMPv2 membership report (RFC 2236 2.1) */
+    V2_MEMBERSHIP_REPORT = 0x16,
+    /** Exit status that CTest counts as a skipped test */
+    SKIPPED = 77
+  };
+
+
+  /** Returns whether the loopback interface is up, which it is not in a network namespace just created */
+  bool loopbackIsUp()
+  {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    ifreq request = ifreq();
+    std::strncpy(request.ifr_name, "lo", sizeof(request.ifr_name) - 1);
+    bool up = fd != -1 && ioctl(fd, SIOCGIFFLAGS, &request) == 0 && (request.ifr_flags & IFF_UP) != 0;
+    if (fd != -1)
+    {
+      close(fd);
+    }
+    return up;
+  }
+
+  /** Returns whether raw IGMP sockets may be opened, which takes CAP_NET_RAW */
+  bool mayOpenRawSockets()
+  {
+    int fd = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_IGMP);
+    if (fd == -1)
+    {
+      return errno != EPERM && errno != EACCES;
+    }
+    close(fd);
+    return true;
+  }
+
+  /** Opens a UDP socket bound to the given address and port, sending on the loopback interface */
+  int openSocket(address_t address, uint16_t port)
+  {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    int enable = 1;
+    sockaddr_in local = sockaddr_in();
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(static_cast<uint32_t>(address.to_ulong()));
+    local.sin_port = htons(port);
+    timeval timeout = { 0, 200000 };
+    in_addr loopback = { htonl(INADDR_LOOPBACK) };
+    if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) != 0
+      || bind(fd, reinterpret_cast<sockaddr *>(&local), sizeof(local)) != 0
+      || setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0
+      || setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &loopback, sizeof(loopback)) != 0)
+    {
+      std::perror("opening socket failed");
+      std::exit(1);
+    }
+    return fd;
+  }
+
+  /** Reports listeners for the group of the given endpoint on the loopback interface, as another host would */
+  void reportListeners(const endpoint_t &endpoint)
+  {
+    int fd = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_IGMP);
+    sockaddr_in local = sockaddr_in();
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(static_cast<uint32_t>(SOURCE.to_ulong()));
+    in_addr loopback = { htonl(INADDR_LOOPBACK) };
+    if (fd == -1 || bind(fd, reinterpret_cast<sockaddr *>(&local), sizeof(local)) != 0
+      || setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &loopback, sizeof(loopback)) != 0)
+    {
+      std::perror("opening IGMP socket failed");
+      std::exit(1);
+    }
+    auto group = static_cast<uint32_t>(endpoint.address().to_v4().to_ulong());
+    uint8_t report[8] = { V2_MEMBERSHIP_REPORT, 0, 0, 0, static_cast<uint8_t>(group >> 24),
+      static_cast<uint8_t>(group >> 16), static_cast<uint8_t>(group >> 8), static_cast<uint8_t>(group) };
+    uint32_t sum = 0;
+    for (std::size_t i = 0; i < sizeof(report); i += 2)
+    {
+      sum += (uint32_t(report[i]) << 8) | report[i + 1];
+    }
+    sum = (sum & 0xffff) + (sum >> 16);
+    report[2] = static_cast<uint8_t>(~sum >> 8);
+    report[3] = static_cast<uint8_t>(~sum);
+    sockaddr_in destination = sockaddr_in();
+    destination.sin_family = AF_INET;
+    destination.sin_addr.s_addr = htonl(group);
+    if (sendto(fd, report, sizeof(report), 0, reinterpret_cast<sockaddr *>(&destination), sizeof(destination)) < 0)
+    {
+      std::perror("reporting listeners failed");
+      std::exit(1);
+    }
+    close(fd);
+  }
+
+  /** Sends datagrams to the given endpoint; returns the number of forwarded copies received */
+  unsigned replay(const endpoint_t &endpoint)
+  {
+    auto source = openSocket(SOURCE, 0);
+    auto listener = openSocket(address_t::any(), PORT);
+    ip_mreq membership = { { htonl(static_cast<uint32_t>(endpoint.address().to_v4().to_ulong())) },
+      { htonl(INADDR_LOOPBACK) } };
+    if (setsockopt(listener, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0)
+    {
+      std::perror("joining group failed");
+      std::exit(1);
+    }
+    char data[64] = "proxied";
+    unsigned forwarded = 0;
+    for (unsigned i = 0; i < DATAGRAMS; ++i)
+    {
+      sendto(source, data, sizeof(data), 0, endpoint.data(), static_cast<socklen_t>(endpoint.size()));
+      for (;;)
+      {
+        sockaddr_in sender;
+        socklen_t senderLength = sizeof(sender);
+        if (recvfrom(listener, data, sizeof(data), 0, reinterpret_cast<sockaddr *>(&sender), &senderLength) < 0)
+        {
+          break;
+        }
+        if (sender.sin_addr.s_addr == htonl(INADDR_LOOPBACK))
+        {
+          ++forwarded;
+          break;
+        }
+      }
+    }
+    close(listener);
+    close(source);
+    return forwarded;
+  }
+}
+
+
+int main()
+{
+  // The router reports the failure through syslog; show it along with the test output
+  openlog("proxyjoin", LOG_PERROR, LOG_USER);
+  if (!loopbackIsUp() || !mayOpenRawSockets())
+  {
+    std::printf("skipped: needs CAP_NET_RAW, and the loopback interface up\n");
+    return SKIPPED;
+  }
+
+  EventLoop eventLoop;
+  Router router(eventLoop, TransmitMode::PER_INTERFACE);
+  const address_t loopback = address_t::loopback();
+  const auto loopbackIndex = if_nametoindex("lo");
+  const Network accepted(SOURCE, 32);
+  const Pipeline::stages_t noStages;
+
+  router.enableIgmpSnooping(false);
+  router.addProxyRule(FAILING_GROUPS, PORT, MISSING_INTERFACE_ADDRESS, &accepted, 1, loopback, loopbackIndex, 0, 0,
+    false, noStages, noStages);
+  router.addProxyRule(PROXIED_GROUPS, PORT, loopback, &accepted, 1, loopback, loopbackIndex, 0, 0, false, noStages,
+    noStages);
+  router.start();
+
+  // Report listeners for a group of each range in turn, then replay the datagrams once both had their turn
+  std::atomic<unsigned> forwarded(0);
+  std::atomic<bool> done(false);
+  std::thread replayer;
+  unsigned step = 0;
+  Timer timer(eventLoop);
+  std::function<void(const boost::system::error_code &)> poll = [&](const boost::system::error_code &) {
+    switch (step++)
+    {
+      case 0:
+        reportListeners(FAILING_ENDPOINT);
+        break;
+      case 1:
+        reportListeners(PROXIED_ENDPOINT);
+        break;
+      case 2:
+        replayer = std::thread([&forwarded, &done] {
+          forwarded = replay(PROXIED_ENDPOINT);
+          done = true;
+        });
+        break;
+      default:
+        if (done)
+        {
+          eventLoop.stop();
+          return;
+        }
+    }
+    timer.expires_from_now(boost::posix_time::milliseconds(50));
+    timer.async_wait(poll);
+  };
+  poll(boost::system::error_code());
+  bool survived = true;
+  try
+  {
+    eventLoop.run();
+  }
+  catch (const std::exception &e)
+  {
+    std::fprintf(stderr, "router stopped: %s\n", e.what());
+    survived = false;
+  }
+  if (replayer.joinable())
+  {
+    replayer.join();
+  }
+
+  router.reportStatistics();
+  router.stop();
+  eventLoop.reset();
+  eventLoop.poll();
+
+  std::printf("%u of %u datagrams forwarded for the group still proxied\n", forwarded.load(), unsigned(DATAGRAMS));
+  return survived && forwarded == DATAGRAMS ? 0 : 1;
+}